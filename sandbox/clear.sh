@@ -5,3 +5,5 @@
 rm -rf *.log
 rm -rf *.flag
 
+rm -rf binaries
+rm -rf job_snapshot*
@@ -4,6 +4,8 @@
 
 #include "agent/agent_impl.h"
 
+#include <vector>
+
 #include "gflags/gflags.h"
 
 #include "boost/bind.hpp"
@@ -11,6 +13,7 @@
 #include "boost/algorithm/string/split.hpp"
 #include "proto/master.pb.h"
 #include "logging.h"
+#include "timer.h"
 
 DECLARE_string(master_host);
 DECLARE_string(master_port);
@@ -26,6 +29,8 @@ DECLARE_int32(agent_memory);
 DECLARE_string(nexus_root_path);
 DECLARE_string(master_path);
 DECLARE_string(nexus_servers);
+DECLARE_bool(agent_use_relay);
+DECLARE_string(relay_path);
 
 namespace baidu {
 namespace galaxy {
@@ -41,7 +46,10 @@ AgentImpl::AgentImpl() :
     gced_(NULL),
     resource_capacity_(),
     nexus_(NULL),
-    mutex_master_endpoint_() { 
+    mutex_master_endpoint_(),
+    relay_(NULL),
+    // starts from the clock, so it keeps increasing over restarts
+    heartbeat_sequence_(common::timer::get_micros()) { 
     rpc_client_ = new RpcClient();    
     endpoint_ = FLAGS_agent_ip;
     endpoint_.append(":");
@@ -58,6 +66,7 @@ AgentImpl::~AgentImpl() {
         delete rpc_client_; 
         rpc_client_ = NULL;
     }
+    delete relay_;
     delete nexus_;
 }
 
@@ -65,14 +74,41 @@ void AgentImpl::Query(::google::protobuf::RpcController* /*cntl*/,
                       const ::baidu::galaxy::QueryRequest* req,
                       ::baidu::galaxy::QueryResponse* resp,
                       ::google::protobuf::Closure* done) {
-    QueryPodsRequest gced_request;
-    QueryPodsResponse gced_response;
-    bool ret = rpc_client_->SendRequest(gced_,
-                                        &Gced_Stub::QueryPods,
-                                        &gced_request,
-                                        &gced_response,
-                                        5, 1);
-    if (!ret) {
+    if (req->bucket_digests_size() > 0) {
+        // digest drill-down from master, answered by the pods gced runs
+        std::vector<uint64_t> bucket_digests(req->bucket_digests().begin(),
+                                             req->bucket_digests().end());
+        std::vector<PodStatus> pods;
+        std::vector<int32_t> mismatched_buckets;
+        if (!ListPods(&pods)) {
+            resp->set_status(kRpcError);
+            done->Run();
+            return;
+        }
+        pods.clear();
+        bool ok = false;
+        {
+            MutexLock lock(&pods_mutex_);
+            ok = running_pods_.Diff(bucket_digests, &pods, &mismatched_buckets);
+        }
+        if (!ok) {
+            resp->set_status(kInputError);
+            done->Run();
+            return;
+        }
+        resp->set_status(kOk);
+        resp->mutable_agent()->set_endpoint(endpoint_);
+        for (size_t i = 0; i < pods.size(); i++) {
+            resp->mutable_agent()->add_pods()->CopyFrom(pods[i]);
+        }
+        for (size_t i = 0; i < mismatched_buckets.size(); i++) {
+            resp->add_mismatched_buckets(mismatched_buckets[i]);
+        }
+        done->Run();
+        return;
+    }
+    std::vector<PodStatus> pods;
+    if (!ListPods(&pods)) {
         resp->set_status(kRpcError); 
     } else {
         resp->set_status(kOk);
@@ -84,10 +120,10 @@ void AgentImpl::Query(::google::protobuf::RpcController* /*cntl*/,
         resp->mutable_agent()->mutable_assigned()->set_memory(FLAGS_agent_memory - resource_capacity_.memory);
         resp->mutable_agent()->mutable_free()->set_millicores(FLAGS_agent_millicores);
         resp->mutable_agent()->mutable_free()->set_memory(FLAGS_agent_memory);
-        for (int i = 0; i < gced_response.pods_size(); i++) {
+        for (size_t i = 0; i < pods.size(); i++) {
             PodStatus* pod_status = 
                             resp->mutable_agent()->add_pods();
-            pod_status->CopyFrom(gced_response.pods(i));
+            pod_status->CopyFrom(pods[i]);
         }
     }
     done->Run(); 
@@ -100,7 +136,9 @@ void AgentImpl::RunPod(::google::protobuf::RpcController* /*cntl*/,
                        ::google::protobuf::Closure* done) {
     PodDesc pod;
     pod.id = req->podid();
+    pod.jobid = req->jobid();
     pod.desc = req->pod();
+    pod.version = req->version();
     int ret = pod_manager_.Run(pod);
     if (ret != 0) {
         resp->set_status(kUnknown);
@@ -177,10 +215,27 @@ void AgentImpl::KillPod(::google::protobuf::RpcController* /*cntl*/,
     } else {
         resp->set_status(gced_response.status()); 
     }
+    if (resp->status() == kOk) {
+        MutexLock lock(&pods_mutex_);
+        running_pods_.Remove(req->podid());
+    }
     done->Run();
     return;
 }
 
+bool AgentImpl::ListPods(std::vector<PodStatus>* pods) {
+    QueryPodsRequest gced_request;
+    QueryPodsResponse gced_response;
+    if (!rpc_client_->SendRequest(gced_, &Gced_Stub::QueryPods,
+                                  &gced_request, &gced_response, 5, 1)) {
+        return false;
+    }
+    pods->assign(gced_response.pods().begin(), gced_response.pods().end());
+    MutexLock lock(&pods_mutex_);
+    running_pods_.Reset(*pods);
+    return true;
+}
+
 void AgentImpl::KeepHeartBeat() {
     MutexLock lock(&mutex_master_endpoint_);
     if (!PingMaster()) {
@@ -222,6 +277,16 @@ bool AgentImpl::PingMaster() {
     HeartBeatRequest request;
     HeartBeatResponse response;
     request.set_endpoint(endpoint_); 
+    request.set_sequence(++heartbeat_sequence_);
+    // no digest while gced can not be reached, master keeps the last one
+    std::vector<PodStatus> pods;
+    if (ListPods(&pods)) {
+        MutexLock lock(&pods_mutex_);
+        request.set_pod_digest(running_pods_.Root());
+    }
+    if (FLAGS_agent_use_relay && PingRelay(request)) {
+        return true;
+    }
     return rpc_client_->SendRequest(master_,
                                     &Master_Stub::HeartBeat,
                                     &request,
@@ -229,6 +294,58 @@ bool AgentImpl::PingMaster() {
                                     5, 1);    
 }
 
+// Falls back to master directly when no relay is reachable or the relay
+// can not reach master, and looks for another relay on the next heartbeat.
+bool AgentImpl::PingRelay(const HeartBeatRequest& request) {
+    mutex_master_endpoint_.AssertHeld();
+    if (relay_ == NULL) {
+        PickRelay();
+        if (relay_ == NULL) {
+            return false;
+        }
+    }
+    HeartBeatResponse response;
+    if (rpc_client_->SendRequest(relay_, &Relay_Stub::HeartBeat,
+                                 &request, &response, 5, 1)
+        && response.status() == kOk) {
+        return true;
+    }
+    LOG(WARNING, "ping relay %s failed or it lost master", relay_endpoint_.c_str());
+    delete relay_;
+    relay_ = NULL;
+    relay_endpoint_.clear();
+    return false;
+}
+
+// Relays register as <relay_path>/<endpoint> on nexus, agents are spread
+// over them by a hash of their own endpoint.
+void AgentImpl::PickRelay() {
+    mutex_master_endpoint_.AssertHeld();
+    std::string relay_prefix = FLAGS_nexus_root_path + FLAGS_relay_path + "/";
+    std::vector<std::string> relays;
+    // '0' follows '/', so the range covers exactly the keys under relay_prefix
+    ::galaxy::ins::sdk::ScanResult* result =
+        nexus_->Scan(relay_prefix, FLAGS_nexus_root_path + FLAGS_relay_path + "0");
+    while (!result->Done()) {
+        if (result->Error() == ::galaxy::ins::sdk::kOK) {
+            relays.push_back(result->Key().substr(relay_prefix.size()));
+        }
+        result->Next();
+    }
+    delete result;
+    if (relays.empty()) {
+        LOG(DEBUG, "no relay found on nexus");
+        return;
+    }
+    uint32_t hash = 0;
+    for (size_t i = 0; i < endpoint_.size(); i++) {
+        hash = hash * 31 + endpoint_[i];
+    }
+    relay_endpoint_ = relays[hash % relays.size()];
+    rpc_client_->GetStub(relay_endpoint_, &relay_);
+    LOG(INFO, "heartbeat through relay %s", relay_endpoint_.c_str());
+}
+
 static void OnMasterChange(const ::galaxy::ins::sdk::WatchParam& param, 
                            ::galaxy::ins::sdk::SDKError error) {
     AgentImpl* agent = static_cast<AgentImpl*>(param.context);
@@ -12,12 +12,14 @@
 #include "proto/agent.pb.h"
 #include "proto/master.pb.h"
 #include "proto/gced.pb.h"
+#include "proto/relay.pb.h"
 
 #include "mutex.h"
 #include "thread_pool.h"
 #include "rpc/rpc_client.h"
 
 #include "pod_manager.h"
+#include "pod_digest.h"
 #include "ins_sdk.h"
 using ::galaxy::ins::sdk::InsSDK;
 
@@ -50,8 +52,12 @@ private:
     
     bool RegistToMaster();
     bool CheckGcedConnection();
+    // pods gced runs, the digest is rebuilt from them
+    bool ListPods(std::vector<PodStatus>* pods);
 
     bool PingMaster();
+    bool PingRelay(const HeartBeatRequest& request);
+    void PickRelay();
     bool WatchMasterPath();
 
     struct ResourceCapacity {
@@ -76,8 +82,14 @@ private:
 
     InsSDK* nexus_;
     Mutex mutex_master_endpoint_;
+    // guarded by mutex_master_endpoint_
+    std::string relay_endpoint_;
+    Relay_Stub* relay_;
+    int64_t heartbeat_sequence_;
 
     PodManager pod_manager_;
+    Mutex pods_mutex_;
+    RunningPods running_pods_;
 };
 
 }   // ending namespace galaxy
@@ -12,8 +12,13 @@ public:
     // pod id
     std::string id;
 
+    std::string jobid;
+
     // pod meta infomation
     PodDescriptor desc;
+
+    // job descriptor version the pod runs
+    std::string version;
 };
 
 class PodInfo {
@@ -32,9 +32,24 @@ int PodManager::Run(const PodDesc& pod) {
     MutexLock lock(&infos_mutex_);
     PodInfosType::iterator it = pod_infos_.find(pod.id);
     if (it != pod_infos_.end()) {
-        LOG(INFO, "pod[%s] already exist", pod.id.c_str());
+        boost::shared_ptr<PodInfo>& info = it->second;
+        if (info->desc.version == pod.version) {
+            LOG(INFO, "pod[%s] already exist", pod.id.c_str());
+            return ret;
+        }
+        // in-place update: keep initd and workspace, the tasks are
+        // created again from the new descriptor by LoopCheckPodInfos
+        for (size_t i = 0; i < info->tasksid.size(); i++) {
+            task_manager_->DeleteTask(info->tasksid[i]);
+        }
+        info->tasksid.clear();
+        LOG(INFO, "update pod[%s] from version %s to %s", pod.id.c_str(),
+            info->desc.version.c_str(), pod.version.c_str());
+        info->desc = pod;
+        info->status.set_version(pod.version);
+        info->status.set_state(kPodPending);
         return ret;
-    }    
+    }
     }
 
     ret = file::Mkdir(FLAGS_gce_work_dir.c_str());
@@ -69,6 +84,9 @@ int PodManager::Run(const PodDesc& pod) {
     pod_info->desc = pod;
     // TODO
     pod_info->status.set_state(kPodPending);
+    pod_info->status.set_version(pod.version);
+    pod_info->status.set_podid(pod.id);
+    pod_info->status.set_jobid(pod.jobid);
 
     {
     MutexLock lock(&infos_mutex_);
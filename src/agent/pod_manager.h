@@ -2,6 +2,7 @@
 #define POD_MANAGER_H
 
 #include <string>
+#include <vector>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/function.hpp>
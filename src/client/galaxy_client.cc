@@ -53,63 +53,84 @@ int AddJob(int argc, char* argv[]) {
 		job.cmd_line = argv[5];
 		job.is_batch = (argc > 6 && 0 == strcmp(argv[6], "batch"));
 
-    std::string jobid = galaxy->SubmitJob(job);
-    if (jobid.empty()) {
+    std::string jobid;
+    int32_t retry_after = 0;
+    baidu::galaxy::SubmitStatus status = galaxy->SubmitJob(job, &jobid, &retry_after);
+    if (status == baidu::galaxy::kSubmitThrottled) {
+        fprintf(stderr, "Master is busy, retry after %d ms\n", retry_after);
+        return 1;
+    }
+    if (status != baidu::galaxy::kSubmitOk) {
         fprintf(stderr, "Submit job fail\n");
         return 1;
     }
     printf("Submit job %s\n", jobid.c_str());
     return 0;
 }
+// a table per page, printed as it arrives
+const int32_t kListPageSize = 500;
+
 int ListAgent(int argc, char* argv[]) {
     baidu::galaxy::Galaxy* galaxy = baidu::galaxy::Galaxy::ConnectGalaxy(FLAGS_master_host + ":" + FLAGS_master_port);
-    std::vector<baidu::galaxy::NodeDescription> agents;
-    baidu::common::TPrinter tp(9);
-    tp.AddRow(9, "", "addr", "pods", "cpu_used", "cpu_assigned", "cpu_total", "mem_used", "mem_assigned", "mem_total");
-    if (galaxy->ListAgents(&agents)) {
+    std::string page_token;
+    uint32_t num = 0;
+    do {
+        std::vector<baidu::galaxy::NodeDescription> agents;
+        if (!galaxy->ListAgents(page_token, kListPageSize, &agents, &page_token)) {
+            printf("Listagent fail\n");
+            return 1;
+        }
+        baidu::common::TPrinter tp(9);
+        if (num == 0) {
+            tp.AddRow(9, "", "addr", "pods", "cpu_used", "cpu_assigned", "cpu_total", "mem_used", "mem_assigned", "mem_total");
+        }
         for (uint32_t i = 0; i < agents.size(); i++) {
             std::vector<std::string> vs;
-						vs.push_back(baidu::common::NumToString(i + 1));
-						vs.push_back(agents[i].addr);
-						vs.push_back(baidu::common::NumToString(agents[i].task_num));
-						vs.push_back(baidu::common::NumToString(agents[i].cpu_used));
-						vs.push_back(baidu::common::NumToString(agents[i].cpu_assigned));
-						vs.push_back(baidu::common::NumToString(agents[i].cpu_share));
-						vs.push_back(baidu::common::NumToString(agents[i].mem_used));
-						vs.push_back(baidu::common::NumToString(agents[i].mem_assigned));
-						vs.push_back(baidu::common::NumToString(agents[i].mem_share));
+            vs.push_back(baidu::common::NumToString(++num));
+            vs.push_back(agents[i].addr);
+            vs.push_back(baidu::common::NumToString(agents[i].task_num));
+            vs.push_back(baidu::common::NumToString(agents[i].cpu_used));
+            vs.push_back(baidu::common::NumToString(agents[i].cpu_assigned));
+            vs.push_back(baidu::common::NumToString(agents[i].cpu_share));
+            vs.push_back(baidu::common::NumToString(agents[i].mem_used));
+            vs.push_back(baidu::common::NumToString(agents[i].mem_assigned));
+            vs.push_back(baidu::common::NumToString(agents[i].mem_share));
             tp.AddRow(vs);
-				}
+        }
         printf("%s\n", tp.ToString().c_str());
-				return 0;
-		}
-		printf("Listagent fail\n");
-		return 1;
+    } while (!page_token.empty());
+    return 0;
 }
  
 int ListJob(int argc, char* argv[]) {
     baidu::galaxy::Galaxy* galaxy = baidu::galaxy::Galaxy::ConnectGalaxy(FLAGS_master_host + ":" + FLAGS_master_port);
-    std::vector<baidu::galaxy::JobInformation> infos;
-    baidu::common::TPrinter tp(8);
-    tp.AddRow(8, "", "id", "name", "running", "replica", "batch", "cpu", "memory");
-    if (galaxy->ListJobs(&infos)) {
+    std::string page_token;
+    uint32_t num = 0;
+    do {
+        std::vector<baidu::galaxy::JobInformation> infos;
+        if (!galaxy->ListJobs(page_token, kListPageSize, &infos, &page_token)) {
+            fprintf(stderr, "List fail\n");
+            return 1;
+        }
+        baidu::common::TPrinter tp(8);
+        if (num == 0) {
+            tp.AddRow(8, "", "id", "name", "running", "replica", "batch", "cpu", "memory");
+        }
         for (uint32_t i = 0; i < infos.size(); i++) {
             std::vector<std::string> vs;
-            vs.push_back(baidu::common::NumToString(i + 1));
+            vs.push_back(baidu::common::NumToString(++num));
             vs.push_back(infos[i].job_id);
             vs.push_back(infos[i].job_name);
             vs.push_back(baidu::common::NumToString(infos[i].running_num));
             vs.push_back(baidu::common::NumToString(infos[i].replica));
-						vs.push_back(infos[i].is_batch ? "batch" : "");
+            vs.push_back(infos[i].is_batch ? "batch" : "");
             vs.push_back(baidu::common::NumToString(infos[i].cpu_used));
             vs.push_back(baidu::common::NumToString(infos[i].mem_used));
             tp.AddRow(vs);
         }
         printf("%s\n", tp.ToString().c_str());
-        return 0;
-    }
-    fprintf(stderr, "List fail\n");
-    return 1;
+    } while (!page_token.empty());
+    return 0;
 }
 int main(int argc, char* argv[]) {
     FLAGS_flagfile = "./galaxy.flag";
@@ -7,18 +7,78 @@
 // nexus
 DEFINE_string(nexus_servers, "", "server list of nexus, e.g abc.com:1234,def.com:5342");
 DEFINE_string(nexus_root_path, "/baidu/galaxy", "root path of galaxy cluster on nexus, e.g /ps/galaxy");
+DEFINE_string(mem_nexus_port, "7831", "listen port of mem_nexus, the in-memory nexus stand-in of tests, reached as nexus_servers=mem://<host:port>");
+DEFINE_int32(mem_nexus_session_timeout, 6000, "ms without keepalive after which mem_nexus ends a session");
 
 // sdk
 DEFINE_string(master_host, "localhost", "Master service hostname");
 
 // master
 DEFINE_string(master_port, "7828", "Master service listen port");
-DEFINE_int32(master_agent_timeout, 40000, "Agent timeout");
+DEFINE_int32(master_agent_timeout, 40000, "agent silent this long in ms is dead regardless of phi");
 DEFINE_int32(master_agent_rpc_timeout, 10000, "Agent RPC timeout");
 DEFINE_int32(master_query_period, 30000, "Query period");
 DEFINE_string(master_lock_path, "/master_lock", "master lock name on nexus");
 DEFINE_string(master_path, "/master", "master path on nexus");
 DEFINE_string(jobs_store_path, "/jobs", "");
+DEFINE_string(jobs_log_path, "/jobs_log", "log of committed job record batches on nexus");
+DEFINE_int32(master_persist_batch_size, 256, "max job records committed to nexus in one batch");
+DEFINE_int32(master_persist_delay, 5, "max delay in ms before queued job records are committed");
+DEFINE_int32(master_persist_threads, 8, "nexus writers of one commit batch");
+DEFINE_string(master_snapshot_path, "./job_snapshot", "master local snapshot of job records");
+DEFINE_int32(master_snapshot_interval, 60000, "interval in ms of writing local job snapshot");
+DEFINE_int32(master_deploy_step, 0, "max starting pods of a job without deploy_step, 0 for no limit");
+DEFINE_int32(master_max_inflight_run_pod, 500, "max RunPod requests in flight to agents");
+DEFINE_int32(master_query_snapshot_interval, 1000, "min interval in ms of publishing read-only query snapshot");
+DEFINE_int32(master_snapshot_pod_run, 1024, "pods encoded together in the query snapshot, rebuilt as one when one changes");
+DEFINE_int32(master_snapshot_usage_interval, 30000, "min interval in ms of refreshing pod usage in the query snapshot");
+DEFINE_bool(master_follower, true, "replicate the active master while waiting for master lock");
+DEFINE_string(master_follow_addr, "", "master to replicate, read from nexus when empty");
+DEFINE_int32(master_replica_interval, 1000, "interval in ms of pulling state from the active master");
+DEFINE_int32(master_liveness_threads, 4, "workers of master heartbeat requests");
+DEFINE_int32(master_scheduling_threads, 4, "workers of master scheduler requests");
+DEFINE_int32(master_query_threads, 8, "workers of master user requests");
+DEFINE_int32(master_liveness_queue_limit, 100000, "max queued heartbeat requests");
+DEFINE_int32(master_scheduling_queue_limit, 1000, "max queued scheduler requests");
+DEFINE_int32(master_query_queue_limit, 1000, "max queued user requests");
+DEFINE_int32(master_max_replica, 100000, "max replica of a job");
+DEFINE_int64(master_user_pending_limit, 100000, "max pods of one user waiting to be placed, submissions over it are throttled");
+DEFINE_int64(master_pending_limit, 1000000, "max pods waiting to be placed, submissions over it are throttled");
+DEFINE_int32(master_pending_batch, 1000, "max materialized pending pods of a job");
+DEFINE_int32(master_throttle_retry_after, 5000, "time in ms throttled clients are asked to wait");
+DEFINE_int32(master_response_cache_size, 1000, "serialized list responses kept by master");
+DEFINE_int32(master_watch_log_size, 100000, "job and pod state transitions kept for watchers");
+DEFINE_int32(master_watch_max_events, 1000, "max events in one watch response");
+DEFINE_int32(master_watch_timeout, 30000, "max time in ms a watch request is held without events");
+DEFINE_double(master_safe_mode_agent_fraction, 0.9, "leave safe mode when this fraction of known agents is reconciled");
+DEFINE_int32(master_safe_mode_min_wait, 5000, "min time in ms in safe mode, for agents to heartbeat");
+DEFINE_int32(master_safe_mode_deadline, 60000, "max time in ms in safe mode");
+DEFINE_int32(master_reconcile_parallelism, 512, "max concurrent first queries of agents");
+DEFINE_int32(master_reschedule_rate, 1000, "max lost pods a second released back to pending");
+DEFINE_int32(master_reschedule_interval, 1000, "interval in ms of releasing lost pods to pending");
+// With 1s heartbeats the defaults suspect an agent after about 21s of
+// silence and declare it dead after about 35s, inside master_agent_timeout.
+// A smaller min std deviation or pause detects deaths sooner but reacts to
+// network hiccups and master pauses as well, and rescheduling the pods of
+// a live agent costs more than restarting a dead one's a few seconds late.
+DEFINE_double(master_phi_suspect_threshold, 3.0, "phi of an agent to stop placing pods on it");
+DEFINE_double(master_phi_dead_threshold, 10.0, "phi of an agent to reschedule its pods");
+DEFINE_int32(master_phi_window, 100, "heartbeat intervals kept per agent for phi");
+DEFINE_int32(master_phi_min_std_deviation, 5000, "min std deviation in ms of heartbeat intervals");
+DEFINE_int32(master_phi_acceptable_pause, 5000, "heartbeat pause in ms tolerated on top of the mean interval");
+DEFINE_int32(master_liveness_check_interval, 500, "interval in ms of evaluating agent phi");
+DEFINE_int32(master_shard_id, -1, "job shard served by this master, under nexus subtree <nexus_root_path>/shard<id>, -1 for unsharded");
+DEFINE_int32(master_shard_num, 1, "number of job shards, agents are leased to one shard at a time by the router");
+DEFINE_int32(master_lease_timeout, 10000, "ms a shard keeps placing on its leased agents without word from the router, the router takes them back after twice as long");
+DEFINE_int32(master_lease_hold, 30000, "ms a shard with pending pods keeps a leased agent another shard asks for");
+DEFINE_int32(master_digest_check_interval, 5000, "interval in ms of comparing agent pod digests");
+DEFINE_string(master_binary_store_path, "./binaries", "local dir of master content-addressed binary store");
+DEFINE_int32(master_binary_fetch_retry, 5000, "interval in ms of retrying deploys held back by a binary missing from the store");
+DEFINE_string(master_event_log_path, "./events", "local dir of master binary event log, empty to disable it");
+DEFINE_int32(master_event_log_segment_size, 64, "size in MB of an event log segment");
+DEFINE_int32(master_event_log_segments, 16, "max event log segments kept");
+DEFINE_int32(master_executor_threads, 0, "workers of master background work and rpc callbacks, 0 for one per core");
+DEFINE_int32(master_callback_batch, 64, "max rpc callbacks run under one acquisition of the job manager lock");
 
 // scheduler
 
@@ -33,6 +93,18 @@ DEFINE_string(agent_initd_bin, "./initd", "initd bin path");
 
 DEFINE_int32(agent_monitor_tasks_interval, 2, "agent monitor pods interval, unit seconds");
 DEFINE_int32(agent_rpc_initd_timeout, 2, "agent monitor initd interval, unit seconds");
+DEFINE_bool(agent_use_relay, false, "send heartbeats through a relay found on nexus");
+
+// relay
+DEFINE_string(relay_path, "/relay", "relay registry path on nexus");
+DEFINE_string(relay_ip, "127.0.0.1", "relay host ip");
+DEFINE_string(relay_port, "7829", "relay listen port");
+DEFINE_int32(relay_flush_interval, 1000, "interval in ms of forwarding heartbeats to master");
+
+// router
+DEFINE_string(router_port, "7830", "router listen port");
+DEFINE_int32(router_threads, 8, "router workers forwarding requests to shards");
+DEFINE_int32(router_rpc_timeout, 5, "timeout in seconds of requests to shards");
 
 // gce
 DEFINE_string(gce_cgroup_root, "/cgroups/", "Cgroup root mount path");
@@ -0,0 +1,155 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "binary_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/sha.h>
+#include <snappy.h>
+#include <logging.h>
+
+namespace baidu {
+namespace galaxy {
+
+BinaryStore::BinaryStore(const std::string& root)
+    : root_(root), prepared_(false) {
+}
+
+BinaryStore::~BinaryStore() {
+}
+
+static std::string ToHex(const unsigned char* digest, int len) {
+    std::string hex;
+    char buf[3];
+    for (int i = 0; i < len; i++) {
+        snprintf(buf, sizeof(buf), "%02x", digest[i]);
+        hex.append(buf, 2);
+    }
+    return hex;
+}
+
+std::string BinaryStore::Digest(const std::string& binary) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(binary.data()), binary.size(), digest);
+    return ToHex(digest, SHA256_DIGEST_LENGTH);
+}
+
+static std::string Sha1Digest(const std::string& binary) {
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char*>(binary.data()), binary.size(), digest);
+    return ToHex(digest, SHA_DIGEST_LENGTH);
+}
+
+std::string BinaryStore::FilePath(const std::string& digest) {
+    return root_ + "/" + digest;
+}
+
+bool BinaryStore::Prepare() {
+    mutex_.AssertHeld();
+    if (prepared_) {
+        return true;
+    }
+    if (::mkdir(root_.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG(WARNING, "mkdir binary store %s fail: %s",
+            root_.c_str(), strerror(errno));
+        return false;
+    }
+    prepared_ = true;
+    return true;
+}
+
+bool BinaryStore::Exists(const std::string& digest) {
+    struct stat st;
+    return ::stat(FilePath(digest).c_str(), &st) == 0;
+}
+
+bool BinaryStore::Put(const std::string& binary, std::string* digest) {
+    *digest = Digest(binary);
+    return Write(*digest, binary);
+}
+
+// the name says the hash, sha1 names are left from older masters
+bool BinaryStore::PutAs(const std::string& digest, const std::string& binary) {
+    std::string actual;
+    if (digest.size() == SHA_DIGEST_LENGTH * 2) {
+        actual = Sha1Digest(binary);
+    } else if (digest.size() == SHA256_DIGEST_LENGTH * 2) {
+        actual = Digest(binary);
+    }
+    if (actual != digest) {
+        LOG(WARNING, "binary does not match its name %s", digest.c_str());
+        return false;
+    }
+    return Write(digest, binary);
+}
+
+bool BinaryStore::Write(const std::string& digest, const std::string& binary) {
+    if (Exists(digest)) {
+        LOG(INFO, "binary %s already stored", digest.c_str());
+        return true;
+    }
+    std::string compressed;
+    snappy::Compress(binary.data(), binary.size(), &compressed);
+
+    MutexLock lock(&mutex_);
+    if (!Prepare()) {
+        return false;
+    }
+    // write aside and rename, readers never see a half written file
+    std::string path = FilePath(digest);
+    std::string tmp_path = path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    if (fp == NULL) {
+        LOG(WARNING, "open %s fail: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    size_t len = fwrite(compressed.data(), 1, compressed.size(), fp);
+    bool ok = (len == compressed.size()) && fflush(fp) == 0
+              && fsync(fileno(fp)) == 0;
+    fclose(fp);
+    if (!ok || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOG(WARNING, "save binary %s fail: %s", digest.c_str(), strerror(errno));
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    LOG(INFO, "binary %s stored, size: %lu, compressed: %lu",
+        digest.c_str(), binary.size(), compressed.size());
+    return true;
+}
+
+bool BinaryStore::Get(const std::string& digest, std::string* binary) {
+    std::string path = FilePath(digest);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG(WARNING, "open binary %s fail: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+        LOG(WARNING, "stat binary %s fail", path.c_str());
+        ::close(fd);
+        return false;
+    }
+    void* data = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        LOG(WARNING, "mmap binary %s fail: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    bool ok = snappy::Uncompress(static_cast<const char*>(data), st.st_size, binary);
+    ::munmap(data, st.st_size);
+    if (!ok) {
+        LOG(WARNING, "uncompress binary %s fail", path.c_str());
+    }
+    return ok;
+}
+
+}
+}
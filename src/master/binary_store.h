@@ -0,0 +1,40 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_BINARY_STORE_H
+#define BAIDU_GALAXY_BINARY_STORE_H
+#include <string>
+
+#include <mutex.h>
+
+namespace baidu {
+namespace galaxy {
+
+// Content-addressed store of task binaries on master local disk.
+// Each binary is kept once, snappy-compressed, in <root>/<sha256 hex>
+// and mmap'd only when it has to be sent to an agent. Binaries stored by
+// older masters are named by their sha1 hex.
+class BinaryStore {
+public:
+    explicit BinaryStore(const std::string& root);
+    ~BinaryStore();
+    bool Put(const std::string& binary, std::string* digest);
+    // stores binary under digest, a sha1 or sha256 hex, if it hashes to it
+    bool PutAs(const std::string& digest, const std::string& binary);
+    bool Get(const std::string& digest, std::string* binary);
+    bool Exists(const std::string& digest);
+    static std::string Digest(const std::string& binary);
+private:
+    std::string FilePath(const std::string& digest);
+    bool Prepare();
+    bool Write(const std::string& digest, const std::string& binary);
+private:
+    std::string root_;
+    bool prepared_;
+    Mutex mutex_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,97 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "chunked_id_set.h"
+
+#include <assert.h>
+#include <iterator>
+
+namespace baidu {
+namespace galaxy {
+
+ChunkedIdSet::Iterator::Iterator(ChunkMap::const_iterator chunk_it,
+                                 ChunkMap::const_iterator chunk_end,
+                                 Chunk::const_iterator it)
+    : chunk_it_(chunk_it), chunk_end_(chunk_end), it_(it) {
+    Skip();
+}
+
+void ChunkedIdSet::Iterator::Next() {
+    ++it_;
+    Skip();
+}
+
+void ChunkedIdSet::Iterator::Skip() {
+    while (chunk_it_ != chunk_end_ && it_ == chunk_it_->second->end()) {
+        if (++chunk_it_ != chunk_end_) {
+            it_ = chunk_it_->second->begin();
+        }
+    }
+}
+
+ChunkedIdSet::ChunkedIdSet() : size_(0) {
+    chunks_[""].reset(new Chunk());
+}
+
+ChunkedIdSet::ChunkMap::iterator ChunkedIdSet::ChunkOf(const std::string& id) {
+    // the first chunk is keyed by "", there is always one before
+    ChunkMap::iterator it = chunks_.upper_bound(id);
+    return --it;
+}
+
+ChunkedIdSet::ChunkMap::const_iterator ChunkedIdSet::ChunkOf(const std::string& id) const {
+    ChunkMap::const_iterator it = chunks_.upper_bound(id);
+    return --it;
+}
+
+ChunkedIdSet::Chunk* ChunkedIdSet::MutableChunk(ChunkMap::iterator chunk_it) {
+    if (!chunk_it->second.unique()) {
+        chunk_it->second.reset(new Chunk(*chunk_it->second));
+    }
+    return chunk_it->second.get();
+}
+
+void ChunkedIdSet::Insert(const std::string& id) {
+    ChunkMap::iterator chunk_it = ChunkOf(id);
+    if (chunk_it->second->find(id) != chunk_it->second->end()) {
+        return;
+    }
+    Chunk* chunk = MutableChunk(chunk_it);
+    chunk->insert(id);
+    size_++;
+    if (chunk->size() <= 2 * kChunkSize) {
+        return;
+    }
+    Chunk::iterator middle = chunk->begin();
+    std::advance(middle, chunk->size() / 2);
+    boost::shared_ptr<Chunk> upper(new Chunk(middle, chunk->end()));
+    chunk->erase(middle, chunk->end());
+    chunks_[*upper->begin()] = upper;
+}
+
+void ChunkedIdSet::Erase(const std::string& id) {
+    ChunkMap::iterator chunk_it = ChunkOf(id);
+    if (chunk_it->second->find(id) == chunk_it->second->end()) {
+        return;
+    }
+    Chunk* chunk = MutableChunk(chunk_it);
+    chunk->erase(id);
+    size_--;
+    if (chunk->empty() && !chunk_it->first.empty()) {
+        chunks_.erase(chunk_it);
+    }
+}
+
+bool ChunkedIdSet::Contains(const std::string& id) const {
+    ChunkMap::const_iterator chunk_it = ChunkOf(id);
+    return chunk_it->second->find(id) != chunk_it->second->end();
+}
+
+ChunkedIdSet::Iterator ChunkedIdSet::UpperBound(const std::string& id) const {
+    ChunkMap::const_iterator chunk_it = ChunkOf(id);
+    assert(chunk_it != chunks_.end());
+    return Iterator(chunk_it, chunks_.end(), chunk_it->second->upper_bound(id));
+}
+
+}
+}
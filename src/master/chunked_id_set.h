@@ -0,0 +1,63 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_CHUNKED_ID_SET_H
+#define BAIDU_GALAXY_CHUNKED_ID_SET_H
+#include <stddef.h>
+#include <string>
+#include <set>
+#include <map>
+#include <boost/shared_ptr.hpp>
+
+namespace baidu {
+namespace galaxy {
+
+// Sorted set of ids kept in chunks, each keyed by the lowest id it may
+// hold, the first by "". Copies share the chunks and a change copies only
+// the chunk it touches, so a set of the query snapshot is updated for the
+// next one at the cost of its chunk map and one chunk.
+class ChunkedIdSet {
+public:
+    typedef std::set<std::string> Chunk;
+    typedef std::map<std::string, boost::shared_ptr<Chunk> > ChunkMap;
+
+    class Iterator {
+    public:
+        bool Valid() const { return chunk_it_ != chunk_end_; }
+        const std::string& Get() const { return *it_; }
+        void Next();
+    private:
+        friend class ChunkedIdSet;
+        Iterator(ChunkMap::const_iterator chunk_it, ChunkMap::const_iterator chunk_end,
+                 Chunk::const_iterator it);
+        // past the empty chunks
+        void Skip();
+        ChunkMap::const_iterator chunk_it_;
+        ChunkMap::const_iterator chunk_end_;
+        Chunk::const_iterator it_;
+    };
+
+    ChunkedIdSet();
+    void Insert(const std::string& id);
+    void Erase(const std::string& id);
+    bool Contains(const std::string& id) const;
+    size_t Size() const { return size_; }
+    bool Empty() const { return size_ == 0; }
+    // at the first id above `id`
+    Iterator UpperBound(const std::string& id) const;
+private:
+    // chunks over twice this are split in halves
+    static const size_t kChunkSize = 512;
+    ChunkMap::iterator ChunkOf(const std::string& id);
+    ChunkMap::const_iterator ChunkOf(const std::string& id) const;
+    // the chunk of id, copied first if a copy of the set shares it
+    Chunk* MutableChunk(ChunkMap::iterator chunk_it);
+
+    ChunkMap chunks_;
+    size_t size_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,144 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_CHUNKED_MAP_H
+#define BAIDU_GALAXY_CHUNKED_MAP_H
+#include <stddef.h>
+#include <iterator>
+#include <string>
+#include <map>
+#include <boost/shared_ptr.hpp>
+
+namespace baidu {
+namespace galaxy {
+
+// Sorted map of ids to values kept in chunks as ChunkedIdSet keeps its
+// ids. Copies share the chunks and a change copies only the chunk it
+// touches, so the maps of the query snapshot are carried to the next one
+// at the cost of their chunk maps and the chunks of changed entries.
+template <class V>
+class ChunkedMap {
+public:
+    typedef std::map<std::string, V> Chunk;
+    typedef std::map<std::string, boost::shared_ptr<Chunk> > ChunkMap;
+
+    class Iterator {
+    public:
+        bool Valid() const { return chunk_it_ != chunk_end_; }
+        const std::string& Key() const { return it_->first; }
+        const V& Value() const { return it_->second; }
+        void Next() {
+            ++it_;
+            Skip();
+        }
+    private:
+        friend class ChunkedMap;
+        Iterator(typename ChunkMap::const_iterator chunk_it,
+                 typename ChunkMap::const_iterator chunk_end,
+                 typename Chunk::const_iterator it)
+            : chunk_it_(chunk_it), chunk_end_(chunk_end), it_(it) {
+            Skip();
+        }
+        // past the empty chunks
+        void Skip() {
+            while (chunk_it_ != chunk_end_ && it_ == chunk_it_->second->end()) {
+                if (++chunk_it_ != chunk_end_) {
+                    it_ = chunk_it_->second->begin();
+                }
+            }
+        }
+        typename ChunkMap::const_iterator chunk_it_;
+        typename ChunkMap::const_iterator chunk_end_;
+        typename Chunk::const_iterator it_;
+    };
+
+    ChunkedMap() : size_(0) {
+        chunks_[""].reset(new Chunk());
+    }
+    // NULL when id is not there
+    const V* Find(const std::string& id) const;
+    void Set(const std::string& id, const V& value);
+    void Erase(const std::string& id);
+    size_t Size() const { return size_; }
+    Iterator Begin() const {
+        return Iterator(chunks_.begin(), chunks_.end(), chunks_.begin()->second->begin());
+    }
+    // at the first id above `id`
+    Iterator UpperBound(const std::string& id) const;
+private:
+    // chunks over twice this are split in halves
+    static const size_t kChunkSize = 512;
+    typename ChunkMap::iterator ChunkOf(const std::string& id) {
+        // the first chunk is keyed by "", there is always one before
+        typename ChunkMap::iterator it = chunks_.upper_bound(id);
+        return --it;
+    }
+    typename ChunkMap::const_iterator ChunkOf(const std::string& id) const {
+        typename ChunkMap::const_iterator it = chunks_.upper_bound(id);
+        return --it;
+    }
+    // the chunk, copied first if a copy of the map shares it
+    Chunk* MutableChunk(typename ChunkMap::iterator chunk_it) {
+        if (!chunk_it->second.unique()) {
+            chunk_it->second.reset(new Chunk(*chunk_it->second));
+        }
+        return chunk_it->second.get();
+    }
+
+    ChunkMap chunks_;
+    size_t size_;
+};
+
+template <class V>
+const V* ChunkedMap<V>::Find(const std::string& id) const {
+    typename ChunkMap::const_iterator chunk_it = ChunkOf(id);
+    typename Chunk::const_iterator it = chunk_it->second->find(id);
+    if (it == chunk_it->second->end()) {
+        return NULL;
+    }
+    return &it->second;
+}
+
+template <class V>
+void ChunkedMap<V>::Set(const std::string& id, const V& value) {
+    Chunk* chunk = MutableChunk(ChunkOf(id));
+    std::pair<typename Chunk::iterator, bool> ret = chunk->insert(std::make_pair(id, value));
+    if (!ret.second) {
+        ret.first->second = value;
+        return;
+    }
+    size_++;
+    if (chunk->size() <= 2 * kChunkSize) {
+        return;
+    }
+    typename Chunk::iterator middle = chunk->begin();
+    std::advance(middle, chunk->size() / 2);
+    boost::shared_ptr<Chunk> upper(new Chunk(middle, chunk->end()));
+    chunk->erase(middle, chunk->end());
+    chunks_[upper->begin()->first] = upper;
+}
+
+template <class V>
+void ChunkedMap<V>::Erase(const std::string& id) {
+    typename ChunkMap::iterator chunk_it = ChunkOf(id);
+    if (chunk_it->second->find(id) == chunk_it->second->end()) {
+        return;
+    }
+    Chunk* chunk = MutableChunk(chunk_it);
+    chunk->erase(id);
+    size_--;
+    if (chunk->empty() && !chunk_it->first.empty()) {
+        chunks_.erase(chunk_it);
+    }
+}
+
+template <class V>
+typename ChunkedMap<V>::Iterator ChunkedMap<V>::UpperBound(const std::string& id) const {
+    typename ChunkMap::const_iterator chunk_it = ChunkOf(id);
+    return Iterator(chunk_it, chunks_.end(), chunk_it->second->upper_bound(id));
+}
+
+}
+}
+
+#endif
@@ -0,0 +1,513 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "event_log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <logging.h>
+#include <timer.h>
+
+namespace baidu {
+namespace galaxy {
+
+// records are written in place, the layout is the file format
+typedef char EventRecordSizeCheck[sizeof(EventRecord) == 64 ? 1 : -1];
+
+static const int64_t kNameSlots = 1 << 16;
+static const int kNameProbes = 16;
+static const size_t kNameChunk = sizeof(((EventRecord*)0)->ids);
+static const int kMaxNameChunks = 127;
+static const char kSegmentPrefix[] = "events.";
+
+EventLog::EventLog()
+    : segment_size_(0), max_segments_(0), current_(NULL), writers_(0), next_index_(0),
+      spare_(NULL), prepare_failed_(false), stop_(false),
+      prepare_cond_(&mutex_), prepare_started_(false) {
+}
+
+EventLog::~EventLog() {
+    {
+        MutexLock lock(&mutex_);
+        stop_ = true;
+        prepare_cond_.Broadcast();
+    }
+    if (prepare_started_) {
+        prepare_thread_.Join();
+    }
+    for (size_t i = 0; i < segments_.size(); i++) {
+        FreeSegment(segments_[i]);
+    }
+    // never current, nothing of it is worth keeping
+    if (spare_ != NULL) {
+        ::unlink(SegmentFile(path_, spare_->index).c_str());
+        FreeSegment(spare_);
+    }
+}
+
+void EventLog::FreeSegment(Segment* segment) {
+    if (segment->base != NULL) {
+        ::munmap(segment->base, segment->capacity * sizeof(EventRecord));
+        delete[] segment->names;
+    }
+    delete segment;
+}
+
+uint64_t EventLog::Hash(const std::string& id) {
+    if (id.empty()) {
+        return 0;
+    }
+    // multiplicative, a word at a time, 0 is kept for none
+    uint64_t hash = 0x9e3779b97f4a7c15UL ^ id.size();
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= id.size(); i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, id.data() + i, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15UL;
+        hash ^= hash >> 32;
+    }
+    for (; i < id.size(); i++) {
+        hash = (hash ^ static_cast<unsigned char>(id[i])) * 0x9e3779b97f4a7c15UL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    return hash == 0 ? 1 : hash;
+}
+
+std::string EventLog::SegmentFile(const std::string& path, int64_t index) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s%ld", kSegmentPrefix, index);
+    return path + "/" + name;
+}
+
+bool EventLog::ListSegments(const std::string& path, std::vector<int64_t>* indexes) {
+    DIR* dir = ::opendir(path.c_str());
+    if (dir == NULL) {
+        LOG(WARNING, "open event log dir %s fail: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    size_t prefix_len = strlen(kSegmentPrefix);
+    struct dirent* entry = NULL;
+    while ((entry = ::readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, kSegmentPrefix, prefix_len) != 0) {
+            continue;
+        }
+        char* end = NULL;
+        int64_t index = strtoll(entry->d_name + prefix_len, &end, 10);
+        if (end != entry->d_name + prefix_len && *end == '\0') {
+            indexes->push_back(index);
+        }
+    }
+    ::closedir(dir);
+    std::sort(indexes->begin(), indexes->end());
+    return true;
+}
+
+bool EventLog::Open(const std::string& path, int64_t segment_size, int32_t max_segments) {
+    MutexLock lock(&mutex_);
+    if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG(WARNING, "mkdir event log %s fail: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    std::vector<int64_t> indexes;
+    if (!ListSegments(path, &indexes)) {
+        return false;
+    }
+    path_ = path;
+    segment_size_ = segment_size;
+    max_segments_ = max_segments;
+    // segments of a previous master are kept, this one starts after them
+    next_index_ = indexes.empty() ? 0 : indexes.back() + 1;
+    Segment* segment = OpenSegment(next_index_++);
+    if (segment == NULL) {
+        return false;
+    }
+    StartSegment(segment);
+    __sync_synchronize();
+    current_ = segment;
+    prepare_thread_.Start(boost::bind(&EventLog::PrepareSegments, this));
+    prepare_started_ = true;
+    LOG(INFO, "event log opened at %s, segment %ld", path.c_str(), segment->index);
+    return true;
+}
+
+void EventLog::PrepareSegments() {
+    for (;;) {
+        int64_t index = 0;
+        {
+            MutexLock lock(&mutex_);
+            while (!stop_ && (spare_ != NULL || prepare_failed_)) {
+                prepare_cond_.Wait();
+            }
+            if (stop_) {
+                return;
+            }
+            index = next_index_++;
+        }
+        // the allocation of a whole segment is not waited for under mutex_
+        Segment* segment = OpenSegment(index);
+        MutexLock lock(&mutex_);
+        spare_ = segment;
+        prepare_failed_ = (segment == NULL);
+        prepare_cond_.Broadcast();
+    }
+}
+
+// path_, segment_size_ and max_segments_ are set before the first call
+EventLog::Segment* EventLog::OpenSegment(int64_t index) {
+    int64_t capacity = segment_size_ / sizeof(EventRecord);
+    if (capacity < 2) {
+        LOG(WARNING, "event log segment size %ld too small", segment_size_);
+        return NULL;
+    }
+    // the oldest go first, so their space is there for the new one
+    std::vector<int64_t> indexes;
+    ListSegments(path_, &indexes);
+    for (size_t i = 0; i + max_segments_ <= indexes.size(); i++) {
+        ::unlink(SegmentFile(path_, indexes[i]).c_str());
+    }
+    std::string file = SegmentFile(path_, index);
+    int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG(WARNING, "open event log %s fail: %s", file.c_str(), strerror(errno));
+        return NULL;
+    }
+    int64_t size = capacity * sizeof(EventRecord);
+    // blocks are allocated up front, writing a hole of a sparse file through
+    // the mapping on a full disk would kill the master with SIGBUS
+    int error = ::posix_fallocate(fd, 0, size);
+    if (error != 0) {
+        LOG(WARNING, "allocate event log %s fail: %s", file.c_str(), strerror(error));
+        ::close(fd);
+        ::unlink(file.c_str());
+        return NULL;
+    }
+    void* base = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        LOG(WARNING, "map event log %s fail: %s", file.c_str(), strerror(errno));
+        ::unlink(file.c_str());
+        return NULL;
+    }
+    Segment* segment = new Segment();
+    segment->index = index;
+    segment->base = static_cast<char*>(base);
+    segment->capacity = capacity;
+    segment->next = 1;
+    segment->committed = 1;
+    segment->names = new uint64_t[kNameSlots]();
+    return segment;
+}
+
+// writes the header of a segment about to become current
+void EventLog::StartSegment(Segment* segment) {
+    mutex_.AssertHeld();
+    EventRecord* header = reinterpret_cast<EventRecord*>(segment->base);
+    header->type = kEventSegment;
+    header->from = -1;
+    header->to = -1;
+    header->time = common::timer::get_micros();
+    header->value = segment->index;
+    header->commit = kEventCommit;
+    segments_.push_back(segment);
+}
+
+// A writer keeps a segment mapped from reserving slots of it to committing
+// them. Reservations past the end fail, the one crossing it commits the
+// unusable tail and switches to the next segment. So a segment is full
+// and unused once all its slots are committed, the last committer unmaps
+// it.
+bool EventLog::Reserve(Segment* segment, int64_t num, int64_t* slot) {
+    *slot = __sync_fetch_and_add(&segment->next, num);
+    if (*slot + num <= segment->capacity) {
+        return true;
+    }
+    if (*slot <= segment->capacity) {
+        if (*slot < segment->capacity) {
+            Commit(segment, segment->capacity - *slot);
+        }
+        Rotate(segment);
+    }
+    return false;
+}
+
+void EventLog::Commit(Segment* segment, int64_t num) {
+    if (__sync_add_and_fetch(&segment->committed, num) != segment->capacity) {
+        return;
+    }
+    ::munmap(segment->base, segment->capacity * sizeof(EventRecord));
+    segment->base = NULL;
+    delete[] segment->names;
+    segment->names = NULL;
+}
+
+// true when the name of id is not in segment yet, the caller writes it
+bool EventLog::AddName(Segment* segment, uint64_t id) {
+    for (int i = 0; i < kNameProbes; i++) {
+        uint64_t* slot = &segment->names[(id + i) & (kNameSlots - 1)];
+        uint64_t old = *static_cast<volatile uint64_t*>(slot);
+        if (old == 0) {
+            old = __sync_val_compare_and_swap(slot, 0, id);
+            if (old == 0) {
+                return true;
+            }
+        }
+        if (old == id) {
+            return false;
+        }
+    }
+    // crowded around id, log the name once more
+    return true;
+}
+
+void EventLog::Append(EventType type, const std::string& jobid, const std::string& podid,
+                      const std::string& agent, int32_t from, int32_t to, int64_t value) {
+    EventRecord record;
+    memset(&record, 0, sizeof(record));
+    record.type = type;
+    record.from = from;
+    record.to = to;
+    record.time = common::timer::get_micros();
+    record.value = value;
+    const std::string* names[3] = {&jobid, &podid, &agent};
+    for (int i = 0; i < 3; i++) {
+        record.ids[i] = Hash(*names[i]);
+    }
+    // counted before current_ is read, see Rotate
+    __sync_fetch_and_add(&writers_, 1);
+    Segment* segment = NULL;
+    int64_t slot = 0;
+    for (;;) {
+        segment = current_;
+        if (segment == NULL) {
+            __sync_fetch_and_sub(&writers_, 1);
+            dropped_.Inc();
+            return;
+        }
+        if (Reserve(segment, 1, &slot)) {
+            break;
+        }
+        while (current_ == segment) {
+            sched_yield();
+        }
+    }
+    // ids new to the segment get their names logged there
+    int64_t chunks[3] = {0, 0, 0};
+    int64_t name_num = 0;
+    for (int i = 0; i < 3; i++) {
+        if (record.ids[i] != 0 && AddName(segment, record.ids[i])) {
+            chunks[i] = std::min<int64_t>((names[i]->size() + kNameChunk - 1) / kNameChunk,
+                                          kMaxNameChunks);
+            name_num += chunks[i];
+        }
+    }
+    int64_t name_slot = 0;
+    if (name_num > 0 && !Reserve(segment, name_num, &name_slot)) {
+        // the segment is full, its reader shows these ids unnamed
+        name_num = 0;
+    }
+    EventRecord* records = reinterpret_cast<EventRecord*>(segment->base);
+    EventRecord* name = records + name_slot;
+    for (int i = 0; i < 3 && name_num > 0; i++) {
+        for (int64_t chunk = 0; chunk < chunks[i]; chunk++, name++) {
+            name->type = kEventName;
+            name->from = chunk;
+            name->to = chunks[i];
+            name->time = record.time;
+            name->value = record.ids[i];
+            names[i]->copy(reinterpret_cast<char*>(name->ids), kNameChunk,
+                           chunk * kNameChunk);
+            __sync_synchronize();
+            name->commit = kEventCommit;
+        }
+    }
+    memcpy(records + slot, &record, sizeof(record));
+    __sync_synchronize();
+    records[slot].commit = kEventCommit;
+    Commit(segment, 1 + name_num);
+    __sync_fetch_and_sub(&writers_, 1);
+    appended_.Inc();
+}
+
+// The caller still writes to full after this. Other writers may hold any
+// segment that was current when they entered Append, so the older ones
+// are freed only when the caller is the one writer left, later writers
+// all see the new segment.
+void EventLog::Rotate(Segment* full) {
+    MutexLock lock(&mutex_);
+    // only waited for when the log fills segments faster than they are
+    // allocated
+    while (spare_ == NULL && !prepare_failed_ && !stop_) {
+        prepare_cond_.Wait();
+    }
+    Segment* segment = spare_;
+    spare_ = NULL;
+    if (segment == NULL) {
+        LOG(WARNING, "event log stopped after segment %ld, events are dropped",
+            full->index);
+    } else {
+        StartSegment(segment);
+        prepare_cond_.Signal();
+    }
+    __sync_synchronize();
+    current_ = segment;
+    if (__sync_add_and_fetch(&writers_, 0) != 1) {
+        return;
+    }
+    std::vector<Segment*> kept;
+    for (size_t i = 0; i < segments_.size(); i++) {
+        if (segments_[i] == full || segments_[i] == segment) {
+            kept.push_back(segments_[i]);
+        } else {
+            FreeSegment(segments_[i]);
+        }
+    }
+    segments_.swap(kept);
+}
+
+int64_t EventLog::Appended() {
+    return appended_.Get();
+}
+
+int64_t EventLog::Dropped() {
+    return dropped_.Get();
+}
+
+EventLogReader::EventLogReader(const std::string& path) : path_(path) {
+}
+
+namespace {
+bool EventTimeLess(const EventRecord& a, const EventRecord& b) {
+    return a.time < b.time;
+}
+}
+
+bool EventLogReader::Load(std::vector<EventRecord>* records) {
+    std::vector<int64_t> indexes;
+    if (!EventLog::ListSegments(path_, &indexes)) {
+        return false;
+    }
+    for (size_t i = 0; i < indexes.size(); i++) {
+        if (!LoadSegment(EventLog::SegmentFile(path_, indexes[i]), records)) {
+            return false;
+        }
+    }
+    // writers commit out of order, by at most their concurrency
+    std::stable_sort(records->begin(), records->end(), EventTimeLess);
+    return true;
+}
+
+bool EventLogReader::LoadSegment(const std::string& file,
+                                 std::vector<EventRecord>* records) {
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG(WARNING, "open event log %s fail: %s", file.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        LOG(WARNING, "stat event log %s fail: %s", file.c_str(), strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    size_t num = st.st_size / sizeof(EventRecord);
+    if (num == 0) {
+        ::close(fd);
+        return true;
+    }
+    void* base = ::mmap(NULL, num * sizeof(EventRecord), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        LOG(WARNING, "mmap event log %s fail: %s", file.c_str(), strerror(errno));
+        return false;
+    }
+    const EventRecord* segment = static_cast<const EventRecord*>(base);
+    std::map<uint64_t, std::vector<std::string> > chunks;
+    for (size_t i = 0; i < num; i++) {
+        const EventRecord& record = segment[i];
+        // slots reserved by a writer that never finished stay zero
+        if (record.commit != kEventCommit) {
+            continue;
+        }
+        if (record.type != kEventName) {
+            records->push_back(record);
+            continue;
+        }
+        if (record.to <= 0 || record.from < 0 || record.from >= record.to) {
+            continue;
+        }
+        std::vector<std::string>& parts = chunks[record.value];
+        parts.resize(record.to);
+        const char* data = reinterpret_cast<const char*>(record.ids);
+        parts[record.from].assign(data, strnlen(data, kNameChunk));
+    }
+    ::munmap(base, num * sizeof(EventRecord));
+    std::map<uint64_t, std::vector<std::string> >::iterator it = chunks.begin();
+    for (; it != chunks.end(); ++it) {
+        std::string name;
+        for (size_t i = 0; i < it->second.size(); i++) {
+            name += it->second[i];
+        }
+        if (!name.empty()) {
+            names_[it->first] = name;
+        }
+    }
+    return true;
+}
+
+std::string EventLogReader::Name(uint64_t id) const {
+    if (id == 0) {
+        return "";
+    }
+    std::map<uint64_t, std::string>::const_iterator it = names_.find(id);
+    if (it != names_.end()) {
+        return it->second;
+    }
+    char hex[20];
+    snprintf(hex, sizeof(hex), "#%016lx", id);
+    return hex;
+}
+
+const char* EventLogReader::TypeName(int type) {
+    switch (type) {
+    case kEventSegment:
+        return "segment";
+    case kEventName:
+        return "name";
+    case kEventJobAdd:
+        return "job_add";
+    case kEventJobUpdate:
+        return "job_update";
+    case kEventJobRemove:
+        return "job_remove";
+    case kEventPodAdd:
+        return "pod_add";
+    case kEventPodState:
+        return "pod_state";
+    case kEventPodReschedule:
+        return "pod_reschedule";
+    case kEventPodStarted:
+        return "pod_started";
+    case kEventPodRunFail:
+        return "pod_run_fail";
+    case kEventAgentState:
+        return "agent_state";
+    default:
+        return "unknown";
+    }
+}
+
+}
+}
@@ -0,0 +1,138 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_EVENT_LOG_H
+#define BAIDU_GALAXY_EVENT_LOG_H
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include <mutex.h>
+#include <counter.h>
+#include <thread.h>
+
+namespace baidu {
+namespace galaxy {
+
+enum EventType {
+    // first record of a segment, value is the segment index
+    kEventSegment = 1,
+    // a chunk of the name of an id, see EventRecord
+    kEventName = 2,
+    kEventJobAdd = 3,
+    kEventJobUpdate = 4,
+    kEventJobRemove = 5,
+    kEventPodAdd = 6,
+    kEventPodState = 7,
+    // lost with its agent or failed to run, back to pending
+    kEventPodReschedule = 8,
+    kEventPodStarted = 9,
+    kEventPodRunFail = 10,
+    kEventAgentState = 11
+};
+
+// One event, 64 bytes on disk in host byte order. Job, pod and agent are
+// 64 bit hashes of their ids, 0 for none. The ids themselves are logged
+// once per segment in kEventName records: value is the hash, from the
+// chunk index, to the chunk count and ids the bytes of the chunk.
+struct EventRecord {
+    // kEventCommit once the record is completely written
+    uint32_t commit;
+    int16_t type;
+    // previous and new state of pod or agent, -1 for none
+    int8_t from;
+    int8_t to;
+    int64_t time;
+    int64_t value;
+    uint64_t ids[5];
+};
+
+static const uint32_t kEventCommit = 0x4c455647;
+static const int kEventJob = 0;
+static const int kEventPod = 1;
+static const int kEventAgent = 2;
+
+// Append-only log of cluster state transitions in mmap'd segment files
+// <path>/events.<index>, each of fixed size. Appending is lock-free, a
+// record slot is reserved with an atomic add and the record is marked
+// committed after it is written. Only switching to the next segment
+// takes a lock, the next one is created and allocated ahead of time by a
+// background thread. The oldest segments are removed beyond max_segments.
+class EventLog {
+public:
+    EventLog();
+    ~EventLog();
+    bool Open(const std::string& path, int64_t segment_size, int32_t max_segments);
+    // empty ids are logged as 0, dropped when the log is not open
+    void Append(EventType type, const std::string& jobid, const std::string& podid,
+                const std::string& agent, int32_t from, int32_t to, int64_t value);
+    int64_t Appended();
+    int64_t Dropped();
+    static uint64_t Hash(const std::string& id);
+    static bool ListSegments(const std::string& path, std::vector<int64_t>* indexes);
+    static std::string SegmentFile(const std::string& path, int64_t index);
+private:
+    struct Segment {
+        int64_t index;
+        char* base;
+        int64_t capacity;
+        // slots reserved and slots written, the header included
+        volatile int64_t next;
+        volatile int64_t committed;
+        // open addressing set of ids with a name record in the segment
+        uint64_t* names;
+    };
+    bool Reserve(Segment* segment, int64_t num, int64_t* slot);
+    void Commit(Segment* segment, int64_t num);
+    bool AddName(Segment* segment, uint64_t id);
+    void Rotate(Segment* full);
+    // creates and maps the file, without mutex_
+    Segment* OpenSegment(int64_t index);
+    void StartSegment(Segment* segment);
+    void FreeSegment(Segment* segment);
+    // keeps spare_ ready on prepare_thread_
+    void PrepareSegments();
+
+    std::string path_;
+    int64_t segment_size_;
+    int32_t max_segments_;
+    Segment* volatile current_;
+    // writers in Append, a segment no longer current is only freed when
+    // none but the one switching away from it is left
+    volatile int64_t writers_;
+    Mutex mutex_;
+    int64_t next_index_;
+    // segments once current, each kept while a late writer may still use it
+    std::vector<Segment*> segments_;
+    // the next segment, NULL until it is prepared
+    Segment* spare_;
+    bool prepare_failed_;
+    bool stop_;
+    CondVar prepare_cond_;
+    common::Thread prepare_thread_;
+    bool prepare_started_;
+    ::baidu::common::Counter appended_;
+    ::baidu::common::Counter dropped_;
+};
+
+// Reads the segments of an event log, for offline analysis.
+class EventLogReader {
+public:
+    explicit EventLogReader(const std::string& path);
+    // committed records of all segments but names, oldest first
+    bool Load(std::vector<EventRecord>* records);
+    // the logged id of hash, its hex form when the name is not in the log
+    std::string Name(uint64_t id) const;
+    static const char* TypeName(int type);
+private:
+    bool LoadSegment(const std::string& file, std::vector<EventRecord>* records);
+
+    std::string path_;
+    std::map<uint64_t, std::string> names_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,229 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "executor.h"
+
+#include <unistd.h>
+#include <timer.h>
+
+namespace baidu {
+namespace galaxy {
+
+// the executor and worker of the calling thread, if it is a worker
+static __thread Executor* current_executor = NULL;
+static __thread int32_t current_worker = -1;
+
+Executor::Executor(int32_t thread_num)
+    : pending_(0), next_worker_(0), steals_(0),
+      idle_cond_(&idle_mutex_), idle_(0), stop_(false), stopped_(false),
+      timer_cond_(&timer_mutex_) {
+    if (thread_num <= 0) {
+        thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (thread_num <= 0) {
+        thread_num = 1;
+    }
+    for (int32_t i = 0; i < thread_num; i++) {
+        workers_.push_back(new Worker());
+    }
+    for (int32_t i = 0; i < thread_num; i++) {
+        workers_[i]->thread.Start(boost::bind(&Executor::Run, this, i));
+    }
+    timer_thread_.Start(boost::bind(&Executor::RunTimer, this));
+}
+
+Executor::~Executor() {
+    Stop();
+    for (size_t i = 0; i < workers_.size(); i++) {
+        delete workers_[i];
+    }
+}
+
+// workers leave once every queue is empty, the tasks added from other
+// threads after that are run here
+void Executor::Stop() {
+    if (stopped_) {
+        return;
+    }
+    stopped_ = true;
+    {
+        MutexLock lock(&idle_mutex_);
+        stop_ = true;
+        idle_cond_.Broadcast();
+    }
+    {
+        MutexLock lock(&timer_mutex_);
+        timer_cond_.Broadcast();
+    }
+    timer_thread_.Join();
+    for (size_t i = 0; i < workers_.size(); i++) {
+        workers_[i]->thread.Join();
+    }
+    Task task;
+    while (Take(0, &task)) {
+        task();
+        task.clear();
+    }
+}
+
+void Executor::AddTask(const Task& task) {
+    int32_t index = current_worker;
+    if (current_executor != this) {
+        index = __sync_fetch_and_add(&next_worker_, 1) % workers_.size();
+    }
+    Push(index, task);
+}
+
+// pending_ is raised before idle_ is read and a worker raises idle_
+// before reading pending_, so either the task is seen or the sleeper is.
+void Executor::Push(int32_t index, const Task& task) {
+    {
+        MutexLock lock(&workers_[index]->mutex);
+        workers_[index]->tasks.push_back(task);
+    }
+    __sync_fetch_and_add(&pending_, 1);
+    if (idle_ > 0) {
+        MutexLock lock(&idle_mutex_);
+        idle_cond_.Signal();
+    }
+}
+
+bool Executor::Take(int32_t index, Task* task) {
+    {
+        Worker* worker = workers_[index];
+        MutexLock lock(&worker->mutex);
+        if (!worker->tasks.empty()) {
+            task->swap(worker->tasks.front());
+            worker->tasks.pop_front();
+            __sync_fetch_and_sub(&pending_, 1);
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); i++) {
+        Worker* victim = workers_[(index + i) % workers_.size()];
+        MutexLock lock(&victim->mutex);
+        if (!victim->tasks.empty()) {
+            task->swap(victim->tasks.back());
+            victim->tasks.pop_back();
+            __sync_fetch_and_sub(&pending_, 1);
+            __sync_fetch_and_add(&steals_, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::Run(int32_t index) {
+    current_executor = this;
+    current_worker = index;
+    Task task;
+    while (true) {
+        if (Take(index, &task)) {
+            task();
+            task.clear();
+            continue;
+        }
+        if (stop_) {
+            break;
+        }
+        MutexLock lock(&idle_mutex_);
+        __sync_fetch_and_add(&idle_, 1);
+        if (pending_ == 0 && !stop_) {
+            idle_cond_.Wait();
+        }
+        __sync_fetch_and_sub(&idle_, 1);
+    }
+}
+
+void Executor::DelayTask(int64_t delay, const Task& task) {
+    int64_t due = common::timer::get_micros() + delay * 1000;
+    MutexLock lock(&timer_mutex_);
+    std::multimap<int64_t, Task>::iterator it = timers_.insert(std::make_pair(due, task));
+    if (it == timers_.begin()) {
+        timer_cond_.Signal();
+    }
+}
+
+void Executor::RunTimer() {
+    MutexLock lock(&timer_mutex_);
+    while (!stop_) {
+        if (timers_.empty()) {
+            timer_cond_.Wait();
+            continue;
+        }
+        int64_t now = common::timer::get_micros();
+        std::multimap<int64_t, Task>::iterator it = timers_.begin();
+        if (it->first > now) {
+            int64_t wait = (it->first - now + 999) / 1000;
+            timer_cond_.TimeWait(wait);
+            continue;
+        }
+        while (it != timers_.end() && it->first <= now) {
+            AddTask(it->second);
+            timers_.erase(it++);
+        }
+    }
+}
+
+int64_t Executor::PendingNum() {
+    return pending_;
+}
+
+int64_t Executor::Steals() {
+    return steals_;
+}
+
+TaskBatch::TaskBatch(Executor* executor, Mutex* lock, int32_t max_batch)
+    : executor_(executor), lock_(lock), max_batch_(max_batch),
+      scheduled_(false), batches_(0), tasks_run_(0) {
+}
+
+void TaskBatch::Add(const Executor::Task& task) {
+    MutexLock lock(&mutex_);
+    tasks_.push_back(task);
+    if (!scheduled_) {
+        scheduled_ = true;
+        executor_->AddTask(boost::bind(&TaskBatch::Drain, this));
+    }
+}
+
+// one drain at a time, the tasks all need lock_ anyway
+void TaskBatch::Drain() {
+    std::vector<Executor::Task> tasks;
+    {
+        MutexLock lock(&mutex_);
+        while (!tasks_.empty() && tasks.size() < (size_t)max_batch_) {
+            tasks.push_back(Executor::Task());
+            tasks.back().swap(tasks_.front());
+            tasks_.pop_front();
+        }
+    }
+    {
+        MutexLock lock(lock_);
+        for (size_t i = 0; i < tasks.size(); i++) {
+            tasks[i]();
+        }
+    }
+    MutexLock lock(&mutex_);
+    batches_++;
+    tasks_run_ += tasks.size();
+    if (tasks_.empty()) {
+        scheduled_ = false;
+    } else {
+        // the rest after whatever else is queued, the lock is released
+        executor_->AddTask(boost::bind(&TaskBatch::Drain, this));
+    }
+}
+
+int64_t TaskBatch::Batches() {
+    MutexLock lock(&mutex_);
+    return batches_;
+}
+
+int64_t TaskBatch::Tasks() {
+    MutexLock lock(&mutex_);
+    return tasks_run_;
+}
+
+}
+}
@@ -0,0 +1,106 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_EXECUTOR_H
+#define BAIDU_GALAXY_EXECUTOR_H
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+
+#include <mutex.h>
+#include <thread.h>
+
+namespace baidu {
+namespace galaxy {
+
+// Work-stealing executor of master background work and rpc callbacks.
+// Every worker has a queue of its own, tasks added by a worker go to its
+// queue, others are spread round robin. A worker runs its queue oldest
+// first and, once it is empty, steals the newest task of another queue.
+// Delayed tasks are kept by one timer thread until due.
+class Executor {
+public:
+    typedef boost::function<void ()> Task;
+    // thread_num <= 0 for a worker per core
+    explicit Executor(int32_t thread_num);
+    ~Executor();
+    // runs the queued tasks and stops the threads, delayed tasks not due
+    // yet are dropped
+    void Stop();
+    void AddTask(const Task& task);
+    // task is run after delay ms
+    void DelayTask(int64_t delay, const Task& task);
+    int64_t PendingNum();
+    int64_t Steals();
+private:
+    struct Worker {
+        Mutex mutex;
+        std::deque<Task> tasks;
+        common::Thread thread;
+    };
+    void Push(int32_t index, const Task& task);
+    bool Take(int32_t index, Task* task);
+    void Run(int32_t index);
+    void RunTimer();
+
+    std::vector<Worker*> workers_;
+    volatile int64_t pending_;
+    volatile int64_t next_worker_;
+    volatile int64_t steals_;
+    // guards sleeping of idle workers
+    Mutex idle_mutex_;
+    CondVar idle_cond_;
+    volatile int32_t idle_;
+    volatile bool stop_;
+    bool stopped_;
+    Mutex timer_mutex_;
+    CondVar timer_cond_;
+    std::multimap<int64_t, Task> timers_;
+    common::Thread timer_thread_;
+};
+
+// Tasks needing the same lock, run under one acquisition of it up to
+// max_batch at a time. Callbacks queued here while a batch runs wait for
+// the next one instead of each waking a thread to contend on the lock.
+class TaskBatch {
+public:
+    TaskBatch(Executor* executor, Mutex* lock, int32_t max_batch);
+    void Add(const Executor::Task& task);
+    int64_t Batches();
+    int64_t Tasks();
+private:
+    void Drain();
+
+    Executor* executor_;
+    Mutex* lock_;
+    int32_t max_batch_;
+    Mutex mutex_;
+    std::deque<Executor::Task> tasks_;
+    bool scheduled_;
+    int64_t batches_;
+    int64_t tasks_run_;
+};
+
+// Adapters of RpcClient::AsyncRequest callbacks, they queue the callback
+// instead of running it on the rpc thread.
+template <class Request, class Response>
+void PostRpcCallback(Executor* executor,
+                     boost::function<void (const Request*, Response*, bool, int)> callback,
+                     const Request* request, Response* response, bool failed, int error) {
+    executor->AddTask(boost::bind(callback, request, response, failed, error));
+}
+
+template <class Request, class Response>
+void BatchRpcCallback(TaskBatch* batch,
+                      boost::function<void (const Request*, Response*, bool, int)> callback,
+                      const Request* request, Response* response, bool failed, int error) {
+    batch->Add(boost::bind(callback, request, response, failed, error));
+}
+
+}
+}
+
+#endif
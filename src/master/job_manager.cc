@@ -3,30 +3,168 @@
 // found in the LICENSE file.
 #include "job_manager.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <gflags/gflags.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include "proto/agent.pb.h"
 #include "proto/master.pb.h"
 #include "proto/galaxy.pb.h"
 #include "master_util.h"
 #include <logging.h>
+#include <timer.h>
 
 DECLARE_int32(master_agent_timeout);
 DECLARE_int32(master_agent_rpc_timeout);
 DECLARE_int32(master_query_period);
+DECLARE_int32(master_query_snapshot_interval);
+DECLARE_int32(master_snapshot_pod_run);
+DECLARE_int32(master_snapshot_usage_interval);
+DECLARE_int32(master_deploy_step);
+DECLARE_int32(master_max_inflight_run_pod);
+DECLARE_double(master_safe_mode_agent_fraction);
+DECLARE_int32(master_safe_mode_min_wait);
+DECLARE_int32(master_safe_mode_deadline);
+DECLARE_int32(master_reconcile_parallelism);
+DECLARE_int32(master_reschedule_rate);
+DECLARE_int32(master_reschedule_interval);
+DECLARE_double(master_phi_suspect_threshold);
+DECLARE_double(master_phi_dead_threshold);
+DECLARE_int32(master_phi_window);
+DECLARE_int32(master_phi_min_std_deviation);
+DECLARE_int32(master_phi_acceptable_pause);
+DECLARE_int32(master_liveness_check_interval);
+DECLARE_int32(master_shard_id);
+DECLARE_int32(master_lease_timeout);
+DECLARE_int32(master_lease_hold);
+DECLARE_int32(master_digest_check_interval);
+DECLARE_int32(master_max_replica);
+DECLARE_int64(master_user_pending_limit);
+DECLARE_int64(master_pending_limit);
+DECLARE_int32(master_pending_batch);
+DECLARE_string(master_event_log_path);
+DECLARE_int32(master_executor_threads);
+DECLARE_int32(master_callback_batch);
+DECLARE_int32(master_binary_fetch_retry);
+DECLARE_int32(master_event_log_segment_size);
+DECLARE_int32(master_event_log_segments);
 
 namespace baidu {
 namespace galaxy {
 
-JobManager::JobManager()
-    : on_query_num_(0) {
+JobManager::JobManager(BinaryStore* binary_store)
+    : lease_renewed_(0),
+      on_query_num_(0),
+      reconcile_inflight_(0),
+      safe_mode_start_(0),
+      recovery_start_(common::timer::get_micros()),
+      time_to_serving_(-1),
+      recovered_jobs_(0),
+      follower_(false),
+      epoch_(common::timer::get_micros()),
+      binary_store_(binary_store),
+      deploy_retry_scheduled_(false),
+      run_pod_inflight_(0),
+      reschedule_scheduled_(false),
+      restored_pods_(0),
+      restore_time_total_(0),
+      restore_time_last_(0),
+      digest_queries_(0),
+      digest_lost_pods_(0),
+      demand_total_(0),
+      throttled_submits_(0),
+      usage_refreshed_(0),
+      dirty_since_(0),
+      publish_scheduled_(false),
+      query_snapshot_(new QuerySnapshot()),
+      executor_(FLAGS_master_executor_threads),
+      callback_batch_(&executor_, &mutex_, FLAGS_master_callback_batch) {
     safe_mode_ = true;
+    if (!FLAGS_master_event_log_path.empty()) {
+        if (!event_log_.Open(FLAGS_master_event_log_path,
+                             FLAGS_master_event_log_segment_size * 1024L * 1024L,
+                             FLAGS_master_event_log_segments)) {
+            LOG(WARNING, "event log at %s not opened, events are dropped",
+                FLAGS_master_event_log_path.c_str());
+        }
+    }
     ScheduleNextQuery();
+    executor_.DelayTask(FLAGS_master_liveness_check_interval,
+                        boost::bind(&JobManager::CheckAgentLiveness, this));
+    executor_.DelayTask(FLAGS_master_digest_check_interval,
+                        boost::bind(&JobManager::CheckAgentDigests, this));
 }
 
 JobManager::~JobManager() {
+    // queued callbacks run while the members they use are still there
+    executor_.Stop();
+}
+
+// replica counts no submission or update may ever have
+static Status CheckReplica(const JobDescriptor& job_desc) {
+    int64_t replica = job_desc.replica();
+    if (replica < 0 || replica > FLAGS_master_max_replica) {
+        LOG(WARNING, "reject job \"%s\" of user %s, replica %ld over %d",
+            job_desc.name().c_str(), job_desc.user().c_str(),
+            replica, FLAGS_master_max_replica);
+        return kInputError;
+    }
+    if (replica > FLAGS_master_user_pending_limit) {
+        LOG(WARNING, "reject job \"%s\" of user %s, replica %ld over user limit",
+            job_desc.name().c_str(), job_desc.user().c_str(), replica);
+        return kQuota;
+    }
+    return kOk;
+}
+
+Status JobManager::Admit(const JobDescriptor& job_desc) {
+    Status status = CheckReplica(job_desc);
+    if (status != kOk) {
+        return status;
+    }
+    int64_t replica = job_desc.replica();
+    MutexLock lock(&mutex_);
+    if (!DemandFits(job_desc, 0, replica)) {
+        return kThrottled;
+    }
+    user_demand_[job_desc.user()] += replica;
+    demand_total_ += replica;
+    return kOk;
+}
+
+// Whether the user of job_desc may have demand pending pods instead of
+// the held ones already counted, the refused ones go to throttled_submits_.
+bool JobManager::DemandFits(const JobDescriptor& job_desc, int64_t held, int64_t demand) {
+    mutex_.AssertHeld();
+    int64_t user_demand = 0;
+    std::map<std::string, int64_t>::iterator it = user_demand_.find(job_desc.user());
+    if (it != user_demand_.end()) {
+        user_demand = it->second;
+    }
+    if (user_demand - held + demand <= FLAGS_master_user_pending_limit
+        && demand_total_ - held + demand <= FLAGS_master_pending_limit) {
+        return true;
+    }
+    throttled_submits_++;
+    LOG(INFO, "throttle job \"%s\" of user %s, pending pods user %ld, total %ld",
+        job_desc.name().c_str(), job_desc.user().c_str(), user_demand, demand_total_);
+    return false;
+}
+
+void JobManager::CancelAdmission(const JobDescriptor& job_desc) {
+    MutexLock lock(&mutex_);
+    int64_t& user_demand = user_demand_[job_desc.user()];
+    user_demand -= job_desc.replica();
+    demand_total_ -= job_desc.replica();
+    if (user_demand == 0) {
+        user_demand_.erase(job_desc.user());
+    }
 }
 
 void JobManager::Add(const JobId& job_id, const JobDescriptor& job_desc) {
@@ -34,23 +172,38 @@ void JobManager::Add(const JobId& job_id, const JobDescriptor& job_desc) {
     job->state_ = kJobNormal;
     job->desc_.CopyFrom(job_desc);
     job->id_ = job_id;
+    // reserved by Admit
+    job->demand_ = job_desc.replica();
     MutexLock lock(&mutex_);
-    FillPodsToJob(job);
     jobs_[job_id] = job;
+    RecordJobChange(job, job->state_);
+    // in safe mode pods of all jobs are filled on leaving it
+    if (!safe_mode_) {
+        FillPodsToJob(job);
+    }
+    RefreshDemand(job);
+    MarkJobDirty(job_id);
+    event_log_.Append(kEventJobAdd, job_id, "", "", -1, -1, job_desc.replica());
     LOG(INFO, "job[%s] submitted by user: %s, ", job_id.c_str(), job_desc.user().c_str());
 }
 
+// Pending pods are materialized master_pending_batch at a time, more are
+// added as they get placed, so a huge replica count costs neither memory
+// nor scheduler time up front.
 void JobManager::FillPodsToJob(Job* job) {
     mutex_.AssertHeld();
     if (jobs_.find(job->id_) == jobs_.end()) {
         return;
     }
-    for(int i = job->pods_.size(); i < job->desc_.replica(); i++) {
+    for(int i = job->pods_.size();
+        i < job->desc_.replica() && job->pending_num_ < FLAGS_master_pending_batch;
+        i++) {
         PodId pod_id = MasterUtil::GeneratePodId(job->desc_);
-        PodStatus* pod_status = new PodStatus();
-        pod_status->set_podid(pod_id);
-        pod_status->set_jobid(job->id_);
+        PodRecord* pod_status = pod_pool_.New(job->id_, pod_id);
         job->pods_[pod_id] = pod_status;
+        CountPod(job, *pod_status, 1);
+        RecordPodChange(*pod_status, false);
+        event_log_.Append(kEventPodAdd, job->id_, pod_id, "", -1, kPodPending, 0);
         pending_pods_[job->id_][pod_id] = pod_status;
         LOG(INFO, "move pod to pendings: %s", pod_id.c_str());
     }
@@ -74,6 +227,8 @@ void JobManager::ReloadJobInfo(const JobInfo& job_info) {
     job->id_ = job_id;
     MutexLock lock(&mutex_);
     jobs_[job_id] = job;
+    RefreshDemand(job);
+    MarkJobDirty(job_id);
 }
 
 Status JobManager::Suspend(const JobId& jobid) {
@@ -89,30 +244,46 @@ Status JobManager::Suspend(const JobId& jobid) {
         return kUnknown;
     }
     job->state_ = kJobSuspend;
+    RecordJobChange(job, job->state_);
+    MarkJobDirty(jobid);
 
     assert(suspend_pods_.find(jobid) == suspend_pods_.end());
 
-    std::map<JobId, std::map<PodId, PodStatus*> >::iterator it;
+    std::map<JobId, std::map<PodId, PodRecord*> >::iterator it;
     it = pending_pods_.find(jobid);
-    if (it != deploy_pods_.end()) {
-        std::map<PodId, PodStatus*>& job_suspend_pods = suspend_pods_[jobid];
-        std::map<PodId, PodStatus*>& job_pending_pods = it->second;
-        std::map<PodId, PodStatus*>::iterator pod_it;
+    if (it != pending_pods_.end()) {
+        std::map<PodId, PodRecord*>& job_suspend_pods = suspend_pods_[jobid];
+        std::map<PodId, PodRecord*>& job_pending_pods = it->second;
+        std::map<PodId, PodRecord*>::iterator pod_it;
         for (pod_it = job_pending_pods.begin(); pod_it != job_pending_pods.end(); ++pod_it) {
-            PodStatus* pod = pod_it->second;
+            PodRecord* pod = pod_it->second;
             SuspendPod(pod);
             job_suspend_pods[pod->podid()] = pod;
         }
         pending_pods_.erase(it);
     }
 
+    it = reschedule_pods_.find(jobid);
+    if (it != reschedule_pods_.end()) {
+        std::map<PodId, PodRecord*>& job_suspend_pods = suspend_pods_[jobid];
+        std::map<PodId, PodRecord*>& job_reschedule_pods = it->second;
+        std::map<PodId, PodRecord*>::iterator pod_it;
+        for (pod_it = job_reschedule_pods.begin(); pod_it != job_reschedule_pods.end(); ++pod_it) {
+            PodRecord* pod = pod_it->second;
+            SuspendPod(pod);
+            job_suspend_pods[pod->podid()] = pod;
+        }
+        reschedule_pods_.erase(it);
+    }
+    job->lost_since_.clear();
+
     it = deploy_pods_.find(jobid);
     if (it != deploy_pods_.end()) {
-        std::map<PodId, PodStatus*>& job_suspend_pods = suspend_pods_[jobid];
-        std::map<PodId, PodStatus*>& job_deploy_pods = it->second;
-        std::map<PodId, PodStatus*>::iterator pod_it;
+        std::map<PodId, PodRecord*>& job_suspend_pods = suspend_pods_[jobid];
+        std::map<PodId, PodRecord*>& job_deploy_pods = it->second;
+        std::map<PodId, PodRecord*>::iterator pod_it;
         for (pod_it = job_deploy_pods.begin(); pod_it != job_deploy_pods.end(); ++pod_it) {
-            PodStatus* pod = pod_it->second;
+            PodRecord* pod = pod_it->second;
             SuspendPod(pod);
             job_suspend_pods[pod->podid()] = pod;
         }
@@ -122,17 +293,17 @@ Status JobManager::Suspend(const JobId& jobid) {
     return kOk;
 }
 
-void JobManager::SuspendPod(PodStatus* pod) {
+void JobManager::SuspendPod(PodRecord* pod) {
     mutex_.AssertHeld();
     PodState state = pod->state();
     if (state == kPodPending) {
-        pod->set_state(kPodSuspend);
+        SetPodState(pod, kPodSuspend);
     } else if (state == kPodDeploy) {
         const std::string& endpoint = pod->endpoint();
         AgentInfo* agent = agents_[endpoint];
         ReclaimResource(*pod, agent);
-        pod->set_state(kPodSuspend);
-        pod->set_endpoint("");
+        SetPodState(pod, kPodSuspend);
+        pod_pool_.SetEndpoint(pod, "");
     }
     LOG(INFO, "pod suspended: %s", pod->podid().c_str());
 }
@@ -150,38 +321,40 @@ Status JobManager::Resume(const JobId& jobid) {
         return kUnknown;
     }
     job->state_ = kJobNormal;
+    RecordJobChange(job, job->state_);
+    MarkJobDirty(jobid);
 
     assert(pending_pods_.find(jobid) == pending_pods_.end());
     assert(deploy_pods_.find(jobid) == deploy_pods_.end());
 
-    std::map<JobId, std::map<PodId, PodStatus*> >::iterator it;
+    std::map<JobId, std::map<PodId, PodRecord*> >::iterator it;
     it = suspend_pods_.find(jobid);
     if (it != suspend_pods_.end()) {
-        std::map<PodId, PodStatus*>& job_pending_pods = pending_pods_[jobid];
-        std::map<PodId, PodStatus*>& job_suspend_pods = it->second;
-        std::map<PodId, PodStatus*>::iterator pod_it;
+        std::map<PodId, PodRecord*>& job_pending_pods = pending_pods_[jobid];
+        std::map<PodId, PodRecord*>& job_suspend_pods = it->second;
+        std::map<PodId, PodRecord*>::iterator pod_it;
         for (pod_it = job_suspend_pods.begin(); pod_it != job_suspend_pods.end(); ++pod_it) {
-            PodStatus* pod = pod_it->second;
+            PodRecord* pod = pod_it->second;
             ResumePod(pod);
             job_pending_pods[pod->podid()] = pod;
         }
-        deploy_pods_.erase(it);
+        suspend_pods_.erase(it);
     }
     LOG(INFO, "job resumed: %s", jobid.c_str());
     return kOk;
 }
 
-void JobManager::ResumePod(PodStatus* pod) {
+void JobManager::ResumePod(PodRecord* pod) {
     mutex_.AssertHeld();
     PodState state = pod->state();
     if (state == kPodSuspend) {
-        pod->set_state(kPodPending);
+        SetPodState(pod, kPodPending);
     }
 }
 
 void JobManager::GetPendingPods(JobInfoList* pending_pods) {
     MutexLock lock(&mutex_);
-    std::map<JobId, std::map<PodId, PodStatus*> >::iterator it;
+    std::map<JobId, std::map<PodId, PodRecord*> >::iterator it;
     for (it = pending_pods_.begin(); it != pending_pods_.end(); ++it) {
         JobInfo* job_info = pending_pods->Add();
         JobId job_id = it->first;
@@ -190,30 +363,50 @@ void JobManager::GetPendingPods(JobInfoList* pending_pods) {
         const JobDescriptor& job_desc = jobs_[job_id]->desc_;
         job_info->mutable_desc()->CopyFrom(job_desc);
 
-        const std::map<PodId, PodStatus*> & job_pending_pods = it->second;
-        std::map<PodId, PodStatus*>::const_iterator jt;
+        const std::map<PodId, PodRecord*> & job_pending_pods = it->second;
+        std::map<PodId, PodRecord*>::const_iterator jt;
         for (jt = job_pending_pods.begin(); jt != job_pending_pods.end(); ++jt) {
-            PodStatus* pod_status = jt->second;
+            PodRecord* pod_status = jt->second;
             PodStatus* new_pod_status = job_info->add_pods();
-            new_pod_status->CopyFrom(*pod_status);
+            pod_status->ToProto(new_pod_status);
         }
     }
 }
 
-Status JobManager::Propose(const ScheduleInfo& sche_info) {
+Status JobManager::Propose(const ScheduleInfoList& sche_infos,
+                           StatusList* statuses,
+                           std::vector<PodKey>* deploy) {
     MutexLock lock(&mutex_);
+    Status batch_status = kOk;
+    for (int i = 0; i < sche_infos.size(); i++) {
+        const ScheduleInfo& sche_info = sche_infos.Get(i);
+        Status status = ProposePod(sche_info);
+        statuses->Add(status);
+        if (status == kOk) {
+            deploy->push_back(std::make_pair(sche_info.jobid(), sche_info.podid()));
+        } else if (batch_status == kOk) {
+            batch_status = status;
+        }
+    }
+    LOG(INFO, "propose batch done, accepted %lu of %d",
+        deploy->size(), sche_infos.size());
+    return batch_status;
+}
+
+Status JobManager::ProposePod(const ScheduleInfo& sche_info) {
+    mutex_.AssertHeld();
     const std::string& jobid = sche_info.jobid();
     const std::string& podid = sche_info.podid();
     const std::string& endpoint = sche_info.endpoint();
 
-    std::map<JobId, std::map<PodId, PodStatus*> >::iterator it;
+    std::map<JobId, std::map<PodId, PodRecord*> >::iterator it;
     it = pending_pods_.find(jobid);
     if (it == pending_pods_.end()) {
         LOG(INFO, "propose fail, no such job: %s", jobid.c_str());
         return kJobNotFound;
     }
-    std::map<PodId, PodStatus*>& job_pending_pods = it->second;
-    std::map<PodId, PodStatus*>::iterator jt = job_pending_pods.find(podid);
+    std::map<PodId, PodRecord*>& job_pending_pods = it->second;
+    std::map<PodId, PodRecord*>::iterator jt = job_pending_pods.find(podid);
     if (jt == job_pending_pods.end()) {
         LOG(INFO, "propse fail, no such pod: %s", podid.c_str());
         return kPodNotFound;
@@ -224,28 +417,39 @@ Status JobManager::Propose(const ScheduleInfo& sche_info) {
         return kAgentNotFound;
     }
 
-    PodStatus* pod = jt->second;
+    PodRecord* pod = jt->second;
     AgentInfo* agent = at->second;
+    if (agent->state() != kAlive) {
+        LOG(INFO, "propose fail, agent not alive: %s", endpoint.c_str());
+        return kAgentNotFound;
+    }
+    if (FLAGS_master_shard_id >= 0 && !LeaseUsable(endpoint)) {
+        LOG(INFO, "propose fail, agent not leased: %s", endpoint.c_str());
+        return kQuota;
+    }
     Status feasible_status = AcquireResource(*pod, agent);
     if (feasible_status != kOk) {
         LOG(INFO, "propose fail, no resource, error code:[%d]", feasible_status);
         return feasible_status;
     }
 
-    pod->set_endpoint(sche_info.endpoint());
-    pod->set_state(kPodDeploy);
+    pod_pool_.SetEndpoint(pod, sche_info.endpoint());
+    SetPodState(pod, kPodDeploy);
     job_pending_pods.erase(jt);
     if (job_pending_pods.size() == 0) {
         pending_pods_.erase(it);
     }
 
     deploy_pods_[jobid][podid] = pod;
+    if (!safe_mode_) {
+        FillPodsToJob(jobs_[jobid]);
+    }
     LOG(INFO, "propose success, %s will be run on %s",
         podid.c_str(), endpoint.c_str());
     return kOk;
 }
 
-Status JobManager::AcquireResource(const PodStatus& pod, AgentInfo* agent) {
+Status JobManager::AcquireResource(const PodRecord& pod, AgentInfo* agent) {
     mutex_.AssertHeld();
     Resource pod_requirement;
     GetPodRequirement(pod, &pod_requirement);
@@ -255,18 +459,20 @@ Status JobManager::AcquireResource(const PodStatus& pod, AgentInfo* agent) {
     }
     MasterUtil::SubstractResource(pod_requirement, agent->mutable_unassigned());
     MasterUtil::AddResource(pod_requirement, agent->mutable_assigned());
+    MarkAgentDirty(agent->endpoint());
     return kOk;
 }
 
-void JobManager::ReclaimResource(const PodStatus& pod, AgentInfo* agent) {
+void JobManager::ReclaimResource(const PodRecord& pod, AgentInfo* agent) {
     mutex_.AssertHeld();
     Resource pod_requirement;
     GetPodRequirement(pod, &pod_requirement);
     MasterUtil::SubstractResource(pod_requirement, agent->mutable_assigned());
     MasterUtil::AddResource(pod_requirement, agent->mutable_unassigned());
+    MarkAgentDirty(agent->endpoint());
 }
 
-void JobManager::GetPodRequirement(const PodStatus& pod, Resource* requirement) {
+void JobManager::GetPodRequirement(const PodRecord& pod, Resource* requirement) {
     Job* job = jobs_[pod.jobid()];
     const PodDescriptor& pod_desc = job->desc_.pod();
     CalculatePodRequirement(pod_desc, requirement);
@@ -285,37 +491,167 @@ void JobManager::CalculatePodRequirement(const PodDescriptor& pod_desc,
     }
 }
 
-void JobManager::KeepAlive(const std::string& agent_addr) {
-    if (agent_addr == "") {
-        LOG(WARNING, "ignore heartbeat with empty endpoint");
+void JobManager::KeepAlive(const std::string& agent_addr, int64_t sequence) {
+    HeartBeatList heartbeats;
+    AgentHeartBeat* heartbeat = heartbeats.Add();
+    heartbeat->set_endpoint(agent_addr);
+    heartbeat->set_sequence(sequence);
+    KeepAlive(heartbeats);
+}
+
+// Only the heartbeats of agents not serving take mutex_, to bring them
+// alive or get them queried; the others end with their liveness.
+void JobManager::KeepAlive(const HeartBeatList& heartbeats) {
+    std::vector<AgentAddr> alive_agents;
+    {
+        MutexLock lock(&mutex_timer_);
+        int64_t now = common::timer::get_micros();
+        for (int i = 0; i < heartbeats.size(); i++) {
+            const AgentAddr& agent_addr = heartbeats.Get(i).endpoint();
+            int64_t sequence = heartbeats.Get(i).sequence();
+            if (agent_addr == "") {
+                LOG(WARNING, "ignore heartbeat with empty endpoint");
+                continue;
+            }
+            LOG(DEBUG, "receive heartbeat from %s", agent_addr.c_str());
+            AgentLiveness& liveness = agent_liveness_[agent_addr];
+            if (sequence > 0) {
+                if (sequence <= liveness.last_sequence) {
+                    continue;
+                }
+                liveness.last_sequence = sequence;
+            }
+            // the silence of a dead agent is not a heartbeat interval
+            if (liveness.last_heartbeat > 0) {
+                int64_t interval = now - liveness.last_heartbeat;
+                liveness.intervals.push_back(interval);
+                liveness.interval_sum += interval;
+                liveness.interval_square_sum += (double)interval * interval;
+                while (liveness.intervals.size() > (size_t)FLAGS_master_phi_window) {
+                    int64_t oldest = liveness.intervals.front();
+                    liveness.intervals.pop_front();
+                    liveness.interval_sum -= oldest;
+                    liveness.interval_square_sum -= (double)oldest * oldest;
+                }
+            }
+            liveness.last_heartbeat = now;
+            if (heartbeats.Get(i).has_pod_digest()) {
+                liveness.digest = heartbeats.Get(i).pod_digest();
+                liveness.has_digest = true;
+            }
+            if (!liveness.serving) {
+                alive_agents.push_back(agent_addr);
+            }
+        }
+    }
+    if (alive_agents.empty()) {
         return;
     }
-    {
-        MutexLock lock(&mutex_);
+
+    MutexLock lock(&mutex_);
+    for (size_t i = 0; i < alive_agents.size(); i++) {
+        const AgentAddr& agent_addr = alive_agents[i];
+        int32_t last_state = -1;
         if (agents_.find(agent_addr) == agents_.end()) {
             LOG(INFO, "new agent added: %s", agent_addr.c_str());
             agents_[agent_addr] = new AgentInfo();
+        } else {
+            last_state = agents_[agent_addr]->state();
         }
         AgentInfo* agent = agents_[agent_addr];
-        agent->set_state(kAlive);
-        agent->set_endpoint(agent_addr);
+        if (agent->state() != kAlive || agent->endpoint() != agent_addr) {
+            event_log_.Append(kEventAgentState, "", "", agent_addr, last_state, kAlive, 0);
+            agent->set_state(kAlive);
+            agent->set_endpoint(agent_addr);
+            MarkAgentDirty(agent_addr);
+        }
+        ReconcileAgent(agent_addr);
+        if (queried_agents_.find(agent_addr) != queried_agents_.end()) {
+            MutexLock timer_lock(&mutex_timer_);
+            agent_liveness_[agent_addr].serving = true;
+        }
     }
+}
 
+void JobManager::StopServing(const AgentAddr& agent_addr) {
+    mutex_.AssertHeld();
     MutexLock lock(&mutex_timer_);
-    LOG(DEBUG, "receive heartbeat from %s", agent_addr.c_str());
-    int64_t timer_id;
-    if (agent_timer_.find(agent_addr) != agent_timer_.end()) {
-        timer_id = agent_timer_[agent_addr];
-        bool cancel_ok = death_checker_.CancelTask(timer_id);
-        if (!cancel_ok) {
-            LOG(WARNING, "agent is offline, agent: %s", agent_addr.c_str());
+    AgentLiveness& liveness = agent_liveness_[agent_addr];
+    liveness.serving = false;
+    liveness.has_digest = false;
+}
+
+// Suspicion level of an agent silent since its last heartbeat, phi = -log10
+// of the probability that a heartbeat interval is that long, the intervals
+// taken as normally distributed. Uses the logistic approximation of the
+// normal CDF, which stays finite for long silences.
+double JobManager::Phi(const AgentLiveness& liveness, int64_t now) {
+    if (liveness.intervals.empty()) {
+        return 0.0;
+    }
+    double n = liveness.intervals.size();
+    double mean = liveness.interval_sum / n;
+    double variance = liveness.interval_square_sum / n - mean * mean;
+    double min_std_deviation = FLAGS_master_phi_min_std_deviation * 1000.0;
+    double std_deviation = variance > 0 ? sqrt(variance) : 0;
+    if (std_deviation < min_std_deviation) {
+        std_deviation = min_std_deviation;
+    }
+    mean += FLAGS_master_phi_acceptable_pause * 1000.0;
+    double y = (now - liveness.last_heartbeat - mean) / std_deviation;
+    double e = exp(-y * (1.5976 + 0.070566 * y * y));
+    if (y > 0) {
+        return -log10(e / (1.0 + e));
+    }
+    return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+// Agents past the suspect threshold get no new pods, past the dead one
+// or master_agent_timeout their pods are rescheduled.
+void JobManager::CheckAgentLiveness() {
+    int64_t now = common::timer::get_micros();
+    std::vector<AgentAddr> suspect_agents;
+    std::vector<AgentAddr> dead_agents;
+    {
+        MutexLock lock(&mutex_timer_);
+        std::map<AgentAddr, AgentLiveness>::iterator it = agent_liveness_.begin();
+        for (; it != agent_liveness_.end(); ++it) {
+            AgentLiveness& liveness = it->second;
+            if (liveness.last_heartbeat == 0) {
+                continue;
+            }
+            double phi = Phi(liveness, now);
+            if (phi >= FLAGS_master_phi_dead_threshold
+                || now - liveness.last_heartbeat > FLAGS_master_agent_timeout * 1000L) {
+                LOG(WARNING, "agent %s silent for %ld ms, phi %.2f",
+                    it->first.c_str(), (now - liveness.last_heartbeat) / 1000, phi);
+                liveness.last_heartbeat = 0;
+                dead_agents.push_back(it->first);
+            } else if (phi >= FLAGS_master_phi_suspect_threshold) {
+                suspect_agents.push_back(it->first);
+            }
+        }
+    }
+    {
+        MutexLock lock(&mutex_);
+        for (size_t i = 0; i < suspect_agents.size(); i++) {
+            std::map<AgentAddr, AgentInfo*>::iterator it = agents_.find(suspect_agents[i]);
+            if (it == agents_.end() || it->second->state() != kAlive) {
+                continue;
+            }
+            event_log_.Append(kEventAgentState, "", "", suspect_agents[i],
+                              kAlive, kSuspect, 0);
+            it->second->set_state(kSuspect);
+            StopServing(suspect_agents[i]);
+            MarkAgentDirty(suspect_agents[i]);
+            LOG(WARNING, "agent is suspect: %s", suspect_agents[i].c_str());
         }
     }
-    timer_id = death_checker_.DelayTask(FLAGS_master_agent_timeout,
-                                        boost::bind(&JobManager::HandleAgentOffline,
-                                                    this,
-                                                    agent_addr));
-    agent_timer_[agent_addr] = timer_id;
+    for (size_t i = 0; i < dead_agents.size(); i++) {
+        HandleAgentOffline(dead_agents[i]);
+    }
+    executor_.DelayTask(FLAGS_master_liveness_check_interval,
+                        boost::bind(&JobManager::CheckAgentLiveness, this));
 }
 
 void JobManager::HandleAgentOffline(const std::string agent_addr) {
@@ -327,6 +663,7 @@ void JobManager::HandleAgentOffline(const std::string agent_addr) {
     }
 
     AgentInfo* agent_info = agents_[agent_addr];
+    event_log_.Append(kEventAgentState, "", "", agent_addr, agent_info->state(), kDead, 0);
 //    for (int i = 0; i < agent_info->pods_size(); i++) {
 //        PodStatus* pod_status = agent_info->mutable_pods(i);
 //        ReschedulePod(pod_status);
@@ -334,98 +671,656 @@ void JobManager::HandleAgentOffline(const std::string agent_addr) {
     PodMap& agent_pods = running_pods_[agent_addr];
     PodMap::iterator it = agent_pods.begin();
     for (; it != agent_pods.end(); ++it) {
-        std::map<PodId, PodStatus*>& job_agent_pods = it->second;
-        std::map<PodId, PodStatus*>::iterator jt = job_agent_pods.begin();
+        std::map<PodId, PodRecord*>& job_agent_pods = it->second;
+        std::map<PodId, PodRecord*>::iterator jt = job_agent_pods.begin();
         for (; jt != job_agent_pods.end(); ++jt) {
-            PodStatus* pod = jt->second;
+            PodRecord* pod = jt->second;
             ReschedulePod(pod);
+            ReleaseStartingPod(jobs_[pod->jobid()], pod);
         }
     }
 
     running_pods_.erase(agent_addr);
+    agent_digests_.erase(agent_addr);
     agent_info->set_state(kDead);
+    StopServing(agent_addr);
+    MarkAgentDirty(agent_addr);
     LOG(INFO, "agent is dead: %s", agent_addr.c_str());
+    // slots held by pods sent there are free now
+    ScheduleDeploy();
 }
 
-void JobManager::ReschedulePod(PodStatus* pod_status) {
+void JobManager::ReschedulePod(PodRecord* pod_status) {
     assert(pod_status);
     assert(pod_status->state() == kPodRunning);
     mutex_.AssertHeld();
 
+    Job* job = jobs_[pod_status->jobid()];
+    job->unconfirmed_pods_.erase(pod_status->podid());
+    event_log_.Append(kEventPodReschedule, pod_status->jobid(), pod_status->podid(),
+                      pod_status->endpoint(), pod_status->state(), kPodPending, 0);
+    CountPod(job, *pod_status, -1);
     pod_status->set_state(kPodPending);
-    pod_status->set_endpoint("");
-    pod_status->mutable_resource_used()->Clear();
-    for (int i = 0; i < pod_status->status_size(); i++) {
-        pod_status->mutable_status(i)->Clear();
-    }
+    pod_pool_.SetEndpoint(pod_status, "");
+    pod_pool_.ClearUsage(pod_status);
+    CountPod(job, *pod_status, 1);
 
     const JobId& job_id = pod_status->jobid();
     const PodId& pod_id = pod_status->podid();
-    pending_pods_[job_id][pod_id] = pod_status;
-    LOG(INFO, "pod state rescheuled to pending, pod id:%s", pod_id.c_str());
+    reschedule_pods_[job_id][pod_id] = pod_status;
+    if (job->lost_since_.find(pod_id) == job->lost_since_.end()) {
+        job->lost_since_[pod_id] = common::timer::get_micros();
+    }
+    if (!reschedule_scheduled_) {
+        reschedule_scheduled_ = true;
+        executor_.DelayTask(FLAGS_master_reschedule_interval,
+                            boost::bind(&JobManager::ReleaseReschedulePods, this));
+    }
+    LOG(INFO, "pod queued for rescheduling, pod id:%s", pod_id.c_str());
+}
+
+namespace {
+// higher priority first, then the job missing more replicas
+struct RescheduleOrder {
+    JobId jobid;
+    int32_t priority;
+    int32_t lost;
+    bool operator<(const RescheduleOrder& other) const {
+        if (priority != other.priority) {
+            return priority > other.priority;
+        }
+        if (lost != other.lost) {
+            return lost > other.lost;
+        }
+        return jobid < other.jobid;
+    }
+};
+}
+
+// Releasing all pods of a lost rack at once would flood the scheduler
+// and the agents left, so at most master_reschedule_rate pods a second
+// go back to pending, the most important jobs first.
+void JobManager::ReleaseReschedulePods() {
+    MutexLock lock(&mutex_);
+    reschedule_scheduled_ = false;
+    int64_t budget = (int64_t)FLAGS_master_reschedule_rate
+                     * FLAGS_master_reschedule_interval / 1000;
+    if (budget < 1) {
+        budget = 1;
+    }
+    std::vector<RescheduleOrder> order;
+    PodMap::iterator it = reschedule_pods_.begin();
+    for (; it != reschedule_pods_.end(); ++it) {
+        Job* job = jobs_[it->first];
+        RescheduleOrder item;
+        item.jobid = it->first;
+        item.priority = job->desc_.priority();
+        item.lost = job->desc_.replica() - job->running_num_;
+        order.push_back(item);
+    }
+    std::sort(order.begin(), order.end());
+    int64_t released = 0;
+    for (size_t i = 0; i < order.size() && released < budget; i++) {
+        const JobId& jobid = order[i].jobid;
+        std::map<PodId, PodRecord*>& job_reschedule_pods = reschedule_pods_[jobid];
+        std::map<PodId, PodRecord*>& job_pending_pods = pending_pods_[jobid];
+        while (!job_reschedule_pods.empty() && released < budget) {
+            PodRecord* pod = job_reschedule_pods.begin()->second;
+            job_pending_pods[pod->podid()] = pod;
+            job_reschedule_pods.erase(job_reschedule_pods.begin());
+            released++;
+        }
+        MarkJobDirty(jobid);
+        if (job_reschedule_pods.empty()) {
+            reschedule_pods_.erase(jobid);
+        }
+    }
+    if (released > 0) {
+        LOG(INFO, "released %ld rescheduled pods to pending, %lu jobs still waiting",
+            released, reschedule_pods_.size());
+    }
+    if (!reschedule_pods_.empty()) {
+        reschedule_scheduled_ = true;
+        executor_.DelayTask(FLAGS_master_reschedule_interval,
+                            boost::bind(&JobManager::ReleaseReschedulePods, this));
+    }
+}
+
+void JobManager::CountPod(Job* job, const PodRecord& pod, int delta) {
+    mutex_.AssertHeld();
+    MarkPodDirty(job, pod.podid());
+    switch (pod.state()) {
+    case kPodPending:
+        job->pending_num_ += delta;
+        break;
+    case kPodDeploy:
+        job->deploy_num_ += delta;
+        break;
+    case kPodRunning:
+        job->running_num_ += delta;
+        job->resource_used_.set_millicores(job->resource_used_.millicores()
+                                           + delta * pod.millicores_used());
+        job->resource_used_.set_memory(job->resource_used_.memory()
+                                       + delta * pod.memory_used());
+        break;
+    default:
+        break;
+    }
+    RefreshDemand(job);
+}
+
+void JobManager::RefreshDemand(Job* job) {
+    mutex_.AssertHeld();
+    int64_t demand = job->pending_num_;
+    if ((int64_t)job->pods_.size() < job->desc_.replica()) {
+        demand += job->desc_.replica() - job->pods_.size();
+    }
+    if (demand == job->demand_) {
+        return;
+    }
+    int64_t& user_demand = user_demand_[job->desc_.user()];
+    user_demand += demand - job->demand_;
+    demand_total_ += demand - job->demand_;
+    job->demand_ = demand;
+    if (user_demand == 0) {
+        user_demand_.erase(job->desc_.user());
+    }
+}
+
+// before the job is removed or its descriptor replaced
+void JobManager::DropDemand(Job* job) {
+    mutex_.AssertHeld();
+    int64_t& user_demand = user_demand_[job->desc_.user()];
+    user_demand -= job->demand_;
+    demand_total_ -= job->demand_;
+    job->demand_ = 0;
+    if (user_demand == 0) {
+        user_demand_.erase(job->desc_.user());
+    }
+}
+
+void JobManager::SetPodState(PodRecord* pod, PodState state) {
+    mutex_.AssertHeld();
+    Job* job = jobs_[pod->jobid()];
+    event_log_.Append(kEventPodState, pod->jobid(), pod->podid(), pod->endpoint(),
+                      pod->state(), state, 0);
+    CountPod(job, *pod, -1);
+    pod->set_state(state);
+    CountPod(job, *pod, 1);
+    if (state != kPodRunning) {
+        job->unconfirmed_pods_.erase(pod->podid());
+    }
+    RecordPodChange(*pod, false);
+}
+
+void JobManager::RecordJobChange(const Job* job, JobState state) {
+    mutex_.AssertHeld();
+    WatchEvent event;
+    event.set_jobid(job->id_);
+    event.set_job_state(state);
+    event.set_version(job->desc_.version());
+    watch_log_.Append(&event);
+}
+
+void JobManager::RecordPodChange(const PodRecord& pod, bool removed) {
+    mutex_.AssertHeld();
+    if (!removed && pod.state() == kPodRunning) {
+        std::map<JobId, Job*>::iterator job_it = jobs_.find(pod.jobid());
+        if (job_it != jobs_.end()
+            && job_it->second->unconfirmed_pods_.count(pod.podid()) > 0) {
+            // told by ConfirmPodRunning when the agent reports it
+            return;
+        }
+    }
+    WatchEvent event;
+    event.set_jobid(pod.jobid());
+    event.set_podid(pod.podid());
+    event.set_pod_state(pod.state());
+    event.set_endpoint(pod.endpoint());
+    event.set_version(pod.version());
+    if (removed) {
+        event.set_removed(true);
+    }
+    watch_log_.Append(&event);
+}
+
+void JobManager::Watch(const WatchRequest* request, WatchResponse* response,
+                       ::google::protobuf::Closure* done) {
+    watch_log_.Watch(request, response, done);
+}
+
+// Usage alone leaves the pod counts as they are, the pods of the query
+// snapshot catch up with it every master_snapshot_usage_interval.
+void JobManager::UpdatePodUsage(PodRecord* pod, const PodStatus& report_pod) {
+    mutex_.AssertHeld();
+    Job* job = jobs_[pod->jobid()];
+    if (pod->state() == kPodRunning) {
+        const Resource& used = report_pod.resource_used();
+        job->resource_used_.set_millicores(job->resource_used_.millicores()
+                                           + used.millicores() - pod->millicores_used());
+        job->resource_used_.set_memory(job->resource_used_.memory()
+                                       + used.memory() - pod->memory_used());
+    }
+    // only copy dynamic information
+    pod_pool_.SetUsage(pod, report_pod);
+    if (!report_pod.version().empty() && report_pod.version() != pod->version()) {
+        RemoveExpectedPod(pod->endpoint(), *pod);
+        pod_pool_.SetVersion(pod, report_pod.version());
+        AddExpectedPod(pod->endpoint(), *pod);
+        MarkPodDirty(job, pod->podid());
+    }
+    usage_dirty_jobs_.insert(job->id_);
+    MarkJobDirty(job->id_);
 }
 
-void JobManager::DeployPod() {
+void JobManager::DeployPod(const std::vector<PodKey>& deploy) {
     MutexLock lock(&mutex_);
-    std::map<JobId, std::map<PodId, PodStatus*> >::iterator it;
-    for (it = deploy_pods_.begin(); it != deploy_pods_.end(); ++it) {
+    std::vector<PodKey>::const_iterator it;
+    for (it = deploy.begin(); it != deploy.end(); ++it) {
         const JobId& jobid = it->first;
-        std::map<PodId, PodStatus*>& job_deploy_pods = it->second;
-        Job* job = jobs_[jobid];
-        const PodDescriptor& pod_desc = job->desc_.pod();
-        std::map<PodId, PodStatus*>::iterator jt;
-        for (jt = job_deploy_pods.begin(); jt != job_deploy_pods.end(); ++jt) {
-            const PodId& podid = jt->first;
-            PodStatus* pod = jt->second;
-            const std::string& endpoint = pod->endpoint();
-            pod->set_state(kPodRunning);
+        const PodId& podid = it->second;
+        PodMap::iterator job_it = deploy_pods_.find(jobid);
+        if (job_it == deploy_pods_.end()
+            || job_it->second.find(podid) == job_it->second.end()) {
+            LOG(INFO, "ignore deploy of pod [%s %s], pod not deploying",
+                jobid.c_str(), podid.c_str());
+            continue;
+        }
+        jobs_[jobid]->deploy_queue_.push_back(podid);
+        deploy_jobs_.insert(jobid);
+    }
+    ScheduleDeploy();
+}
+
+void JobManager::ScheduleDeploy() {
+    mutex_.AssertHeld();
+    // one pod per job a round, so a big job can not hold all the slots
+    bool progress = true;
+    while (progress && run_pod_inflight_ < FLAGS_master_max_inflight_run_pod) {
+        progress = false;
+        std::vector<JobId> jobids(deploy_jobs_.begin(), deploy_jobs_.end());
+        for (size_t i = 0; i < jobids.size(); i++) {
+            if (run_pod_inflight_ >= FLAGS_master_max_inflight_run_pod) {
+                break;
+            }
+            if (DeployNextPod(jobids[i])) {
+                progress = true;
+            }
+        }
+    }
+}
+
+bool JobManager::DeployNextPod(const JobId& jobid) {
+    mutex_.AssertHeld();
+    std::map<JobId, Job*>::iterator job_it = jobs_.find(jobid);
+    if (job_it == jobs_.end()) {
+        deploy_jobs_.erase(jobid);
+        return false;
+    }
+    Job* job = job_it->second;
+    // pods rescheduled or suspended since they were sent free their slot
+    std::map<PodId, std::string>::iterator st = job->starting_pods_.begin();
+    while (st != job->starting_pods_.end()) {
+        std::map<PodId, PodRecord*>::iterator pod_it = job->pods_.find(st->first);
+        if (pod_it == job->pods_.end() || pod_it->second->state() != kPodRunning) {
+            job->starting_pods_.erase(st++);
+        } else {
+            ++st;
+        }
+    }
+    int32_t deploy_step = job->desc_.deploy_step() > 0 ?
+                          job->desc_.deploy_step() : FLAGS_master_deploy_step;
+    if (deploy_step > 0 && job->starting_pods_.size() >= (size_t)deploy_step) {
+        return false;
+    }
+    if (job->deploy_queue_.empty() && job->update_queue_.empty()) {
+        deploy_jobs_.erase(jobid);
+        return false;
+    }
+    // a job with a binary missing waits, its pods stay deploying
+    boost::shared_ptr<PodDescriptor> desc = GetRunPodDescriptor(job);
+    if (!desc) {
+        return false;
+    }
+    std::map<PodId, PodRecord*>& job_deploy_pods = deploy_pods_[jobid];
+    PodRecord* pod = NULL;
+    bool update = false;
+    while (pod == NULL && !job->deploy_queue_.empty()) {
+        const PodId podid = job->deploy_queue_.front();
+        job->deploy_queue_.pop_front();
+        std::map<PodId, PodRecord*>::iterator it = job_deploy_pods.find(podid);
+        if (it == job_deploy_pods.end()) {
+            LOG(INFO, "drop queued pod [%s %s], pod not deploying",
+                jobid.c_str(), podid.c_str());
+            continue;
+        }
+        pod = it->second;
+        job_deploy_pods.erase(it);
+    }
+    // new pods go first, then running ones are updated
+    while (pod == NULL && !job->update_queue_.empty()) {
+        const PodId podid = job->update_queue_.front();
+        job->update_queue_.pop_front();
+        // pods still starting are queued again once their slot is freed
+        std::map<PodId, PodRecord*>::iterator it = job->pods_.find(podid);
+        if (it == job->pods_.end() || it->second->state() != kPodRunning
+            || it->second->version() == job->desc_.version()
+            || job->starting_pods_.find(podid) != job->starting_pods_.end()) {
+            continue;
+        }
+        pod = it->second;
+        update = true;
+    }
+    if (job_deploy_pods.size() == 0) {
+        deploy_pods_.erase(jobid);
+    }
+    if (job->deploy_queue_.empty() && job->update_queue_.empty()) {
+        deploy_jobs_.erase(jobid);
+    }
+    if (pod == NULL) {
+        return false;
+    }
+    job->starting_pods_[pod->podid()] = update ? pod->version() : "";
+    job->unconfirmed_pods_[pod->podid()] = job->desc_.version();
+    if (!update) {
+        const std::string& endpoint = pod->endpoint();
+        pod_pool_.SetVersion(pod, job->desc_.version());
+        SetPodState(pod, kPodRunning);
+        std::map<PodId, int64_t>::iterator lost_it = job->lost_since_.find(pod->podid());
+        if (lost_it != job->lost_since_.end()) {
+            restore_time_last_ = common::timer::get_micros() - lost_it->second;
+            restore_time_total_ += restore_time_last_;
+            restored_pods_++;
+            job->lost_since_.erase(lost_it);
+        }
+
+        // TODO:: check agent health
+        // AgentInfo* agent = agents_[endpoint];
+
+        running_pods_[endpoint][jobid][pod->podid()] = pod;
+        AddExpectedPod(endpoint, *pod);
+    } else {
+        RemoveExpectedPod(pod->endpoint(), *pod);
+        pod_pool_.SetVersion(pod, job->desc_.version());
+        AddExpectedPod(pod->endpoint(), *pod);
+        MarkPodDirty(job, pod->podid());
+        RecordPodChange(*pod, false);
+    }
+    run_pod_inflight_++;
+    RunPod(job, pod, update, desc);
+    return true;
+}
+
+Status JobManager::Update(const JobId& jobid, const JobDescriptor& job_desc) {
+    Status admission = CheckReplica(job_desc);
+    if (admission != kOk) {
+        return admission;
+    }
+    MutexLock lock(&mutex_);
+    std::map<JobId, Job*>::iterator job_it = jobs_.find(jobid);
+    if (job_it == jobs_.end()) {
+        LOG(INFO, "update failed, no such job: %s", jobid.c_str());
+        return kJobNotFound;
+    }
+    Job* job = job_it->second;
+    // a scale up goes through admission like a submission, the pods it
+    // adds on top of what the job already holds
+    JobDescriptor admitted_desc(job_desc);
+    if (!admitted_desc.has_user()) {
+        admitted_desc.set_user(job->desc_.user());
+    }
+    int64_t demand = job->pending_num_;
+    if ((int64_t)job->pods_.size() < admitted_desc.replica()) {
+        demand += admitted_desc.replica() - job->pods_.size();
+    }
+    int64_t held = admitted_desc.user() == job->desc_.user() ? job->demand_ : 0;
+    if (demand > held && !DemandFits(admitted_desc, held, demand)) {
+        return kThrottled;
+    }
+    Resource old_requirement;
+    Resource new_requirement;
+    CalculatePodRequirement(job->desc_.pod(), &old_requirement);
+    CalculatePodRequirement(job_desc.pod(), &new_requirement);
+    char version[32];
+    snprintf(version, sizeof(version), "%ld",
+             atol(job->desc_.version().c_str()) + 1);
+    std::string user = job->desc_.user();
+    DropDemand(job);
+    job->desc_.CopyFrom(job_desc);
+    if (!job->desc_.has_user()) {
+        job->desc_.set_user(user);
+    }
+    job->desc_.set_version(version);
+    RefreshDemand(job);
+    job->run_pod_desc_.reset();
+    job->update_queue_.clear();
+    RecordJobChange(job, job->state_);
+    MarkJobDirty(jobid);
+    event_log_.Append(kEventJobUpdate, jobid, "", "", -1, -1, job_desc.replica());
+
+    // move placed pods from the old requirement to the new one on their
+    // agents, the ones that no longer fit are placed again
+    std::vector<PodRecord*> evicted;
+    std::map<PodId, PodRecord*>::iterator pod_it = job->pods_.begin();
+    for (; pod_it != job->pods_.end(); ++pod_it) {
+        PodRecord* pod = pod_it->second;
+        if (pod->state() != kPodDeploy && pod->state() != kPodRunning) {
+            continue;
+        }
+        std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.find(pod->endpoint());
+        if (agent_it == agents_.end()) {
+            continue;
+        }
+        AgentInfo* agent = agent_it->second;
+        MasterUtil::SubstractResource(old_requirement, agent->mutable_assigned());
+        MasterUtil::AddResource(old_requirement, agent->mutable_unassigned());
+        MarkAgentDirty(agent->endpoint());
+        if (!MasterUtil::FitResource(new_requirement, agent->unassigned())) {
+            evicted.push_back(pod);
+            continue;
+        }
+        MasterUtil::SubstractResource(new_requirement, agent->mutable_unassigned());
+        MasterUtil::AddResource(new_requirement, agent->mutable_assigned());
+        // deploying pods get the new descriptor when they are sent
+        if (pod->state() == kPodRunning) {
+            job->update_queue_.push_back(pod->podid());
+        }
+    }
+    for (size_t i = 0; i < evicted.size(); i++) {
+        PodRecord* pod = evicted[i];
+        const PodId& podid = pod->podid();
+        const AgentAddr endpoint = pod->endpoint();
+        LOG(INFO, "pod [%s %s] does not fit on %s after update, reschedule it",
+            jobid.c_str(), podid.c_str(), endpoint.c_str());
+        if (pod->state() == kPodDeploy) {
+            deploy_pods_[jobid].erase(podid);
+            if (deploy_pods_[jobid].size() == 0) {
+                deploy_pods_.erase(jobid);
+            }
+            pod_pool_.SetEndpoint(pod, "");
+            SetPodState(pod, kPodPending);
+            pending_pods_[jobid][podid] = pod;
+        } else {
+            KillPod(endpoint, podid);
+            running_pods_[endpoint][jobid].erase(podid);
+            if (running_pods_[endpoint][jobid].size() == 0) {
+                running_pods_[endpoint].erase(jobid);
+            }
+            RemoveExpectedPod(endpoint, *pod);
+            ReschedulePod(pod);
+        }
+    }
+    if (!safe_mode_) {
+        FillPodsToJob(job);
+    }
+    if (!job->update_queue_.empty()) {
+        deploy_jobs_.insert(jobid);
+    }
+    LOG(INFO, "job %s updated to version %s, %lu pods to restart, %lu rescheduled",
+        jobid.c_str(), version, job->update_queue_.size(), evicted.size());
+    ScheduleDeploy();
+    return kOk;
+}
+
+void JobManager::KillPod(const AgentAddr& endpoint, const PodId& podid) {
+    mutex_.AssertHeld();
+    KillPodRequest* request = new KillPodRequest;
+    KillPodResponse* response = new KillPodResponse;
+    request->set_podid(podid);
+    Agent_Stub* stub;
+    rpc_client_.GetStub(endpoint, &stub);
+    boost::function<void (const KillPodRequest*, KillPodResponse*, bool, int)> kill_pod_callback;
+    kill_pod_callback = boost::bind(&JobManager::KillPodCallback, this, endpoint,
+                                    _1, _2, _3, _4);
+    kill_pod_callback = boost::bind(&PostRpcCallback<KillPodRequest, KillPodResponse>,
+                                    &executor_, kill_pod_callback, _1, _2, _3, _4);
+    rpc_client_.AsyncRequest(stub, &Agent_Stub::KillPod, request, response,
+                             kill_pod_callback, FLAGS_master_agent_rpc_timeout, 0);
+    delete stub;
+}
 
-            // TODO:: check agent health
-            // AgentInfo* agent = agents_[endpoint];
+void JobManager::KillPodCallback(AgentAddr endpoint, const KillPodRequest* request,
+                                 KillPodResponse* response, bool failed, int error) {
+    boost::scoped_ptr<const KillPodRequest> request_ptr(request);
+    boost::scoped_ptr<KillPodResponse> response_ptr(response);
+    if (failed || response->status() != kOk) {
+        LOG(WARNING, "kill pod %s on [%s] fail: %d", request->podid().c_str(),
+            endpoint.c_str(), response->status());
+        return;
+    }
+    LOG(INFO, "kill pod %s on [%s] success", request->podid().c_str(), endpoint.c_str());
+}
 
-            running_pods_[endpoint][jobid][podid] = pod;
-            RunPod(pod_desc, pod);
+boost::shared_ptr<PodDescriptor> JobManager::GetRunPodDescriptor(Job* job) {
+    mutex_.AssertHeld();
+    boost::shared_ptr<PodDescriptor> desc = job->run_pod_desc_.lock();
+    if (!desc) {
+        desc.reset(new PodDescriptor());
+        desc->CopyFrom(job->desc_.pod());
+        bool loaded = true;
+        for (int i = 0; i < desc->tasks_size(); i++) {
+            TaskDescriptor* task = desc->mutable_tasks(i);
+            if (task->binary_digest().empty() || !task->binary().empty()) {
+                continue;
+            }
+            if (!binary_store_->Get(task->binary_digest(), task->mutable_binary())) {
+                LOG(DEBUG, "load binary %s of job %s fail",
+                    task->binary_digest().c_str(), job->id_.c_str());
+                RequestBinary(task->binary_digest());
+                loaded = false;
+            }
         }
+        if (!loaded) {
+            return boost::shared_ptr<PodDescriptor>();
+        }
+        job->run_pod_desc_ = desc;
+        LOG(DEBUG, "build run pod descriptor for job %s", job->id_.c_str());
+    }
+    return desc;
+}
+
+// Fetched once at a time, the deploy is tried again after
+// master_binary_fetch_retry in any case.
+void JobManager::RequestBinary(const std::string& digest) {
+    mutex_.AssertHeld();
+    if (!deploy_retry_scheduled_) {
+        deploy_retry_scheduled_ = true;
+        executor_.DelayTask(FLAGS_master_binary_fetch_retry,
+                            boost::bind(&JobManager::RetryDeploy, this));
+    }
+    if (!binary_fetcher_ || !fetching_binaries_.insert(digest).second) {
+        return;
     }
+    LOG(WARNING, "binary %s missing from store, fetch it", digest.c_str());
+    executor_.AddTask(boost::bind(binary_fetcher_, digest));
+}
+
+void JobManager::RetryDeploy() {
+    MutexLock lock(&mutex_);
+    deploy_retry_scheduled_ = false;
+    ScheduleDeploy();
+}
+
+void JobManager::SetBinaryFetcher(const boost::function<void (const std::string&)>& fetcher) {
+    MutexLock lock(&mutex_);
+    binary_fetcher_ = fetcher;
+}
+
+void JobManager::BinaryFetched(const std::string& digest) {
+    MutexLock lock(&mutex_);
+    fetching_binaries_.erase(digest);
+    ScheduleDeploy();
 }
 
-void JobManager::RunPod(const PodDescriptor& desc, PodStatus* pod) {
+void JobManager::RunPod(Job* job, PodRecord* pod, bool update,
+                        boost::shared_ptr<PodDescriptor> desc) {
     mutex_.AssertHeld();
     RunPodRequest* request = new RunPodRequest;
     RunPodResponse* response = new RunPodResponse;
     request->set_podid(pod->podid());
-    request->mutable_pod()->CopyFrom(desc);
+    request->set_jobid(pod->jobid());
+    request->set_version(job->desc_.version());
+    // borrow the shared descriptor instead of copying it (binaries included)
+    // into every request, sofa-pbrpc serializes the request inside the stub
+    // call, which always runs under mutex_, so the borrowed message is never
+    // encoded concurrently. The callback releases it before deleting request.
+    request->set_allocated_pod(desc.get());
 
     Agent_Stub* stub;
     const AgentAddr& endpoint = pod->endpoint();
     rpc_client_.GetStub(endpoint, &stub);
     boost::function<void (const RunPodRequest*, RunPodResponse*, bool, int)> run_pod_callback;
     run_pod_callback = boost::bind(&JobManager::RunPodCallback, this, pod, endpoint,
-                                   _1, _2, _3, _4);
+                                   update, desc, _1, _2, _3, _4);
     rpc_client_.AsyncRequest(stub, &Agent_Stub::RunPod, request, response,
-                             run_pod_callback, FLAGS_master_agent_rpc_timeout, 0);
+                             Batched(run_pod_callback), FLAGS_master_agent_rpc_timeout, 0);
     delete stub;
 }
 
-void JobManager::RunPodCallback(PodStatus* pod, AgentAddr endpoint,
+void JobManager::RunPodCallback(PodRecord* pod, AgentAddr endpoint, bool update,
+                                boost::shared_ptr<PodDescriptor> desc,
                                 const RunPodRequest* request,
                                 RunPodResponse* response,
                                 bool failed, int error) {
+    // give back the borrowed descriptor, `desc` keeps it alive till here
+    const_cast<RunPodRequest*>(request)->release_pod();
     boost::scoped_ptr<const RunPodRequest> request_ptr(request);
     boost::scoped_ptr<RunPodResponse> response_ptr(response);
-    MutexLock lock(&mutex_);
+    mutex_.AssertHeld();
+    run_pod_inflight_--;
     const std::string& jobid = pod->jobid();
     const std::string& podid = pod->podid();
     if (pod->state() != kPodRunning || pod->endpoint() != endpoint) {
         LOG(INFO, "ignore run pod callback of pod [%s %s] on [%s]",
             jobid.c_str(), podid.c_str(), endpoint.c_str());
+        ScheduleDeploy();
         return;
     }
 
     Status status = response->status();
+    if ((failed || status != kOk) && update) {
+        // the old version keeps running there
+        LOG(WARNING, "update pod [%s %s] on [%s] fail: %d", jobid.c_str(),
+            podid.c_str(), endpoint.c_str(), status);
+        Job* job = jobs_[jobid];
+        std::map<PodId, std::string>::iterator st = job->starting_pods_.find(podid);
+        if (st != job->starting_pods_.end() && st->second != pod->version()) {
+            RemoveExpectedPod(endpoint, *pod);
+            pod_pool_.SetVersion(pod, st->second);
+            AddExpectedPod(endpoint, *pod);
+            MarkPodDirty(job, podid);
+        }
+        // it runs as before
+        job->unconfirmed_pods_.erase(podid);
+        ReleaseStartingPod(job, pod);
+        ScheduleDeploy();
+        return;
+    }
     if (failed || status != kOk) {
         LOG(INFO, "run pod [%s %s] on [%s] fail: %d", jobid.c_str(),
             podid.c_str(), endpoint.c_str(), status);
+        event_log_.Append(kEventPodRunFail, jobid, podid, endpoint, -1, -1,
+                          failed ? error : status);
         assert(pod == running_pods_[endpoint][jobid][podid]);
         running_pods_[endpoint][jobid].erase(podid);
         if (running_pods_[endpoint][jobid].size() == 0) {
@@ -434,24 +1329,35 @@ void JobManager::RunPodCallback(PodStatus* pod, AgentAddr endpoint,
                 running_pods_.erase(endpoint);
             }
         }
+        RemoveExpectedPod(endpoint, *pod);
         ReschedulePod(pod);
+        ScheduleDeploy();
         return;
     }
+    event_log_.Append(kEventPodStarted, jobid, podid, endpoint, -1, -1, update ? 1 : 0);
     LOG(INFO, "run pod [%s %s] on [%s] success", jobid.c_str(),
         podid.c_str(), endpoint.c_str());
+    // the agent took it, the next pod need not wait for a query round
+    ReleaseStartingPod(jobs_[jobid], pod);
+    ScheduleDeploy();
 }
 
 void JobManager::ScheduleNextQuery() {
-    thread_pool_.DelayTask(FLAGS_master_query_period, boost::bind(&JobManager::Query, this));
+    executor_.DelayTask(FLAGS_master_query_period, boost::bind(&JobManager::Query, this));
 }
 
 void JobManager::Query() {
     MutexLock lock(&mutex_);
     assert(on_query_num_ == 0);
+    if (follower_) {
+        // agents are queried by the active master
+        ScheduleNextQuery();
+        return;
+    }
     std::map<AgentAddr, AgentInfo*>::iterator it;
     for (it = agents_.begin(); it != agents_.end(); ++it) {
         AgentInfo* agent = it->second;
-        QueryAgent(agent);
+        QueryAgent(agent, false);
     }
     LOG(INFO, "query %lld agents", on_query_num_);
     if (on_query_num_ == 0) {
@@ -459,9 +1365,9 @@ void JobManager::Query() {
     }
 }
 
-void JobManager::QueryAgent(AgentInfo* agent) {
+void JobManager::QueryAgent(AgentInfo* agent, bool reconcile) {
     const AgentAddr& endpoint = agent->endpoint();
-    if (agent->state() != kAlive) {
+    if (agent->state() == kDead) {
         LOG(DEBUG, "ignore dead agent [%s]", endpoint.c_str());
         return;
     }
@@ -473,28 +1379,239 @@ void JobManager::QueryAgent(AgentInfo* agent) {
     rpc_client_.GetStub(endpoint, &stub);
     boost::function<void (const QueryRequest*, QueryResponse*, bool, int)> query_callback;
     query_callback = boost::bind(&JobManager::QueryAgentCallback, this,
-                                 endpoint, _1, _2, _3, _4);
+                                 endpoint, reconcile, common::timer::get_micros(),
+                                 _1, _2, _3, _4);
 
     LOG(INFO, "query agent [%s]", endpoint.c_str());
     rpc_client_.AsyncRequest(stub, &Agent_Stub::Query, request, response,
-                             query_callback, FLAGS_master_agent_rpc_timeout, 0);
+                             Batched(query_callback), FLAGS_master_agent_rpc_timeout, 0);
     delete stub;
-    on_query_num_++;
+    if (reconcile) {
+        reconcile_inflight_++;
+    } else {
+        on_query_num_++;
+    }
 }
 
-void JobManager::QueryAgentCallback(AgentAddr endpoint, const QueryRequest* request,
-                                    QueryResponse* response, bool failed, int error) {
-    boost::scoped_ptr<const QueryRequest> request_ptr(request);
-    boost::scoped_ptr<QueryResponse> response_ptr(response);
-    MutexLock lock(&mutex_);
-    bool first_query_on_agent = false;
-    if (queried_agents_.find(endpoint) == queried_agents_.end()) {
-        first_query_on_agent = true;
-        LOG(INFO, "first query callback for agent: %s", endpoint.c_str());
-        queried_agents_.insert(endpoint);
+void JobManager::ReconcileAgent(const AgentAddr& endpoint) {
+    mutex_.AssertHeld();
+    if (follower_ || queried_agents_.find(endpoint) != queried_agents_.end()
+        || reconciling_agents_.find(endpoint) != reconciling_agents_.end()) {
+        return;
     }
-    
-    if (--on_query_num_ == 0) {
+    reconciling_agents_.insert(endpoint);
+    reconcile_queue_.push_back(endpoint);
+    IssueReconcile();
+}
+
+// Agents are queried as soon as they first heartbeat instead of waiting
+// for the next query round, many at a time.
+void JobManager::IssueReconcile() {
+    mutex_.AssertHeld();
+    while (reconcile_inflight_ < FLAGS_master_reconcile_parallelism
+           && !reconcile_queue_.empty()) {
+        AgentAddr endpoint = reconcile_queue_.front();
+        reconcile_queue_.pop_front();
+        std::map<AgentAddr, AgentInfo*>::iterator it = agents_.find(endpoint);
+        if (it == agents_.end() || it->second->state() == kDead) {
+            reconciling_agents_.erase(endpoint);
+            continue;
+        }
+        QueryAgent(it->second, true);
+    }
+}
+
+// A pod found on an agent at its first report. It is taken over as
+// running there; a pod standing in for it, either the same pod not yet
+// known placed or a spare created on leaving safe mode, is dropped so the
+// pod is never placed twice. When every replica is placed past deploy
+// already, the reported pod is the surplus one and is killed.
+PodRecord* JobManager::AdoptPod(const AgentAddr& endpoint, const PodStatus& report_pod) {
+    mutex_.AssertHeld();
+    const JobId& jobid = report_pod.jobid();
+    const PodId& podid = report_pod.podid();
+    std::map<JobId, Job*>::iterator job_it = jobs_.find(jobid);
+    if (job_it == jobs_.end()) {
+        return NULL;
+    }
+    Job* job = job_it->second;
+    PodRecord* pod = NULL;
+    std::map<PodId, PodRecord*>::iterator pod_it = job->pods_.find(podid);
+    if (pod_it != job->pods_.end()) {
+        pod = pod_it->second;
+        if (pod->state() != kPodPending) {
+            return NULL;
+        }
+        pending_pods_[jobid].erase(podid);
+        reschedule_pods_[jobid].erase(podid);
+        if (reschedule_pods_[jobid].size() == 0) {
+            reschedule_pods_.erase(jobid);
+        }
+        job->lost_since_.erase(podid);
+    } else {
+        if (job->pods_.size() >= (size_t)job->desc_.replica()
+            && !DropSparePod(job, podid, endpoint)) {
+            LOG(WARNING, "kill surplus pod [%s %s] on %s, all %d replicas placed",
+                jobid.c_str(), podid.c_str(), endpoint.c_str(), job->desc_.replica());
+            KillPod(endpoint, podid);
+            if (pending_pods_[jobid].size() == 0) {
+                pending_pods_.erase(jobid);
+            }
+            return NULL;
+        }
+        pod = pod_pool_.New(jobid, podid);
+        job->pods_[podid] = pod;
+        CountPod(job, *pod, 1);
+    }
+    if (pending_pods_[jobid].size() == 0) {
+        pending_pods_.erase(jobid);
+    }
+    pod_pool_.SetEndpoint(pod, endpoint);
+    pod_pool_.SetVersion(pod, report_pod.version());
+    SetPodState(pod, kPodRunning);
+    running_pods_[endpoint][jobid][podid] = pod;
+    AddExpectedPod(endpoint, *pod);
+    LOG(INFO, "adopt pod [%s %s] on %s", jobid.c_str(), podid.c_str(), endpoint.c_str());
+    return pod;
+}
+
+// Drops a pod of job not yet running anywhere, in favour of the pod podid
+// found on endpoint. A pending one is preferred, a proposed one gives its
+// resource back to the agent. Returns false when there is none.
+bool JobManager::DropSparePod(Job* job, const PodId& podid, const AgentAddr& endpoint) {
+    mutex_.AssertHeld();
+    const JobId& jobid = job->id_;
+    PodRecord* spare = NULL;
+    PodMap::iterator it = pending_pods_.find(jobid);
+    if (it != pending_pods_.end() && !it->second.empty()) {
+        spare = it->second.begin()->second;
+        it->second.erase(spare->podid());
+    } else {
+        it = deploy_pods_.find(jobid);
+        if (it == deploy_pods_.end() || it->second.empty()) {
+            return false;
+        }
+        spare = it->second.begin()->second;
+        it->second.erase(spare->podid());
+        if (it->second.empty()) {
+            deploy_pods_.erase(it);
+        }
+        std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.find(spare->endpoint());
+        if (agent_it != agents_.end()) {
+            ReclaimResource(*spare, agent_it->second);
+        }
+    }
+    job->pods_.erase(spare->podid());
+    job->unconfirmed_pods_.erase(spare->podid());
+    job->lost_since_.erase(spare->podid());
+    CountPod(job, *spare, -1);
+    RecordPodChange(*spare, true);
+    LOG(INFO, "drop spare pod [%s %s] for pod %s on %s", jobid.c_str(),
+        spare->podid().c_str(), podid.c_str(), endpoint.c_str());
+    pod_pool_.Delete(spare);
+    return true;
+}
+
+void JobManager::ReleaseStartingPod(Job* job, PodRecord* pod) {
+    mutex_.AssertHeld();
+    job->starting_pods_.erase(pod->podid());
+    // updated again in the meantime, or the update did not make it
+    if (pod->state() == kPodRunning && pod->version() != job->desc_.version()) {
+        job->update_queue_.push_back(pod->podid());
+        deploy_jobs_.insert(job->id_);
+    }
+}
+
+// An agent reports the version it runs, the one from before the update
+// until it has restarted the pod, any other means the RunPod took effect.
+// Agents reporting no version are taken at their word.
+bool JobManager::StartingPodReported(Job* job, const PodStatus& report) {
+    mutex_.AssertHeld();
+    if (report.state() == kPodPending) {
+        return false;
+    }
+    std::map<PodId, std::string>::iterator it = job->starting_pods_.find(report.podid());
+    if (it == job->starting_pods_.end()) {
+        return false;
+    }
+    return report.version().empty() || report.version() != it->second;
+}
+
+void JobManager::ConfirmPodRunning(Job* job, PodRecord* pod, const PodStatus& report) {
+    mutex_.AssertHeld();
+    std::map<PodId, std::string>::iterator it = job->unconfirmed_pods_.find(pod->podid());
+    if (it == job->unconfirmed_pods_.end() || report.state() != kPodRunning
+        || (!report.version().empty() && report.version() != it->second)) {
+        return;
+    }
+    job->unconfirmed_pods_.erase(it);
+    RecordPodChange(*pod, false);
+}
+
+void JobManager::StartRecovery() {
+    MutexLock lock(&mutex_);
+    recovery_start_ = common::timer::get_micros();
+}
+
+void JobManager::EnterSafeMode() {
+    MutexLock lock(&mutex_);
+    if (!safe_mode_) {
+        return;
+    }
+    safe_mode_start_ = common::timer::get_micros();
+    executor_.DelayTask(FLAGS_master_safe_mode_min_wait,
+                        boost::bind(&JobManager::CheckSafeMode, this));
+    executor_.DelayTask(FLAGS_master_safe_mode_deadline,
+                        boost::bind(&JobManager::CheckSafeMode, this));
+}
+
+void JobManager::CheckSafeMode() {
+    MutexLock lock(&mutex_);
+    MaybeLeaveSafeMode();
+}
+
+// Leaves safe mode once enough known agents are reconciled, or at the
+// deadline whatever the rest are doing. Later agents are reconciled
+// one by one as they show up.
+void JobManager::MaybeLeaveSafeMode() {
+    mutex_.AssertHeld();
+    if (!safe_mode_ || safe_mode_start_ == 0) {
+        return;
+    }
+    int64_t elapsed = (common::timer::get_micros() - safe_mode_start_) / 1000;
+    bool quorum = elapsed >= FLAGS_master_safe_mode_min_wait && agents_.size() > 0
+                  && queried_agents_.size()
+                     >= FLAGS_master_safe_mode_agent_fraction * agents_.size();
+    if (!quorum && elapsed < FLAGS_master_safe_mode_deadline) {
+        return;
+    }
+    LOG(INFO, "%lu of %lu agents reconciled in %ld ms",
+        queried_agents_.size(), agents_.size(), elapsed);
+    LeaveSafeMode();
+}
+
+void JobManager::LeaveSafeMode() {
+    mutex_.AssertHeld();
+    FillAllJobs();
+    safe_mode_ = false;
+    time_to_serving_ = (common::timer::get_micros() - recovery_start_) / 1000;
+    recovered_jobs_ = jobs_.size();
+    LOG(INFO, "master leave safe mode, serving %ld jobs %ld ms after taking the lock",
+        recovered_jobs_, time_to_serving_);
+}
+
+void JobManager::QueryAgentCallback(AgentAddr endpoint, bool reconcile, int64_t sent,
+                                    const QueryRequest* request,
+                                    QueryResponse* response, bool failed, int error) {
+    boost::scoped_ptr<const QueryRequest> request_ptr(request);
+    boost::scoped_ptr<QueryResponse> response_ptr(response);
+    mutex_.AssertHeld();
+    if (reconcile) {
+        // a failed one is retried on the next heartbeat
+        reconcile_inflight_--;
+        reconciling_agents_.erase(endpoint);
+        IssueReconcile();
+    } else if (--on_query_num_ == 0) {
         ScheduleNextQuery();
     }
     std::map<AgentAddr, AgentInfo*>::iterator it = agents_.find(endpoint);
@@ -508,23 +1625,35 @@ void JobManager::QueryAgentCallback(AgentAddr endpoint, const QueryRequest* requ
         return;
     }
     LOG(INFO, "query agent [%s] success", endpoint.c_str());
-    
+    bool first_query_on_agent = false;
+    if (queried_agents_.find(endpoint) == queried_agents_.end()) {
+        first_query_on_agent = true;
+        LOG(INFO, "first query callback for agent: %s", endpoint.c_str());
+        queried_agents_.insert(endpoint);
+    }
+
     AgentInfo* agent = it->second;
     const AgentInfo& report_agent_info = response->agent();
     agent->CopyFrom(report_agent_info);
+    if (FLAGS_master_shard_id >= 0) {
+        LeaseAgentResource(agent, sent);
+    }
+    MarkAgentDirty(endpoint);
 
     PodMap agent_running_pods = running_pods_[endpoint]; // this is a copy
+    bool slot_freed = false;
     for (int32_t i = 0; i < report_agent_info.pods_size(); i++) {
         const PodStatus& report_pod_info = report_agent_info.pods(i);
         const JobId& jobid = report_pod_info.jobid();
         const PodId& podid = report_pod_info.podid();
+        if (FLAGS_master_shard_id >= 0
+            && MasterUtil::ShardOf(jobid) != FLAGS_master_shard_id) {
+            continue;
+        }
        
-        if (first_query_on_agent && jobs_.find(jobid) != jobs_.end() && 
-            jobs_[jobid]->pods_.find(podid) == jobs_[jobid]->pods_.end()) {
-            PodStatus* pod = new PodStatus();
-            pod->CopyFrom(report_pod_info);
-            jobs_[jobid]->pods_[podid] = pod;
-            if(pod->state() == kPodRunning) {
+        if (first_query_on_agent) {
+            PodRecord* pod = AdoptPod(endpoint, report_pod_info);
+            if (pod != NULL) {
                 agent_running_pods[jobid][podid] = pod;
             }
         }
@@ -536,11 +1665,16 @@ void JobManager::QueryAgentCallback(AgentAddr endpoint, const QueryRequest* requ
             LOG(WARNING, "report non-exist pod [%s %s]", jobid.c_str(), podid.c_str());
             continue;
         }
-        PodStatus* pod = agent_running_pods[jobid][podid];
-        // only copy dynamic information
-        pod->mutable_status()->CopyFrom(report_pod_info.status());
-        pod->mutable_resource_used()->CopyFrom(report_pod_info.resource_used());
+        PodRecord* pod = agent_running_pods[jobid][podid];
+        UpdatePodUsage(pod, report_pod_info);
+        ConfirmPodRunning(jobs_[jobid], pod, report_pod_info);
         LOG(DEBUG, "update pod [%s %s]", jobid.c_str(), podid.c_str());
+        // the agent has set up all tasks of the pod, give its deploy slot
+        // to the next one
+        if (StartingPodReported(jobs_[jobid], report_pod_info)) {
+            ReleaseStartingPod(jobs_[jobid], pod);
+            slot_freed = true;
+        }
 
         agent_running_pods[jobid].erase(podid);
         if (agent_running_pods[jobid].size() == 0) {
@@ -552,87 +1686,1187 @@ void JobManager::QueryAgentCallback(AgentAddr endpoint, const QueryRequest* requ
     PodMap::iterator pod_it = agent_running_pods.begin();
     for (; pod_it != agent_running_pods.end(); ++pod_it) {
         const JobId& jobid = pod_it->first;
-        std::map<PodId, PodStatus*>& pods = pod_it->second;
-        std::map<PodId, PodStatus*>::iterator pod_it = pods.begin();
+        std::map<PodId, PodRecord*>& pods = pod_it->second;
+        std::map<PodId, PodRecord*>::iterator pod_it = pods.begin();
         for (; pod_it != pods.end(); ++pod_it) {
             const PodId& podid = pod_it->first;
             LOG(WARNING, "dead pod [%s %s]", jobid.c_str(), podid.c_str());
-            PodStatus* pod = pod_it->second;
+            PodRecord* pod = pod_it->second;
             running_pods_[endpoint][jobid].erase(podid);
+            RemoveExpectedPod(endpoint, *pod);
             ReschedulePod(pod);
+            slot_freed = true;
         }
     }
+    if (slot_freed) {
+        ScheduleDeploy();
+    }
     
-    if (queried_agents_.size() == agents_.size() && safe_mode_) {
-        FillAllJobs();
-        safe_mode_ = false;
-        LOG(INFO, "master leave safe mode");
+    MaybeLeaveSafeMode();
+}
+
+// Agents are shared by all shards. Each keeps only its own pods, and the
+// resource left unassigned at the last report only when it holds the lease
+// of the agent, so shards placing at once never overcommit an agent.
+void JobManager::LeaseAgentResource(AgentInfo* agent, int64_t query_sent) {
+    mutex_.AssertHeld();
+    google::protobuf::RepeatedPtrField<PodStatus> own_pods;
+    for (int i = 0; i < agent->pods_size(); i++) {
+        if (MasterUtil::ShardOf(agent->pods(i).jobid()) == FLAGS_master_shard_id) {
+            own_pods.Add()->CopyFrom(agent->pods(i));
+        }
+    }
+    agent->mutable_pods()->Swap(&own_pods);
+    agent->set_pod_num(agent->pods_size());
+    std::map<AgentAddr, AgentLease>::iterator it = leases_.find(agent->endpoint());
+    if (it != leases_.end() && query_sent >= it->second.granted) {
+        it->second.usable = true;
+    }
+    if (LeaseUsable(agent->endpoint())) {
+        unleased_free_.erase(agent->endpoint());
+        return;
+    }
+    unleased_free_[agent->endpoint()] = agent->unassigned();
+    agent->mutable_unassigned()->set_millicores(0);
+    agent->mutable_unassigned()->set_memory(0);
+}
+
+bool JobManager::LeaseUsable(const AgentAddr& endpoint) {
+    mutex_.AssertHeld();
+    std::map<AgentAddr, AgentLease>::iterator it = leases_.find(endpoint);
+    // the router may have granted it elsewhere once it stopped hearing from us
+    return it != leases_.end() && it->second.usable
+           && common::timer::get_micros() - lease_renewed_
+              < FLAGS_master_lease_timeout * 1000L;
+}
+
+void JobManager::ReleaseLease(const AgentAddr& endpoint) {
+    mutex_.AssertHeld();
+    leases_.erase(endpoint);
+    std::map<AgentAddr, AgentInfo*>::iterator it = agents_.find(endpoint);
+    if (it == agents_.end()) {
+        return;
     }
+    AgentInfo* agent = it->second;
+    unleased_free_[endpoint] = agent->unassigned();
+    agent->mutable_unassigned()->set_millicores(0);
+    agent->mutable_unassigned()->set_memory(0);
+    MarkAgentDirty(endpoint);
 }
 
-void JobManager::GetAgentsInfo(AgentInfoList* agents_info) {
+// A leased agent is given back once no pod of this shard is on the way to
+// it, when there is nothing pending or another shard has waited for it
+// longer than master_lease_hold. Unleased agents whose free resource fits a
+// pending pod are asked for, at most one per pending pod.
+void JobManager::RenewLeases(const BatchHeartBeatRequest& request,
+                             BatchHeartBeatResponse* response) {
+    if (FLAGS_master_shard_id < 0 || !request.lease()) {
+        return;
+    }
     MutexLock lock(&mutex_);
-    std::map<AgentAddr, AgentInfo*>::iterator it;
-    for (it = agents_.begin(); it != agents_.end(); ++it) {
-        AgentInfo* agent = it->second;
-        agents_info->Add()->CopyFrom(*agent);
+    int64_t now = common::timer::get_micros();
+    lease_renewed_ = now;
+    std::set<AgentAddr> leased(request.leased_agents().begin(),
+                               request.leased_agents().end());
+    std::set<AgentAddr> contended(request.contended_agents().begin(),
+                                  request.contended_agents().end());
+    std::vector<AgentAddr> revoked;
+    std::map<AgentAddr, AgentLease>::iterator it = leases_.begin();
+    for (; it != leases_.end(); ++it) {
+        if (leased.find(it->first) == leased.end()) {
+            revoked.push_back(it->first);
+        }
+    }
+    for (size_t i = 0; i < revoked.size(); i++) {
+        LOG(WARNING, "lease of agent %s revoked by router", revoked[i].c_str());
+        ReleaseLease(revoked[i]);
+    }
+    std::set<AgentAddr>::iterator leased_it = leased.begin();
+    for (; leased_it != leased.end(); ++leased_it) {
+        if (leases_.find(*leased_it) == leases_.end()) {
+            LOG(INFO, "agent %s leased", leased_it->c_str());
+            leases_[*leased_it].granted = now;
+        }
+    }
+
+    // agents still getting pods of this shard
+    std::set<AgentAddr> busy;
+    PodMap::iterator job_it = deploy_pods_.begin();
+    for (; job_it != deploy_pods_.end(); ++job_it) {
+        std::map<PodId, PodRecord*>::iterator pod_it = job_it->second.begin();
+        for (; pod_it != job_it->second.end(); ++pod_it) {
+            busy.insert(pod_it->second->endpoint());
+        }
+    }
+    std::map<JobId, Job*>::iterator jt = jobs_.begin();
+    for (; jt != jobs_.end(); ++jt) {
+        Job* job = jt->second;
+        std::map<PodId, std::string>::iterator st = job->starting_pods_.begin();
+        for (; st != job->starting_pods_.end(); ++st) {
+            std::map<PodId, PodRecord*>::iterator pod_it = job->pods_.find(st->first);
+            if (pod_it != job->pods_.end()) {
+                busy.insert(pod_it->second->endpoint());
+            }
+        }
+    }
+    std::vector<AgentAddr> released;
+    for (it = leases_.begin(); it != leases_.end(); ++it) {
+        const AgentAddr& endpoint = it->first;
+        if (busy.find(endpoint) != busy.end()) {
+            continue;
+        }
+        if (pending_pods_.empty()
+            || (contended.find(endpoint) != contended.end()
+                && now - it->second.granted > FLAGS_master_lease_hold * 1000L)) {
+            released.push_back(endpoint);
+        }
+    }
+    for (size_t i = 0; i < released.size(); i++) {
+        LOG(INFO, "give back lease of agent %s", released[i].c_str());
+        ReleaseLease(released[i]);
+    }
+    for (it = leases_.begin(); it != leases_.end(); ++it) {
+        response->add_held_agents(it->first);
+    }
+
+    std::vector<Resource> requirements;
+    size_t pending_num = 0;
+    for (job_it = pending_pods_.begin(); job_it != pending_pods_.end(); ++job_it) {
+        Resource requirement;
+        CalculatePodRequirement(jobs_[job_it->first]->desc_.pod(), &requirement);
+        requirements.push_back(requirement);
+        pending_num += job_it->second.size();
+    }
+    std::map<AgentAddr, Resource>::iterator free_it = unleased_free_.begin();
+    for (; free_it != unleased_free_.end()
+           && (size_t)response->wanted_agents_size() < pending_num; ++free_it) {
+        std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.find(free_it->first);
+        if (agent_it == agents_.end() || agent_it->second->state() != kAlive) {
+            continue;
+        }
+        for (size_t i = 0; i < requirements.size(); i++) {
+            if (MasterUtil::FitResource(requirements[i], free_it->second)) {
+                response->add_wanted_agents(free_it->first);
+                break;
+            }
+        }
+    }
+}
+
+void JobManager::AddExpectedPod(const AgentAddr& endpoint, const PodRecord& pod) {
+    mutex_.AssertHeld();
+    agent_digests_[endpoint].expected.Add(pod.podid(), pod.version());
+}
+
+void JobManager::RemoveExpectedPod(const AgentAddr& endpoint, const PodRecord& pod) {
+    mutex_.AssertHeld();
+    agent_digests_[endpoint].expected.Remove(pod.podid(), pod.version());
+}
+
+// Anti-entropy between running_pods_ and the agents. Agents whose digest
+// matches cost one comparison, the others are asked for the pods of the
+// differing buckets only. A digest has to differ on two checks in a row,
+// so pods being sent or updated are not taken for lost. Shards are left to
+// Query, as the digest of an agent covers the pods of all of them.
+void JobManager::CheckAgentDigests() {
+    {
+        MutexLock lock(&mutex_);
+        if (!safe_mode_ && !follower_ && FLAGS_master_shard_id < 0) {
+            {
+                MutexLock timer_lock(&mutex_timer_);
+                std::map<AgentAddr, AgentLiveness>::iterator it = agent_liveness_.begin();
+                for (; it != agent_liveness_.end(); ++it) {
+                    if (it->second.serving && it->second.has_digest) {
+                        AgentDigest& digest = agent_digests_[it->first];
+                        digest.reported = it->second.digest;
+                        digest.has_reported = true;
+                    }
+                }
+            }
+            std::map<AgentAddr, AgentDigest>::iterator it = agent_digests_.begin();
+            for (; it != agent_digests_.end(); ++it) {
+                AgentDigest& digest = it->second;
+                if (!digest.has_reported || digest.expected.Root() == digest.reported) {
+                    digest.mismatch_checks = 0;
+                    continue;
+                }
+                if (++digest.mismatch_checks < 2
+                    || digest_querying_.find(it->first) != digest_querying_.end()) {
+                    continue;
+                }
+                digest.mismatch_checks = 0;
+                QueryAgentDigest(it->first);
+            }
+        }
+    }
+    executor_.DelayTask(FLAGS_master_digest_check_interval,
+                        boost::bind(&JobManager::CheckAgentDigests, this));
+}
+
+void JobManager::QueryAgentDigest(const AgentAddr& endpoint) {
+    mutex_.AssertHeld();
+    std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.find(endpoint);
+    if (agent_it == agents_.end() || agent_it->second->state() == kDead) {
+        return;
+    }
+    QueryRequest* request = new QueryRequest;
+    QueryResponse* response = new QueryResponse;
+    AgentDigest& digest = agent_digests_[endpoint];
+    for (int32_t i = 0; i < PodDigest::kBucketNum; i++) {
+        request->add_bucket_digests(digest.expected.Bucket(i));
+    }
+    digest_querying_.insert(endpoint);
+    digest_queries_++;
+
+    Agent_Stub* stub;
+    rpc_client_.GetStub(endpoint, &stub);
+    boost::function<void (const QueryRequest*, QueryResponse*, bool, int)> query_callback;
+    query_callback = boost::bind(&JobManager::QueryAgentDigestCallback, this,
+                                 endpoint, _1, _2, _3, _4);
+    rpc_client_.AsyncRequest(stub, &Agent_Stub::Query, request, response,
+                             Batched(query_callback), FLAGS_master_agent_rpc_timeout, 0);
+    delete stub;
+}
+
+void JobManager::QueryAgentDigestCallback(AgentAddr endpoint, const QueryRequest* request,
+                                          QueryResponse* response, bool failed, int /*error*/) {
+    boost::scoped_ptr<const QueryRequest> request_ptr(request);
+    boost::scoped_ptr<QueryResponse> response_ptr(response);
+    mutex_.AssertHeld();
+    digest_querying_.erase(endpoint);
+    if (failed || response->status() != kOk) {
+        LOG(INFO, "digest query agent [%s] fail: %d", endpoint.c_str(), response->status());
+        return;
+    }
+    std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.find(endpoint);
+    if (agent_it == agents_.end() || agent_it->second->state() == kDead) {
+        return;
+    }
+    std::set<int32_t> buckets(response->mismatched_buckets().begin(),
+                              response->mismatched_buckets().end());
+    PodMap& agent_pods = running_pods_[endpoint];
+    bool slot_freed = false;
+    std::set<PodId> reported;
+    const AgentInfo& report_agent_info = response->agent();
+    for (int i = 0; i < report_agent_info.pods_size(); i++) {
+        const PodStatus& report_pod = report_agent_info.pods(i);
+        const JobId& jobid = report_pod.jobid();
+        const PodId& podid = report_pod.podid();
+        reported.insert(podid);
+        PodMap::iterator job_it = agent_pods.find(jobid);
+        if (job_it == agent_pods.end() || job_it->second.find(podid) == job_it->second.end()) {
+            LOG(WARNING, "agent %s runs unknown pod [%s %s]", endpoint.c_str(),
+                jobid.c_str(), podid.c_str());
+            continue;
+        }
+        PodRecord* pod = job_it->second[podid];
+        Job* job = jobs_[jobid];
+        if (report_pod.version() != pod->version()) {
+            RemoveExpectedPod(endpoint, *pod);
+            pod_pool_.SetVersion(pod, report_pod.version());
+            AddExpectedPod(endpoint, *pod);
+            MarkPodDirty(job, podid);
+        }
+        ConfirmPodRunning(job, pod, report_pod);
+        if (StartingPodReported(job, report_pod)) {
+            ReleaseStartingPod(job, pod);
+            slot_freed = true;
+        }
+    }
+    // pods expected in the differing buckets the agent does not run, those
+    // whose RunPod may still be on the way are left to the next round
+    std::vector<PodRecord*> lost_pods;
+    PodMap::iterator job_it = agent_pods.begin();
+    for (; job_it != agent_pods.end(); ++job_it) {
+        Job* job = jobs_[job_it->first];
+        std::map<PodId, PodRecord*>::iterator pod_it = job_it->second.begin();
+        for (; pod_it != job_it->second.end(); ++pod_it) {
+            const PodId& podid = pod_it->first;
+            if (buckets.find(PodDigest::BucketOf(podid)) != buckets.end()
+                && reported.find(podid) == reported.end()
+                && job->starting_pods_.find(podid) == job->starting_pods_.end()) {
+                lost_pods.push_back(pod_it->second);
+            }
+        }
+    }
+    for (size_t i = 0; i < lost_pods.size(); i++) {
+        PodRecord* pod = lost_pods[i];
+        const JobId jobid = pod->jobid();
+        LOG(WARNING, "pod [%s %s] missing on %s", jobid.c_str(),
+            pod->podid().c_str(), endpoint.c_str());
+        agent_pods[jobid].erase(pod->podid());
+        if (agent_pods[jobid].size() == 0) {
+            agent_pods.erase(jobid);
+        }
+        RemoveExpectedPod(endpoint, *pod);
+        ReschedulePod(pod);
+        digest_lost_pods_++;
+        slot_freed = true;
+    }
+    if (agent_pods.size() == 0) {
+        running_pods_.erase(endpoint);
+    }
+    LOG(INFO, "digest query agent [%s]: %lu buckets differ, %d pods reported, %lu lost",
+        endpoint.c_str(), buckets.size(), report_agent_info.pods_size(), lost_pods.size());
+    if (slot_freed) {
+        ScheduleDeploy();
+    }
+}
+
+void JobManager::GetAgentsInfo(const ListAgentsRequest& request,
+                               AgentInfoList* agents_info,
+                               std::string* next_page_token) {
+    boost::shared_ptr<const QuerySnapshot> snapshot = GetQuerySnapshot();
+    std::set<std::string> fields(request.fields().begin(), request.fields().end());
+    // page tokens are the last key returned, snapshot maps are ordered
+    ChunkedMap<boost::shared_ptr<const AgentInfo> >::Iterator it =
+        snapshot->agents.UpperBound(request.page_token());
+    for (; it.Valid(); it.Next()) {
+        if (!MatchAgent(request.filter(), *it.Value())) {
+            continue;
+        }
+        if (request.page_size() > 0 && agents_info->size() >= request.page_size()) {
+            *next_page_token = agents_info->Get(agents_info->size() - 1).endpoint();
+            break;
+        }
+        CopyAgentInfo(*it.Value(), fields, request.with_pods(), agents_info->Add());
     }
 }
 
 void JobManager::GetAliveAgentsInfo(AgentInfoList* agents_info) {
-    MutexLock lock(&mutex_);
-    std::map<AgentAddr, AgentInfo*>::iterator it;
-    for (it = agents_.begin(); it != agents_.end(); ++it) {
-        AgentInfo* agent = it->second;
-        if (agent->state() != kAlive) {
+    boost::shared_ptr<const QuerySnapshot> snapshot = GetQuerySnapshot();
+    ChunkedMap<boost::shared_ptr<const AgentInfo> >::Iterator it = snapshot->agents.Begin();
+    for (; it.Valid(); it.Next()) {
+        const AgentInfo& agent = *it.Value();
+        if (agent.state() != kAlive) {
+            continue;
+        }
+        agents_info->Add()->CopyFrom(agent);
+    }
+}
+
+void JobManager::GetJobsOverview(const ListJobsRequest& request,
+                                 JobOverviewList* jobs_overview,
+                                 std::string* next_page_token) {
+    boost::shared_ptr<const QuerySnapshot> snapshot = GetQuerySnapshot();
+    std::vector<std::string> terms;
+    GetFilterTerms(request.filter(), &terms);
+    if (terms.empty()) {
+        ChunkedMap<boost::shared_ptr<const JobOverview> >::Iterator it =
+            snapshot->overviews.UpperBound(request.page_token());
+        for (; it.Valid(); it.Next()) {
+            if (request.page_size() > 0 && jobs_overview->size() >= request.page_size()) {
+                *next_page_token = jobs_overview->Get(jobs_overview->size() - 1).jobid();
+                break;
+            }
+            jobs_overview->Add()->CopyFrom(*it.Value());
+        }
+        return;
+    }
+    // intersect the index sets of all terms, walking the smallest one
+    std::vector<const ChunkedIdSet*> sets;
+    for (size_t i = 0; i < terms.size(); i++) {
+        std::map<std::string, boost::shared_ptr<const ChunkedIdSet> >::const_iterator index_it;
+        index_it = snapshot->job_index.find(terms[i]);
+        if (index_it == snapshot->job_index.end()) {
+            return;
+        }
+        sets.push_back(index_it->second.get());
+        if (sets.back()->Size() < sets[0]->Size()) {
+            std::swap(sets[0], sets.back());
+        }
+    }
+    ChunkedIdSet::Iterator it = sets[0]->UpperBound(request.page_token());
+    for (; it.Valid(); it.Next()) {
+        bool matched = true;
+        for (size_t i = 1; i < sets.size() && matched; i++) {
+            matched = sets[i]->Contains(it.Get());
+        }
+        if (!matched) {
             continue;
         }
-        agents_info->Add()->CopyFrom(*agent);
+        if (request.page_size() > 0 && jobs_overview->size() >= request.page_size()) {
+            *next_page_token = jobs_overview->Get(jobs_overview->size() - 1).jobid();
+            break;
+        }
+        jobs_overview->Add()->CopyFrom(**snapshot->overviews.Find(it.Get()));
+    }
+}
+
+Status JobManager::GetJobInfo(const JobId& jobid, bool with_pods, JobInfo* job_info) {
+    boost::shared_ptr<const QuerySnapshot> snapshot = GetQuerySnapshot();
+    const boost::shared_ptr<const JobInfo>* job = snapshot->jobs.Find(jobid);
+    if (job == NULL) {
+        LOG(WARNING, "get job info failed, no such job: %s", jobid.c_str());
+        return kJobNotFound;
+    }
+    job_info->CopyFrom(**job);
+    if (with_pods) {
+        AppendSnapshotPods(*snapshot, jobid, job_info);
+    }
+    return kOk;
+}
+
+static std::string JobIndexTerm(const char* name, int value) {
+    char term[32];
+    snprintf(term, sizeof(term), "%s:%d", name, value);
+    return term;
+}
+
+// the terms a job is indexed under, one per indexed attribute and label
+void JobManager::GetJobIndexTerms(const JobOverview& job, std::vector<std::string>* terms) {
+    terms->push_back("user:" + job.desc().user());
+    terms->push_back(JobIndexTerm("state", job.state()));
+    terms->push_back(JobIndexTerm("type", job.desc().type()));
+    for (int i = 0; i < job.desc().labels_size(); i++) {
+        terms->push_back("label:" + job.desc().labels(i));
+    }
+}
+
+// the terms a job has to carry all of to match filter
+void JobManager::GetFilterTerms(const QueryFilter& filter, std::vector<std::string>* terms) {
+    if (filter.has_user()) {
+        terms->push_back("user:" + filter.user());
+    }
+    if (filter.has_job_state()) {
+        terms->push_back(JobIndexTerm("state", filter.job_state()));
+    }
+    if (filter.has_job_type()) {
+        terms->push_back(JobIndexTerm("type", filter.job_type()));
+    }
+    for (int i = 0; i < filter.labels_size(); i++) {
+        terms->push_back("label:" + filter.labels(i));
+    }
+}
+
+// Moves jobid between the index sets of the terms old_job and new_job
+// differ in, either may be NULL. A set is copied the first time it is
+// touched in a publish, the previous snapshot keeps its own.
+void JobManager::UpdateJobIndex(const JobId& jobid, const JobOverview* old_job,
+                                const JobOverview* new_job, QuerySnapshot* snapshot,
+                                std::map<std::string, boost::shared_ptr<ChunkedIdSet> >* touched) {
+    std::vector<std::string> old_terms;
+    std::vector<std::string> new_terms;
+    if (old_job != NULL) {
+        GetJobIndexTerms(*old_job, &old_terms);
+    }
+    if (new_job != NULL) {
+        GetJobIndexTerms(*new_job, &new_terms);
+    }
+    std::set<std::string> removed(old_terms.begin(), old_terms.end());
+    std::set<std::string> added(new_terms.begin(), new_terms.end());
+    for (size_t i = 0; i < new_terms.size(); i++) {
+        removed.erase(new_terms[i]);
+    }
+    for (size_t i = 0; i < old_terms.size(); i++) {
+        added.erase(old_terms[i]);
+    }
+    for (int op = 0; op < 2; op++) {
+        const std::set<std::string>& terms = (op == 0 ? removed : added);
+        std::set<std::string>::const_iterator it = terms.begin();
+        for (; it != terms.end(); ++it) {
+            boost::shared_ptr<ChunkedIdSet>& set = (*touched)[*it];
+            if (!set) {
+                // shares the chunks with the published set
+                std::map<std::string, boost::shared_ptr<const ChunkedIdSet> >::iterator index_it;
+                index_it = snapshot->job_index.find(*it);
+                if (index_it == snapshot->job_index.end()) {
+                    set.reset(new ChunkedIdSet());
+                } else {
+                    set.reset(new ChunkedIdSet(*index_it->second));
+                }
+            }
+            if (op == 0) {
+                set->Erase(jobid);
+            } else {
+                set->Insert(jobid);
+            }
+        }
+    }
+}
+
+bool JobManager::MatchAgent(const QueryFilter& filter, const AgentInfo& agent) {
+    if (filter.has_agent_state() && filter.agent_state() != agent.state()) {
+        return false;
+    }
+    if (filter.has_endpoint_prefix()
+        && agent.endpoint().compare(0, filter.endpoint_prefix().size(),
+                                    filter.endpoint_prefix()) != 0) {
+        return false;
+    }
+    return true;
+}
+
+// Only the fields asked for are built, see ListAgentsRequest. The
+// endpoint is the page token, it is always copied.
+void JobManager::CopyAgentInfo(const AgentInfo& agent, const std::set<std::string>& fields,
+                               bool with_pods, AgentInfo* to) {
+    bool all = fields.empty();
+    if (all && with_pods) {
+        to->CopyFrom(agent);
+        return;
+    }
+    to->set_endpoint(agent.endpoint());
+    if (all || fields.count("state") > 0) {
+        to->set_state(agent.state());
+    }
+    if (all || fields.count("pod_num") > 0) {
+        to->set_pod_num(agent.pod_num());
+    }
+    if (all || fields.count("total") > 0) {
+        to->mutable_total()->CopyFrom(agent.total());
+    }
+    if (all || fields.count("assigned") > 0) {
+        to->mutable_assigned()->CopyFrom(agent.assigned());
+    }
+    if (all || fields.count("unassigned") > 0) {
+        to->mutable_unassigned()->CopyFrom(agent.unassigned());
+    }
+    if (all || fields.count("used") > 0) {
+        to->mutable_used()->CopyFrom(agent.used());
+    }
+    if (all || fields.count("free") > 0) {
+        to->mutable_free()->CopyFrom(agent.free());
+    }
+    if (!all && fields.count("pods") > 0) {
+        to->mutable_pods()->CopyFrom(agent.pods());
+    }
+}
+
+void JobManager::FillJobOverview(const Job* job, JobOverview* overview) {
+    mutex_.AssertHeld();
+    // everything but the pod descriptor, fields added to JobDescriptor
+    // later come along unless they are cleared here too
+    JobDescriptor* overview_desc = overview->mutable_desc();
+    overview_desc->CopyFrom(job->desc_);
+    overview_desc->clear_pod();
+    overview->set_jobid(job->id_);
+    overview->set_state(job->state_);
+    overview->set_running_num(job->running_num_);
+    overview->set_pending_num(job->pending_num_);
+    overview->set_deploy_num(job->deploy_num_);
+    overview->mutable_resource_used()->CopyFrom(job->resource_used_);
+}
+
+// all but the pods, see RebuildPodRuns
+void JobManager::FillJobInfo(const Job* job, JobInfo* job_info) {
+    mutex_.AssertHeld();
+    job_info->set_jobid(job->id_);
+    job_info->set_state(job->state_);
+    job_info->mutable_desc()->CopyFrom(job->desc_);
+}
+
+void JobManager::AppendSnapshotPods(const QuerySnapshot& snapshot, const JobId& jobid,
+                                    JobInfo* job_info) {
+    const boost::shared_ptr<const PodRuns>* runs = snapshot.pods.Find(jobid);
+    if (runs == NULL) {
+        return;
+    }
+    PodRuns::const_iterator run_it = (*runs)->begin();
+    for (; run_it != (*runs)->end(); ++run_it) {
+        if (!job_info->MergeFromString(*run_it->second)) {
+            LOG(WARNING, "fail to decode pods of job %s", jobid.c_str());
+        }
+    }
+}
+
+// Rebuilds the runs holding podids, all of them when podids is NULL. Runs
+// over master_snapshot_pod_run are split, empty ones but the first dropped.
+void JobManager::RebuildPodRuns(const JobId& jobid, const std::set<PodId>* podids,
+                                QuerySnapshot* snapshot) {
+    mutex_.AssertHeld();
+    std::map<JobId, Job*>::iterator job_it = jobs_.find(jobid);
+    if (job_it == jobs_.end()) {
+        snapshot->pods.Erase(jobid);
+        return;
+    }
+    const std::map<PodId, PodRecord*>& pods = job_it->second->pods_;
+    boost::shared_ptr<PodRuns> runs(new PodRuns());
+    std::set<PodId> stale_runs;
+    const boost::shared_ptr<const PodRuns>* old_runs = snapshot->pods.Find(jobid);
+    if (podids != NULL && old_runs != NULL) {
+        *runs = **old_runs;
+        std::set<PodId>::const_iterator pod_it = podids->begin();
+        for (; pod_it != podids->end(); ++pod_it) {
+            // the first run is keyed by "", there is always one before
+            PodRuns::iterator run_it = runs->upper_bound(*pod_it);
+            --run_it;
+            stale_runs.insert(run_it->first);
+        }
+    } else {
+        (*runs)[""];
+        stale_runs.insert("");
+    }
+
+    const uint32_t tag = (JobInfo::kPodsFieldNumber << 3) | 2;
+    PodStatus pod_status;
+    std::set<PodId>::iterator stale_it = stale_runs.begin();
+    for (; stale_it != stale_runs.end(); ++stale_it) {
+        PodRuns::iterator run_it = runs->find(*stale_it);
+        PodRuns::iterator next_it = run_it;
+        ++next_it;
+        std::map<PodId, PodRecord*>::const_iterator end = pods.end();
+        if (next_it != runs->end()) {
+            end = pods.lower_bound(next_it->first);
+        }
+        runs->erase(run_it);
+        std::map<PodId, PodRecord*>::const_iterator pod_it = pods.lower_bound(*stale_it);
+        PodId key = *stale_it;
+        while (pod_it != end || key.empty()) {
+            std::string encoded;
+            {
+                google::protobuf::io::StringOutputStream stream(&encoded);
+                google::protobuf::io::CodedOutputStream output(&stream);
+                for (int32_t n = 0; pod_it != end && n < FLAGS_master_snapshot_pod_run; n++) {
+                    pod_status.Clear();
+                    pod_it->second->ToProto(&pod_status);
+                    output.WriteTag(tag);
+                    output.WriteVarint32(pod_status.ByteSize());
+                    pod_status.SerializeWithCachedSizes(&output);
+                    ++pod_it;
+                }
+            }
+            // a copy, the stream over-allocates
+            (*runs)[key].reset(new std::string(encoded));
+            if (pod_it == end) {
+                break;
+            }
+            key = pod_it->first;
+        }
+    }
+    snapshot->pods.Set(jobid, runs);
+}
+
+void JobManager::MarkPodDirty(Job* job, const PodId& podid) {
+    mutex_.AssertHeld();
+    dirty_pods_[job->id_].insert(podid);
+    MarkJobDirty(job->id_);
+}
+
+void JobManager::MarkJobDirty(const JobId& jobid) {
+    mutex_.AssertHeld();
+    dirty_jobs_.insert(jobid);
+    if (dirty_since_ == 0) {
+        dirty_since_ = common::timer::get_micros();
+    }
+    if (!publish_scheduled_) {
+        publish_scheduled_ = true;
+        executor_.DelayTask(FLAGS_master_query_snapshot_interval,
+                            boost::bind(&JobManager::PublishQuerySnapshot, this));
+    }
+}
+
+void JobManager::MarkAgentDirty(const AgentAddr& endpoint) {
+    mutex_.AssertHeld();
+    dirty_agents_.insert(endpoint);
+    if (dirty_since_ == 0) {
+        dirty_since_ = common::timer::get_micros();
+    }
+    if (!publish_scheduled_) {
+        publish_scheduled_ = true;
+        executor_.DelayTask(FLAGS_master_query_snapshot_interval,
+                            boost::bind(&JobManager::PublishQuerySnapshot, this));
+    }
+}
+
+void JobManager::PublishQuerySnapshot() {
+    MutexLock publish_lock(&publish_mutex_);
+    // the copy shares the chunks of the entry maps with the published
+    // snapshot, only the chunks of dirty entries are copied under mutex_
+    boost::shared_ptr<QuerySnapshot> snapshot(new QuerySnapshot(*GetQuerySnapshot()));
+    snapshot->version++;
+    std::map<std::string, boost::shared_ptr<ChunkedIdSet> > touched_terms;
+    size_t dirty_jobs_num = 0;
+    size_t dirty_agents_num = 0;
+    {
+        MutexLock lock(&mutex_);
+        publish_scheduled_ = false;
+        dirty_jobs_num = dirty_jobs_.size();
+        dirty_agents_num = dirty_agents_.size();
+        std::set<JobId>::iterator job_it = dirty_jobs_.begin();
+        for (; job_it != dirty_jobs_.end(); ++job_it) {
+            std::map<JobId, Job*>::iterator it = jobs_.find(*job_it);
+            boost::shared_ptr<const JobOverview> old_overview;
+            const boost::shared_ptr<const JobOverview>* overview_ptr;
+            overview_ptr = snapshot->overviews.Find(*job_it);
+            if (overview_ptr != NULL) {
+                old_overview = *overview_ptr;
+            }
+            if (it == jobs_.end()) {
+                UpdateJobIndex(*job_it, old_overview.get(), NULL,
+                               snapshot.get(), &touched_terms);
+                snapshot->overviews.Erase(*job_it);
+                snapshot->jobs.Erase(*job_it);
+                snapshot->pods.Erase(*job_it);
+                snapshot->job_versions.Erase(*job_it);
+                continue;
+            }
+            JobOverview* overview = new JobOverview();
+            FillJobOverview(it->second, overview);
+            UpdateJobIndex(*job_it, old_overview.get(), overview,
+                           snapshot.get(), &touched_terms);
+            snapshot->overviews.Set(*job_it, boost::shared_ptr<const JobOverview>(overview));
+            JobInfo* job_info = new JobInfo();
+            FillJobInfo(it->second, job_info);
+            PodMap::iterator reschedule_it = reschedule_pods_.find(*job_it);
+            if (reschedule_it != reschedule_pods_.end()) {
+                std::map<PodId, PodRecord*>::iterator pod_it = reschedule_it->second.begin();
+                for (; pod_it != reschedule_it->second.end(); ++pod_it) {
+                    job_info->add_reschedule_podids(pod_it->first);
+                }
+            }
+            snapshot->jobs.Set(*job_it, boost::shared_ptr<const JobInfo>(job_info));
+            snapshot->job_versions.Set(*job_it, snapshot->version);
+        }
+        // pods are rebuilt by the run, usage alone joins them at a bounded rate
+        int64_t now = common::timer::get_micros();
+        int64_t usage_due = usage_refreshed_ + FLAGS_master_snapshot_usage_interval * 1000L;
+        if (!usage_dirty_jobs_.empty() && now >= usage_due) {
+            dirty_pod_lists_.insert(usage_dirty_jobs_.begin(), usage_dirty_jobs_.end());
+            usage_dirty_jobs_.clear();
+            usage_refreshed_ = now;
+        }
+        std::set<JobId>::iterator list_it = dirty_pod_lists_.begin();
+        for (; list_it != dirty_pod_lists_.end(); ++list_it) {
+            RebuildPodRuns(*list_it, NULL, snapshot.get());
+            if (jobs_.find(*list_it) != jobs_.end()) {
+                snapshot->job_versions.Set(*list_it, snapshot->version);
+            }
+        }
+        std::map<JobId, std::set<PodId> >::iterator pods_it = dirty_pods_.begin();
+        for (; pods_it != dirty_pods_.end(); ++pods_it) {
+            if (dirty_pod_lists_.find(pods_it->first) == dirty_pod_lists_.end()) {
+                RebuildPodRuns(pods_it->first, &pods_it->second, snapshot.get());
+            }
+        }
+        dirty_pod_lists_.clear();
+        dirty_pods_.clear();
+        if (!usage_dirty_jobs_.empty() && !publish_scheduled_) {
+            publish_scheduled_ = true;
+            executor_.DelayTask(std::max(usage_due - now, 0L) / 1000 + 1,
+                                boost::bind(&JobManager::PublishQuerySnapshot, this));
+        }
+        std::set<AgentAddr>::iterator agent_it = dirty_agents_.begin();
+        for (; agent_it != dirty_agents_.end(); ++agent_it) {
+            std::map<AgentAddr, AgentInfo*>::iterator it = agents_.find(*agent_it);
+            if (it == agents_.end()) {
+                snapshot->agents.Erase(*agent_it);
+                snapshot->agent_versions.Erase(*agent_it);
+                continue;
+            }
+            AgentInfo* agent = new AgentInfo();
+            agent->CopyFrom(*it->second);
+            agent->set_pod_num(agent->pods_size());
+            snapshot->agents.Set(*agent_it, boost::shared_ptr<const AgentInfo>(agent));
+            snapshot->agent_versions.Set(*agent_it, snapshot->version);
+        }
+        dirty_jobs_.clear();
+        dirty_agents_.clear();
+        dirty_since_ = 0;
+    }
+    std::map<std::string, boost::shared_ptr<ChunkedIdSet> >::iterator term_it;
+    for (term_it = touched_terms.begin(); term_it != touched_terms.end(); ++term_it) {
+        if (term_it->second->Empty()) {
+            snapshot->job_index.erase(term_it->first);
+        } else {
+            snapshot->job_index[term_it->first] = term_it->second;
+        }
+    }
+    snapshot->publish_time = common::timer::get_micros();
+    {
+        MutexLock lock(&snapshot_mutex_);
+        query_snapshot_ = snapshot;
+    }
+    LOG(DEBUG, "publish query snapshot %ld, %lu jobs and %lu agents changed",
+        snapshot->version, dirty_jobs_num, dirty_agents_num);
+}
+
+int64_t JobManager::QuerySnapshotVersion() {
+    return GetQuerySnapshot()->version;
+}
+
+boost::shared_ptr<const QuerySnapshot> JobManager::GetQuerySnapshot() {
+    MutexLock lock(&snapshot_mutex_);
+    return query_snapshot_;
+}
+
+void JobManager::GetReplicaState(int64_t epoch, int64_t since_version,
+                                 GetReplicaStateResponse* response) {
+    boost::shared_ptr<const QuerySnapshot> snapshot = GetQuerySnapshot();
+    if (epoch != epoch_) {
+        since_version = 0;
+    }
+    response->set_epoch(epoch_);
+    response->set_version(snapshot->version);
+    ChunkedMap<int64_t>::Iterator job_it = snapshot->job_versions.Begin();
+    for (; job_it.Valid(); job_it.Next()) {
+        response->add_jobids(job_it.Key());
+        if (job_it.Value() > since_version) {
+            JobInfo* job_info = response->add_jobs();
+            job_info->CopyFrom(**snapshot->jobs.Find(job_it.Key()));
+            AppendSnapshotPods(*snapshot, job_it.Key(), job_info);
+        }
+    }
+    ChunkedMap<int64_t>::Iterator agent_it = snapshot->agent_versions.Begin();
+    for (; agent_it.Valid(); agent_it.Next()) {
+        response->add_endpoints(agent_it.Key());
+        if (agent_it.Value() > since_version) {
+            response->add_agents()->CopyFrom(**snapshot->agents.Find(agent_it.Key()));
+        }
     }
 }
 
-void JobManager::GetJobsOverview(JobOverviewList* jobs_overview) {
+void JobManager::SetFollower(bool follower) {
     MutexLock lock(&mutex_);
+    follower_ = follower;
+}
+
+void JobManager::ApplyReplicaState(const GetReplicaStateResponse& response) {
+    MutexLock lock(&mutex_);
+    std::set<JobId> jobids(response.jobids().begin(), response.jobids().end());
+    std::vector<JobId> removed_jobs;
     std::map<JobId, Job*>::iterator job_it = jobs_.begin();
     for (; job_it != jobs_.end(); ++job_it) {
-        const JobId& jobid = job_it->first;
-        Job* job = job_it->second;
-        JobOverview* overview = jobs_overview->Add();
-        overview->mutable_desc()->CopyFrom(job->desc_);
-        overview->mutable_desc()->mutable_pod()->Clear();
-        overview->set_jobid(jobid);
-        overview->set_state(job->state_);
-
-        uint32_t running_num = 0;
-        std::map<PodId, PodStatus*>& pods = job->pods_;
-        std::map<PodId, PodStatus*>::iterator pod_it = pods.begin();
-        for (; pod_it != pods.end(); ++pod_it) {
-            // const PodId& podid = pod_it->first;
-            const PodStatus* pod = pod_it->second;
-            if (pod->state() == kPodRunning) {
-                running_num++;
-                MasterUtil::AddResource(pod->resource_used(), overview->mutable_resource_used());
+        if (jobids.find(job_it->first) == jobids.end()) {
+            removed_jobs.push_back(job_it->first);
+        }
+    }
+    for (size_t i = 0; i < removed_jobs.size(); i++) {
+        RemoveJob(removed_jobs[i]);
+    }
+    // changed jobs are reloaded in place, they were neither removed nor
+    // changed by this master, so no watch or event log entry is made
+    for (int i = 0; i < response.jobs_size(); i++) {
+        const JobInfo& job_info = response.jobs(i);
+        std::map<JobId, Job*>::iterator it = jobs_.find(job_info.jobid());
+        if (it == jobs_.end()) {
+            LoadJob(job_info);
+            continue;
+        }
+        Job* job = it->second;
+        ClearJobPods(job);
+        DropDemand(job);
+        job->state_ = job_info.state();
+        job->desc_.CopyFrom(job_info.desc());
+        job->run_pod_desc_.reset();
+        LoadJobPods(job, job_info);
+    }
+
+    std::set<AgentAddr> endpoints(response.endpoints().begin(), response.endpoints().end());
+    std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.begin();
+    while (agent_it != agents_.end()) {
+        if (endpoints.find(agent_it->first) == endpoints.end()) {
+            MarkAgentDirty(agent_it->first);
+            delete agent_it->second;
+            agents_.erase(agent_it++);
+        } else {
+            ++agent_it;
+        }
+    }
+    for (int i = 0; i < response.agents_size(); i++) {
+        const AgentInfo& agent_info = response.agents(i);
+        AgentInfo*& agent = agents_[agent_info.endpoint()];
+        if (agent == NULL) {
+            agent = new AgentInfo();
+        }
+        agent->CopyFrom(agent_info);
+        MarkAgentDirty(agent_info.endpoint());
+    }
+    LOG(INFO, "apply replica state %ld, %d jobs and %d agents changed",
+        response.version(), response.jobs_size(), response.agents_size());
+}
+
+void JobManager::ApplyJobRecord(const JobInfo& job_info) {
+    {
+        MutexLock lock(&mutex_);
+        std::map<JobId, Job*>::iterator it = jobs_.find(job_info.jobid());
+        if (it != jobs_.end()) {
+            Job* job = it->second;
+            job->state_ = job_info.state();
+            DropDemand(job);
+            job->desc_.CopyFrom(job_info.desc());
+            RefreshDemand(job);
+            job->run_pod_desc_.reset();
+            MarkJobDirty(job->id_);
+            return;
+        }
+    }
+    ReloadJobInfo(job_info);
+}
+
+void JobManager::Promote() {
+    std::vector<AgentAddr> alive_agents;
+    {
+        MutexLock lock(&mutex_);
+        follower_ = false;
+        // placed by the former master but not sent to agents yet
+        PodMap::iterator it = deploy_pods_.begin();
+        for (; it != deploy_pods_.end(); ++it) {
+            Job* job = jobs_[it->first];
+            job->deploy_queue_.clear();
+            std::map<PodId, PodRecord*>::iterator jt = it->second.begin();
+            for (; jt != it->second.end(); ++jt) {
+                job->deploy_queue_.push_back(jt->first);
             }
+            deploy_jobs_.insert(it->first);
+        }
+        ScheduleDeploy();
+        if (!reschedule_pods_.empty() && !reschedule_scheduled_) {
+            reschedule_scheduled_ = true;
+            executor_.DelayTask(FLAGS_master_reschedule_interval,
+                                boost::bind(&JobManager::ReleaseReschedulePods, this));
+        }
+        // the replicated state is already reconciled
+        if (safe_mode_) {
+            LeaveSafeMode();
         }
+        std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.begin();
+        for (; agent_it != agents_.end(); ++agent_it) {
+            if (agent_it->second->state() != kDead) {
+                alive_agents.push_back(agent_it->first);
+            }
+        }
+        LOG(INFO, "promote to active master with %lu jobs and %lu agents",
+            jobs_.size(), agents_.size());
+    }
+    // arm death checkers, agents missing the next heartbeats go offline
+    for (size_t i = 0; i < alive_agents.size(); i++) {
+        KeepAlive(alive_agents[i], 0);
     }
 }
 
-Status JobManager::GetJobInfo(const JobId& jobid, JobInfo* job_info) {
+void JobManager::LoadJob(const JobInfo& job_info) {
+    mutex_.AssertHeld();
+    Job* job = new Job();
+    job->state_ = job_info.state();
+    job->desc_.CopyFrom(job_info.desc());
+    job->id_ = job_info.jobid();
+    jobs_[job->id_] = job;
+    LoadJobPods(job, job_info);
+}
+
+// pods the active master holds back for rescheduling stay held back here,
+// so they are released at master_reschedule_rate after a promotion
+void JobManager::LoadJobPods(Job* job, const JobInfo& job_info) {
+    mutex_.AssertHeld();
+    const JobId& jobid = job->id_;
+    std::set<PodId> reschedule_podids(job_info.reschedule_podids().begin(),
+                                      job_info.reschedule_podids().end());
+    int64_t now = common::timer::get_micros();
+    for (int i = 0; i < job_info.pods_size(); i++) {
+        PodRecord* pod = pod_pool_.New(job_info.pods(i));
+        const PodId& podid = pod->podid();
+        job->pods_[podid] = pod;
+        CountPod(job, *pod, 1);
+        switch (pod->state()) {
+        case kPodPending:
+            if (reschedule_podids.find(podid) != reschedule_podids.end()) {
+                reschedule_pods_[jobid][podid] = pod;
+                job->lost_since_[podid] = now;
+            } else {
+                pending_pods_[jobid][podid] = pod;
+            }
+            break;
+        case kPodDeploy:
+            deploy_pods_[jobid][podid] = pod;
+            break;
+        case kPodRunning:
+            running_pods_[pod->endpoint()][jobid][podid] = pod;
+            AddExpectedPod(pod->endpoint(), *pod);
+            break;
+        case kPodSuspend:
+            suspend_pods_[jobid][podid] = pod;
+            break;
+        default:
+            break;
+        }
+    }
+    RefreshDemand(job);
+    dirty_pod_lists_.insert(jobid);
+    MarkJobDirty(jobid);
+}
+
+void JobManager::RemoveJob(const JobId& jobid) {
+    mutex_.AssertHeld();
+    std::map<JobId, Job*>::iterator it = jobs_.find(jobid);
+    if (it == jobs_.end()) {
+        return;
+    }
+    Job* job = it->second;
+    ClearJobPods(job);
+    RecordJobChange(job, kJobTerminated);
+    event_log_.Append(kEventJobRemove, jobid, "", "", -1, -1, 0);
+    DropDemand(job);
+    delete job;
+    jobs_.erase(it);
+    MarkJobDirty(jobid);
+}
+
+// drops the pods of job from every index and their counts, the job stays
+void JobManager::ClearJobPods(Job* job) {
+    mutex_.AssertHeld();
+    const JobId& jobid = job->id_;
+    std::map<PodId, PodRecord*>::iterator pod_it = job->pods_.begin();
+    for (; pod_it != job->pods_.end(); ++pod_it) {
+        PodRecord* pod = pod_it->second;
+        if (pod->state() == kPodRunning) {
+            RemoveExpectedPod(pod->endpoint(), *pod);
+        }
+        std::map<AgentAddr, PodMap>::iterator agent_it = running_pods_.find(pod->endpoint());
+        if (agent_it != running_pods_.end()) {
+            agent_it->second.erase(jobid);
+            if (agent_it->second.size() == 0) {
+                running_pods_.erase(agent_it);
+            }
+        }
+        pod_pool_.Delete(pod);
+    }
+    job->pods_.clear();
+    job->pending_num_ = 0;
+    job->deploy_num_ = 0;
+    job->running_num_ = 0;
+    job->resource_used_.Clear();
+    job->deploy_queue_.clear();
+    job->starting_pods_.clear();
+    job->unconfirmed_pods_.clear();
+    job->update_queue_.clear();
+    job->lost_since_.clear();
+    pending_pods_.erase(jobid);
+    reschedule_pods_.erase(jobid);
+    deploy_pods_.erase(jobid);
+    suspend_pods_.erase(jobid);
+    deploy_jobs_.erase(jobid);
+    dirty_pods_.erase(jobid);
+    usage_dirty_jobs_.erase(jobid);
+    dirty_pod_lists_.insert(jobid);
+}
+
+void JobManager::GetMetrics(MetricList* metrics) {
+    boost::shared_ptr<const QuerySnapshot> snapshot = GetQuerySnapshot();
+    int64_t now = common::timer::get_micros();
+    Metric* metric = metrics->Add();
+    metric->set_name("query_snapshot_version");
+    metric->set_value(snapshot->version);
+    metric = metrics->Add();
+    metric->set_name("query_snapshot_age_ms");
+    metric->set_value((now - snapshot->publish_time) / 1000);
+    MutexLock lock(&mutex_);
+    // how long the oldest unpublished change has been invisible to readers
+    metric = metrics->Add();
+    metric->set_name("query_snapshot_staleness_ms");
+    metric->set_value(dirty_since_ == 0 ? 0 : (now - dirty_since_) / 1000);
+    metric = metrics->Add();
+    metric->set_name("safe_mode");
+    metric->set_value(safe_mode_ ? 1 : 0);
+    metric = metrics->Add();
+    metric->set_name("reconciled_agents");
+    metric->set_value(queried_agents_.size());
+    metric = metrics->Add();
+    metric->set_name("reconcile_inflight");
+    metric->set_value(reconcile_inflight_);
+    metric = metrics->Add();
+    metric->set_name("run_pod_inflight");
+    metric->set_value(run_pod_inflight_);
+    metric = metrics->Add();
+    metric->set_name("deploy_waiting_jobs");
+    metric->set_value(deploy_jobs_.size());
+    int64_t suspect_agents = 0;
+    std::map<AgentAddr, AgentInfo*>::iterator agent_it = agents_.begin();
+    for (; agent_it != agents_.end(); ++agent_it) {
+        if (agent_it->second->state() == kSuspect) {
+            suspect_agents++;
+        }
+    }
+    metric = metrics->Add();
+    metric->set_name("suspect_agents");
+    metric->set_value(suspect_agents);
+    metric = metrics->Add();
+    metric->set_name("pending_demand");
+    metric->set_value(demand_total_);
+    metric = metrics->Add();
+    metric->set_name("throttled_submits");
+    metric->set_value(throttled_submits_);
+    metric = metrics->Add();
+    metric->set_name("time_to_serving_ms");
+    metric->set_value(time_to_serving_);
+    metric = metrics->Add();
+    metric->set_name("recovered_jobs");
+    metric->set_value(recovered_jobs_);
+    metric = metrics->Add();
+    metric->set_name("executor_pending");
+    metric->set_value(executor_.PendingNum());
+    metric = metrics->Add();
+    metric->set_name("executor_steals");
+    metric->set_value(executor_.Steals());
+    metric = metrics->Add();
+    metric->set_name("callback_batches");
+    metric->set_value(callback_batch_.Batches());
+    metric = metrics->Add();
+    metric->set_name("batched_callbacks");
+    metric->set_value(callback_batch_.Tasks());
+    metric = metrics->Add();
+    metric->set_name("event_log_appended");
+    metric->set_value(event_log_.Appended());
+    metric = metrics->Add();
+    metric->set_name("event_log_dropped");
+    metric->set_value(event_log_.Dropped());
+    metric = metrics->Add();
+    metric->set_name("pod_records");
+    metric->set_value(pod_pool_.Size());
+    metric = metrics->Add();
+    metric->set_name("pod_bytes_avg");
+    metric->set_value(pod_pool_.Size() == 0 ? 0 : pod_pool_.Bytes() / pod_pool_.Size());
+    metric = metrics->Add();
+    metric->set_name("watchers");
+    metric->set_value(watch_log_.WatcherNum());
+    metric = metrics->Add();
+    metric->set_name("digest_queries");
+    metric->set_value(digest_queries_);
+    metric = metrics->Add();
+    metric->set_name("digest_lost_pods");
+    metric->set_value(digest_lost_pods_);
+    int64_t reschedule_depth = 0;
+    PodMap::iterator it = reschedule_pods_.begin();
+    for (; it != reschedule_pods_.end(); ++it) {
+        reschedule_depth += it->second.size();
+    }
+    metric = metrics->Add();
+    metric->set_name("reschedule_queue_depth");
+    metric->set_value(reschedule_depth);
+    // from losing a pod to launching it again on another agent
+    metric = metrics->Add();
+    metric->set_name("restored_pods");
+    metric->set_value(restored_pods_);
+    metric = metrics->Add();
+    metric->set_name("restore_time_avg_ms");
+    metric->set_value(restored_pods_ == 0 ? 0 : restore_time_total_ / restored_pods_ / 1000);
+    metric = metrics->Add();
+    metric->set_name("restore_time_last_ms");
+    metric->set_value(restore_time_last_ / 1000);
+}
+
+void JobManager::GetJobRecords(JobInfoList* job_infos) {
+    MutexLock lock(&mutex_);
+    std::map<JobId, Job*>::iterator job_it = jobs_.begin();
+    for (; job_it != jobs_.end(); ++job_it) {
+        Job* job = job_it->second;
+        JobInfo* job_info = job_infos->Add();
+        job_info->set_jobid(job_it->first);
+        job_info->set_state(job->state_);
+        job_info->mutable_desc()->CopyFrom(job->desc_);
+    }
+}
+
+Status JobManager::GetJobRecord(const JobId& jobid, JobInfo* job_info) {
     MutexLock lock(&mutex_);
     std::map<JobId, Job*>::iterator job_it = jobs_.find(jobid);
     if (job_it == jobs_.end()) {
-        LOG(WARNING, "get job info failed, no such job: %s", jobid.c_str());
         return kJobNotFound;
     }
-
     Job* job = job_it->second;
     job_info->set_jobid(jobid);
+    job_info->set_state(job->state_);
     job_info->mutable_desc()->CopyFrom(job->desc_);
-    std::map<PodId, PodStatus*>::iterator pod_it = job->pods_.begin();
-    for (; pod_it != job->pods_.end(); ++pod_it) {
-        PodStatus* pod = pod_it->second;
-        job_info->add_pods()->CopyFrom(*pod);
-    }
     return kOk;
 }
 
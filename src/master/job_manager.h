@@ -6,7 +6,10 @@
 #include <string>
 #include <set>
 #include <map>
+#include <deque>
 #include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
 
 //#include <mutex.h>
 #include <thread_pool.h>
@@ -15,6 +18,14 @@
 #include "proto/master.pb.h"
 #include "proto/galaxy.pb.h"
 #include "rpc/rpc_client.h"
+#include "binary_store.h"
+#include "chunked_id_set.h"
+#include "chunked_map.h"
+#include "pod_digest.h"
+#include "event_log.h"
+#include "executor.h"
+#include "pod_record.h"
+#include "watch_log.h"
 
 namespace baidu {
 namespace galaxy {
@@ -25,70 +36,371 @@ typedef std::string AgentAddr;
 typedef google::protobuf::RepeatedPtrField<baidu::galaxy::JobInfo> JobInfoList;
 typedef google::protobuf::RepeatedPtrField<baidu::galaxy::AgentInfo> AgentInfoList;
 typedef google::protobuf::RepeatedPtrField<baidu::galaxy::JobOverview> JobOverviewList;
+typedef google::protobuf::RepeatedPtrField<baidu::galaxy::ScheduleInfo> ScheduleInfoList;
+typedef google::protobuf::RepeatedField<int> StatusList;
+typedef std::pair<JobId, PodId> PodKey;
+typedef google::protobuf::RepeatedPtrField<baidu::galaxy::Metric> MetricList;
+typedef google::protobuf::RepeatedPtrField<baidu::galaxy::AgentHeartBeat> HeartBeatList;
 
 struct Job {
     JobState state_;
-    std::map<PodId, PodStatus*> pods_;
+    std::map<PodId, PodRecord*> pods_;
     JobDescriptor desc_;
     JobId id_;
+    // kept up to date on every pod transition, so overview never walks pods_
+    int32_t pending_num_;
+    int32_t deploy_num_;
+    int32_t running_num_;
+    Resource resource_used_;
+    Job() : state_(kJobNormal), pending_num_(0), deploy_num_(0), running_num_(0),
+            demand_(0) {}
+    // pod descriptor shared by all in-flight RunPod requests of this job,
+    // released as soon as the last request completes
+    boost::weak_ptr<PodDescriptor> run_pod_desc_;
+    // pods placed by the scheduler and waiting for a deploy slot
+    std::deque<PodId> deploy_queue_;
+    // pods sent to agents and not yet accepted or reported back, at most
+    // deploy_step, with the version each ran before, empty for a new pod
+    std::map<PodId, std::string> starting_pods_;
+    // pods sent to agents and not yet reported running, with the version
+    // sent; their watch event waits for the report
+    std::map<PodId, std::string> unconfirmed_pods_;
+    // running pods to restart in place with a new descriptor version
+    std::deque<PodId> update_queue_;
+    // time each lost pod was rescheduled, until it is launched again
+    std::map<PodId, int64_t> lost_since_;
+    // pending pods plus replicas not materialized yet, accounted to the
+    // user in JobManager::user_demand_
+    int64_t demand_;
+};
+
+// Heartbeat inter-arrival statistics of one agent, over the last
+// master_phi_window intervals
+struct AgentLiveness {
+    // 0 once the agent is declared dead, until it heartbeats again
+    int64_t last_heartbeat;
+    // of the latest heartbeat, relayed ones may arrive late or twice
+    int64_t last_sequence;
+    std::deque<int64_t> intervals;
+    int64_t interval_sum;
+    double interval_square_sum;
+    // alive in agents_ and queried, its heartbeats leave mutex_ alone
+    bool serving;
+    // pod digest of the latest heartbeat
+    uint64_t digest;
+    bool has_digest;
+    AgentLiveness() : last_heartbeat(0), last_sequence(0),
+                      interval_sum(0), interval_square_sum(0),
+                      serving(false), digest(0), has_digest(false) {}
+};
+
+// Pods master expects on an agent, against the digest of the pods it
+// runs sent in its heartbeats
+struct AgentDigest {
+    PodDigest expected;
+    uint64_t reported;
+    bool has_reported;
+    // consecutive checks the two differed
+    int32_t mismatch_checks;
+    AgentDigest() : reported(0), has_reported(false), mismatch_checks(0) {}
+};
+
+// An agent leased to a sharded master by the router, see RenewLeases
+struct AgentLease {
+    int64_t granted;
+    // a query sent after the grant has come back, so the reported resource
+    // covers the pods of the previous holder
+    bool usable;
+    AgentLease() : granted(0), usable(false) {}
+};
+
+// Pods of a job in a query snapshot, as encoded `pods` fields of JobInfo
+// in runs of up to master_snapshot_pod_run pods. Each run is keyed by the
+// lowest pod id it covers, the first by "", so a changed pod rebuilds only
+// its own run.
+typedef std::map<PodId, boost::shared_ptr<const std::string> > PodRuns;
+
+// Immutable copy of job and agent state served to read-only RPCs.
+// Entries and the chunks of the maps holding them are shared between
+// consecutive snapshots, publishing one copies only the chunk maps and
+// rebuilds the jobs and agents changed since the previous one.
+struct QuerySnapshot {
+    int64_t version;
+    int64_t publish_time;
+    ChunkedMap<boost::shared_ptr<const JobOverview> > overviews;
+    // without pods, they are kept apart in `pods`
+    ChunkedMap<boost::shared_ptr<const JobInfo> > jobs;
+    ChunkedMap<boost::shared_ptr<const PodRuns> > pods;
+    ChunkedMap<boost::shared_ptr<const AgentInfo> > agents;
+    // secondary indexes of overviews, ids of the jobs with each term, see
+    // GetJobIndexTerms. Publishing copies only the touched chunks of the
+    // sets of changed terms.
+    std::map<std::string, boost::shared_ptr<const ChunkedIdSet> > job_index;
+    // snapshot version each entry was last rebuilt in
+    ChunkedMap<int64_t> job_versions;
+    ChunkedMap<int64_t> agent_versions;
+    QuerySnapshot() : version(0), publish_time(0) {}
 };
 
 class JobManager {
 public:
+    // Admission control of submissions. Reserves the replicas of the job
+    // against the per-user and global pending pod limits, kThrottled when
+    // they are reached. The reservation is taken over by Add or released
+    // by CancelAdmission.
+    Status Admit(const JobDescriptor& job_desc);
+    void CancelAdmission(const JobDescriptor& job_desc);
     void Add(const JobId& job_id, const JobDescriptor& job_desc);
     Status Suspend(const JobId& jobid);
+    // replaces the descriptor and restarts placed pods in place, paced
+    // like deployment; pods no longer fitting their agent are rescheduled.
+    // Added replicas are admitted like a submission, kThrottled when they
+    // are over the pending pod limits.
+    Status Update(const JobId& jobid, const JobDescriptor& job_desc);
     Status Resume(const JobId& jobid);
-    JobManager();
+    explicit JobManager(BinaryStore* binary_store);
     ~JobManager();
     void GetPendingPods(JobInfoList* pending_pods);
-    Status Propose(const ScheduleInfo& sche_info);
-    void GetAgentsInfo(AgentInfoList* agents_info);
+    // apply a whole batch of schedule infos under one lock, one status per
+    // item is appended to `statuses`, pods that turn to deploy go to `deploy`
+    Status Propose(const ScheduleInfoList& sche_infos,
+                   StatusList* statuses,
+                   std::vector<PodKey>* deploy);
+    // one page of the agents matching request filter, next_page_token is
+    // left empty on the last page
+    void GetAgentsInfo(const ListAgentsRequest& request, AgentInfoList* agents_info,
+                       std::string* next_page_token);
     void GetAliveAgentsInfo(AgentInfoList* agents_info);
-    void GetJobsOverview(JobOverviewList* jobs_overview);
-    Status GetJobInfo(const JobId& jobid, JobInfo* job_info);
-    void KeepAlive(const std::string& agent_addr);
-    void DeployPod();
+    void GetJobsOverview(const ListJobsRequest& request, JobOverviewList* jobs_overview,
+                         std::string* next_page_token);
+    Status GetJobInfo(const JobId& jobid, bool with_pods, JobInfo* job_info);
+    // the part of a job persisted to nexus: id, descriptor and state
+    Status GetJobRecord(const JobId& jobid, JobInfo* job_info);
+    void GetJobRecords(JobInfoList* job_infos);
+    void GetMetrics(MetricList* metrics);
+    void KeepAlive(const std::string& agent_addr, int64_t sequence);
+    // heartbeats of many agents forwarded by a relay
+    void KeepAlive(const HeartBeatList& heartbeats);
+    // Sharded masters place pods only on agents the router leases to them,
+    // each agent to one shard at a time with all of its free resource.
+    // Takes the leases of a lease batch, answers with the agents kept and
+    // the ones wanted for pending pods.
+    void RenewLeases(const BatchHeartBeatRequest& request,
+                     BatchHeartBeatResponse* response);
+    void DeployPod(const std::vector<PodKey>& deploy);
     void ReloadJobInfo(const JobInfo& job_info);
+    void PublishQuerySnapshot();
+    // bumped by every publish of changed jobs or agents
+    int64_t QuerySnapshotVersion();
+    // long-poll for job and pod state transitions, see WatchLog
+    void Watch(const WatchRequest* request, WatchResponse* response,
+               ::google::protobuf::Closure* done);
+
+    // Hot standby. The active master serves its published state to
+    // followers, which apply it without querying agents. On taking the
+    // master lock a follower catches up the job records committed since
+    // and promotes itself, keeping jobs, pods and agents.
+    void GetReplicaState(int64_t epoch, int64_t since_version,
+                         GetReplicaStateResponse* response);
+    void SetFollower(bool follower);
+    void ApplyReplicaState(const GetReplicaStateResponse& response);
+    void ApplyJobRecord(const JobInfo& job_info);
+    void Promote();
+    // the master lock is taken, time to serving counts from here
+    void StartRecovery();
+    // starts the safe mode clock once job records are loaded
+    void EnterSafeMode();
+    // Run with the digest of a binary missing from the store, the jobs
+    // needing it do not deploy until BinaryFetched.
+    void SetBinaryFetcher(const boost::function<void (const std::string&)>& fetcher);
+    void BinaryFetched(const std::string& digest);
 private:
-    void SuspendPod(PodStatus* pod);
-    void ResumePod(PodStatus* pod);
-    Status AcquireResource(const PodStatus& pod, AgentInfo* agent);
-    void ReclaimResource(const PodStatus& pod, AgentInfo* agent);
-    void GetPodRequirement(const PodStatus& pod, Resource* requirement);
+    void SuspendPod(PodRecord* pod);
+    void ResumePod(PodRecord* pod);
+    Status AcquireResource(const PodRecord& pod, AgentInfo* agent);
+    void ReclaimResource(const PodRecord& pod, AgentInfo* agent);
+    void GetPodRequirement(const PodRecord& pod, Resource* requirement);
     void CalculatePodRequirement(const PodDescriptor& pod_desc, Resource* pod_requirement);
     void HandleAgentOffline(const std::string agent_addr);
-    void ReschedulePod(PodStatus* pod_status);
+    // the next heartbeat of the agent takes mutex_ to bring it back alive
+    void StopServing(const AgentAddr& agent_addr);
+    void CheckAgentLiveness();
+    static double Phi(const AgentLiveness& liveness, int64_t now);
+    void ReschedulePod(PodRecord* pod_status);
+    void ReleaseReschedulePods();
+    void CountPod(Job* job, const PodRecord& pod, int delta);
+    void RefreshDemand(Job* job);
+    bool DemandFits(const JobDescriptor& job_desc, int64_t held, int64_t demand);
+    void DropDemand(Job* job);
+    void SetPodState(PodRecord* pod, PodState state);
+    void RecordJobChange(const Job* job, JobState state);
+    void RecordPodChange(const PodRecord& pod, bool removed);
+    void UpdatePodUsage(PodRecord* pod, const PodStatus& report_pod);
+    Status ProposePod(const ScheduleInfo& sche_info);
 
-    void RunPod(const PodDescriptor& desc, PodStatus* pod) ;
-    void RunPodCallback(PodStatus* pod, AgentAddr endpoint, const RunPodRequest* request,
+    // NULL while a binary of the job can not be loaded
+    boost::shared_ptr<PodDescriptor> GetRunPodDescriptor(Job* job);
+    void RequestBinary(const std::string& digest);
+    void RetryDeploy();
+    void ScheduleDeploy();
+    bool DeployNextPod(const JobId& jobid);
+    void RunPod(Job* job, PodRecord* pod, bool update,
+                boost::shared_ptr<PodDescriptor> desc);
+    void KillPod(const AgentAddr& endpoint, const PodId& podid);
+    void KillPodCallback(AgentAddr endpoint, const KillPodRequest* request,
+                         KillPodResponse* response, bool failed, int error);
+    void RunPodCallback(PodRecord* pod, AgentAddr endpoint, bool update,
+                        boost::shared_ptr<PodDescriptor> desc,
+                        const RunPodRequest* request,
                         RunPodResponse* response, bool failed, int error);
 
     void Query();
-    void QueryAgent(AgentInfo* agent);
-    void QueryAgentCallback(AgentAddr endpoint, const QueryRequest* request,
+    void QueryAgent(AgentInfo* agent, bool reconcile);
+    void QueryAgentCallback(AgentAddr endpoint, bool reconcile, int64_t sent,
+                            const QueryRequest* request,
                             QueryResponse* response, bool failed, int error);
+    PodRecord* AdoptPod(const AgentAddr& endpoint, const PodStatus& report_pod);
+    bool DropSparePod(Job* job, const PodId& podid, const AgentAddr& endpoint);
+    // frees the deploy slot of pod, queues it again when its version is stale
+    void ReleaseStartingPod(Job* job, PodRecord* pod);
+    // whether report shows a starting pod set up at the version it was sent,
+    // or any newer one
+    bool StartingPodReported(Job* job, const PodStatus& report);
+    // records the change of an unconfirmed pod once report shows it running
+    // the version it was sent
+    void ConfirmPodRunning(Job* job, PodRecord* pod, const PodStatus& report);
+    void LeaseAgentResource(AgentInfo* agent, int64_t query_sent);
+    bool LeaseUsable(const AgentAddr& endpoint);
+    void ReleaseLease(const AgentAddr& endpoint);
+    void AddExpectedPod(const AgentAddr& endpoint, const PodRecord& pod);
+    void RemoveExpectedPod(const AgentAddr& endpoint, const PodRecord& pod);
+    void CheckAgentDigests();
+    void QueryAgentDigest(const AgentAddr& endpoint);
+    void QueryAgentDigestCallback(AgentAddr endpoint, const QueryRequest* request,
+                                  QueryResponse* response, bool failed, int error);
+    // an async rpc callback run with mutex_ held, batched with others
+    template <class Request, class Response>
+    boost::function<void (const Request*, Response*, bool, int)>
+    Batched(const boost::function<void (const Request*, Response*, bool, int)>& callback) {
+        return boost::bind(&BatchRpcCallback<Request, Response>, &callback_batch_,
+                           callback, _1, _2, _3, _4);
+    }
+    void ReconcileAgent(const AgentAddr& endpoint);
+    void IssueReconcile();
+    void CheckSafeMode();
+    void MaybeLeaveSafeMode();
+    void LeaveSafeMode();
+
+    static void GetJobIndexTerms(const JobOverview& job, std::vector<std::string>* terms);
+    static void GetFilterTerms(const QueryFilter& filter, std::vector<std::string>* terms);
+    static void UpdateJobIndex(const JobId& jobid, const JobOverview* old_job,
+                               const JobOverview* new_job, QuerySnapshot* snapshot,
+                               std::map<std::string, boost::shared_ptr<ChunkedIdSet> >* touched);
+    static bool MatchAgent(const QueryFilter& filter, const AgentInfo& agent);
+    static void CopyAgentInfo(const AgentInfo& agent, const std::set<std::string>& fields,
+                              bool with_pods, AgentInfo* to);
+    void FillJobOverview(const Job* job, JobOverview* overview);
+    void FillJobInfo(const Job* job, JobInfo* job_info);
+    static void AppendSnapshotPods(const QuerySnapshot& snapshot, const JobId& jobid,
+                                   JobInfo* job_info);
+    void RebuildPodRuns(const JobId& jobid, const std::set<PodId>* podids,
+                        QuerySnapshot* snapshot);
+    void MarkJobDirty(const JobId& jobid);
+    // the pod changed in state, placement or version
+    void MarkPodDirty(Job* job, const PodId& podid);
+    void MarkAgentDirty(const AgentAddr& endpoint);
+    boost::shared_ptr<const QuerySnapshot> GetQuerySnapshot();
 
     void ScheduleNextQuery();
+    void LoadJob(const JobInfo& job_info);
+    void LoadJobPods(Job* job, const JobInfo& job_info);
+    void RemoveJob(const JobId& jobid);
+    void ClearJobPods(Job* job);
     void FillPodsToJob(Job* job);
     void FillAllJobs();
 
 private:
     std::map<JobId, Job*> jobs_;
-    typedef std::map<JobId, std::map<PodId, PodStatus*> > PodMap;
+    // every PodRecord of jobs_
+    PodPool pod_pool_;
+    typedef std::map<JobId, std::map<PodId, PodRecord*> > PodMap;
     PodMap suspend_pods_;
     PodMap pending_pods_;
     PodMap deploy_pods_;
+    // lost pods waiting to be released into pending_pods_
+    PodMap reschedule_pods_;
     std::map<AgentAddr, PodMap> running_pods_;
+    // kept in step with running_pods_
+    std::map<AgentAddr, AgentDigest> agent_digests_;
+    std::set<AgentAddr> digest_querying_;
     std::map<AgentAddr, AgentInfo*> agents_;
-    std::map<AgentAddr, int64_t> agent_timer_;
-    ThreadPool death_checker_;
-    ThreadPool thread_pool_;
+    // sharded only, agents leased by the router and the unassigned resource
+    // last reported by the others
+    std::map<AgentAddr, AgentLease> leases_;
+    std::map<AgentAddr, Resource> unleased_free_;
+    int64_t lease_renewed_;
+    // guarded by mutex_timer_, taken under mutex_ but never the other way
+    std::map<AgentAddr, AgentLiveness> agent_liveness_;
     Mutex mutex_;   
     Mutex mutex_timer_;
     RpcClient rpc_client_;
     int64_t on_query_num_;
+    // agents whose pods have been reconciled with jobs_
     std::set<AgentAddr> queried_agents_;
+    // agents waiting for or under their first query
+    std::set<AgentAddr> reconciling_agents_;
+    std::deque<AgentAddr> reconcile_queue_;
+    int32_t reconcile_inflight_;
     bool safe_mode_;
+    int64_t safe_mode_start_;
+    // from taking the master lock to leaving safe mode, -1 until then,
+    // and the jobs recovered by that time
+    int64_t recovery_start_;
+    int64_t time_to_serving_;
+    int64_t recovered_jobs_;
+    bool follower_;
+    // identifies this master instance to followers
+    int64_t epoch_;
+    BinaryStore* binary_store_;
+    boost::function<void (const std::string&)> binary_fetcher_;
+    std::set<std::string> fetching_binaries_;
+    bool deploy_retry_scheduled_;
+    // jobs with a non-empty deploy_queue_
+    std::set<JobId> deploy_jobs_;
+    int32_t run_pod_inflight_;
+    bool reschedule_scheduled_;
+    int64_t restored_pods_;
+    int64_t restore_time_total_;
+    int64_t restore_time_last_;
+    int64_t digest_queries_;
+    int64_t digest_lost_pods_;
+    // pending pod demand of all jobs and of each user, admitted
+    // submissions included
+    std::map<std::string, int64_t> user_demand_;
+    int64_t demand_total_;
+    int64_t throttled_submits_;
+
+    std::set<JobId> dirty_jobs_;
+    std::set<AgentAddr> dirty_agents_;
+    // changed pods by job, only their runs of the snapshot are rebuilt
+    std::map<JobId, std::set<PodId> > dirty_pods_;
+    // jobs whose pods are rebuilt whole
+    std::set<JobId> dirty_pod_lists_;
+    // jobs with pod usage reported since their pods were last rebuilt,
+    // which happens at most every master_snapshot_usage_interval
+    std::set<JobId> usage_dirty_jobs_;
+    int64_t usage_refreshed_;
+    // time of the oldest change not yet published, 0 if none
+    int64_t dirty_since_;
+    bool publish_scheduled_;
+    Mutex publish_mutex_;
+    Mutex snapshot_mutex_;
+    boost::shared_ptr<const QuerySnapshot> query_snapshot_;
+    WatchLog watch_log_;
+    EventLog event_log_;
+    // stopped by the destructor before anything its tasks use is destroyed
+    Executor executor_;
+    TaskBatch callback_batch_;
 };
 
 }
@@ -0,0 +1,263 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "job_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <gflags/gflags.h>
+#include <logging.h>
+#include <timer.h>
+
+DECLARE_string(nexus_root_path);
+DECLARE_string(jobs_store_path);
+DECLARE_string(jobs_log_path);
+DECLARE_int32(master_persist_batch_size);
+DECLARE_int32(master_persist_delay);
+DECLARE_int32(master_persist_threads);
+
+namespace baidu {
+namespace galaxy {
+
+JobStore::JobStore(KvStore* kv_store)
+    : kv_store_(kv_store),
+      flush_scheduled_(false),
+      revision_(0),
+      flusher_(1),
+      writers_(FLAGS_master_persist_threads) {
+}
+
+JobStore::~JobStore() {
+    flusher_.Stop(true);
+    writers_.Stop(true);
+}
+
+std::string JobStore::JobKey(const std::string& jobid) {
+    return FLAGS_nexus_root_path + FLAGS_jobs_store_path + "/" + jobid;
+}
+
+std::string JobStore::LogKey(int64_t revision) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%020ld", revision);
+    return FLAGS_nexus_root_path + FLAGS_jobs_log_path + "/" + buf;
+}
+
+void JobStore::Save(const JobInfo& job_info, const Callback& callback) {
+    std::string job_raw_data;
+    job_info.SerializeToString(&job_raw_data);
+    Enqueue(job_info.jobid(), job_raw_data, false, callback);
+}
+
+void JobStore::Remove(const std::string& jobid, const Callback& callback) {
+    Enqueue(jobid, "", true, callback);
+}
+
+void JobStore::Enqueue(const std::string& jobid, const std::string& value,
+                       bool deleted, const Callback& callback) {
+    MutexLock lock(&mutex_);
+    // a later mutation of the same job overrides the queued one
+    Mutation& mutation = pending_[jobid];
+    mutation.value = value;
+    mutation.deleted = deleted;
+    mutation.ok = false;
+    mutation.callbacks.push_back(callback);
+    if (pending_.size() == static_cast<size_t>(FLAGS_master_persist_batch_size)) {
+        flusher_.AddTask(boost::bind(&JobStore::Flush, this));
+    } else if (!flush_scheduled_) {
+        flusher_.DelayTask(FLAGS_master_persist_delay, boost::bind(&JobStore::Flush, this));
+    }
+    flush_scheduled_ = true;
+}
+
+void JobStore::Flush() {
+    MutationMap batch_mutations;
+    int64_t revision = 0;
+    {
+        MutexLock lock(&mutex_);
+        MutationMap::iterator it = pending_.begin();
+        for (int i = 0; it != pending_.end() && i < FLAGS_master_persist_batch_size; i++) {
+            Mutation& mutation = batch_mutations[it->first];
+            mutation.callbacks.swap(it->second.callbacks);
+            mutation.value.swap(it->second.value);
+            mutation.deleted = it->second.deleted;
+            mutation.ok = false;
+            pending_.erase(it++);
+        }
+        if (pending_.empty()) {
+            flush_scheduled_ = false;
+        } else {
+            flusher_.AddTask(boost::bind(&JobStore::Flush, this));
+        }
+        revision = revision_ + 1;
+    }
+    if (batch_mutations.empty()) {
+        return;
+    }
+
+    int64_t start = common::timer::get_micros();
+    Batch batch;
+    MutationMap::iterator it = batch_mutations.begin();
+    for (; it != batch_mutations.end(); ++it) {
+        batch.items.push_back(std::make_pair(&it->first, &it->second));
+    }
+    size_t writers = FLAGS_master_persist_threads > 0 ? FLAGS_master_persist_threads : 1;
+    size_t step = (batch.items.size() + writers - 1) / writers;
+    {
+        MutexLock lock(&batch.mutex);
+        for (size_t begin = 0; begin < batch.items.size(); begin += step) {
+            size_t end = std::min(begin + step, batch.items.size());
+            batch.running++;
+            writers_.AddTask(boost::bind(&JobStore::Write, this, &batch, begin, end));
+        }
+        while (batch.running > 0) {
+            batch.cond.Wait();
+        }
+    }
+    if (!AppendLog(revision, batch_mutations)) {
+        LOG(WARNING, "append job log %ld fail, replay after it needs a full reload",
+            revision);
+    }
+
+    int failed = 0;
+    for (it = batch_mutations.begin(); it != batch_mutations.end(); ++it) {
+        Mutation& mutation = it->second;
+        if (!mutation.ok) {
+            failed++;
+        }
+        for (size_t i = 0; i < mutation.callbacks.size(); i++) {
+            mutation.callbacks[i](mutation.ok);
+        }
+    }
+    {
+        MutexLock lock(&mutex_);
+        revision_ = revision;
+    }
+    LOG(INFO, "commit %lu job records to nexus at revision %ld, %d failed, cost %ld us",
+        batch_mutations.size(), revision, failed, common::timer::get_micros() - start);
+}
+
+void JobStore::Write(Batch* batch, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        std::string key = JobKey(*batch->items[i].first);
+        Mutation* mutation = batch->items[i].second;
+        if (mutation->deleted) {
+            mutation->ok = kv_store_->Delete(key);
+        } else {
+            mutation->ok = kv_store_->Put(key, mutation->value);
+        }
+    }
+    MutexLock lock(&batch->mutex);
+    if (--batch->running == 0) {
+        batch->cond.Signal();
+    }
+}
+
+bool JobStore::AppendLog(int64_t revision, const MutationMap& mutations) {
+    JobStoreLog log;
+    log.set_revision(revision);
+    MutationMap::const_iterator it = mutations.begin();
+    for (; it != mutations.end(); ++it) {
+        const Mutation& mutation = it->second;
+        if (!mutation.ok) {
+            continue;
+        }
+        if (mutation.deleted) {
+            log.add_removed_jobs(it->first);
+        } else {
+            log.add_jobs(mutation.value);
+            log.add_jobids(it->first);
+        }
+    }
+    std::string log_raw_data;
+    log.SerializeToString(&log_raw_data);
+    return kv_store_->Put(LogKey(revision), log_raw_data);
+}
+
+bool JobStore::ScanLog(int64_t after, KvList* entries) {
+    std::string start_key = LogKey(after + 1);
+    std::string end_key = FLAGS_nexus_root_path + FLAGS_jobs_log_path + "/~";
+    return kv_store_->Scan(start_key, end_key, entries);
+}
+
+bool JobStore::LoadAll(std::map<std::string, std::string>* records) {
+    std::string start_key = FLAGS_nexus_root_path + FLAGS_jobs_store_path + "/";
+    std::string end_key = start_key + "~";
+    KvList jobs;
+    if (!kv_store_->Scan(start_key, end_key, &jobs)) {
+        return false;
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        std::string jobid = jobs[i].first.substr(start_key.size());
+        (*records)[jobid].swap(jobs[i].second);
+    }
+    // continue numbering after the newest log entry
+    KvList entries;
+    if (!ScanLog(0, &entries)) {
+        return false;
+    }
+    if (!entries.empty()) {
+        JobStoreLog log;
+        if (!log.ParseFromString(entries.back().second)) {
+            LOG(WARNING, "fail to parse job log: %s", entries.back().first.c_str());
+            return false;
+        }
+        SetRevision(log.revision());
+    }
+    return true;
+}
+
+bool JobStore::ReplayLog(int64_t revision, std::map<std::string, std::string>* records) {
+    KvList entries;
+    if (!ScanLog(revision, &entries)) {
+        return false;
+    }
+    int64_t expected = revision + 1;
+    for (size_t i = 0; i < entries.size(); i++, expected++) {
+        JobStoreLog log;
+        if (!log.ParseFromString(entries[i].second)) {
+            LOG(WARNING, "fail to parse job log: %s", entries[i].first.c_str());
+            return false;
+        }
+        if (log.revision() != expected) {
+            LOG(WARNING, "job log gap, expect revision %ld, got %ld",
+                expected, log.revision());
+            return false;
+        }
+        for (int j = 0; j < log.jobs_size() && j < log.jobids_size(); j++) {
+            (*records)[log.jobids(j)] = log.jobs(j);
+        }
+        for (int j = 0; j < log.removed_jobs_size(); j++) {
+            records->erase(log.removed_jobs(j));
+        }
+    }
+    SetRevision(expected - 1);
+    LOG(INFO, "replay %lu job log entries after revision %ld", entries.size(), revision);
+    return true;
+}
+
+void JobStore::TrimLog(int64_t revision) {
+    KvList entries;
+    std::string start_key = FLAGS_nexus_root_path + FLAGS_jobs_log_path + "/";
+    if (!kv_store_->Scan(start_key, LogKey(revision), &entries)) {
+        return;
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        kv_store_->Delete(entries[i].first);
+    }
+    LOG(INFO, "trim %lu job log entries before revision %ld", entries.size(), revision);
+}
+
+int64_t JobStore::AppliedRevision() {
+    MutexLock lock(&mutex_);
+    return revision_;
+}
+
+void JobStore::SetRevision(int64_t revision) {
+    MutexLock lock(&mutex_);
+    revision_ = revision;
+}
+
+}
+}
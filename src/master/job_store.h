@@ -0,0 +1,85 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_JOB_STORE_H
+#define BAIDU_GALAXY_JOB_STORE_H
+#include <string>
+#include <map>
+#include <vector>
+#include <boost/function.hpp>
+
+#include <mutex.h>
+#include <thread_pool.h>
+
+#include "proto/master.pb.h"
+#include "kv_store.h"
+
+namespace baidu {
+namespace galaxy {
+
+// Group-commit pipeline of job records to nexus.
+// Mutations are queued and coalesced per job, a batch is flushed when it
+// reaches --master_persist_batch_size or --master_persist_delay ms after
+// its first mutation, and its writes are spread over
+// --master_persist_threads writers. Callbacks run once the whole batch
+// is committed, batches commit one after another.
+//
+// Every committed batch is also appended to the job log under
+// --jobs_log_path with the next revision, so a master holding a local
+// snapshot of revision R only has to replay the log after R.
+class JobStore {
+public:
+    typedef boost::function<void (bool ok)> Callback;
+    explicit JobStore(KvStore* kv_store);
+    ~JobStore();
+    void Save(const JobInfo& job_info, const Callback& callback);
+    void Remove(const std::string& jobid, const Callback& callback);
+
+    // serialized records of all jobs, keyed by job id
+    bool LoadAll(std::map<std::string, std::string>* records);
+    // apply log entries after `revision` on `records`, fails if the log
+    // has already been trimmed past `revision`
+    bool ReplayLog(int64_t revision, std::map<std::string, std::string>* records);
+    // drop log entries older than `revision`, the newest entry is kept
+    void TrimLog(int64_t revision);
+    // every batch up to the returned revision is committed and its
+    // callbacks have run
+    int64_t AppliedRevision();
+    void SetRevision(int64_t revision);
+    static std::string JobKey(const std::string& jobid);
+private:
+    struct Mutation {
+        std::string value;
+        bool deleted;
+        std::vector<Callback> callbacks;
+        bool ok;
+    };
+    typedef std::map<std::string, Mutation> MutationMap;
+    struct Batch {
+        std::vector<std::pair<const std::string*, Mutation*> > items;
+        int running;
+        Mutex mutex;
+        CondVar cond;
+        Batch() : running(0), cond(&mutex) {}
+    };
+    void Enqueue(const std::string& jobid, const std::string& value,
+                 bool deleted, const Callback& callback);
+    void Flush();
+    void Write(Batch* batch, size_t begin, size_t end);
+    bool AppendLog(int64_t revision, const MutationMap& mutations);
+    bool ScanLog(int64_t after, KvList* entries);
+    static std::string LogKey(int64_t revision);
+private:
+    KvStore* kv_store_;
+    Mutex mutex_;
+    MutationMap pending_;
+    bool flush_scheduled_;
+    int64_t revision_;
+    ThreadPool flusher_;
+    ThreadPool writers_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,479 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "kv_store.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <gflags/gflags.h>
+#include <logging.h>
+#include <timer.h>
+
+#include "master_util.h"
+
+DECLARE_int32(mem_nexus_session_timeout);
+
+namespace baidu {
+namespace galaxy {
+
+KvStore* KvStore::Open(const std::string& servers) {
+    const std::string mem_prefix = "mem://";
+    if (servers.compare(0, mem_prefix.size(), mem_prefix) == 0) {
+        return new RemoteKvStore(servers.substr(mem_prefix.size()));
+    }
+    return new InsKvStore(servers);
+}
+
+InsKvStore::InsKvStore(const std::string& servers)
+    : nexus_(new ::galaxy::ins::sdk::InsSDK(servers)) {
+}
+
+InsKvStore::~InsKvStore() {
+    delete nexus_;
+}
+
+bool InsKvStore::Put(const std::string& key, const std::string& value) {
+    ::galaxy::ins::sdk::SDKError err;
+    bool ok = nexus_->Put(key, value, &err);
+    if (!ok) {
+        LOG(WARNING, "put %s to nexus fail, reason: %s", key.c_str(),
+            ::galaxy::ins::sdk::InsSDK::StatusToString(err).c_str());
+    }
+    return ok;
+}
+
+bool InsKvStore::Get(const std::string& key, std::string* value) {
+    ::galaxy::ins::sdk::SDKError err;
+    bool ok = nexus_->Get(key, value, &err);
+    if (!ok && err != ::galaxy::ins::sdk::kNoSuchKey) {
+        LOG(WARNING, "get %s from nexus fail, reason: %s", key.c_str(),
+            ::galaxy::ins::sdk::InsSDK::StatusToString(err).c_str());
+    }
+    return ok;
+}
+
+bool InsKvStore::Delete(const std::string& key) {
+    ::galaxy::ins::sdk::SDKError err;
+    bool ok = nexus_->Delete(key, &err);
+    if (!ok) {
+        LOG(WARNING, "delete %s from nexus fail, reason: %s", key.c_str(),
+            ::galaxy::ins::sdk::InsSDK::StatusToString(err).c_str());
+    }
+    return ok;
+}
+
+bool InsKvStore::Scan(const std::string& start_key, const std::string& end_key,
+                      KvList* result) {
+    ::galaxy::ins::sdk::ScanResult* scan = nexus_->Scan(start_key, end_key);
+    bool ok = true;
+    while (!scan->Done()) {
+        if (scan->Error() != ::galaxy::ins::sdk::kOK) {
+            LOG(WARNING, "scan [%s, %s) on nexus fail, reason: %s",
+                start_key.c_str(), end_key.c_str(),
+                ::galaxy::ins::sdk::InsSDK::StatusToString(scan->Error()).c_str());
+            ok = false;
+            break;
+        }
+        result->push_back(std::make_pair(scan->Key(), scan->Value()));
+        scan->Next();
+    }
+    delete scan;
+    return ok;
+}
+
+bool InsKvStore::Lock(const std::string& key) {
+    ::galaxy::ins::sdk::SDKError err;
+    bool ok = nexus_->Lock(key, &err);
+    if (!ok || err != ::galaxy::ins::sdk::kOK) {
+        LOG(WARNING, "lock %s on nexus fail, reason: %s", key.c_str(),
+            ::galaxy::ins::sdk::InsSDK::StatusToString(err).c_str());
+        return false;
+    }
+    return true;
+}
+
+void InsKvStore::OnWatch(const ::galaxy::ins::sdk::WatchParam& param,
+                         ::galaxy::ins::sdk::SDKError /*error*/) {
+    KvWatchCallback* callback = static_cast<KvWatchCallback*>(param.context);
+    (*callback)(param.key, param.value, param.deleted);
+    delete callback;
+}
+
+bool InsKvStore::Watch(const std::string& key, const KvWatchCallback& callback) {
+    ::galaxy::ins::sdk::SDKError err;
+    KvWatchCallback* context = new KvWatchCallback(callback);
+    bool ok = nexus_->Watch(key, &InsKvStore::OnWatch, context, &err);
+    if (!ok) {
+        LOG(WARNING, "watch %s on nexus fail, reason: %s", key.c_str(),
+            ::galaxy::ins::sdk::InsSDK::StatusToString(err).c_str());
+        delete context;
+    }
+    return ok;
+}
+
+std::string InsKvStore::SessionId() {
+    return nexus_->GetSessionID();
+}
+
+void InsKvStore::OnSessionTimeout(void* context) {
+    InsKvStore* store = static_cast<InsKvStore*>(context);
+    if (store->timeout_callback_) {
+        store->timeout_callback_();
+    }
+}
+
+void InsKvStore::SetSessionTimeoutCallback(const boost::function<void ()>& callback) {
+    timeout_callback_ = callback;
+    nexus_->RegisterSessionTimeout(&InsKvStore::OnSessionTimeout, this);
+}
+
+struct MemKvData {
+    Mutex mutex;
+    CondVar lock_released;
+    std::map<std::string, std::string> kv;
+    // lock key -> session holding it
+    std::map<std::string, std::string> locks;
+    std::multimap<std::string, KvWatchCallback> watches;
+    int64_t sessions;
+    MemKvData() : lock_released(&mutex), sessions(0) {}
+};
+
+MemKvStore::MemKvStore() : data_(new MemKvData()), expired_(false) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "mem-%ld", ++data_->sessions);
+    session_id_ = buf;
+}
+
+MemKvStore::MemKvStore(MemKvStore* peer, const std::string& session_id)
+    : data_(peer->data_), session_id_(session_id), expired_(false) {
+}
+
+MemKvStore::~MemKvStore() {
+    std::vector<std::pair<KvWatchCallback, std::string> > fired;
+    {
+        MutexLock lock(&data_->mutex);
+        ReleaseLocks(&fired);
+    }
+    for (size_t i = 0; i < fired.size(); i++) {
+        fired[i].first(fired[i].second, "", true);
+    }
+}
+
+// the watches of key are taken out, they fire once
+void MemKvStore::Fire(const std::string& key,
+                      std::vector<std::pair<KvWatchCallback, std::string> >* fired) {
+    data_->mutex.AssertHeld();
+    std::multimap<std::string, KvWatchCallback>::iterator it = data_->watches.lower_bound(key);
+    while (it != data_->watches.end() && it->first == key) {
+        fired->push_back(std::make_pair(it->second, key));
+        data_->watches.erase(it++);
+    }
+}
+
+void MemKvStore::ReleaseLocks(std::vector<std::pair<KvWatchCallback, std::string> >* fired) {
+    data_->mutex.AssertHeld();
+    std::map<std::string, std::string>::iterator it = data_->locks.begin();
+    while (it != data_->locks.end()) {
+        if (it->second != session_id_) {
+            ++it;
+            continue;
+        }
+        data_->kv.erase(it->first);
+        Fire(it->first, fired);
+        data_->locks.erase(it++);
+    }
+    data_->lock_released.Broadcast();
+}
+
+bool MemKvStore::Put(const std::string& key, const std::string& value) {
+    std::vector<std::pair<KvWatchCallback, std::string> > fired;
+    {
+        MutexLock lock(&data_->mutex);
+        data_->kv[key] = value;
+        Fire(key, &fired);
+    }
+    for (size_t i = 0; i < fired.size(); i++) {
+        fired[i].first(key, value, false);
+    }
+    return true;
+}
+
+bool MemKvStore::Get(const std::string& key, std::string* value) {
+    MutexLock lock(&data_->mutex);
+    std::map<std::string, std::string>::iterator it = data_->kv.find(key);
+    if (it == data_->kv.end()) {
+        return false;
+    }
+    *value = it->second;
+    return true;
+}
+
+bool MemKvStore::Delete(const std::string& key) {
+    std::vector<std::pair<KvWatchCallback, std::string> > fired;
+    {
+        MutexLock lock(&data_->mutex);
+        if (data_->kv.erase(key) > 0) {
+            Fire(key, &fired);
+        }
+    }
+    for (size_t i = 0; i < fired.size(); i++) {
+        fired[i].first(key, "", true);
+    }
+    return true;
+}
+
+bool MemKvStore::Scan(const std::string& start_key, const std::string& end_key,
+                      KvList* result) {
+    MutexLock lock(&data_->mutex);
+    std::map<std::string, std::string>::iterator it = data_->kv.lower_bound(start_key);
+    for (; it != data_->kv.end() && it->first < end_key; ++it) {
+        result->push_back(*it);
+    }
+    return true;
+}
+
+bool MemKvStore::TryLock(const std::string& key) {
+    std::vector<std::pair<KvWatchCallback, std::string> > fired;
+    {
+        MutexLock lock(&data_->mutex);
+        if (expired_) {
+            return false;
+        }
+        std::map<std::string, std::string>::iterator it = data_->locks.find(key);
+        if (it != data_->locks.end()) {
+            return it->second == session_id_;
+        }
+        data_->locks[key] = session_id_;
+        data_->kv[key] = session_id_;
+        Fire(key, &fired);
+    }
+    for (size_t i = 0; i < fired.size(); i++) {
+        fired[i].first(key, session_id_, false);
+    }
+    return true;
+}
+
+bool MemKvStore::Lock(const std::string& key) {
+    while (!TryLock(key)) {
+        MutexLock lock(&data_->mutex);
+        if (expired_) {
+            return false;
+        }
+        std::map<std::string, std::string>::iterator it = data_->locks.find(key);
+        if (it != data_->locks.end() && it->second != session_id_) {
+            data_->lock_released.Wait();
+        }
+    }
+    return true;
+}
+
+bool MemKvStore::Watch(const std::string& key, const KvWatchCallback& callback) {
+    MutexLock lock(&data_->mutex);
+    data_->watches.insert(std::make_pair(key, callback));
+    return true;
+}
+
+std::string MemKvStore::SessionId() {
+    return session_id_;
+}
+
+void MemKvStore::SetSessionTimeoutCallback(const boost::function<void ()>& callback) {
+    MutexLock lock(&data_->mutex);
+    timeout_callback_ = callback;
+}
+
+void MemKvStore::ExpireSession() {
+    std::vector<std::pair<KvWatchCallback, std::string> > fired;
+    boost::function<void ()> timeout_callback;
+    {
+        MutexLock lock(&data_->mutex);
+        if (expired_) {
+            return;
+        }
+        expired_ = true;
+        ReleaseLocks(&fired);
+        timeout_callback = timeout_callback_;
+    }
+    for (size_t i = 0; i < fired.size(); i++) {
+        fired[i].first(fired[i].second, "", true);
+    }
+    if (timeout_callback) {
+        timeout_callback();
+    }
+}
+
+size_t MemKvStore::Size() {
+    MutexLock lock(&data_->mutex);
+    return data_->kv.size();
+}
+
+RemoteKvStore::RemoteKvStore(const std::string& server)
+    : server_(server), last_keepalive_(common::timer::get_micros()),
+      keepalive_thread_(1) {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%s-%d-%ld", MasterUtil::SelfEndpoint("").c_str(),
+             getpid(), last_keepalive_);
+    session_id_ = buf;
+    keepalive_thread_.AddTask(boost::bind(&RemoteKvStore::KeepAlive, this));
+}
+
+RemoteKvStore::~RemoteKvStore() {
+    keepalive_thread_.Stop(false);
+}
+
+bool RemoteKvStore::Call(void (MemNexus_Stub::*method)(::google::protobuf::RpcController*,
+                                                       const MemNexusRequest*,
+                                                       MemNexusResponse*,
+                                                       ::google::protobuf::Closure*),
+                         MemNexusRequest* request, MemNexusResponse* response,
+                         int32_t timeout) {
+    request->set_session(session_id_);
+    MemNexus_Stub* stub = NULL;
+    rpc_client_.GetStub(server_, &stub);
+    boost::scoped_ptr<MemNexus_Stub> stub_ptr(stub);
+    return rpc_client_.SendRequest(stub, method, request, response, timeout, 1)
+           && response->ok();
+}
+
+bool RemoteKvStore::Put(const std::string& key, const std::string& value) {
+    MemNexusRequest request;
+    MemNexusResponse response;
+    request.set_key(key);
+    request.set_value(value);
+    return Call(&MemNexus_Stub::Put, &request, &response, 5);
+}
+
+bool RemoteKvStore::Get(const std::string& key, std::string* value) {
+    MemNexusRequest request;
+    MemNexusResponse response;
+    request.set_key(key);
+    if (!Call(&MemNexus_Stub::Get, &request, &response, 5) || !response.exists()) {
+        return false;
+    }
+    *value = response.value();
+    return true;
+}
+
+bool RemoteKvStore::Delete(const std::string& key) {
+    MemNexusRequest request;
+    MemNexusResponse response;
+    request.set_key(key);
+    return Call(&MemNexus_Stub::Delete, &request, &response, 5);
+}
+
+bool RemoteKvStore::Scan(const std::string& start_key, const std::string& end_key,
+                         KvList* result) {
+    MemNexusRequest request;
+    MemNexusResponse response;
+    request.set_key(start_key);
+    request.set_end_key(end_key);
+    if (!Call(&MemNexus_Stub::Scan, &request, &response, 60)) {
+        return false;
+    }
+    for (int i = 0; i < response.pairs_size(); i++) {
+        result->push_back(std::make_pair(response.pairs(i).key(), response.pairs(i).value()));
+    }
+    return true;
+}
+
+// the server gives up after a few seconds, so a lost session is noticed
+bool RemoteKvStore::Lock(const std::string& key) {
+    while (true) {
+        MemNexusRequest request;
+        MemNexusResponse response;
+        request.set_key(key);
+        if (Call(&MemNexus_Stub::Lock, &request, &response, 10)) {
+            return true;
+        }
+        MutexLock lock(&mutex_);
+        if (last_keepalive_ == 0) {
+            return false;
+        }
+    }
+}
+
+// a long poll, sent again until the key changes
+void RemoteKvStore::SendWatch(const std::string& key, bool exists, const std::string& value,
+                              const KvWatchCallback& callback) {
+    MemNexusRequest* request = new MemNexusRequest;
+    MemNexusResponse* response = new MemNexusResponse;
+    request->set_session(session_id_);
+    request->set_key(key);
+    request->set_exists(exists);
+    request->set_value(value);
+    MemNexus_Stub* stub = NULL;
+    rpc_client_.GetStub(server_, &stub);
+    boost::function<void (const MemNexusRequest*, MemNexusResponse*, bool, int)> watch_callback;
+    watch_callback = boost::bind(&RemoteKvStore::WatchCallback, this, callback,
+                                 _1, _2, _3, _4);
+    rpc_client_.AsyncRequest(stub, &MemNexus_Stub::Watch, request, response,
+                             watch_callback, 60, 0);
+    delete stub;
+}
+
+void RemoteKvStore::WatchCallback(KvWatchCallback callback, const MemNexusRequest* request,
+                                  MemNexusResponse* response, bool failed, int /*error*/) {
+    boost::scoped_ptr<const MemNexusRequest> request_ptr(request);
+    boost::scoped_ptr<MemNexusResponse> response_ptr(response);
+    if (failed || !response->ok()) {
+        if (failed) {
+            sleep(1);
+        }
+        SendWatch(request->key(), request->exists(), request->value(), callback);
+        return;
+    }
+    callback(request->key(), response->value(), !response->exists());
+}
+
+bool RemoteKvStore::Watch(const std::string& key, const KvWatchCallback& callback) {
+    MemNexusRequest request;
+    MemNexusResponse response;
+    request.set_key(key);
+    if (!Call(&MemNexus_Stub::Get, &request, &response, 5)) {
+        return false;
+    }
+    SendWatch(key, response.exists(), response.value(), callback);
+    return true;
+}
+
+std::string RemoteKvStore::SessionId() {
+    return session_id_;
+}
+
+void RemoteKvStore::SetSessionTimeoutCallback(const boost::function<void ()>& callback) {
+    MutexLock lock(&mutex_);
+    timeout_callback_ = callback;
+}
+
+void RemoteKvStore::KeepAlive() {
+    MemNexusRequest request;
+    MemNexusResponse response;
+    bool ok = Call(&MemNexus_Stub::KeepAlive, &request, &response, 1);
+    boost::function<void ()> timeout_callback;
+    {
+        MutexLock lock(&mutex_);
+        int64_t now = common::timer::get_micros();
+        if (last_keepalive_ == 0) {
+            return;
+        }
+        if (ok) {
+            last_keepalive_ = now;
+        } else if (now - last_keepalive_ > FLAGS_mem_nexus_session_timeout * 1000L) {
+            LOG(WARNING, "session %s with mem nexus %s lost",
+                session_id_.c_str(), server_.c_str());
+            last_keepalive_ = 0;
+            timeout_callback = timeout_callback_;
+        }
+    }
+    if (timeout_callback) {
+        timeout_callback();
+        return;
+    }
+    keepalive_thread_.DelayTask(FLAGS_mem_nexus_session_timeout / 4,
+                                boost::bind(&RemoteKvStore::KeepAlive, this));
+}
+
+}
+}
@@ -0,0 +1,149 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_KV_STORE_H
+#define BAIDU_GALAXY_KV_STORE_H
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <mutex.h>
+#include <thread_pool.h>
+#include "ins_sdk.h"
+#include "proto/mem_nexus.pb.h"
+#include "rpc/rpc_client.h"
+
+namespace baidu {
+namespace galaxy {
+
+// The part of nexus master and router use: key-value pairs, locks held by
+// the session of a client and watches. Backed by InsSDK in production, by
+// MemKvStore in tests and by RemoteKvStore against the mem_nexus stand-in
+// when several processes are tested together.
+typedef std::vector<std::pair<std::string, std::string> > KvList;
+// key, its new value and whether it was deleted
+typedef boost::function<void (const std::string&, const std::string&, bool)> KvWatchCallback;
+
+class KvStore {
+public:
+    virtual ~KvStore() {}
+    virtual bool Put(const std::string& key, const std::string& value) = 0;
+    virtual bool Get(const std::string& key, std::string* value) = 0;
+    virtual bool Delete(const std::string& key) = 0;
+    // all pairs with start_key <= key < end_key in key order
+    virtual bool Scan(const std::string& start_key, const std::string& end_key,
+                      KvList* result) = 0;
+    // blocks until the lock is held by this session, the value of key is
+    // then the session id
+    virtual bool Lock(const std::string& key) = 0;
+    // callback is run once, on the next change of key
+    virtual bool Watch(const std::string& key, const KvWatchCallback& callback) = 0;
+    virtual std::string SessionId() = 0;
+    // callback is run when the session is lost, its locks with it
+    virtual void SetSessionTimeoutCallback(const boost::function<void ()>& callback) = 0;
+    // "mem://<host:port>" for a mem_nexus, nexus servers otherwise
+    static KvStore* Open(const std::string& servers);
+};
+
+class InsKvStore : public KvStore {
+public:
+    explicit InsKvStore(const std::string& servers);
+    virtual ~InsKvStore();
+    virtual bool Put(const std::string& key, const std::string& value);
+    virtual bool Get(const std::string& key, std::string* value);
+    virtual bool Delete(const std::string& key);
+    virtual bool Scan(const std::string& start_key, const std::string& end_key,
+                      KvList* result);
+    virtual bool Lock(const std::string& key);
+    virtual bool Watch(const std::string& key, const KvWatchCallback& callback);
+    virtual std::string SessionId();
+    virtual void SetSessionTimeoutCallback(const boost::function<void ()>& callback);
+private:
+    static void OnWatch(const ::galaxy::ins::sdk::WatchParam& param,
+                        ::galaxy::ins::sdk::SDKError error);
+    static void OnSessionTimeout(void* context);
+
+    ::galaxy::ins::sdk::InsSDK* nexus_;
+    boost::function<void ()> timeout_callback_;
+};
+
+struct MemKvData;
+
+// In-memory stand-in for nexus. Stores made from the same one share their
+// data, each as a session of its own.
+class MemKvStore : public KvStore {
+public:
+    MemKvStore();
+    // a new session on the data of peer
+    MemKvStore(MemKvStore* peer, const std::string& session_id);
+    // the session ends, its locks are released
+    virtual ~MemKvStore();
+    virtual bool Put(const std::string& key, const std::string& value);
+    virtual bool Get(const std::string& key, std::string* value);
+    virtual bool Delete(const std::string& key);
+    virtual bool Scan(const std::string& start_key, const std::string& end_key,
+                      KvList* result);
+    virtual bool Lock(const std::string& key);
+    virtual bool Watch(const std::string& key, const KvWatchCallback& callback);
+    virtual std::string SessionId();
+    virtual void SetSessionTimeoutCallback(const boost::function<void ()>& callback);
+    bool TryLock(const std::string& key);
+    // as nexus does to a silent client: releases the locks of the session,
+    // fails its later Lock calls and runs its timeout callback
+    void ExpireSession();
+    size_t Size();
+private:
+    // with data_->mutex held, the callbacks are to be run without it
+    void ReleaseLocks(std::vector<std::pair<KvWatchCallback, std::string> >* fired);
+    void Fire(const std::string& key,
+              std::vector<std::pair<KvWatchCallback, std::string> >* fired);
+
+    boost::shared_ptr<MemKvData> data_;
+    std::string session_id_;
+    bool expired_;
+    boost::function<void ()> timeout_callback_;
+};
+
+// Client of a mem_nexus process, see src/test/mem_nexus.cc. Its session is
+// kept by a heartbeat, once heartbeats fail for the session timeout of the
+// server the session is taken for lost.
+class RemoteKvStore : public KvStore {
+public:
+    explicit RemoteKvStore(const std::string& server);
+    virtual ~RemoteKvStore();
+    virtual bool Put(const std::string& key, const std::string& value);
+    virtual bool Get(const std::string& key, std::string* value);
+    virtual bool Delete(const std::string& key);
+    virtual bool Scan(const std::string& start_key, const std::string& end_key,
+                      KvList* result);
+    virtual bool Lock(const std::string& key);
+    virtual bool Watch(const std::string& key, const KvWatchCallback& callback);
+    virtual std::string SessionId();
+    virtual void SetSessionTimeoutCallback(const boost::function<void ()>& callback);
+private:
+    bool Call(void (MemNexus_Stub::*method)(::google::protobuf::RpcController*,
+                                            const MemNexusRequest*, MemNexusResponse*,
+                                            ::google::protobuf::Closure*),
+              MemNexusRequest* request, MemNexusResponse* response, int32_t timeout);
+    void SendWatch(const std::string& key, bool exists, const std::string& value,
+                   const KvWatchCallback& callback);
+    void WatchCallback(KvWatchCallback callback, const MemNexusRequest* request,
+                       MemNexusResponse* response, bool failed, int error);
+    void KeepAlive();
+
+    std::string server_;
+    std::string session_id_;
+    RpcClient rpc_client_;
+    Mutex mutex_;
+    boost::function<void ()> timeout_callback_;
+    int64_t last_keepalive_;
+    ThreadPool keepalive_thread_;
+};
+
+}
+}
+
+#endif
@@ -2,44 +2,86 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 #include "master_impl.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <boost/bind.hpp>
 #include <gflags/gflags.h>
+#include <snappy.h>
 #include "master_util.h"
 #include <logging.h>
+#include <timer.h>
 
 DECLARE_string(nexus_servers);
 DECLARE_string(nexus_root_path);
 DECLARE_string(master_lock_path);
 DECLARE_string(master_path);
 DECLARE_string(jobs_store_path);
+DECLARE_string(master_binary_store_path);
+DECLARE_string(master_snapshot_path);
+DECLARE_int32(master_snapshot_interval);
+DECLARE_bool(master_follower);
+DECLARE_string(master_follow_addr);
+DECLARE_int32(master_replica_interval);
+DECLARE_int32(master_shard_id);
+DECLARE_int32(master_liveness_threads);
+DECLARE_int32(master_scheduling_threads);
+DECLARE_int32(master_query_threads);
+DECLARE_int32(master_liveness_queue_limit);
+DECLARE_int32(master_scheduling_queue_limit);
+DECLARE_int32(master_query_queue_limit);
+DECLARE_int32(master_response_cache_size);
+DECLARE_int32(master_throttle_retry_after);
 
 namespace baidu {
 namespace galaxy {
 
-MasterImpl::MasterImpl() : nexus_(NULL) {
-    nexus_ = new InsSDK(FLAGS_nexus_servers);
-}
-
-MasterImpl::~MasterImpl() {
-    delete nexus_;
-}
+static const int32_t kLoadAllJobsRetry = 3;
 
-static void OnMasterLockChange(const ::galaxy::ins::sdk::WatchParam& param, 
-                               ::galaxy::ins::sdk::SDKError error) {
-    MasterImpl* master = static_cast<MasterImpl*>(param.context);
-    master->OnLockChange(param.value);
+MasterImpl::MasterImpl()
+    : binary_store_(FLAGS_master_binary_store_path),
+      job_manager_(&binary_store_),
+      kv_store_(NULL),
+      job_store_(NULL),
+      background_pool_(1),
+      following_(false),
+      replica_epoch_(0),
+      replica_version_(0),
+      replica_revision_(0),
+      response_cache_(FLAGS_master_response_cache_size) {
+    kv_store_ = KvStore::Open(FLAGS_nexus_servers);
+    job_store_ = new JobStore(kv_store_);
+    job_manager_.SetBinaryFetcher(boost::bind(&MasterImpl::FetchBinary, this, _1));
+    lanes_[kLivenessLane].name = "liveness";
+    lanes_[kLivenessLane].pool = new ThreadPool(FLAGS_master_liveness_threads);
+    lanes_[kLivenessLane].queue_limit = FLAGS_master_liveness_queue_limit;
+    lanes_[kSchedulingLane].name = "scheduling";
+    lanes_[kSchedulingLane].pool = new ThreadPool(FLAGS_master_scheduling_threads);
+    lanes_[kSchedulingLane].queue_limit = FLAGS_master_scheduling_queue_limit;
+    lanes_[kQueryLane].name = "query";
+    lanes_[kQueryLane].pool = new ThreadPool(FLAGS_master_query_threads);
+    lanes_[kQueryLane].queue_limit = FLAGS_master_query_queue_limit;
 }
 
-static void OnMasterSessionTimeout(void* ctx) {
-    MasterImpl* master = static_cast<MasterImpl*>(ctx);
-    master->OnSessionTimeout();
+MasterImpl::~MasterImpl() {
+    for (int i = 0; i < kLaneNum; i++) {
+        lanes_[i].pool->Stop(true);
+        delete lanes_[i].pool;
+    }
+    background_pool_.Stop(true);
+    delete job_store_;
+    delete kv_store_;
 }
 
-void MasterImpl::OnLockChange(std::string lock_session_id) {
-    std::string self_session_id = nexus_->GetSessionID();
+void MasterImpl::OnLockChange(const std::string& lock_key,
+                              const std::string& lock_session_id,
+                              bool /*deleted*/) {
+    std::string self_session_id = kv_store_->SessionId();
     if (self_session_id != lock_session_id) {
         LOG(FATAL, "master lost lock , die.");
         abort();
     }
+    kv_store_->Watch(lock_key, boost::bind(&MasterImpl::OnLockChange, this, _1, _2, _3));
 }
 
 void MasterImpl::OnSessionTimeout() {
@@ -48,114 +90,575 @@ void MasterImpl::OnSessionTimeout() {
 }
 
 void MasterImpl::Init() {
+    if (FLAGS_master_follower) {
+        job_manager_.SetFollower(true);
+        following_ = true;
+        background_pool_.AddTask(boost::bind(&MasterImpl::SyncReplica, this));
+    }
     AcquireMasterLock();
+    job_manager_.StartRecovery();
+    {
+        MutexLock lock(&replica_mutex_);
+        following_ = false;
+    }
+    if (FLAGS_master_follower && CatchUpReplica()) {
+        job_manager_.Promote();
+        if (FLAGS_master_snapshot_interval > 0) {
+            background_pool_.DelayTask(FLAGS_master_snapshot_interval,
+                                       boost::bind(&MasterImpl::DumpSnapshot, this));
+        }
+        return;
+    }
+    job_manager_.SetFollower(false);
     LOG(INFO, "begin to reload job descriptor from nexus");
     ReloadJobInfo();
+    job_manager_.EnterSafeMode();
+}
+
+// The rpcs run without replica_mutex_, so Init taking over is not held
+// up by them. What they got is applied only while still following.
+void MasterImpl::SyncReplica() {
+    GetReplicaStateRequest request;
+    {
+        MutexLock lock(&replica_mutex_);
+        if (!following_) {
+            return;
+        }
+        request.set_epoch(replica_epoch_);
+        request.set_version(replica_version_);
+    }
+    if (FLAGS_master_shard_id >= 0) {
+        request.set_shard(FLAGS_master_shard_id);
+    }
+    std::string leader = FLAGS_master_follow_addr;
+    if (leader.empty()) {
+        std::string master_path_key = FLAGS_nexus_root_path + FLAGS_master_path;
+        if (!kv_store_->Get(master_path_key, &leader)) {
+            leader.clear();
+        }
+    }
+    if (!leader.empty() && leader != MasterUtil::SelfEndpoint()) {
+        Master_Stub* stub = NULL;
+        rpc_client_.GetStub(leader, &stub);
+        GetReplicaStateResponse response;
+        bool ret = rpc_client_.SendRequest(stub, &Master_Stub::GetReplicaState,
+                                           &request, &response, 5, 1);
+        if (ret && response.status() == kOk) {
+            FetchBinaries(stub, response);
+            MutexLock lock(&replica_mutex_);
+            if (!following_) {
+                delete stub;
+                return;
+            }
+            replica_leader_ = leader;
+            job_manager_.ApplyReplicaState(response);
+            replica_epoch_ = response.epoch();
+            replica_version_ = response.version();
+            replica_revision_ = response.job_revision();
+        } else {
+            LOG(WARNING, "fail to sync replica state from %s", leader.c_str());
+        }
+        delete stub;
+    }
+    background_pool_.DelayTask(FLAGS_master_replica_interval,
+                               boost::bind(&MasterImpl::SyncReplica, this));
+}
+
+void MasterImpl::FetchBinaries(Master_Stub* stub, const GetReplicaStateResponse& response) {
+    for (int i = 0; i < response.jobs_size(); i++) {
+        const PodDescriptor& pod_desc = response.jobs(i).desc().pod();
+        for (int j = 0; j < pod_desc.tasks_size(); j++) {
+            const std::string& digest = pod_desc.tasks(j).binary_digest();
+            if (digest.empty() || binary_store_.Exists(digest)) {
+                continue;
+            }
+            FetchBinaryFrom(stub, digest);
+        }
+    }
+}
+
+bool MasterImpl::FetchBinaryFrom(Master_Stub* stub, const std::string& digest) {
+    GetBinaryRequest request;
+    GetBinaryResponse response;
+    request.set_digest(digest);
+    bool ret = rpc_client_.SendRequest(stub, &Master_Stub::GetBinary,
+                                       &request, &response, 60, 1);
+    // kept under the name the jobs know it by, sha1 for older binaries
+    if (!ret || response.status() != kOk
+        || !binary_store_.PutAs(digest, response.binary())) {
+        LOG(WARNING, "fail to fetch binary %s", digest.c_str());
+        return false;
+    }
+    return true;
+}
+
+// A binary a job needs is missing from the store, e.g. it failed to
+// replicate before this master took over. Asked of the master followed
+// last, the job manager retries the deploy either way.
+void MasterImpl::FetchBinary(const std::string& digest) {
+    background_pool_.AddTask(boost::bind(&MasterImpl::DoFetchBinary, this, digest));
+}
+
+void MasterImpl::DoFetchBinary(const std::string& digest) {
+    std::string peer = FLAGS_master_follow_addr;
+    if (peer.empty()) {
+        MutexLock lock(&replica_mutex_);
+        peer = replica_leader_;
+    }
+    if (!peer.empty() && peer != MasterUtil::SelfEndpoint()
+        && !binary_store_.Exists(digest)) {
+        Master_Stub* stub = NULL;
+        rpc_client_.GetStub(peer, &stub);
+        if (FetchBinaryFrom(stub, digest)) {
+            LOG(INFO, "binary %s fetched from %s", digest.c_str(), peer.c_str());
+        }
+        delete stub;
+    }
+    job_manager_.BinaryFetched(digest);
+}
+
+// Without the job records the master cannot serve, so after a few tries
+// it dies and leaves the lock to another.
+void MasterImpl::LoadAllJobs(std::map<JobId, std::string>* records) {
+    for (int32_t i = 0; i < kLoadAllJobsRetry; i++) {
+        if (job_store_->LoadAll(records)) {
+            return;
+        }
+        LOG(WARNING, "fail to load all jobs from nexus, try %d", i + 1);
+        records->clear();
+        sleep(1);
+    }
+    LOG(FATAL, "fail to load jobs from nexus, die.");
+    abort();
+}
+
+// On taking over, replays the job records committed after the last
+// replicated state, or all of them when the job log no longer reaches
+// back. Returns false when there is nothing replicated.
+bool MasterImpl::CatchUpReplica() {
+    if (replica_epoch_ == 0) {
+        LOG(INFO, "no replicated state, start cold");
+        return false;
+    }
+    int64_t start = common::timer::get_micros();
+    std::map<JobId, std::string> records;
+    if (!job_store_->ReplayLog(replica_revision_, &records)) {
+        LOG(WARNING, "fail to replay job log after revision %ld, load all",
+            replica_revision_);
+        records.clear();
+        LoadAllJobs(&records);
+    }
+    std::vector<const std::string*> raw_records;
+    std::map<JobId, std::string>::iterator it = records.begin();
+    for (; it != records.end(); ++it) {
+        raw_records.push_back(&it->second);
+    }
+    std::vector<JobInfo> job_infos;
+    ParseJobRecords(raw_records, &job_infos);
+    for (size_t i = 0; i < job_infos.size(); i++) {
+        if (!job_infos[i].has_jobid()) {
+            continue;
+        }
+        job_manager_.ApplyJobRecord(job_infos[i]);
+    }
+    LOG(INFO, "catch up %lu job records after replicated state %ld, cost %ld ms",
+        job_infos.size(), replica_version_, (common::timer::get_micros() - start) / 1000);
+    return true;
 }
 
 void MasterImpl::ReloadJobInfo() {
-    std::string start_key = FLAGS_nexus_root_path + FLAGS_jobs_store_path + "/";
-    std::string end_key = start_key + "~";
-    ::galaxy::ins::sdk::ScanResult* result = nexus_->Scan(start_key, end_key);
+    int64_t start = common::timer::get_micros();
+    // records = local snapshot + job log after it, or everything on nexus
+    std::map<JobId, std::string> records;
+    JobSnapshot snapshot;
+    bool from_snapshot = LoadSnapshot(&snapshot);
+    if (from_snapshot) {
+        for (int i = 0; i < snapshot.jobs_size() && i < snapshot.jobids_size(); i++) {
+            records[snapshot.jobids(i)].swap(*snapshot.mutable_jobs(i));
+        }
+        from_snapshot = job_store_->ReplayLog(snapshot.revision(), &records);
+        if (!from_snapshot) {
+            LOG(WARNING, "local snapshot unusable, reload all jobs from nexus");
+            records.clear();
+        }
+    }
+    if (!from_snapshot) {
+        LoadAllJobs(&records);
+    }
+
+    std::vector<const std::string*> raw_records;
+    std::map<JobId, std::string>::iterator it = records.begin();
+    for (; it != records.end(); ++it) {
+        raw_records.push_back(&it->second);
+    }
+    std::vector<JobInfo> job_infos;
+    ParseJobRecords(raw_records, &job_infos);
+
     int job_amount = 0;
-    while (!result->Done()) {
-        assert(result->Error() == ::galaxy::ins::sdk::kOK);
-        std::string key = result->Key();
-        std::string job_raw_data = result->Value(); 
-        JobInfo job_info;
-        bool ok = job_info.ParseFromString(job_raw_data);
-        if (ok) {
-            LOG(INFO, "reload job: %s", job_info.jobid().c_str());
-            job_manager_.ReloadJobInfo(job_info);
-        } else {
-            LOG(WARNING, "faild to parse job_info: %s", key.c_str());
+    for (size_t i = 0; i < job_infos.size(); i++) {
+        JobInfo& job_info = job_infos[i];
+        if (!job_info.has_jobid()) {
+            LOG(WARNING, "faild to parse job_info #%lu", i);
+            continue;
         }
-        result->Next();
+        LOG(DEBUG, "reload job: %s", job_info.jobid().c_str());
+        // move binaries persisted inline by older masters to binary store,
+        // the job keeps them inline when that fails
+        int stored = StoreBinaries(job_info.mutable_desc());
+        if (stored < 0) {
+            LOG(WARNING, "fail to move binaries of %s to binary store, keep them inline",
+                job_info.jobid().c_str());
+        } else if (stored > 0) {
+            std::string job_raw_data;
+            job_info.SerializeToString(&job_raw_data);
+            if (!kv_store_->Put(JobStore::JobKey(job_info.jobid()), job_raw_data)) {
+                LOG(WARNING, "fail to save stripped job_info: %s",
+                    job_info.jobid().c_str());
+            }
+        }
+        job_manager_.ReloadJobInfo(job_info);
         job_amount ++;
     }
-    LOG(INFO, "reload all job desc finish, total#: %d", job_amount);
+    LOG(INFO, "reload all job desc finish, total#: %d, from %s, revision %ld, cost %ld ms",
+        job_amount, from_snapshot ? "snapshot" : "nexus",
+        job_store_->AppliedRevision(), (common::timer::get_micros() - start) / 1000);
+    if (FLAGS_master_snapshot_interval > 0) {
+        background_pool_.DelayTask(FLAGS_master_snapshot_interval,
+                                   boost::bind(&MasterImpl::DumpSnapshot, this));
+    }
+}
+
+static void ParseJobRecordRange(const std::vector<const std::string*>* records,
+                                std::vector<JobInfo>* job_infos,
+                                size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        if (!(*job_infos)[i].ParseFromString(*(*records)[i])) {
+            (*job_infos)[i].Clear();
+        }
+    }
+}
+
+void MasterImpl::ParseJobRecords(const std::vector<const std::string*>& records,
+                                 std::vector<JobInfo>* job_infos) {
+    job_infos->resize(records.size());
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cores > 0 ? cores : 1;
+    size_t step = (records.size() + threads - 1) / threads;
+    if (step == 0) {
+        return;
+    }
+    ThreadPool parse_pool(threads);
+    for (size_t begin = 0; begin < records.size(); begin += step) {
+        size_t end = std::min(begin + step, records.size());
+        parse_pool.AddTask(boost::bind(&ParseJobRecordRange, &records, job_infos,
+                                       begin, end));
+    }
+    parse_pool.Stop(true);
+}
+
+bool MasterImpl::LoadSnapshot(JobSnapshot* snapshot) {
+    FILE* fp = fopen(FLAGS_master_snapshot_path.c_str(), "rb");
+    if (fp == NULL) {
+        LOG(INFO, "no local job snapshot: %s", FLAGS_master_snapshot_path.c_str());
+        return false;
+    }
+    std::string compressed;
+    char buf[65536];
+    size_t len = 0;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        compressed.append(buf, len);
+    }
+    fclose(fp);
+    std::string snapshot_raw_data;
+    if (!snappy::Uncompress(compressed.data(), compressed.size(), &snapshot_raw_data)
+        || !snapshot->ParseFromString(snapshot_raw_data)) {
+        LOG(WARNING, "fail to parse local job snapshot: %s",
+            FLAGS_master_snapshot_path.c_str());
+        return false;
+    }
+    LOG(INFO, "load local job snapshot, revision %ld, %d jobs",
+        snapshot->revision(), snapshot->jobs_size());
+    return true;
+}
+
+void MasterImpl::DumpSnapshot() {
+    int64_t start = common::timer::get_micros();
+    // every commit up to revision is applied to job_manager_ already,
+    // later ones may be included too and are replayed idempotently
+    int64_t revision = job_store_->AppliedRevision();
+    JobSnapshot snapshot;
+    snapshot.set_revision(revision);
+    {
+        JobInfoList job_infos;
+        job_manager_.GetJobRecords(&job_infos);
+        for (int i = 0; i < job_infos.size(); i++) {
+            job_infos.Get(i).SerializeToString(snapshot.add_jobs());
+            snapshot.add_jobids(job_infos.Get(i).jobid());
+        }
+    }
+    std::string snapshot_raw_data;
+    snapshot.SerializeToString(&snapshot_raw_data);
+    std::string compressed;
+    snappy::Compress(snapshot_raw_data.data(), snapshot_raw_data.size(), &compressed);
+
+    std::string tmp_path = FLAGS_master_snapshot_path + ".tmp";
+    FILE* fp = fopen(tmp_path.c_str(), "wb");
+    bool ok = (fp != NULL);
+    if (ok) {
+        ok = fwrite(compressed.data(), 1, compressed.size(), fp) == compressed.size()
+             && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+        fclose(fp);
+    }
+    if (ok && rename(tmp_path.c_str(), FLAGS_master_snapshot_path.c_str()) == 0) {
+        LOG(INFO, "dump job snapshot, revision %ld, %d jobs, %lu bytes, cost %ld ms",
+            revision, snapshot.jobs_size(), compressed.size(),
+            (common::timer::get_micros() - start) / 1000);
+        job_store_->TrimLog(revision);
+    } else {
+        LOG(WARNING, "fail to dump job snapshot: %s", FLAGS_master_snapshot_path.c_str());
+    }
+    background_pool_.DelayTask(FLAGS_master_snapshot_interval,
+                               boost::bind(&MasterImpl::DumpSnapshot, this));
 }
 
 void MasterImpl::AcquireMasterLock() {
     std::string master_lock = FLAGS_nexus_root_path + FLAGS_master_lock_path;
-    ::galaxy::ins::sdk::SDKError err;
-    nexus_->RegisterSessionTimeout(&OnMasterSessionTimeout, this);
-    bool ret = nexus_->Lock(master_lock, &err); //whould block until accquired
-    assert(ret && err == ::galaxy::ins::sdk::kOK);
+    kv_store_->SetSessionTimeoutCallback(boost::bind(&MasterImpl::OnSessionTimeout, this));
+    if (!kv_store_->Lock(master_lock)) { //whould block until accquired
+        LOG(FATAL, "fail to lock %s on nexus, die.", master_lock.c_str());
+        abort();
+    }
     std::string master_endpoint = MasterUtil::SelfEndpoint();
     std::string master_path_key = FLAGS_nexus_root_path + FLAGS_master_path;
-    ret = nexus_->Put(master_path_key, master_endpoint, &err);
-    assert(ret && err == ::galaxy::ins::sdk::kOK);
-    ret = nexus_->Watch(master_lock, &OnMasterLockChange, this, &err);
-    assert(ret && err == ::galaxy::ins::sdk::kOK);
+    if (!kv_store_->Put(master_path_key, master_endpoint)
+        || !kv_store_->Watch(master_lock,
+                             boost::bind(&MasterImpl::OnLockChange, this, _1, _2, _3))) {
+        LOG(FATAL, "fail to register master on nexus, die.");
+        abort();
+    }
     LOG(INFO, "master lock [ok].  %s -> %s", 
         master_path_key.c_str(), master_endpoint.c_str());
 }
 
+// Binaries are stripped only once all of them are stored, job_desc is
+// left as it was when one fails.
+int MasterImpl::StoreBinaries(JobDescriptor* job_desc) {
+    PodDescriptor* pod_desc = job_desc->mutable_pod();
+    std::vector<std::string> digests(pod_desc->tasks_size());
+    for (int i = 0; i < pod_desc->tasks_size(); i++) {
+        const TaskDescriptor& task_desc = pod_desc->tasks(i);
+        if (!task_desc.binary().empty()
+            && !binary_store_.Put(task_desc.binary(), &digests[i])) {
+            return -1;
+        }
+    }
+    int stored = 0;
+    for (int i = 0; i < pod_desc->tasks_size(); i++) {
+        TaskDescriptor* task_desc = pod_desc->mutable_tasks(i);
+        if (task_desc->binary().empty()) {
+            continue;
+        }
+        task_desc->set_binary_digest(digests[i]);
+        task_desc->set_binary_size(task_desc->binary().size());
+        task_desc->clear_binary();
+        stored++;
+    }
+    return stored;
+}
+
+void MasterImpl::Dispatch(RequestLaneType lane_type,
+                          ::google::protobuf::RpcController* controller,
+                          ::google::protobuf::Closure* done,
+                          const ThreadPool::Task& task) {
+    RequestLane& lane = lanes_[lane_type];
+    if (lane.pool->PendingNum() >= lane.queue_limit) {
+        // fail fast, the caller retries instead of timing out in the queue
+        lane.rejected.Inc();
+        controller->SetFailed("master overloaded");
+        done->Run();
+        return;
+    }
+    lane.pool->AddTask(task);
+}
+
 void MasterImpl::SubmitJob(::google::protobuf::RpcController* controller,
                            const ::baidu::galaxy::SubmitJobRequest* request,
                            ::baidu::galaxy::SubmitJobResponse* response,
                            ::google::protobuf::Closure* done) {
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoSubmitJob, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoSubmitJob(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::SubmitJobRequest* request,
+                             ::baidu::galaxy::SubmitJobResponse* response,
+                             ::google::protobuf::Closure* done) {
     const JobDescriptor& job_desc = request->job();
+    Status admission = job_manager_.Admit(job_desc);
+    if (admission != kOk) {
+        response->set_status(admission);
+        if (admission == kThrottled) {
+            response->set_retry_after(FLAGS_master_throttle_retry_after);
+        }
+        done->Run();
+        return;
+    }
     JobId job_id = MasterUtil::GenerateJobId(job_desc);
 
-    std::string job_raw_data;
     JobInfo job_info;
     job_info.mutable_desc()->CopyFrom(job_desc);
     job_info.set_jobid(job_id);
-    job_info.SerializeToString(&job_raw_data);
     job_info.set_state(kJobNormal);
     LOG(INFO, "user[%s] try to submit a job: \"%s\"", 
         job_info.desc().user().c_str(), job_info.desc().name().c_str());
+    if (StoreBinaries(job_info.mutable_desc()) < 0) {
+        job_manager_.CancelAdmission(job_desc);
+        response->set_status(kJobSubmitFail);
+        LOG(WARNING, "save binaries of job \"%s\" fail",
+            job_info.desc().name().c_str());
+        done->Run();
+        return;
+    }
     for (int i = 0; i < job_info.desc().pod().tasks_size(); i++) {
         const TaskDescriptor& task_desc = job_info.desc().pod().tasks(i);
         LOG(INFO, "try submmit job: \"%s\", "
-            "tasks[%d]: start_cmd: \"%s\", stop_cmd: \"%s\", binary_size: %d",
+            "tasks[%d]: start_cmd: \"%s\", stop_cmd: \"%s\", binary: %s, binary_size: %lld",
             job_info.desc().name().c_str(), 
             i, 
             task_desc.start_command().c_str(),
             task_desc.stop_command().c_str(),
-            task_desc.binary().size());
+            task_desc.binary_digest().c_str(),
+            static_cast<long long>(task_desc.binary_size()));
     }
-    std::string job_key = FLAGS_nexus_root_path + FLAGS_jobs_store_path 
-                          + "/" + job_id;
-    ::galaxy::ins::sdk::SDKError err;
-    bool put_ok = nexus_->Put(job_key, job_raw_data, &err);
-    if (!put_ok) {
+    // answer after the batch carrying this job is committed to nexus
+    job_store_->Save(job_info, boost::bind(&MasterImpl::OnJobSubmitted, this,
+                                           job_info, response, done, _1));
+}
+
+void MasterImpl::OnJobSubmitted(const JobInfo& job_info,
+                                ::baidu::galaxy::SubmitJobResponse* response,
+                                ::google::protobuf::Closure* done,
+                                bool ok) {
+    if (!ok) {
+        job_manager_.CancelAdmission(job_info.desc());
         response->set_status(kJobSubmitFail);
-        LOG(WARNING, "save job_desc to nexus fail, reason: %s",
-            ::galaxy::ins::sdk::InsSDK::StatusToString(err).c_str());
+        LOG(WARNING, "save job_desc to nexus fail: %s", job_info.jobid().c_str());
         done->Run();
         return;
     }
+    job_manager_.Add(job_info.jobid(), job_info.desc());
+    response->set_status(kOk);
+    response->set_jobid(job_info.jobid());
+    done->Run();
+}
 
-    job_manager_.Add(job_id, job_desc);
-    response->set_jobid(job_id);
+template <class Response>
+static void ReplyStatus(Response* response, ::google::protobuf::Closure* done, Status status) {
+    response->set_status(status);
     done->Run();
 }
 
+// answers after the batch carrying the job record is committed to nexus,
+// as SubmitJob does
+void MasterImpl::SaveJobRecord(const JobId& jobid, const StatusReply& reply) {
+    JobInfo job_info;
+    Status status = job_manager_.GetJobRecord(jobid, &job_info);
+    if (status != kOk) {
+        reply(status);
+        return;
+    }
+    job_store_->Save(job_info, boost::bind(&MasterImpl::OnJobRecordSaved, this,
+                                           jobid, reply, _1));
+}
+
+void MasterImpl::OnJobRecordSaved(const JobId& jobid, const StatusReply& reply, bool ok) {
+    if (!ok) {
+        LOG(WARNING, "save job state to nexus fail: %s", jobid.c_str());
+        reply(kUnknown);
+        return;
+    }
+    reply(kOk);
+}
+
 void MasterImpl::UpdateJob(::google::protobuf::RpcController* controller,
-                           const ::baidu::galaxy::UpdateJobRequest*,
-                           ::baidu::galaxy::UpdateJobResponse*,
+                           const ::baidu::galaxy::UpdateJobRequest* request,
+                           ::baidu::galaxy::UpdateJobResponse* response,
                            ::google::protobuf::Closure* done) {
-    controller->SetFailed("Method UpdateJob() not implemented.");
-    done->Run();
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoUpdateJob, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoUpdateJob(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::UpdateJobRequest* request,
+                             ::baidu::galaxy::UpdateJobResponse* response,
+                             ::google::protobuf::Closure* done) {
+    JobDescriptor job_desc;
+    job_desc.CopyFrom(request->job());
+    if (StoreBinaries(&job_desc) < 0) {
+        response->set_status(kUnknown);
+        LOG(WARNING, "save binaries of job %s fail", request->jobid().c_str());
+        done->Run();
+        return;
+    }
+    Status status = job_manager_.Update(request->jobid(), job_desc);
+    response->set_status(status);
+    if (status == kThrottled) {
+        response->set_retry_after(FLAGS_master_throttle_retry_after);
+    }
+    if (status != kOk) {
+        done->Run();
+        return;
+    }
+    SaveJobRecord(request->jobid(),
+                  boost::bind(&ReplyStatus<UpdateJobResponse>, response, done, _1));
 }
 
 void MasterImpl::SuspendJob(::google::protobuf::RpcController* controller,
                             const ::baidu::galaxy::SuspendJobRequest* request,
                             ::baidu::galaxy::SuspendJobResponse* response,
                             ::google::protobuf::Closure* done) {
-    response->set_status(job_manager_.Suspend(request->jobid()));
-    done->Run();
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoSuspendJob, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoSuspendJob(::google::protobuf::RpcController* controller,
+                              const ::baidu::galaxy::SuspendJobRequest* request,
+                              ::baidu::galaxy::SuspendJobResponse* response,
+                              ::google::protobuf::Closure* done) {
+    Status status = job_manager_.Suspend(request->jobid());
+    response->set_status(status);
+    if (status != kOk) {
+        done->Run();
+        return;
+    }
+    SaveJobRecord(request->jobid(),
+                  boost::bind(&ReplyStatus<SuspendJobResponse>, response, done, _1));
 }
 
 void MasterImpl::ResumeJob(::google::protobuf::RpcController* controller,
                            const ::baidu::galaxy::ResumeJobRequest* request,
                            ::baidu::galaxy::ResumeJobResponse* response,
                            ::google::protobuf::Closure* done) {
-    response->set_status(job_manager_.Resume(request->jobid()));
-    done->Run();
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoResumeJob, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoResumeJob(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::ResumeJobRequest* request,
+                             ::baidu::galaxy::ResumeJobResponse* response,
+                             ::google::protobuf::Closure* done) {
+    Status status = job_manager_.Resume(request->jobid());
+    response->set_status(status);
+    if (status != kOk) {
+        done->Run();
+        return;
+    }
+    SaveJobRecord(request->jobid(),
+                  boost::bind(&ReplyStatus<ResumeJobResponse>, response, done, _1));
 }
 
 void MasterImpl::TerminateJob(::google::protobuf::RpcController* controller,
@@ -170,9 +673,19 @@ void MasterImpl::ShowJob(::google::protobuf::RpcController* controller,
                          const ::baidu::galaxy::ShowJobRequest* request,
                          ::baidu::galaxy::ShowJobResponse* response,
                          ::google::protobuf::Closure* done) {
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoShowJob, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoShowJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::ShowJobRequest* request,
+                           ::baidu::galaxy::ShowJobResponse* response,
+                           ::google::protobuf::Closure* done) {
     for (int32_t i = 0; i < request->jobsid_size(); i++) {
         const JobId& jobid = request->jobsid(i);
-        if (kOk != job_manager_.GetJobInfo(jobid, response->mutable_jobs()->Add())) {
+        if (kOk != job_manager_.GetJobInfo(jobid, request->with_pods(),
+                                           response->mutable_jobs()->Add())) {
             response->mutable_jobs()->RemoveLast();
         }
     }
@@ -184,33 +697,134 @@ void MasterImpl::ListJobs(::google::protobuf::RpcController* controller,
                           const ::baidu::galaxy::ListJobsRequest* request,
                           ::baidu::galaxy::ListJobsResponse* response,
                           ::google::protobuf::Closure* done) {
-    job_manager_.GetJobsOverview(response->mutable_jobs());
-    response->set_status(kOk);
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoListJobs, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoListJobs(::google::protobuf::RpcController* controller,
+                            const ::baidu::galaxy::ListJobsRequest* request,
+                            ::baidu::galaxy::ListJobsResponse* response,
+                            ::google::protobuf::Closure* done) {
+    response_cache_.Fill("ListJobs", *request, job_manager_.QuerySnapshotVersion(),
+                         boost::bind(&MasterImpl::BuildListJobs, this, request, _1),
+                         response);
     done->Run();
 }
 
+void MasterImpl::BuildListJobs(const ::baidu::galaxy::ListJobsRequest* request,
+                               ::google::protobuf::Message* message) {
+    ListJobsResponse* response = static_cast<ListJobsResponse*>(message);
+    job_manager_.GetJobsOverview(*request, response->mutable_jobs(),
+                                 response->mutable_next_page_token());
+    response->set_status(kOk);
+}
+
+void MasterImpl::Watch(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::WatchRequest* request,
+                       ::baidu::galaxy::WatchResponse* response,
+                       ::google::protobuf::Closure* done) {
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoWatch, this,
+                         controller, request, response, done));
+}
+
+// does not hold the lane worker, a request without events is parked in
+// the watch log and answered from there
+void MasterImpl::DoWatch(::google::protobuf::RpcController* controller,
+                         const ::baidu::galaxy::WatchRequest* request,
+                         ::baidu::galaxy::WatchResponse* response,
+                         ::google::protobuf::Closure* done) {
+    job_manager_.Watch(request, response, done);
+}
+
 void MasterImpl::HeartBeat(::google::protobuf::RpcController* controller,
-                          const ::baidu::galaxy::HeartBeatRequest* request,
-                          ::baidu::galaxy::HeartBeatResponse*,
-                          ::google::protobuf::Closure* done) {
-    std::string agent_addr = request->endpoint();
-    job_manager_.KeepAlive(agent_addr);
+                           const ::baidu::galaxy::HeartBeatRequest* request,
+                           ::baidu::galaxy::HeartBeatResponse* response,
+                           ::google::protobuf::Closure* done) {
+    Dispatch(kLivenessLane, controller, done,
+             boost::bind(&MasterImpl::DoHeartBeat, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoHeartBeat(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::HeartBeatRequest* request,
+                             ::baidu::galaxy::HeartBeatResponse* response,
+                             ::google::protobuf::Closure* done) {
+    HeartBeatList heartbeats;
+    AgentHeartBeat* heartbeat = heartbeats.Add();
+    heartbeat->set_endpoint(request->endpoint());
+    heartbeat->set_sequence(request->sequence());
+    if (request->has_pod_digest()) {
+        heartbeat->set_pod_digest(request->pod_digest());
+    }
+    job_manager_.KeepAlive(heartbeats);
+    response->set_status(kOk);
+    done->Run();
+}
+
+void MasterImpl::BatchHeartBeat(::google::protobuf::RpcController* controller,
+                                const ::baidu::galaxy::BatchHeartBeatRequest* request,
+                                ::baidu::galaxy::BatchHeartBeatResponse* response,
+                                ::google::protobuf::Closure* done) {
+    Dispatch(kLivenessLane, controller, done,
+             boost::bind(&MasterImpl::DoBatchHeartBeat, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoBatchHeartBeat(::google::protobuf::RpcController* /*controller*/,
+                                  const ::baidu::galaxy::BatchHeartBeatRequest* request,
+                                  ::baidu::galaxy::BatchHeartBeatResponse* response,
+                                  ::google::protobuf::Closure* done) {
+    const std::string& compressed = request->heartbeats();
+    std::string raw;
+    HeartBeatBatch batch;
+    if (!snappy::Uncompress(compressed.data(), compressed.size(), &raw)
+        || !batch.ParseFromString(raw)) {
+        LOG(WARNING, "bad heartbeat batch from relay %s", request->relay().c_str());
+        response->set_status(kInputError);
+        done->Run();
+        return;
+    }
+    LOG(DEBUG, "receive %d heartbeats from relay %s",
+        batch.heartbeats_size(), request->relay().c_str());
+    job_manager_.KeepAlive(batch.heartbeats());
+    job_manager_.RenewLeases(*request, response);
+    response->set_status(kOk);
     done->Run();
 }
 
 void MasterImpl::GetPendingJobs(::google::protobuf::RpcController* controller,
-                                const ::baidu::galaxy::GetPendingJobsRequest*,
+                                const ::baidu::galaxy::GetPendingJobsRequest* request,
                                 ::baidu::galaxy::GetPendingJobsResponse* response,
                                 ::google::protobuf::Closure* done) {
+    Dispatch(kSchedulingLane, controller, done,
+             boost::bind(&MasterImpl::DoGetPendingJobs, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoGetPendingJobs(::google::protobuf::RpcController* controller,
+                                  const ::baidu::galaxy::GetPendingJobsRequest* request,
+                                  ::baidu::galaxy::GetPendingJobsResponse* response,
+                                  ::google::protobuf::Closure* done) {
     job_manager_.GetPendingPods(response->mutable_scale_up_jobs());
     response->set_status(kOk);
     done->Run();
 }
 
 void MasterImpl::GetResourceSnapshot(::google::protobuf::RpcController* controller,
-                         const ::baidu::galaxy::GetResourceSnapshotRequest* request,
-                         ::baidu::galaxy::GetResourceSnapshotResponse* response,
-                         ::google::protobuf::Closure* done) {
+                                     const ::baidu::galaxy::GetResourceSnapshotRequest* request,
+                                     ::baidu::galaxy::GetResourceSnapshotResponse* response,
+                                     ::google::protobuf::Closure* done) {
+    Dispatch(kSchedulingLane, controller, done,
+             boost::bind(&MasterImpl::DoGetResourceSnapshot, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoGetResourceSnapshot(::google::protobuf::RpcController* controller,
+                                       const ::baidu::galaxy::GetResourceSnapshotRequest* request,
+                                       ::baidu::galaxy::GetResourceSnapshotResponse* response,
+                                       ::google::protobuf::Closure* done) {
     job_manager_.GetAliveAgentsInfo(response->mutable_agents());
     response->set_status(kOk);
     done->Run();
@@ -220,22 +834,116 @@ void MasterImpl::Propose(::google::protobuf::RpcController* controller,
                          const ::baidu::galaxy::ProposeRequest* request,
                          ::baidu::galaxy::ProposeResponse* response,
                          ::google::protobuf::Closure* done) {
-    for (int i = 0; i < request->schedule_size(); i++) {
-        const ScheduleInfo& sche_info = request->schedule(i);
-        response->set_status(job_manager_.Propose(sche_info));
-    }
+    Dispatch(kSchedulingLane, controller, done,
+             boost::bind(&MasterImpl::DoPropose, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoPropose(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::ProposeRequest* request,
+                           ::baidu::galaxy::ProposeResponse* response,
+                           ::google::protobuf::Closure* done) {
+    std::vector<PodKey> deploy;
+    response->set_status(job_manager_.Propose(request->schedule(),
+                                              response->mutable_schedule_status(),
+                                              &deploy));
     done->Run();
-    job_manager_.DeployPod();
+    job_manager_.DeployPod(deploy);
 }
 
 void MasterImpl::ListAgents(::google::protobuf::RpcController* controller,
                             const ::baidu::galaxy::ListAgentsRequest* request,
                             ::baidu::galaxy::ListAgentsResponse* response,
                             ::google::protobuf::Closure* done) {
-    job_manager_.GetAgentsInfo(response->mutable_agents());
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoListAgents, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoListAgents(::google::protobuf::RpcController* controller,
+                              const ::baidu::galaxy::ListAgentsRequest* request,
+                              ::baidu::galaxy::ListAgentsResponse* response,
+                              ::google::protobuf::Closure* done) {
+    response_cache_.Fill("ListAgents", *request, job_manager_.QuerySnapshotVersion(),
+                         boost::bind(&MasterImpl::BuildListAgents, this, request, _1),
+                         response);
+    done->Run();
+}
+
+void MasterImpl::BuildListAgents(const ::baidu::galaxy::ListAgentsRequest* request,
+                                 ::google::protobuf::Message* message) {
+    ListAgentsResponse* response = static_cast<ListAgentsResponse*>(message);
+    job_manager_.GetAgentsInfo(*request, response->mutable_agents(),
+                               response->mutable_next_page_token());
+    response->set_status(kOk);
+}
+
+void MasterImpl::GetMasterStatus(::google::protobuf::RpcController* controller,
+                                 const ::baidu::galaxy::GetMasterStatusRequest* request,
+                                 ::baidu::galaxy::GetMasterStatusResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    job_manager_.GetMetrics(response->mutable_metrics());
+    for (int i = 0; i < kLaneNum; i++) {
+        Metric* metric = response->add_metrics();
+        metric->set_name(std::string(lanes_[i].name) + "_queue_depth");
+        metric->set_value(lanes_[i].pool->PendingNum());
+        metric = response->add_metrics();
+        metric->set_name(std::string(lanes_[i].name) + "_rejected");
+        metric->set_value(lanes_[i].rejected.Get());
+    }
+    Metric* metric = response->add_metrics();
+    metric->set_name("response_cache_hits");
+    metric->set_value(response_cache_.Hits());
+    metric = response->add_metrics();
+    metric->set_name("response_cache_misses");
+    metric->set_value(response_cache_.Misses());
     response->set_status(kOk);
     done->Run();
 }
 
+void MasterImpl::GetReplicaState(::google::protobuf::RpcController* controller,
+                                 const ::baidu::galaxy::GetReplicaStateRequest* request,
+                                 ::baidu::galaxy::GetReplicaStateResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoGetReplicaState, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoGetReplicaState(::google::protobuf::RpcController* controller,
+                                   const ::baidu::galaxy::GetReplicaStateRequest* request,
+                                   ::baidu::galaxy::GetReplicaStateResponse* response,
+                                   ::google::protobuf::Closure* done) {
+    // commits up to revision have been applied to job_manager_ by now,
+    // publishing afterwards makes the state reflect all of them
+    int64_t revision = job_store_->AppliedRevision();
+    job_manager_.PublishQuerySnapshot();
+    job_manager_.GetReplicaState(request->epoch(), request->version(), response);
+    response->set_job_revision(revision);
+    response->set_status(kOk);
+    done->Run();
+}
+
+void MasterImpl::GetBinary(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::GetBinaryRequest* request,
+                           ::baidu::galaxy::GetBinaryResponse* response,
+                           ::google::protobuf::Closure* done) {
+    Dispatch(kQueryLane, controller, done,
+             boost::bind(&MasterImpl::DoGetBinary, this,
+                         controller, request, response, done));
+}
+
+void MasterImpl::DoGetBinary(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::GetBinaryRequest* request,
+                             ::baidu::galaxy::GetBinaryResponse* response,
+                             ::google::protobuf::Closure* done) {
+    if (!binary_store_.Get(request->digest(), response->mutable_binary())) {
+        response->set_status(kNotFound);
+    } else {
+        response->set_status(kOk);
+    }
+    done->Run();
+}
+
 }
 }
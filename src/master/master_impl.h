@@ -4,14 +4,41 @@
 #ifndef BAIDU_GALAXY_MASTER_IMPL_H
 #define BAIDU_GALAXY_MASTER_IMPL_H
 
+#include <map>
+#include <string>
+#include <vector>
+#include <thread_pool.h>
+#include <counter.h>
+
 #include "proto/master.pb.h"
 #include "job_manager.h"
-#include "ins_sdk.h"
+#include "binary_store.h"
+#include "kv_store.h"
+#include "job_store.h"
+#include "response_cache.h"
+#include "rpc/rpc_client.h"
 
-using ::galaxy::ins::sdk::InsSDK;
 
 namespace baidu {
 namespace galaxy {
+
+// Admission classes of master RPCs. Each has its own workers and bounded
+// queue, so a flood of queries can not hold back heartbeats.
+enum RequestLaneType {
+    kLivenessLane = 0,
+    kSchedulingLane = 1,
+    kQueryLane = 2,
+    kLaneNum = 3
+};
+
+struct RequestLane {
+    const char* name;
+    ThreadPool* pool;
+    int64_t queue_limit;
+    ::baidu::common::Counter rejected;
+    RequestLane() : name(""), pool(NULL), queue_limit(0) {}
+};
+
 class MasterImpl : public Master {
 public:
       MasterImpl();
@@ -47,10 +74,18 @@ public:
                             const ::baidu::galaxy::ListJobsRequest* request,
                             ::baidu::galaxy::ListJobsResponse* response,
                             ::google::protobuf::Closure* done);
+      virtual void Watch(::google::protobuf::RpcController* controller,
+                         const ::baidu::galaxy::WatchRequest* request,
+                         ::baidu::galaxy::WatchResponse* response,
+                         ::google::protobuf::Closure* done);
       virtual void HeartBeat(::google::protobuf::RpcController* controller,
                              const ::baidu::galaxy::HeartBeatRequest* request,
                              ::baidu::galaxy::HeartBeatResponse* response,
                              ::google::protobuf::Closure* done);
+      virtual void BatchHeartBeat(::google::protobuf::RpcController* controller,
+                                  const ::baidu::galaxy::BatchHeartBeatRequest* request,
+                                  ::baidu::galaxy::BatchHeartBeatResponse* response,
+                                  ::google::protobuf::Closure* done);
       virtual void GetPendingJobs(::google::protobuf::RpcController* controller,
                                   const ::baidu::galaxy::GetPendingJobsRequest* request,
                                   ::baidu::galaxy::GetPendingJobsResponse* response,
@@ -67,11 +102,128 @@ public:
                               const ::baidu::galaxy::ListAgentsRequest* request,
                               ::baidu::galaxy::ListAgentsResponse* response,
                               ::google::protobuf::Closure* done);
+      virtual void GetMasterStatus(::google::protobuf::RpcController* controller,
+                                   const ::baidu::galaxy::GetMasterStatusRequest* request,
+                                   ::baidu::galaxy::GetMasterStatusResponse* response,
+                                   ::google::protobuf::Closure* done);
+      virtual void GetReplicaState(::google::protobuf::RpcController* controller,
+                                   const ::baidu::galaxy::GetReplicaStateRequest* request,
+                                   ::baidu::galaxy::GetReplicaStateResponse* response,
+                                   ::google::protobuf::Closure* done);
+      virtual void GetBinary(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::GetBinaryRequest* request,
+                             ::baidu::galaxy::GetBinaryResponse* response,
+                             ::google::protobuf::Closure* done);
       void OnSessionTimeout();
-      void OnLockChange(std::string lock_session_id);
+      void OnLockChange(const std::string& lock_key,
+                        const std::string& lock_session_id,
+                        bool deleted);
+private:
+      void Dispatch(RequestLaneType lane_type,
+                    ::google::protobuf::RpcController* controller,
+                    ::google::protobuf::Closure* done,
+                    const ThreadPool::Task& task);
+      void DoSubmitJob(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::SubmitJobRequest* request,
+                       ::baidu::galaxy::SubmitJobResponse* response,
+                       ::google::protobuf::Closure* done);
+      void DoUpdateJob(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::UpdateJobRequest* request,
+                       ::baidu::galaxy::UpdateJobResponse* response,
+                       ::google::protobuf::Closure* done);
+      void DoSuspendJob(::google::protobuf::RpcController* controller,
+                        const ::baidu::galaxy::SuspendJobRequest* request,
+                        ::baidu::galaxy::SuspendJobResponse* response,
+                        ::google::protobuf::Closure* done);
+      void DoResumeJob(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::ResumeJobRequest* request,
+                       ::baidu::galaxy::ResumeJobResponse* response,
+                       ::google::protobuf::Closure* done);
+      void DoShowJob(::google::protobuf::RpcController* controller,
+                     const ::baidu::galaxy::ShowJobRequest* request,
+                     ::baidu::galaxy::ShowJobResponse* response,
+                     ::google::protobuf::Closure* done);
+      void DoListJobs(::google::protobuf::RpcController* controller,
+                      const ::baidu::galaxy::ListJobsRequest* request,
+                      ::baidu::galaxy::ListJobsResponse* response,
+                      ::google::protobuf::Closure* done);
+      void DoWatch(::google::protobuf::RpcController* controller,
+                   const ::baidu::galaxy::WatchRequest* request,
+                   ::baidu::galaxy::WatchResponse* response,
+                   ::google::protobuf::Closure* done);
+      void DoHeartBeat(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::HeartBeatRequest* request,
+                       ::baidu::galaxy::HeartBeatResponse* response,
+                       ::google::protobuf::Closure* done);
+      void DoBatchHeartBeat(::google::protobuf::RpcController* controller,
+                            const ::baidu::galaxy::BatchHeartBeatRequest* request,
+                            ::baidu::galaxy::BatchHeartBeatResponse* response,
+                            ::google::protobuf::Closure* done);
+      void DoGetPendingJobs(::google::protobuf::RpcController* controller,
+                            const ::baidu::galaxy::GetPendingJobsRequest* request,
+                            ::baidu::galaxy::GetPendingJobsResponse* response,
+                            ::google::protobuf::Closure* done);
+      void DoGetResourceSnapshot(::google::protobuf::RpcController* controller,
+                                 const ::baidu::galaxy::GetResourceSnapshotRequest* request,
+                                 ::baidu::galaxy::GetResourceSnapshotResponse* response,
+                                 ::google::protobuf::Closure* done);
+      void DoPropose(::google::protobuf::RpcController* controller,
+                     const ::baidu::galaxy::ProposeRequest* request,
+                     ::baidu::galaxy::ProposeResponse* response,
+                     ::google::protobuf::Closure* done);
+      void DoListAgents(::google::protobuf::RpcController* controller,
+                        const ::baidu::galaxy::ListAgentsRequest* request,
+                        ::baidu::galaxy::ListAgentsResponse* response,
+                        ::google::protobuf::Closure* done);
+      void DoGetReplicaState(::google::protobuf::RpcController* controller,
+                             const ::baidu::galaxy::GetReplicaStateRequest* request,
+                             ::baidu::galaxy::GetReplicaStateResponse* response,
+                             ::google::protobuf::Closure* done);
+      void DoGetBinary(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::GetBinaryRequest* request,
+                       ::baidu::galaxy::GetBinaryResponse* response,
+                       ::google::protobuf::Closure* done);
+      void BuildListJobs(const ::baidu::galaxy::ListJobsRequest* request,
+                         ::google::protobuf::Message* response);
+      void BuildListAgents(const ::baidu::galaxy::ListAgentsRequest* request,
+                           ::google::protobuf::Message* response);
+      int StoreBinaries(JobDescriptor* job_desc);
+      void SyncReplica();
+      void FetchBinaries(Master_Stub* stub, const GetReplicaStateResponse& response);
+      bool FetchBinaryFrom(Master_Stub* stub, const std::string& digest);
+      void FetchBinary(const std::string& digest);
+      void DoFetchBinary(const std::string& digest);
+      bool CatchUpReplica();
+      void LoadAllJobs(std::map<JobId, std::string>* records);
+      bool LoadSnapshot(JobSnapshot* snapshot);
+      void DumpSnapshot();
+      void ParseJobRecords(const std::vector<const std::string*>& records,
+                           std::vector<JobInfo>* job_infos);
+      typedef boost::function<void (Status)> StatusReply;
+      void SaveJobRecord(const JobId& jobid, const StatusReply& reply);
+      void OnJobSubmitted(const JobInfo& job_info,
+                          ::baidu::galaxy::SubmitJobResponse* response,
+                          ::google::protobuf::Closure* done,
+                          bool ok);
+      void OnJobRecordSaved(const JobId& jobid, const StatusReply& reply, bool ok);
 private:
+      BinaryStore binary_store_;
       JobManager job_manager_;
-      InsSDK* nexus_;
+      KvStore* kv_store_;
+      JobStore* job_store_;
+      ThreadPool background_pool_;
+
+      // follower state, guarded by replica_mutex_
+      Mutex replica_mutex_;
+      bool following_;
+      int64_t replica_epoch_;
+      int64_t replica_version_;
+      int64_t replica_revision_;
+      // the master last followed
+      std::string replica_leader_;
+      RpcClient rpc_client_;
+      RequestLane lanes_[kLaneNum];
+      ResponseCache response_cache_;
 };
 
 }
@@ -11,6 +11,7 @@
 #include <logging.h>
 
 #include "master_impl.h"
+#include "master_util.h"
 
 using baidu::common::Log;
 using baidu::common::FATAL;
@@ -18,6 +19,8 @@ using baidu::common::INFO;
 using baidu::common::WARNING;
 
 DECLARE_string(master_port);
+DECLARE_string(nexus_root_path);
+DECLARE_int32(master_shard_id);
 
 static volatile bool s_quit = false;
 static void SignalIntHandler(int /*sig*/){
@@ -26,6 +29,13 @@ static void SignalIntHandler(int /*sig*/){
 
 int main(int argc, char* argv[]) {
     ::google::ParseCommandLineFlags(&argc, &argv, true);
+    if (FLAGS_master_shard_id >= 0) {
+        // lock, endpoint and job records of a shard all live in its subtree,
+        // the root one is taken by the router
+        FLAGS_nexus_root_path = baidu::galaxy::MasterUtil::ShardRootPath(FLAGS_master_shard_id);
+        LOG(INFO, "serve job shard %d under %s", FLAGS_master_shard_id,
+            FLAGS_nexus_root_path.c_str());
+    }
     sofa::pbrpc::RpcServerOptions options;
     sofa::pbrpc::RpcServer rpc_server(options);
     baidu::galaxy::MasterImpl* master_impl = new baidu::galaxy::MasterImpl();
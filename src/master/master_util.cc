@@ -4,6 +4,8 @@
 
 #include "master_util.h"
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <sstream>
 #include <sys/utsname.h>
 #include <boost/uuid/uuid.hpp>
@@ -15,12 +17,42 @@
 #include "proto/master.pb.h"
 
 DECLARE_string(master_port);
+DECLARE_string(nexus_root_path);
+DECLARE_int32(master_shard_id);
 
 namespace baidu {
 namespace galaxy {
 
 std::string MasterUtil::GenerateJobId(const JobDescriptor& job_desc) {
-    return "job_" + job_desc.name() + "_" + UUID();
+    std::string jobid = "job_" + job_desc.name() + "_" + UUID();
+    if (FLAGS_master_shard_id >= 0) {
+        return ShardPrefix(FLAGS_master_shard_id) + jobid;
+    }
+    return jobid;
+}
+
+std::string MasterUtil::ShardPrefix(int32_t shard) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "s%04d-", shard);
+    return buf;
+}
+
+int32_t MasterUtil::ShardOf(const std::string& jobid) {
+    if (jobid.size() < 6 || jobid[0] != 's' || jobid[5] != '-') {
+        return -1;
+    }
+    for (size_t i = 1; i < 5; i++) {
+        if (jobid[i] < '0' || jobid[i] > '9') {
+            return -1;
+        }
+    }
+    return atoi(jobid.substr(1, 4).c_str());
+}
+
+std::string MasterUtil::ShardRootPath(int32_t shard) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "/shard%d", shard);
+    return FLAGS_nexus_root_path + buf;
 }
 
 std::string MasterUtil::GeneratePodId(const JobDescriptor& job_desc) {
@@ -59,13 +91,17 @@ bool MasterUtil::FitResource(const Resource& from, const Resource& to) {
 }
 
 std::string MasterUtil::SelfEndpoint() {
+    return SelfEndpoint(FLAGS_master_port);
+}
+
+std::string MasterUtil::SelfEndpoint(const std::string& port) {
     std::string hostname = "";
     struct utsname buf;
     if (0 != uname(&buf)) {
         *buf.nodename = '\0';
     }
     hostname = buf.nodename;
-    return hostname + ":" + FLAGS_master_port;
+    return hostname + ":" + port;
 }
 
 }
@@ -4,6 +4,7 @@
 #ifndef BAIDU_GALAXY_MASTER_UTIL_H
 #define BAIDU_GALAXY_MASTER_UTIL_H
 #include <string>
+#include <stdint.h>
 
 namespace baidu {
 namespace galaxy {
@@ -20,6 +21,15 @@ public:
     static void SubstractResource(const Resource& from, Resource* to);
     static bool FitResource(const Resource& from, const Resource& to);
     static std::string SelfEndpoint();
+    static std::string SelfEndpoint(const std::string& port);
+
+    // Jobs of shard k are "s<kkkk>-job_...", so each shard owns a range
+    // of job ids and a page of one shard never mixes with another.
+    static std::string ShardPrefix(int32_t shard);
+    // -1 for job ids of an unsharded master
+    static int32_t ShardOf(const std::string& jobid);
+    // nexus subtree of a shard
+    static std::string ShardRootPath(int32_t shard);
 private:
     static std::string UUID();
 };
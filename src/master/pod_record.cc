@@ -0,0 +1,172 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "pod_record.h"
+
+#include <assert.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+
+namespace baidu {
+namespace galaxy {
+
+StringPool::StringPool() : bytes_(0) {
+}
+
+const std::string* StringPool::Empty() {
+    static const std::string empty;
+    return &empty;
+}
+
+const std::string* StringPool::Intern(const std::string& str) {
+    if (str.empty()) {
+        return Empty();
+    }
+    std::map<std::string, int64_t>::iterator it = strings_.find(str);
+    if (it == strings_.end()) {
+        it = strings_.insert(std::make_pair(str, 0)).first;
+        bytes_ += sizeof(std::string) + str.size();
+    }
+    it->second++;
+    return &it->first;
+}
+
+void StringPool::Release(const std::string* str) {
+    if (str == Empty()) {
+        return;
+    }
+    std::map<std::string, int64_t>::iterator it = strings_.find(*str);
+    assert(it != strings_.end());
+    if (--it->second == 0) {
+        bytes_ -= sizeof(std::string) + str->size();
+        strings_.erase(it);
+    }
+}
+
+int64_t StringPool::Bytes() const {
+    return bytes_;
+}
+
+void PodRecord::ToProto(PodStatus* pod) const {
+    pod->set_podid(podid_);
+    pod->set_jobid(*jobid_);
+    pod->set_endpoint(*endpoint_);
+    if (!version_->empty()) {
+        pod->set_version(*version_);
+    }
+    pod->set_state(state());
+    if (millicores_used_ != 0 || memory_used_ != 0) {
+        pod->mutable_resource_used()->set_millicores(millicores_used_);
+        pod->mutable_resource_used()->set_memory(memory_used_);
+    }
+    if (!tasks_.empty()) {
+        pod->MergeFromString(tasks_);
+    }
+}
+
+PodPool::PodPool() : size_(0), heap_bytes_(0) {
+}
+
+PodPool::~PodPool() {
+    for (size_t i = 0; i < slabs_.size(); i++) {
+        delete[] slabs_[i];
+    }
+}
+
+PodRecord* PodPool::New(const std::string& jobid, const std::string& podid) {
+    if (free_.empty()) {
+        PodRecord* slab = new PodRecord[kSlabSize];
+        slabs_.push_back(slab);
+        for (size_t i = kSlabSize; i > 0; i--) {
+            free_.push_back(&slab[i - 1]);
+        }
+    }
+    PodRecord* pod = free_.back();
+    free_.pop_back();
+    pod->podid_.assign(podid);
+    pod->jobid_ = strings_.Intern(jobid);
+    pod->endpoint_ = StringPool::Empty();
+    pod->version_ = StringPool::Empty();
+    pod->millicores_used_ = 0;
+    pod->memory_used_ = 0;
+    pod->state_ = kPodPending;
+    heap_bytes_ += pod->podid_.size();
+    size_++;
+    return pod;
+}
+
+PodRecord* PodPool::New(const PodStatus& pod_status) {
+    PodRecord* pod = New(pod_status.jobid(), pod_status.podid());
+    SetEndpoint(pod, pod_status.endpoint());
+    SetVersion(pod, pod_status.version());
+    pod->set_state(pod_status.state());
+    SetUsage(pod, pod_status);
+    return pod;
+}
+
+void PodPool::Delete(PodRecord* pod) {
+    strings_.Release(pod->jobid_);
+    strings_.Release(pod->endpoint_);
+    strings_.Release(pod->version_);
+    heap_bytes_ -= pod->podid_.size() + pod->tasks_.size();
+    std::string().swap(pod->tasks_);
+    size_--;
+    free_.push_back(pod);
+}
+
+void PodPool::SetString(const std::string& value, const std::string** field) {
+    if (**field == value) {
+        return;
+    }
+    const std::string* old = *field;
+    *field = strings_.Intern(value);
+    strings_.Release(old);
+}
+
+void PodPool::SetEndpoint(PodRecord* pod, const std::string& endpoint) {
+    SetString(endpoint, &pod->endpoint_);
+}
+
+void PodPool::SetVersion(PodRecord* pod, const std::string& version) {
+    SetString(version, &pod->version_);
+}
+
+void PodPool::SetUsage(PodRecord* pod, const PodStatus& report_pod) {
+    pod->millicores_used_ = report_pod.resource_used().millicores();
+    pod->memory_used_ = report_pod.resource_used().memory();
+    heap_bytes_ -= pod->tasks_.size();
+    std::string tasks;
+    {
+        google::protobuf::io::StringOutputStream stream(&tasks);
+        google::protobuf::io::CodedOutputStream output(&stream);
+        // length-delimited field `status` of PodStatus
+        const uint32_t tag = (PodStatus::kStatusFieldNumber << 3) | 2;
+        for (int i = 0; i < report_pod.status_size(); i++) {
+            const TaskStatus& task = report_pod.status(i);
+            output.WriteTag(tag);
+            output.WriteVarint32(task.ByteSize());
+            task.SerializeWithCachedSizes(&output);
+        }
+    }
+    // exact size, the stream over-allocates
+    std::string(tasks).swap(pod->tasks_);
+    heap_bytes_ += pod->tasks_.size();
+}
+
+void PodPool::ClearUsage(PodRecord* pod) {
+    pod->millicores_used_ = 0;
+    pod->memory_used_ = 0;
+    heap_bytes_ -= pod->tasks_.size();
+    std::string().swap(pod->tasks_);
+}
+
+int64_t PodPool::Size() const {
+    return size_;
+}
+
+int64_t PodPool::Bytes() const {
+    return slabs_.size() * kSlabSize * sizeof(PodRecord) + heap_bytes_ + strings_.Bytes();
+}
+
+}
+}
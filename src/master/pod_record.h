@@ -0,0 +1,93 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_POD_RECORD_H
+#define BAIDU_GALAXY_POD_RECORD_H
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+
+#include "proto/galaxy.pb.h"
+
+namespace baidu {
+namespace galaxy {
+
+// Strings shared by many pods: job ids, endpoints and versions. Counted,
+// so the ones of removed jobs and agents are dropped.
+class StringPool {
+public:
+    StringPool();
+    // the empty string is never stored
+    const std::string* Intern(const std::string& str);
+    void Release(const std::string* str);
+    int64_t Bytes() const;
+    static const std::string* Empty();
+private:
+    std::map<std::string, int64_t> strings_;
+    int64_t bytes_;
+};
+
+// Fixed layout master copy of a PodStatus. Shared strings are interned,
+// task statuses reported by the agent are kept encoded. The protobuf is
+// only built by ToProto, where pods leave JobManager.
+class PodRecord {
+public:
+    PodRecord() : jobid_(StringPool::Empty()), endpoint_(StringPool::Empty()),
+                  version_(StringPool::Empty()), millicores_used_(0),
+                  memory_used_(0), state_(kPodPending) {}
+    const std::string& podid() const { return podid_; }
+    const std::string& jobid() const { return *jobid_; }
+    const std::string& endpoint() const { return *endpoint_; }
+    const std::string& version() const { return *version_; }
+    PodState state() const { return static_cast<PodState>(state_); }
+    void set_state(PodState state) { state_ = state; }
+    int32_t millicores_used() const { return millicores_used_; }
+    int32_t memory_used() const { return memory_used_; }
+    void ToProto(PodStatus* pod) const;
+private:
+    friend class PodPool;
+    std::string podid_;
+    const std::string* jobid_;
+    const std::string* endpoint_;
+    const std::string* version_;
+    // PodStatus wire format of the task statuses only
+    std::string tasks_;
+    int32_t millicores_used_;
+    int32_t memory_used_;
+    int8_t state_;
+};
+
+// Slab allocator of the PodRecords of JobManager, used under its lock.
+// Deleted records are kept for reuse, pod id buffer included.
+class PodPool {
+public:
+    PodPool();
+    ~PodPool();
+    PodRecord* New(const std::string& jobid, const std::string& podid);
+    PodRecord* New(const PodStatus& pod);
+    void Delete(PodRecord* pod);
+    void SetEndpoint(PodRecord* pod, const std::string& endpoint);
+    void SetVersion(PodRecord* pod, const std::string& version);
+    // resource and task statuses reported by the agent
+    void SetUsage(PodRecord* pod, const PodStatus& report_pod);
+    void ClearUsage(PodRecord* pod);
+    int64_t Size() const;
+    // of the slabs, the strings owned by records and the interned ones
+    int64_t Bytes() const;
+private:
+    static const size_t kSlabSize = 1024;
+    void SetString(const std::string& value, const std::string** field);
+
+    std::vector<PodRecord*> slabs_;
+    std::vector<PodRecord*> free_;
+    StringPool strings_;
+    int64_t size_;
+    // pod ids and encoded task statuses of live records
+    int64_t heap_bytes_;
+};
+
+}
+}
+
+#endif
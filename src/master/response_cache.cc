@@ -0,0 +1,92 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "response_cache.h"
+
+namespace baidu {
+namespace galaxy {
+
+ResponseCache::ResponseCache(int32_t capacity)
+    : capacity_(capacity), built_(&mutex_), hits_(0), misses_(0) {
+}
+
+bool ResponseCache::Fill(const std::string& method,
+                         const ::google::protobuf::Message& request,
+                         int64_t version, const Builder& build,
+                         ::google::protobuf::Message* response) {
+    std::string key = method;
+    key.push_back('\0');
+    request.AppendToString(&key);
+    boost::shared_ptr<Entry> entry;
+    bool hit = false;
+    {
+        MutexLock lock(&mutex_);
+        std::map<std::string, boost::shared_ptr<Entry> >::iterator it = entries_.find(key);
+        if (it != entries_.end() && it->second->version >= version) {
+            entry = it->second;
+            while (entry->building) {
+                built_.Wait();
+            }
+            hits_++;
+            hit = true;
+        } else {
+            if (it == entries_.end() && entries_.size() >= (size_t)capacity_) {
+                Evict(version);
+            }
+            entry.reset(new Entry());
+            entry->version = version;
+            entries_[key] = entry;
+            misses_++;
+        }
+    }
+    if (hit) {
+        // fields of a built entry are never changed, copy them unlocked
+        response->Clear();
+        response->GetReflection()->MutableUnknownFields(response)->MergeFrom(entry->fields);
+        return true;
+    }
+    build(response);
+    std::string bytes;
+    response->SerializeToString(&bytes);
+    ::google::protobuf::UnknownFieldSet fields;
+    fields.ParseFromString(bytes);
+    MutexLock lock(&mutex_);
+    entry->fields.Swap(&fields);
+    entry->building = false;
+    built_.Broadcast();
+    return false;
+}
+
+// drops entries older than version, then any built ones while full
+void ResponseCache::Evict(int64_t version) {
+    mutex_.AssertHeld();
+    std::map<std::string, boost::shared_ptr<Entry> >::iterator it = entries_.begin();
+    while (it != entries_.end()) {
+        if (!it->second->building && it->second->version < version) {
+            entries_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    it = entries_.begin();
+    while (it != entries_.end() && entries_.size() >= (size_t)capacity_) {
+        if (!it->second->building) {
+            entries_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int64_t ResponseCache::Hits() {
+    MutexLock lock(&mutex_);
+    return hits_;
+}
+
+int64_t ResponseCache::Misses() {
+    MutexLock lock(&mutex_);
+    return misses_;
+}
+
+}
+}
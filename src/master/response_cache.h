@@ -0,0 +1,58 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_RESPONSE_CACHE_H
+#define BAIDU_GALAXY_RESPONSE_CACHE_H
+#include <string>
+#include <map>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <google/protobuf/message.h>
+#include <google/protobuf/unknown_field_set.h>
+
+#include <mutex.h>
+
+namespace baidu {
+namespace galaxy {
+
+// Serialized responses of read-only RPCs, keyed by method and request.
+// An entry is valid for the query snapshot version it was built from and
+// any older one. Identical requests missing at the same time wait for a
+// single build.
+//
+// Entries keep the response as an UnknownFieldSet parsed from its bytes,
+// nested messages stay length-delimited blobs. A hit only copies them to
+// the response, which serializes them verbatim, nothing is rebuilt or
+// re-encoded.
+class ResponseCache {
+public:
+    typedef boost::function<void (::google::protobuf::Message*)> Builder;
+    explicit ResponseCache(int32_t capacity);
+    // response is built by build on a miss and copied from the entry on
+    // a hit, returns true on a hit
+    bool Fill(const std::string& method, const ::google::protobuf::Message& request,
+              int64_t version, const Builder& build,
+              ::google::protobuf::Message* response);
+    int64_t Hits();
+    int64_t Misses();
+private:
+    struct Entry {
+        int64_t version;
+        bool building;
+        ::google::protobuf::UnknownFieldSet fields;
+        Entry() : version(0), building(true) {}
+    };
+    void Evict(int64_t version);
+
+    int32_t capacity_;
+    Mutex mutex_;
+    CondVar built_;
+    std::map<std::string, boost::shared_ptr<Entry> > entries_;
+    int64_t hits_;
+    int64_t misses_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,230 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "watch_log.h"
+
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <gflags/gflags.h>
+#include <timer.h>
+
+DECLARE_int32(master_watch_log_size);
+DECLARE_int32(master_watch_max_events);
+DECLARE_int32(master_watch_timeout);
+
+namespace baidu {
+namespace galaxy {
+
+// Revisions start from the clock, so those of a previous master are
+// older than anything this one has kept and get a compacted response.
+WatchLog::WatchLog()
+    : revision_(common::timer::get_micros()),
+      notified_revision_(revision_),
+      next_watcher_id_(0),
+      notify_scheduled_(false),
+      thread_pool_(1) {
+}
+
+WatchLog::~WatchLog() {
+}
+
+void WatchLog::Append(WatchEvent* event) {
+    MutexLock lock(&mutex_);
+    event->set_revision(++revision_);
+    events_.push_back(*event);
+    while (events_.size() > (size_t)FLAGS_master_watch_log_size) {
+        events_.pop_front();
+    }
+    if (watchers_.empty()) {
+        notified_revision_ = revision_;
+        return;
+    }
+    // one notify serves all events appended until it runs
+    if (!notify_scheduled_) {
+        notify_scheduled_ = true;
+        thread_pool_.AddTask(boost::bind(&WatchLog::Notify, this));
+    }
+}
+
+int64_t WatchLog::Revision() {
+    MutexLock lock(&mutex_);
+    return revision_;
+}
+
+int32_t WatchLog::WatcherNum() {
+    MutexLock lock(&mutex_);
+    return watchers_.size();
+}
+
+// Returns false when the request has to wait for more events.
+bool WatchLog::FillEvents(const WatchRequest& request, WatchResponse* response) {
+    mutex_.AssertHeld();
+    response->set_status(kOk);
+    int64_t from = request.revision();
+    if (from <= 0) {
+        response->set_revision(revision_);
+        return true;
+    }
+    int64_t first = events_.empty() ? revision_ + 1 : events_.front().revision();
+    if (from > revision_ || from < first - 1) {
+        response->set_compacted(true);
+        response->set_revision(revision_);
+        return true;
+    }
+    std::set<std::string> jobids(request.jobids().begin(), request.jobids().end());
+    int64_t last = from;
+    for (size_t i = from + 1 - first;
+         i < events_.size() && response->events_size() < FLAGS_master_watch_max_events;
+         i++) {
+        const WatchEvent& event = events_[i];
+        last = event.revision();
+        if (jobids.empty() || jobids.find(event.jobid()) != jobids.end()) {
+            response->add_events()->CopyFrom(event);
+        }
+    }
+    if (response->events_size() == 0) {
+        return false;
+    }
+    response->set_revision(last);
+    return true;
+}
+
+void WatchLog::Watch(const WatchRequest* request, WatchResponse* response,
+                     ::google::protobuf::Closure* done) {
+    {
+        MutexLock lock(&mutex_);
+        if (!FillEvents(*request, response)) {
+            int64_t watcher_id = next_watcher_id_++;
+            Watcher& watcher = watchers_[watcher_id];
+            watcher.request = request;
+            watcher.response = response;
+            watcher.done = done;
+            watcher.revision = revision_;
+            if (request->jobids_size() == 0) {
+                all_job_watchers_.insert(watcher_id);
+            }
+            for (int i = 0; i < request->jobids_size(); i++) {
+                job_watchers_[request->jobids(i)].insert(watcher_id);
+            }
+            int32_t timeout = FLAGS_master_watch_timeout;
+            if (request->timeout() > 0) {
+                timeout = std::min(request->timeout(), timeout);
+            }
+            thread_pool_.DelayTask(timeout, boost::bind(&WatchLog::Expire, this, watcher_id));
+            return;
+        }
+    }
+    done->Run();
+}
+
+// Looks only at the events appended since the previous run.
+void WatchLog::Notify() {
+    std::vector< ::google::protobuf::Closure*> dones;
+    {
+        MutexLock lock(&mutex_);
+        notify_scheduled_ = false;
+        std::set<int64_t> answered;
+        int64_t first = events_.empty() ? revision_ + 1 : events_.front().revision();
+        size_t next = 0;
+        if (notified_revision_ >= first - 1) {
+            next = notified_revision_ + 1 - first;
+        } else {
+            // dropped before they were handed out, whoever has not seen
+            // them has to list again
+            std::map<int64_t, Watcher>::iterator it = watchers_.begin();
+            for (; it != watchers_.end(); ++it) {
+                if (it->second.revision < first - 1) {
+                    it->second.response->set_compacted(true);
+                    answered.insert(it->first);
+                }
+            }
+        }
+        for (; next < events_.size(); next++) {
+            const WatchEvent& event = events_[next];
+            HandOut(all_job_watchers_, event, &answered);
+            std::map<std::string, std::set<int64_t> >::iterator job_it;
+            job_it = job_watchers_.find(event.jobid());
+            if (job_it != job_watchers_.end()) {
+                HandOut(job_it->second, event, &answered);
+            }
+        }
+        notified_revision_ = revision_;
+        std::set<int64_t>::iterator id_it = answered.begin();
+        for (; id_it != answered.end(); ++id_it) {
+            std::map<int64_t, Watcher>::iterator it = watchers_.find(*id_it);
+            Watcher& watcher = it->second;
+            // a full response ends at its last event, the others have seen all
+            if (watcher.response->compacted()
+                || watcher.response->events_size() < FLAGS_master_watch_max_events) {
+                watcher.response->set_revision(revision_);
+            } else {
+                watcher.response->set_revision(watcher.revision);
+            }
+            dones.push_back(Remove(it));
+        }
+    }
+    for (size_t i = 0; i < dones.size(); i++) {
+        dones[i]->Run();
+    }
+}
+
+void WatchLog::HandOut(const std::set<int64_t>& watcher_ids, const WatchEvent& event,
+                       std::set<int64_t>* answered) {
+    mutex_.AssertHeld();
+    std::set<int64_t>::const_iterator id_it = watcher_ids.begin();
+    for (; id_it != watcher_ids.end(); ++id_it) {
+        Watcher& watcher = watchers_[*id_it];
+        if (event.revision() <= watcher.revision
+            || watcher.response->compacted()
+            || watcher.response->events_size() >= FLAGS_master_watch_max_events) {
+            continue;
+        }
+        watcher.response->add_events()->CopyFrom(event);
+        watcher.revision = event.revision();
+        answered->insert(*id_it);
+    }
+}
+
+::google::protobuf::Closure* WatchLog::Remove(std::map<int64_t, Watcher>::iterator it) {
+    mutex_.AssertHeld();
+    const WatchRequest* request = it->second.request;
+    if (request->jobids_size() == 0) {
+        all_job_watchers_.erase(it->first);
+    }
+    for (int i = 0; i < request->jobids_size(); i++) {
+        std::map<std::string, std::set<int64_t> >::iterator job_it;
+        job_it = job_watchers_.find(request->jobids(i));
+        if (job_it == job_watchers_.end()) {
+            continue;
+        }
+        job_it->second.erase(it->first);
+        if (job_it->second.empty()) {
+            job_watchers_.erase(job_it);
+        }
+    }
+    ::google::protobuf::Closure* done = it->second.done;
+    watchers_.erase(it);
+    return done;
+}
+
+void WatchLog::Expire(int64_t watcher_id) {
+    ::google::protobuf::Closure* done = NULL;
+    {
+        MutexLock lock(&mutex_);
+        std::map<int64_t, Watcher>::iterator it = watchers_.find(watcher_id);
+        if (it == watchers_.end()) {
+            return;
+        }
+        // none of the events handed out so far is watched, skip them next
+        // time; the ones after are left to the next request
+        Watcher& watcher = it->second;
+        watcher.response->set_revision(std::max(watcher.revision, notified_revision_));
+        done = Remove(it);
+    }
+    done->Run();
+}
+
+}
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_WATCH_LOG_H
+#define BAIDU_GALAXY_WATCH_LOG_H
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+
+#include <mutex.h>
+#include <thread_pool.h>
+#include "proto/master.pb.h"
+
+namespace baidu {
+namespace galaxy {
+
+// In-memory log of job and pod state transitions behind the Watch RPC.
+// Each event gets the next revision, only the latest master_watch_log_size
+// ones are kept. Watch requests with nothing to return are parked until
+// an event they care about is appended or their timeout expires. Parked
+// watchers are indexed by job id, each event appended is looked at once
+// and handed to the watchers of its job.
+class WatchLog {
+public:
+    WatchLog();
+    ~WatchLog();
+    // sets the revision of event, cheap enough to call under JobManager lock
+    void Append(WatchEvent* event);
+    // done is run once response is filled, possibly from another thread
+    void Watch(const WatchRequest* request, WatchResponse* response,
+               ::google::protobuf::Closure* done);
+    int64_t Revision();
+    int32_t WatcherNum();
+private:
+    struct Watcher {
+        const WatchRequest* request;
+        WatchResponse* response;
+        ::google::protobuf::Closure* done;
+        // the events up to it have been looked at for this watcher
+        int64_t revision;
+    };
+    bool FillEvents(const WatchRequest& request, WatchResponse* response);
+    void Notify();
+    // adds event to the responses of watcher_ids not full yet
+    void HandOut(const std::set<int64_t>& watcher_ids, const WatchEvent& event,
+                 std::set<int64_t>* answered);
+    void Expire(int64_t watcher_id);
+    // takes the watcher out of watchers_ and the indexes
+    ::google::protobuf::Closure* Remove(std::map<int64_t, Watcher>::iterator it);
+
+    Mutex mutex_;
+    std::deque<WatchEvent> events_;
+    // of the newest event
+    int64_t revision_;
+    // of the newest event Notify has handed out
+    int64_t notified_revision_;
+    std::map<int64_t, Watcher> watchers_;
+    // ids of the parked watchers of each job, the ones of all jobs apart
+    std::map<std::string, std::set<int64_t> > job_watchers_;
+    std::set<int64_t> all_job_watchers_;
+    int64_t next_watcher_id_;
+    bool notify_scheduled_;
+    ThreadPool thread_pool_;
+};
+
+}
+}
+
+#endif
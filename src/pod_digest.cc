@@ -0,0 +1,115 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "pod_digest.h"
+
+namespace baidu {
+namespace galaxy {
+
+static const uint64_t kFnvOffset = 14695981039346656037ULL;
+static const uint64_t kFnvPrime = 1099511628211ULL;
+
+static uint64_t FnvHash(uint64_t hash, const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+PodDigest::PodDigest() : root_(0), root_dirty_(true) {
+    for (int32_t i = 0; i < kBucketNum; i++) {
+        buckets_[i] = 0;
+    }
+}
+
+void PodDigest::Add(const std::string& podid, const std::string& version) {
+    Toggle(podid, version);
+}
+
+// xor is its own inverse
+void PodDigest::Remove(const std::string& podid, const std::string& version) {
+    Toggle(podid, version);
+}
+
+void PodDigest::Toggle(const std::string& podid, const std::string& version) {
+    uint64_t hash = FnvHash(kFnvOffset, podid.data(), podid.size());
+    // keeps ("ab", "c") apart from ("a", "bc")
+    hash = FnvHash(hash, "", 1);
+    hash = FnvHash(hash, version.data(), version.size());
+    buckets_[BucketOf(podid)] ^= hash;
+    root_dirty_ = true;
+}
+
+uint64_t PodDigest::Root() {
+    if (root_dirty_) {
+        root_ = FnvHash(kFnvOffset, reinterpret_cast<const char*>(buckets_),
+                        sizeof(buckets_));
+        root_dirty_ = false;
+    }
+    return root_;
+}
+
+uint64_t PodDigest::Bucket(int32_t bucket) const {
+    return buckets_[bucket];
+}
+
+int32_t PodDigest::BucketOf(const std::string& podid) {
+    return FnvHash(kFnvOffset, podid.data(), podid.size()) % kBucketNum;
+}
+
+void RunningPods::Reset(const std::vector<PodStatus>& pods) {
+    pods_.clear();
+    digest_ = PodDigest();
+    for (size_t i = 0; i < pods.size(); i++) {
+        const PodStatus& pod = pods[i];
+        if (pods_.find(pod.podid()) != pods_.end()) {
+            continue;
+        }
+        pods_[pod.podid()] = pod;
+        digest_.Add(pod.podid(), pod.version());
+    }
+}
+
+void RunningPods::Remove(const std::string& podid) {
+    std::map<std::string, PodStatus>::iterator it = pods_.find(podid);
+    if (it == pods_.end()) {
+        return;
+    }
+    digest_.Remove(podid, it->second.version());
+    pods_.erase(it);
+}
+
+uint64_t RunningPods::Root() {
+    return digest_.Root();
+}
+
+bool RunningPods::Diff(const std::vector<uint64_t>& bucket_digests,
+                       std::vector<PodStatus>* pods,
+                       std::vector<int32_t>* mismatched_buckets) const {
+    if (bucket_digests.size() != (size_t)PodDigest::kBucketNum) {
+        return false;
+    }
+    std::vector<bool> mismatched(PodDigest::kBucketNum, false);
+    for (int32_t i = 0; i < PodDigest::kBucketNum; i++) {
+        if (digest_.Bucket(i) != bucket_digests[i]) {
+            mismatched[i] = true;
+            mismatched_buckets->push_back(i);
+        }
+    }
+    if (mismatched_buckets->empty()) {
+        return true;
+    }
+    std::map<std::string, PodStatus>::const_iterator it = pods_.begin();
+    for (; it != pods_.end(); ++it) {
+        if (mismatched[PodDigest::BucketOf(it->first)]) {
+            pods->push_back(it->second);
+        }
+    }
+    return true;
+}
+
+}
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
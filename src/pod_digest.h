@@ -0,0 +1,62 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_POD_DIGEST_H
+#define BAIDU_GALAXY_POD_DIGEST_H
+
+#include <string>
+#include <map>
+#include <vector>
+#include <stdint.h>
+
+#include "proto/galaxy.pb.h"
+
+namespace baidu {
+namespace galaxy {
+
+// Two level digest of the pods on an agent, kept by the agent for what it
+// runs and by master for what it expects there. A pod hashes its id and
+// version into the bucket of its id, a bucket is the xor of its pod
+// hashes and the root hashes all buckets. Adding or removing a pod is
+// O(1), and two digests with different roots are told apart bucket by
+// bucket without listing the pods of the equal ones.
+class PodDigest {
+public:
+    static const int32_t kBucketNum = 64;
+    PodDigest();
+    void Add(const std::string& podid, const std::string& version);
+    void Remove(const std::string& podid, const std::string& version);
+    uint64_t Root();
+    uint64_t Bucket(int32_t bucket) const;
+    static int32_t BucketOf(const std::string& podid);
+private:
+    void Toggle(const std::string& podid, const std::string& version);
+    uint64_t buckets_[kBucketNum];
+    uint64_t root_;
+    bool root_dirty_;
+};
+
+// Pods an agent runs as gced lists them, the source of its full Query, and
+// their digest. It is rebuilt from every listing, so an agent restarted
+// under a running gced reports the pods still there.
+class RunningPods {
+public:
+    void Reset(const std::vector<PodStatus>& pods);
+    // the pod is killed, until the next listing
+    void Remove(const std::string& podid);
+    uint64_t Root();
+    // pods in the buckets whose digest differs from bucket_digests, which
+    // buckets differ goes to mismatched_buckets; false for a malformed
+    // bucket_digests
+    bool Diff(const std::vector<uint64_t>& bucket_digests,
+              std::vector<PodStatus>* pods,
+              std::vector<int32_t>* mismatched_buckets) const;
+private:
+    std::map<std::string, PodStatus> pods_;
+    PodDigest digest_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,174 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "relay_impl.h"
+
+#include <boost/bind.hpp>
+#include <gflags/gflags.h>
+#include <snappy.h>
+#include <logging.h>
+
+DECLARE_string(nexus_servers);
+DECLARE_string(nexus_root_path);
+DECLARE_string(master_path);
+DECLARE_string(relay_path);
+DECLARE_string(relay_ip);
+DECLARE_string(relay_port);
+DECLARE_int32(relay_flush_interval);
+
+namespace baidu {
+namespace galaxy {
+
+RelayImpl::RelayImpl() : master_reachable_(true), master_(NULL), flush_thread_(1) {
+    endpoint_ = FLAGS_relay_ip + ":" + FLAGS_relay_port;
+    nexus_ = new InsSDK(FLAGS_nexus_servers);
+}
+
+RelayImpl::~RelayImpl() {
+    flush_thread_.Stop(false);
+    delete master_;
+    delete nexus_;
+}
+
+bool RelayImpl::Init() {
+    if (!WatchMasterPath()) {
+        return false;
+    }
+    std::string master_path_key = FLAGS_nexus_root_path + FLAGS_master_path;
+    ::galaxy::ins::sdk::SDKError err;
+    std::string master_endpoint;
+    if (!nexus_->Get(master_path_key, &master_endpoint, &err)) {
+        LOG(WARNING, "fail to get master endpoint from nexus, err_code: %d", err);
+        return false;
+    }
+    HandleMasterChange(master_endpoint);
+    if (!RegistToNexus()) {
+        return false;
+    }
+    flush_thread_.DelayTask(FLAGS_relay_flush_interval, boost::bind(&RelayImpl::Flush, this));
+    return true;
+}
+
+void RelayImpl::HeartBeat(::google::protobuf::RpcController* /*controller*/,
+                          const ::baidu::galaxy::HeartBeatRequest* request,
+                          ::baidu::galaxy::HeartBeatResponse* response,
+                          ::google::protobuf::Closure* done) {
+    {
+        MutexLock lock(&mutex_);
+        if (!master_reachable_) {
+            response->set_status(kRpcError);
+            done->Run();
+            return;
+        }
+        AgentHeartBeat& heartbeat = heartbeats_[request->endpoint()];
+        if (request->sequence() >= heartbeat.sequence()) {
+            heartbeat.set_endpoint(request->endpoint());
+            heartbeat.set_sequence(request->sequence());
+            heartbeat.set_pod_digest(request->pod_digest());
+        }
+    }
+    response->set_status(kOk);
+    done->Run();
+}
+
+// Undelivered heartbeats are dropped, master would take them for fresh
+// ones once they arrive. While master is unreachable agents are turned
+// away and an empty batch probes it.
+void RelayImpl::Flush() {
+    std::map<std::string, AgentHeartBeat> heartbeats;
+    bool probe = false;
+    {
+        MutexLock lock(&mutex_);
+        heartbeats.swap(heartbeats_);
+        probe = !master_reachable_;
+    }
+    if (!heartbeats.empty() || probe) {
+        HeartBeatBatch batch;
+        std::map<std::string, AgentHeartBeat>::iterator it = heartbeats.begin();
+        for (; it != heartbeats.end(); ++it) {
+            batch.add_heartbeats()->CopyFrom(it->second);
+        }
+        std::string raw;
+        batch.SerializeToString(&raw);
+        BatchHeartBeatRequest request;
+        BatchHeartBeatResponse response;
+        request.set_relay(endpoint_);
+        snappy::Compress(raw.data(), raw.size(), request.mutable_heartbeats());
+        bool ok = false;
+        {
+            MutexLock lock(&mutex_master_endpoint_);
+            if (master_ != NULL) {
+                ok = rpc_client_.SendRequest(master_, &Master_Stub::BatchHeartBeat,
+                                             &request, &response, 5, 1)
+                     && response.status() == kOk;
+            }
+        }
+        if (ok) {
+            LOG(DEBUG, "forward %lu heartbeats in %lu bytes",
+                heartbeats.size(), request.heartbeats().size());
+        } else {
+            LOG(WARNING, "forward %lu heartbeats to master %s failed, dropped",
+                heartbeats.size(), master_endpoint_.c_str());
+        }
+        MutexLock lock(&mutex_);
+        if (ok != master_reachable_) {
+            LOG(INFO, "%s", ok ? "master reachable again, accept agents"
+                               : "master unreachable, turn agents away");
+        }
+        master_reachable_ = ok;
+    }
+    flush_thread_.DelayTask(FLAGS_relay_flush_interval, boost::bind(&RelayImpl::Flush, this));
+}
+
+static void OnMasterChange(const ::galaxy::ins::sdk::WatchParam& param,
+                           ::galaxy::ins::sdk::SDKError /*error*/) {
+    RelayImpl* relay = static_cast<RelayImpl*>(param.context);
+    relay->HandleMasterChange(param.value);
+}
+
+void RelayImpl::HandleMasterChange(const std::string& new_master_endpoint) {
+    if (!WatchMasterPath()) {
+        LOG(WARNING, "watch master again failed");
+    }
+    MutexLock lock(&mutex_master_endpoint_);
+    if (new_master_endpoint.empty()) {
+        LOG(WARNING, "the master endpoint is deleted from nexus");
+        return;
+    }
+    if (new_master_endpoint != master_endpoint_) {
+        LOG(INFO, "master change to %s", new_master_endpoint.c_str());
+        master_endpoint_ = new_master_endpoint;
+        delete master_;
+        master_ = NULL;
+        rpc_client_.GetStub(master_endpoint_, &master_);
+    }
+}
+
+bool RelayImpl::WatchMasterPath() {
+    std::string master_path_key = FLAGS_nexus_root_path + FLAGS_master_path;
+    ::galaxy::ins::sdk::SDKError err;
+    bool ok = nexus_->Watch(master_path_key, &OnMasterChange, this, &err);
+    if (!ok) {
+        LOG(WARNING, "fail to watch on nexus, err_code: %d", err);
+    }
+    return ok;
+}
+
+// The key is held by the nexus session, so agents stop finding a relay
+// that went away.
+bool RelayImpl::RegistToNexus() {
+    std::string relay_key = FLAGS_nexus_root_path + FLAGS_relay_path + "/" + endpoint_;
+    ::galaxy::ins::sdk::SDKError err;
+    if (!nexus_->Lock(relay_key, &err)) {
+        LOG(WARNING, "fail to register relay %s on nexus, err_code: %d",
+            relay_key.c_str(), err);
+        return false;
+    }
+    LOG(INFO, "relay registered on nexus: %s", relay_key.c_str());
+    return true;
+}
+
+}
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
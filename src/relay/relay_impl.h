@@ -0,0 +1,55 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_RELAY_IMPL_H
+#define BAIDU_GALAXY_RELAY_IMPL_H
+
+#include <map>
+#include <string>
+#include <mutex.h>
+#include <thread_pool.h>
+
+#include "proto/master.pb.h"
+#include "proto/relay.pb.h"
+#include "rpc/rpc_client.h"
+#include "ins_sdk.h"
+
+using ::galaxy::ins::sdk::InsSDK;
+
+namespace baidu {
+namespace galaxy {
+
+class RelayImpl : public Relay {
+public:
+    RelayImpl();
+    virtual ~RelayImpl();
+    // finds master and registers this relay on nexus for agents
+    bool Init();
+    virtual void HeartBeat(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::HeartBeatRequest* request,
+                           ::baidu::galaxy::HeartBeatResponse* response,
+                           ::google::protobuf::Closure* done);
+    void HandleMasterChange(const std::string& new_master_endpoint);
+private:
+    bool WatchMasterPath();
+    bool RegistToNexus();
+    void Flush();
+private:
+    std::string endpoint_;
+    Mutex mutex_;
+    // latest heartbeat of each agent heard from since the last flush
+    std::map<std::string, AgentHeartBeat> heartbeats_;
+    // whether the last flush reached master
+    bool master_reachable_;
+    Mutex mutex_master_endpoint_;
+    std::string master_endpoint_;
+    Master_Stub* master_;
+    RpcClient rpc_client_;
+    InsSDK* nexus_;
+    ThreadPool flush_thread_;
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,53 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include <signal.h>
+#include <unistd.h>
+#include <string>
+
+#include <sofa/pbrpc/pbrpc.h>
+#include <gflags/gflags.h>
+#include <logging.h>
+
+#include "relay_impl.h"
+
+using baidu::common::Log;
+using baidu::common::FATAL;
+using baidu::common::INFO;
+using baidu::common::WARNING;
+
+DECLARE_string(relay_port);
+
+static volatile bool s_quit = false;
+static void SignalIntHandler(int /*sig*/){
+    s_quit = true;
+}
+
+int main(int argc, char* argv[]) {
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    sofa::pbrpc::RpcServerOptions options;
+    sofa::pbrpc::RpcServer rpc_server(options);
+    baidu::galaxy::RelayImpl* relay_impl = new baidu::galaxy::RelayImpl();
+    if (!rpc_server.RegisterService(static_cast<baidu::galaxy::Relay*>(relay_impl))) {
+        LOG(FATAL, "failed to register relay service");
+        exit(-1);
+    }
+    std::string server_addr = "0.0.0.0:" + FLAGS_relay_port;
+    if (!rpc_server.Start(server_addr)) {
+        LOG(FATAL, "failed to start galaxy relay on %s", server_addr.c_str());
+        exit(-2);
+    }
+    // agents find it on nexus only once it can serve them
+    if (!relay_impl->Init()) {
+        LOG(FATAL, "relay init failed");
+        exit(-3);
+    }
+    signal(SIGINT, SignalIntHandler);
+    signal(SIGTERM, SignalIntHandler);
+    while (!s_quit) {
+        sleep(1);
+    }
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
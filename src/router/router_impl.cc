@@ -0,0 +1,732 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "router_impl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <gflags/gflags.h>
+#include <snappy.h>
+#include <logging.h>
+#include <timer.h>
+
+#include "master/master_util.h"
+
+DECLARE_string(nexus_servers);
+DECLARE_string(nexus_root_path);
+DECLARE_string(master_path);
+DECLARE_string(master_lock_path);
+DECLARE_int32(master_shard_num);
+DECLARE_string(router_port);
+DECLARE_int32(router_threads);
+DECLARE_int32(router_rpc_timeout);
+DECLARE_int32(relay_flush_interval);
+DECLARE_int32(master_lease_timeout);
+
+namespace baidu {
+namespace galaxy {
+
+// One Watch sent to the shards it covers. It is answered by the first
+// shard with events, or once all of them have answered, and freed with
+// the last shard response.
+struct RouterImpl::WatchFanOut {
+    Mutex mutex;
+    WatchResponse* response;
+    ::google::protobuf::Closure* done;
+    std::vector<int64_t> revisions;
+    int32_t pending;
+    bool answered;
+};
+
+RouterImpl::RouterImpl()
+    : shard_endpoints_(FLAGS_master_shard_num),
+      next_shard_(0),
+      leasing_(FLAGS_master_shard_num, false),
+      wanted_(FLAGS_master_shard_num),
+      start_time_(common::timer::get_micros()),
+      lease_answered_(FLAGS_master_shard_num, common::timer::get_micros()),
+      workers_(FLAGS_router_threads),
+      flush_thread_(1) {
+    kv_store_ = KvStore::Open(FLAGS_nexus_servers);
+}
+
+RouterImpl::~RouterImpl() {
+    flush_thread_.Stop(false);
+    workers_.Stop(false);
+    delete kv_store_;
+}
+
+std::string RouterImpl::ShardMasterKey(int32_t shard) {
+    return MasterUtil::ShardRootPath(shard) + FLAGS_master_path;
+}
+
+bool RouterImpl::WatchShard(int32_t shard) {
+    bool ok = kv_store_->Watch(ShardMasterKey(shard),
+                               boost::bind(&RouterImpl::HandleShardChange, this, _1, _2, _3));
+    if (!ok) {
+        LOG(WARNING, "fail to watch shard %d on nexus", shard);
+    }
+    return ok;
+}
+
+void RouterImpl::HandleShardChange(const std::string& key, const std::string& endpoint,
+                                   bool /*deleted*/) {
+    for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+        if (ShardMasterKey(shard) != key) {
+            continue;
+        }
+        WatchShard(shard);
+        MutexLock lock(&mutex_);
+        LOG(INFO, "shard %d master change to %s", shard, endpoint.c_str());
+        shard_endpoints_[shard] = endpoint;
+        return;
+    }
+}
+
+bool RouterImpl::Init() {
+    for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+        if (!WatchShard(shard)) {
+            return false;
+        }
+        std::string endpoint;
+        if (!kv_store_->Get(ShardMasterKey(shard), &endpoint)) {
+            LOG(WARNING, "shard %d has no master yet", shard);
+        }
+        MutexLock lock(&mutex_);
+        shard_endpoints_[shard] = endpoint;
+    }
+    AcquireMasterLock();
+    flush_thread_.DelayTask(FLAGS_relay_flush_interval,
+                            boost::bind(&RouterImpl::FlushHeartBeats, this));
+    return true;
+}
+
+void RouterImpl::AcquireMasterLock() {
+    std::string master_lock = FLAGS_nexus_root_path + FLAGS_master_lock_path;
+    if (!kv_store_->Lock(master_lock)) { //whould block until accquired
+        LOG(FATAL, "fail to lock %s on nexus, die.", master_lock.c_str());
+        abort();
+    }
+    std::string router_endpoint = MasterUtil::SelfEndpoint(FLAGS_router_port);
+    std::string master_path_key = FLAGS_nexus_root_path + FLAGS_master_path;
+    if (!kv_store_->Put(master_path_key, router_endpoint)) {
+        LOG(FATAL, "fail to register router on nexus, die.");
+        abort();
+    }
+    LOG(INFO, "router lock [ok].  %s -> %s",
+        master_path_key.c_str(), router_endpoint.c_str());
+}
+
+template <class Request, class Response>
+bool RouterImpl::CallShard(int32_t shard,
+                           void (Master_Stub::*method)(::google::protobuf::RpcController*,
+                                                       const Request*, Response*,
+                                                       ::google::protobuf::Closure*),
+                           const Request* request, Response* response) {
+    std::string endpoint;
+    {
+        MutexLock lock(&mutex_);
+        endpoint = shard_endpoints_[shard];
+    }
+    if (endpoint.empty()) {
+        LOG(WARNING, "shard %d has no master", shard);
+        return false;
+    }
+    Master_Stub* stub = NULL;
+    rpc_client_.GetStub(endpoint, &stub);
+    boost::scoped_ptr<Master_Stub> stub_ptr(stub);
+    return rpc_client_.SendRequest(stub, method, request, response,
+                                   FLAGS_router_rpc_timeout, 1);
+}
+
+template <class Request, class Response>
+void RouterImpl::ForwardToShard(int32_t shard,
+                                void (Master_Stub::*method)(::google::protobuf::RpcController*,
+                                                            const Request*, Response*,
+                                                            ::google::protobuf::Closure*),
+                                ::google::protobuf::RpcController* controller,
+                                const Request* request, Response* response,
+                                ::google::protobuf::Closure* done) {
+    if (!CallShard(shard, method, request, response)) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "shard %d unavailable", shard);
+        controller->SetFailed(buf);
+    }
+    done->Run();
+}
+
+// new jobs are spread over shards in turn
+void RouterImpl::SubmitJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::SubmitJobRequest* request,
+                           ::baidu::galaxy::SubmitJobResponse* response,
+                           ::google::protobuf::Closure* done) {
+    int32_t shard = 0;
+    {
+        MutexLock lock(&mutex_);
+        shard = next_shard_;
+        next_shard_ = (next_shard_ + 1) % FLAGS_master_shard_num;
+    }
+    workers_.AddTask(boost::bind(&RouterImpl::ForwardToShard<SubmitJobRequest, SubmitJobResponse>,
+                                 this, shard, &Master_Stub::SubmitJob,
+                                 controller, request, response, done));
+}
+
+template <class Request, class Response>
+void RouterImpl::RouteByJobId(void (Master_Stub::*method)(::google::protobuf::RpcController*,
+                                                          const Request*, Response*,
+                                                          ::google::protobuf::Closure*),
+                              ::google::protobuf::RpcController* controller,
+                              const Request* request, Response* response,
+                              ::google::protobuf::Closure* done) {
+    int32_t shard = MasterUtil::ShardOf(request->jobid());
+    if (shard < 0 || shard >= FLAGS_master_shard_num) {
+        response->set_status(kJobNotFound);
+        done->Run();
+        return;
+    }
+    workers_.AddTask(boost::bind(&RouterImpl::ForwardToShard<Request, Response>,
+                                 this, shard, method, controller, request, response, done));
+}
+
+void RouterImpl::UpdateJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::UpdateJobRequest* request,
+                           ::baidu::galaxy::UpdateJobResponse* response,
+                           ::google::protobuf::Closure* done) {
+    RouteByJobId(&Master_Stub::UpdateJob, controller, request, response, done);
+}
+
+void RouterImpl::SuspendJob(::google::protobuf::RpcController* controller,
+                            const ::baidu::galaxy::SuspendJobRequest* request,
+                            ::baidu::galaxy::SuspendJobResponse* response,
+                            ::google::protobuf::Closure* done) {
+    RouteByJobId(&Master_Stub::SuspendJob, controller, request, response, done);
+}
+
+void RouterImpl::ResumeJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::ResumeJobRequest* request,
+                           ::baidu::galaxy::ResumeJobResponse* response,
+                           ::google::protobuf::Closure* done) {
+    RouteByJobId(&Master_Stub::ResumeJob, controller, request, response, done);
+}
+
+void RouterImpl::TerminateJob(::google::protobuf::RpcController* controller,
+                              const ::baidu::galaxy::TerminateJobRequest* request,
+                              ::baidu::galaxy::TerminateJobResponse* response,
+                              ::google::protobuf::Closure* done) {
+    RouteByJobId(&Master_Stub::TerminateJob, controller, request, response, done);
+}
+
+void RouterImpl::ShowJob(::google::protobuf::RpcController* /*controller*/,
+                         const ::baidu::galaxy::ShowJobRequest* request,
+                         ::baidu::galaxy::ShowJobResponse* response,
+                         ::google::protobuf::Closure* done) {
+    workers_.AddTask(boost::bind(&RouterImpl::DoShowJob, this, request, response, done));
+}
+
+void RouterImpl::DoShowJob(const ShowJobRequest* request, ShowJobResponse* response,
+                           ::google::protobuf::Closure* done) {
+    std::map<int32_t, ShowJobRequest> shard_requests;
+    for (int i = 0; i < request->jobsid_size(); i++) {
+        int32_t shard = MasterUtil::ShardOf(request->jobsid(i));
+        if (shard < 0 || shard >= FLAGS_master_shard_num) {
+            continue;
+        }
+        ShowJobRequest& shard_request = shard_requests[shard];
+        shard_request.set_with_pods(request->with_pods());
+        shard_request.add_jobsid(request->jobsid(i));
+    }
+    response->set_status(kOk);
+    std::map<int32_t, ShowJobRequest>::iterator it = shard_requests.begin();
+    for (; it != shard_requests.end(); ++it) {
+        ShowJobResponse shard_response;
+        if (!CallShard(it->first, &Master_Stub::ShowJob, &it->second, &shard_response)) {
+            response->set_status(kRpcError);
+            continue;
+        }
+        response->mutable_jobs()->MergeFrom(shard_response.jobs());
+    }
+    done->Run();
+}
+
+void RouterImpl::ListJobs(::google::protobuf::RpcController* /*controller*/,
+                          const ::baidu::galaxy::ListJobsRequest* request,
+                          ::baidu::galaxy::ListJobsResponse* response,
+                          ::google::protobuf::Closure* done) {
+    workers_.AddTask(boost::bind(&RouterImpl::DoListJobs, this, request, response, done));
+}
+
+// Shards own consecutive job id ranges, so a page continues in the shard
+// of its token and then moves on to the next shards in order.
+void RouterImpl::DoListJobs(const ListJobsRequest* request, ListJobsResponse* response,
+                            ::google::protobuf::Closure* done) {
+    int32_t shard = 0;
+    std::string page_token = request->page_token();
+    if (!page_token.empty()) {
+        shard = MasterUtil::ShardOf(page_token);
+        if (shard < 0) {
+            response->set_status(kInputError);
+            done->Run();
+            return;
+        }
+    }
+    response->set_status(kOk);
+    for (; shard < FLAGS_master_shard_num; shard++) {
+        ListJobsRequest shard_request;
+        shard_request.CopyFrom(*request);
+        shard_request.set_page_token(page_token);
+        if (request->page_size() > 0) {
+            shard_request.set_page_size(request->page_size() - response->jobs_size());
+        }
+        ListJobsResponse shard_response;
+        if (!CallShard(shard, &Master_Stub::ListJobs, &shard_request, &shard_response)
+            || shard_response.status() != kOk) {
+            response->set_status(kRpcError);
+            break;
+        }
+        response->mutable_jobs()->MergeFrom(shard_response.jobs());
+        if (!shard_response.next_page_token().empty()) {
+            response->set_next_page_token(shard_response.next_page_token());
+            break;
+        }
+        // sorts before every job id of the next shard
+        page_token = MasterUtil::ShardPrefix(shard + 1);
+        if (request->page_size() > 0 && response->jobs_size() >= request->page_size()
+            && shard + 1 < FLAGS_master_shard_num) {
+            response->set_next_page_token(page_token);
+            break;
+        }
+    }
+    done->Run();
+}
+
+void RouterImpl::ListAgents(::google::protobuf::RpcController* /*controller*/,
+                            const ::baidu::galaxy::ListAgentsRequest* request,
+                            ::baidu::galaxy::ListAgentsResponse* response,
+                            ::google::protobuf::Closure* done) {
+    workers_.AddTask(boost::bind(&RouterImpl::DoListAgents, this, request, response, done));
+}
+
+// Every shard knows all agents but only its own pods and resource lease.
+// The page of shard 0 decides the agents, the others add their pods and
+// unassigned resource to them.
+void RouterImpl::DoListAgents(const ListAgentsRequest* request, ListAgentsResponse* response,
+                              ::google::protobuf::Closure* done) {
+    std::map<std::string, AgentInfo*> agents;
+    response->set_status(kOk);
+    for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+        ListAgentsResponse shard_response;
+        if (!CallShard(shard, &Master_Stub::ListAgents, request, &shard_response)
+            || shard_response.status() != kOk) {
+            response->set_status(kRpcError);
+            break;
+        }
+        if (shard == 0) {
+            response->mutable_agents()->Swap(shard_response.mutable_agents());
+            response->set_next_page_token(shard_response.next_page_token());
+            for (int i = 0; i < response->agents_size(); i++) {
+                AgentInfo* agent = response->mutable_agents(i);
+                agents[agent->endpoint()] = agent;
+            }
+            continue;
+        }
+        for (int i = 0; i < shard_response.agents_size(); i++) {
+            const AgentInfo& shard_agent = shard_response.agents(i);
+            std::map<std::string, AgentInfo*>::iterator it = agents.find(shard_agent.endpoint());
+            if (it == agents.end()) {
+                continue;
+            }
+            AgentInfo* agent = it->second;
+            agent->mutable_pods()->MergeFrom(shard_agent.pods());
+            agent->set_pod_num(agent->pod_num() + shard_agent.pod_num());
+            MasterUtil::AddResource(shard_agent.unassigned(), agent->mutable_unassigned());
+        }
+    }
+    done->Run();
+}
+
+void RouterImpl::GetMasterStatus(::google::protobuf::RpcController* /*controller*/,
+                                 const ::baidu::galaxy::GetMasterStatusRequest* /*request*/,
+                                 ::baidu::galaxy::GetMasterStatusResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    workers_.AddTask(boost::bind(&RouterImpl::DoGetMasterStatus, this, response, done));
+}
+
+void RouterImpl::DoGetMasterStatus(GetMasterStatusResponse* response,
+                                   ::google::protobuf::Closure* done) {
+    response->set_status(kOk);
+    for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+        GetMasterStatusRequest shard_request;
+        GetMasterStatusResponse shard_response;
+        if (!CallShard(shard, &Master_Stub::GetMasterStatus, &shard_request, &shard_response)) {
+            response->set_status(kRpcError);
+            continue;
+        }
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "shard%d.", shard);
+        for (int i = 0; i < shard_response.metrics_size(); i++) {
+            Metric* metric = response->add_metrics();
+            metric->set_name(prefix + shard_response.metrics(i).name());
+            metric->set_value(shard_response.metrics(i).value());
+        }
+    }
+    done->Run();
+}
+
+void RouterImpl::GetReplicaState(::google::protobuf::RpcController* controller,
+                                 const ::baidu::galaxy::GetReplicaStateRequest* request,
+                                 ::baidu::galaxy::GetReplicaStateResponse* response,
+                                 ::google::protobuf::Closure* done) {
+    int32_t shard = request->shard();
+    if (shard < 0 || shard >= FLAGS_master_shard_num) {
+        response->set_status(kInputError);
+        done->Run();
+        return;
+    }
+    workers_.AddTask(boost::bind(&RouterImpl::ForwardToShard<GetReplicaStateRequest,
+                                                             GetReplicaStateResponse>,
+                                 this, shard, &Master_Stub::GetReplicaState,
+                                 controller, request, response, done));
+}
+
+void RouterImpl::GetBinary(::google::protobuf::RpcController* /*controller*/,
+                           const ::baidu::galaxy::GetBinaryRequest* request,
+                           ::baidu::galaxy::GetBinaryResponse* response,
+                           ::google::protobuf::Closure* done) {
+    workers_.AddTask(boost::bind(&RouterImpl::DoGetBinary, this, request, response, done));
+}
+
+// a binary is kept by the shards of the jobs using it, the first one
+// having it answers
+void RouterImpl::DoGetBinary(const GetBinaryRequest* request, GetBinaryResponse* response,
+                             ::google::protobuf::Closure* done) {
+    response->set_status(kNotFound);
+    for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+        GetBinaryResponse shard_response;
+        if (!CallShard(shard, &Master_Stub::GetBinary, request, &shard_response)) {
+            response->set_status(kRpcError);
+            continue;
+        }
+        if (shard_response.status() == kOk) {
+            response->Swap(&shard_response);
+            break;
+        }
+    }
+    done->Run();
+}
+
+// Revisions of the shards are unrelated, so the router answers with all
+// of them and the client sends them back. A revision of a single master
+// is not one of them, the client is told to list again.
+void RouterImpl::Watch(::google::protobuf::RpcController* /*controller*/,
+                       const ::baidu::galaxy::WatchRequest* request,
+                       ::baidu::galaxy::WatchResponse* response,
+                       ::google::protobuf::Closure* done) {
+    std::set<int32_t> shards;
+    for (int i = 0; i < request->jobids_size(); i++) {
+        int32_t shard = MasterUtil::ShardOf(request->jobids(i));
+        if (shard >= 0 && shard < FLAGS_master_shard_num) {
+            shards.insert(shard);
+        }
+    }
+    if (request->jobids_size() == 0) {
+        for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+            shards.insert(shard);
+        }
+    }
+    if (shards.empty()) {
+        response->set_status(kJobNotFound);
+        done->Run();
+        return;
+    }
+    std::vector<std::string> endpoints;
+    {
+        MutexLock lock(&mutex_);
+        endpoints = shard_endpoints_;
+    }
+    std::set<int32_t>::iterator it = shards.begin();
+    for (; it != shards.end(); ++it) {
+        if (endpoints[*it].empty()) {
+            LOG(WARNING, "shard %d has no master", *it);
+            response->set_status(kRpcError);
+            done->Run();
+            return;
+        }
+    }
+    WatchFanOut* fan_out = new WatchFanOut();
+    fan_out->response = response;
+    fan_out->done = done;
+    fan_out->revisions.resize(FLAGS_master_shard_num, 0);
+    fan_out->pending = shards.size();
+    fan_out->answered = false;
+    if (request->shard_revisions_size() == FLAGS_master_shard_num) {
+        fan_out->revisions.assign(request->shard_revisions().begin(),
+                                  request->shard_revisions().end());
+    } else if (request->revision() != 0) {
+        response->set_compacted(true);
+    }
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        WatchRequest* shard_request = new WatchRequest();
+        WatchResponse* shard_response = new WatchResponse();
+        shard_request->set_revision(fan_out->revisions[*it]);
+        shard_request->mutable_jobids()->CopyFrom(request->jobids());
+        shard_request->set_timeout(request->timeout());
+        Master_Stub* stub = NULL;
+        rpc_client_.GetStub(endpoints[*it], &stub);
+        boost::function<void (const WatchRequest*, WatchResponse*, bool, int)> callback;
+        callback = boost::bind(&RouterImpl::WatchShardCallback, this, fan_out, *it,
+                               _1, _2, _3, _4);
+        rpc_client_.AsyncRequest(stub, &Master_Stub::Watch, shard_request, shard_response,
+                                 callback, request->timeout() / 1000 + FLAGS_router_rpc_timeout,
+                                 0);
+        delete stub;
+    }
+}
+
+void RouterImpl::WatchShardCallback(WatchFanOut* fan_out, int32_t shard,
+                                    const WatchRequest* request, WatchResponse* response,
+                                    bool failed, int /*error*/) {
+    boost::scoped_ptr<const WatchRequest> request_ptr(request);
+    boost::scoped_ptr<WatchResponse> response_ptr(response);
+    ::google::protobuf::Closure* done = NULL;
+    bool last = false;
+    {
+        MutexLock lock(&fan_out->mutex);
+        last = --fan_out->pending == 0;
+        if (!fan_out->answered) {
+            WatchResponse* merged = fan_out->response;
+            if (failed || response->status() != kOk) {
+                merged->set_status(failed ? kRpcError : response->status());
+                done = fan_out->done;
+            } else {
+                fan_out->revisions[shard] = response->revision();
+                merged->mutable_events()->MergeFrom(response->events());
+                if (response->compacted()) {
+                    merged->set_compacted(true);
+                }
+                if (last || response->events_size() > 0 || response->compacted()) {
+                    merged->set_status(kOk);
+                    done = fan_out->done;
+                }
+            }
+            if (done != NULL) {
+                fan_out->answered = true;
+                int64_t revision = 0;
+                for (size_t i = 0; i < fan_out->revisions.size(); i++) {
+                    merged->add_shard_revisions(fan_out->revisions[i]);
+                    revision += fan_out->revisions[i];
+                }
+                merged->set_revision(revision);
+            }
+        }
+    }
+    if (done != NULL) {
+        done->Run();
+    }
+    if (last) {
+        delete fan_out;
+    }
+}
+
+void RouterImpl::AddHeartBeat(const AgentHeartBeat& heartbeat) {
+    mutex_.AssertHeld();
+    AgentHeartBeat& last_heartbeat = heartbeats_[heartbeat.endpoint()];
+    if (heartbeat.sequence() >= last_heartbeat.sequence()) {
+        last_heartbeat.CopyFrom(heartbeat);
+    }
+}
+
+void RouterImpl::HeartBeat(::google::protobuf::RpcController* /*controller*/,
+                           const ::baidu::galaxy::HeartBeatRequest* request,
+                           ::baidu::galaxy::HeartBeatResponse* response,
+                           ::google::protobuf::Closure* done) {
+    {
+        AgentHeartBeat heartbeat;
+        heartbeat.set_endpoint(request->endpoint());
+        heartbeat.set_sequence(request->sequence());
+        heartbeat.set_pod_digest(request->pod_digest());
+        MutexLock lock(&mutex_);
+        AddHeartBeat(heartbeat);
+    }
+    response->set_status(kOk);
+    done->Run();
+}
+
+void RouterImpl::BatchHeartBeat(::google::protobuf::RpcController* /*controller*/,
+                                const ::baidu::galaxy::BatchHeartBeatRequest* request,
+                                ::baidu::galaxy::BatchHeartBeatResponse* response,
+                                ::google::protobuf::Closure* done) {
+    const std::string& compressed = request->heartbeats();
+    std::string raw;
+    HeartBeatBatch batch;
+    if (!snappy::Uncompress(compressed.data(), compressed.size(), &raw)
+        || !batch.ParseFromString(raw)) {
+        LOG(WARNING, "bad heartbeat batch from relay %s", request->relay().c_str());
+        response->set_status(kInputError);
+        done->Run();
+        return;
+    }
+    {
+        MutexLock lock(&mutex_);
+        for (int i = 0; i < batch.heartbeats_size(); i++) {
+            AddHeartBeat(batch.heartbeats(i));
+        }
+    }
+    response->set_status(kOk);
+    done->Run();
+}
+
+// Heartbeats go to every shard, as all of them place pods on all agents.
+// The batches are sent to all shards at once, a slow or dead shard does
+// not hold back the others. Agent leases ride on them, one lease batch in
+// flight per shard, so a shard answers the grants it was last sent.
+void RouterImpl::FlushHeartBeats() {
+    std::map<std::string, AgentHeartBeat> heartbeats;
+    std::vector<std::string> endpoints;
+    std::vector<bool> lease(FLAGS_master_shard_num, false);
+    std::vector<std::vector<std::string> > leased(FLAGS_master_shard_num);
+    std::vector<std::vector<std::string> > contended(FLAGS_master_shard_num);
+    {
+        MutexLock lock(&mutex_);
+        heartbeats.swap(heartbeats_);
+        endpoints = shard_endpoints_;
+        ExpireLeases();
+        for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+            if (!endpoints[shard].empty() && !leasing_[shard]) {
+                lease[shard] = true;
+                leasing_[shard] = true;
+            }
+        }
+        std::map<std::string, int32_t>::iterator it = leases_.begin();
+        for (; it != leases_.end(); ++it) {
+            leased[it->second].push_back(it->first);
+            for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+                if (shard != it->second && wanted_[shard].count(it->first) > 0) {
+                    contended[it->second].push_back(it->first);
+                    break;
+                }
+            }
+        }
+    }
+    std::string compressed;
+    if (!heartbeats.empty()) {
+        HeartBeatBatch batch;
+        std::map<std::string, AgentHeartBeat>::iterator it = heartbeats.begin();
+        for (; it != heartbeats.end(); ++it) {
+            batch.add_heartbeats()->CopyFrom(it->second);
+        }
+        std::string raw;
+        batch.SerializeToString(&raw);
+        snappy::Compress(raw.data(), raw.size(), &compressed);
+    }
+    for (int32_t shard = 0; shard < FLAGS_master_shard_num; shard++) {
+        if (endpoints[shard].empty()) {
+            LOG(WARNING, "shard %d has no master, drop %lu heartbeats",
+                shard, heartbeats.size());
+            continue;
+        }
+        if (heartbeats.empty() && !lease[shard]) {
+            continue;
+        }
+        BatchHeartBeatRequest* request = new BatchHeartBeatRequest;
+        BatchHeartBeatResponse* response = new BatchHeartBeatResponse;
+        request->set_relay(MasterUtil::SelfEndpoint(FLAGS_router_port));
+        if (!heartbeats.empty()) {
+            request->set_heartbeats(compressed);
+        }
+        if (lease[shard]) {
+            request->set_lease(true);
+            for (size_t i = 0; i < leased[shard].size(); i++) {
+                request->add_leased_agents(leased[shard][i]);
+            }
+            for (size_t i = 0; i < contended[shard].size(); i++) {
+                request->add_contended_agents(contended[shard][i]);
+            }
+        }
+        Master_Stub* stub = NULL;
+        rpc_client_.GetStub(endpoints[shard], &stub);
+        boost::function<void (const BatchHeartBeatRequest*, BatchHeartBeatResponse*,
+                              bool, int)> callback;
+        callback = boost::bind(&RouterImpl::FlushHeartBeatsCallback, this, shard,
+                               (int32_t)heartbeats.size(), _1, _2, _3, _4);
+        rpc_client_.AsyncRequest(stub, &Master_Stub::BatchHeartBeat, request, response,
+                                 callback, FLAGS_router_rpc_timeout, 0);
+        delete stub;
+    }
+    flush_thread_.DelayTask(FLAGS_relay_flush_interval,
+                            boost::bind(&RouterImpl::FlushHeartBeats, this));
+}
+
+void RouterImpl::FlushHeartBeatsCallback(int32_t shard, int32_t num,
+                                         const BatchHeartBeatRequest* request,
+                                         BatchHeartBeatResponse* response,
+                                         bool failed, int /*error*/) {
+    boost::scoped_ptr<const BatchHeartBeatRequest> request_ptr(request);
+    boost::scoped_ptr<BatchHeartBeatResponse> response_ptr(response);
+    if (failed || response->status() != kOk) {
+        LOG(WARNING, "forward %d heartbeats to shard %d failed", num, shard);
+    }
+    if (!request->lease()) {
+        return;
+    }
+    MutexLock lock(&mutex_);
+    leasing_[shard] = false;
+    if (failed || response->status() != kOk) {
+        return;
+    }
+    UpdateLeases(shard, *response);
+}
+
+// Leases not held any more are freed, then free agents are granted to the
+// shard asking, first come first served. Grants reach it with its next
+// lease batch. A restarted router grants nothing until the leases of the
+// previous one have run out on the shards.
+void RouterImpl::UpdateLeases(int32_t shard, const BatchHeartBeatResponse& response) {
+    mutex_.AssertHeld();
+    int64_t now = common::timer::get_micros();
+    lease_answered_[shard] = now;
+    std::set<std::string> held(response.held_agents().begin(),
+                               response.held_agents().end());
+    std::map<std::string, int32_t>::iterator it = leases_.begin();
+    while (it != leases_.end()) {
+        if (it->second == shard && held.find(it->first) == held.end()) {
+            leases_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    wanted_[shard].clear();
+    wanted_[shard].insert(response.wanted_agents().begin(), response.wanted_agents().end());
+    if (now - start_time_ < FLAGS_master_lease_timeout * 2000L) {
+        return;
+    }
+    std::set<std::string>::iterator wanted_it = wanted_[shard].begin();
+    for (; wanted_it != wanted_[shard].end(); ++wanted_it) {
+        if (leases_.find(*wanted_it) == leases_.end()) {
+            LOG(DEBUG, "lease agent %s to shard %d", wanted_it->c_str(), shard);
+            leases_[*wanted_it] = shard;
+        }
+    }
+}
+
+// a shard silent for twice the lease timeout has stopped using its leases
+void RouterImpl::ExpireLeases() {
+    mutex_.AssertHeld();
+    int64_t now = common::timer::get_micros();
+    std::map<std::string, int32_t>::iterator it = leases_.begin();
+    while (it != leases_.end()) {
+        if (now - lease_answered_[it->second] > FLAGS_master_lease_timeout * 2000L) {
+            LOG(WARNING, "take back lease of agent %s from silent shard %d",
+                it->first.c_str(), it->second);
+            leases_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
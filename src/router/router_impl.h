@@ -0,0 +1,161 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_ROUTER_IMPL_H
+#define BAIDU_GALAXY_ROUTER_IMPL_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <mutex.h>
+#include <thread_pool.h>
+
+#include "proto/master.pb.h"
+#include "rpc/rpc_client.h"
+#include "master/kv_store.h"
+
+namespace baidu {
+namespace galaxy {
+
+// Front of a sharded master. It takes the master path on nexus, so SDK,
+// client and agents reach it as they would a single master. Job requests
+// go to the shard owning the job id, listings are merged over shards and
+// heartbeats are fanned out to all of them in batches, which also carry
+// the leases of agents to shards. Watches go to the shards of their jobs
+// and carry a revision per shard. Schedulers connect to the shards
+// directly, one per shard.
+class RouterImpl : public Master {
+public:
+    RouterImpl();
+    virtual ~RouterImpl();
+    bool Init();
+    virtual void SubmitJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::SubmitJobRequest* request,
+                           ::baidu::galaxy::SubmitJobResponse* response,
+                           ::google::protobuf::Closure* done);
+    virtual void UpdateJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::UpdateJobRequest* request,
+                           ::baidu::galaxy::UpdateJobResponse* response,
+                           ::google::protobuf::Closure* done);
+    virtual void SuspendJob(::google::protobuf::RpcController* controller,
+                            const ::baidu::galaxy::SuspendJobRequest* request,
+                            ::baidu::galaxy::SuspendJobResponse* response,
+                            ::google::protobuf::Closure* done);
+    virtual void ResumeJob(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::ResumeJobRequest* request,
+                           ::baidu::galaxy::ResumeJobResponse* response,
+                           ::google::protobuf::Closure* done);
+    virtual void TerminateJob(::google::protobuf::RpcController* controller,
+                              const ::baidu::galaxy::TerminateJobRequest* request,
+                              ::baidu::galaxy::TerminateJobResponse* response,
+                              ::google::protobuf::Closure* done);
+    virtual void ShowJob(::google::protobuf::RpcController* controller,
+                         const ::baidu::galaxy::ShowJobRequest* request,
+                         ::baidu::galaxy::ShowJobResponse* response,
+                         ::google::protobuf::Closure* done);
+    virtual void ListJobs(::google::protobuf::RpcController* controller,
+                          const ::baidu::galaxy::ListJobsRequest* request,
+                          ::baidu::galaxy::ListJobsResponse* response,
+                          ::google::protobuf::Closure* done);
+    virtual void Watch(::google::protobuf::RpcController* controller,
+                       const ::baidu::galaxy::WatchRequest* request,
+                       ::baidu::galaxy::WatchResponse* response,
+                       ::google::protobuf::Closure* done);
+    virtual void HeartBeat(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::HeartBeatRequest* request,
+                           ::baidu::galaxy::HeartBeatResponse* response,
+                           ::google::protobuf::Closure* done);
+    virtual void BatchHeartBeat(::google::protobuf::RpcController* controller,
+                                const ::baidu::galaxy::BatchHeartBeatRequest* request,
+                                ::baidu::galaxy::BatchHeartBeatResponse* response,
+                                ::google::protobuf::Closure* done);
+    virtual void ListAgents(::google::protobuf::RpcController* controller,
+                            const ::baidu::galaxy::ListAgentsRequest* request,
+                            ::baidu::galaxy::ListAgentsResponse* response,
+                            ::google::protobuf::Closure* done);
+    virtual void GetMasterStatus(::google::protobuf::RpcController* controller,
+                                 const ::baidu::galaxy::GetMasterStatusRequest* request,
+                                 ::baidu::galaxy::GetMasterStatusResponse* response,
+                                 ::google::protobuf::Closure* done);
+    virtual void GetReplicaState(::google::protobuf::RpcController* controller,
+                                 const ::baidu::galaxy::GetReplicaStateRequest* request,
+                                 ::baidu::galaxy::GetReplicaStateResponse* response,
+                                 ::google::protobuf::Closure* done);
+    virtual void GetBinary(::google::protobuf::RpcController* controller,
+                           const ::baidu::galaxy::GetBinaryRequest* request,
+                           ::baidu::galaxy::GetBinaryResponse* response,
+                           ::google::protobuf::Closure* done);
+    void HandleShardChange(const std::string& key, const std::string& endpoint, bool deleted);
+private:
+    struct WatchFanOut;
+    template <class Request, class Response>
+    bool CallShard(int32_t shard,
+                   void (Master_Stub::*method)(::google::protobuf::RpcController*,
+                                               const Request*, Response*,
+                                               ::google::protobuf::Closure*),
+                   const Request* request, Response* response);
+    template <class Request, class Response>
+    void ForwardToShard(int32_t shard,
+                        void (Master_Stub::*method)(::google::protobuf::RpcController*,
+                                                    const Request*, Response*,
+                                                    ::google::protobuf::Closure*),
+                        ::google::protobuf::RpcController* controller,
+                        const Request* request, Response* response,
+                        ::google::protobuf::Closure* done);
+    template <class Request, class Response>
+    void RouteByJobId(void (Master_Stub::*method)(::google::protobuf::RpcController*,
+                                                  const Request*, Response*,
+                                                  ::google::protobuf::Closure*),
+                      ::google::protobuf::RpcController* controller,
+                      const Request* request, Response* response,
+                      ::google::protobuf::Closure* done);
+    void DoShowJob(const ShowJobRequest* request, ShowJobResponse* response,
+                   ::google::protobuf::Closure* done);
+    void DoListJobs(const ListJobsRequest* request, ListJobsResponse* response,
+                    ::google::protobuf::Closure* done);
+    void DoListAgents(const ListAgentsRequest* request, ListAgentsResponse* response,
+                      ::google::protobuf::Closure* done);
+    void DoGetMasterStatus(GetMasterStatusResponse* response,
+                           ::google::protobuf::Closure* done);
+    void DoGetBinary(const GetBinaryRequest* request, GetBinaryResponse* response,
+                     ::google::protobuf::Closure* done);
+    void WatchShardCallback(WatchFanOut* fan_out, int32_t shard,
+                            const WatchRequest* request, WatchResponse* response,
+                            bool failed, int error);
+    void AddHeartBeat(const AgentHeartBeat& heartbeat);
+    void FlushHeartBeats();
+    void FlushHeartBeatsCallback(int32_t shard, int32_t num,
+                                 const BatchHeartBeatRequest* request,
+                                 BatchHeartBeatResponse* response,
+                                 bool failed, int error);
+    void UpdateLeases(int32_t shard, const BatchHeartBeatResponse& response);
+    void ExpireLeases();
+    bool WatchShard(int32_t shard);
+    void AcquireMasterLock();
+    std::string ShardMasterKey(int32_t shard);
+private:
+    Mutex mutex_;
+    std::vector<std::string> shard_endpoints_;
+    int32_t next_shard_;
+    // latest heartbeat of each agent since the last flush
+    std::map<std::string, AgentHeartBeat> heartbeats_;
+    // Agent leases. Each agent is leased to at most one shard, which may
+    // place on all of its free resource. Shards ask for agents their
+    // pending pods fit on and give them back when done.
+    std::map<std::string, int32_t> leases_;
+    std::vector<bool> leasing_;
+    std::vector<std::set<std::string> > wanted_;
+    int64_t start_time_;
+    // last lease answer of each shard
+    std::vector<int64_t> lease_answered_;
+    RpcClient rpc_client_;
+    KvStore* kv_store_;
+    ThreadPool workers_;
+    ThreadPool flush_thread_;
+};
+
+}
+}
+
+#endif
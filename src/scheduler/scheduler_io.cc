@@ -90,6 +90,17 @@ void SchedulerIO::Loop() {
                                   5, 1);
     if (!ret) {
         LOG(INFO, "fail to propose");
+        goto END;
+    }
+    // failed pods stay pending on master and come back in the next turn
+    for (int i = 0; i < pro_response.schedule_status_size(); i++) {
+        if (pro_response.schedule_status(i) == kOk) {
+            continue;
+        }
+        const ScheduleInfo& sched = pro_request.schedule(i);
+        LOG(INFO, "propose pod %s on %s fail, status %s",
+            sched.podid().c_str(), sched.endpoint().c_str(),
+            Status_Name(pro_response.schedule_status(i)).c_str());
     }
 END:
     for (std::vector<ScheduleInfo*>::iterator it = propose.begin();
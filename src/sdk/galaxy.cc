@@ -4,28 +4,63 @@
 
 #include "galaxy.h"
 
+#include <map>
 #include "proto/master.pb.h"
 #include "rpc/rpc_client.h"
 
 namespace baidu {
 namespace galaxy {
 
+static const int32_t kListPageSize = 1000;
+// long-poll time of a watch request in ms
+static const int32_t kWatchTimeout = 30000;
+static const int32_t kWatchRetryInterval = 1000;
+
 class GalaxyImpl : public Galaxy {
 public:
     GalaxyImpl(const std::string& master_addr)
-      : master_(NULL) {
+      : master_(NULL), next_watch_id_(0), watch_pool_(1) {
         rpc_client_ = new RpcClient();
         rpc_client_->GetStub(master_addr, &master_);
     }
     virtual ~GalaxyImpl() {}
     std::string SubmitJob(const JobDescription& job);
+    SubmitStatus SubmitJob(const JobDescription& job, std::string* jobid,
+                           int32_t* retry_after);
     bool UpdateJob(const std::string& jobid, const JobDescription& job);
     bool ListJobs(std::vector<JobInformation>* jobs);
+    bool ListJobs(const std::string& page_token, int32_t page_size,
+                  std::vector<JobInformation>* jobs,
+                  std::string* next_page_token);
     bool ListAgents(std::vector<NodeDescription>* nodes);
+    bool ListAgents(const std::string& page_token, int32_t page_size,
+                    std::vector<NodeDescription>* nodes,
+                    std::string* next_page_token);
     bool TerminateJob(const std::string& job_id);
+    int64_t Watch(const std::vector<std::string>& jobids,
+                  WatchCallback callback, void* context);
+    void Unwatch(int64_t watch_id);
 private:
+    struct Subscription {
+        std::vector<std::string> jobids;
+        WatchCallback callback;
+        void* context;
+        // of the last event received, 0 until the first response
+        int64_t revision;
+        // of each shard behind a router
+        std::vector<int64_t> shard_revisions;
+    };
+    void SendWatch(int64_t watch_id);
+    void OnWatchResponse(int64_t watch_id, const WatchRequest* request,
+                       WatchResponse* response, bool failed, int error);
+
     RpcClient* rpc_client_;
     Master_Stub* master_;
+    Mutex watch_mutex_;
+    std::map<int64_t, Subscription> subscriptions_;
+    int64_t next_watch_id_;
+    // retries failed watch requests
+    ThreadPool watch_pool_;
 };
 
 bool GalaxyImpl::TerminateJob(const std::string& job_id) {
@@ -39,6 +74,14 @@ bool GalaxyImpl::TerminateJob(const std::string& job_id) {
 }
 
 std::string GalaxyImpl::SubmitJob(const JobDescription& job){
+    std::string jobid;
+    int32_t retry_after = 0;
+    SubmitJob(job, &jobid, &retry_after);
+    return jobid;
+}
+
+SubmitStatus GalaxyImpl::SubmitJob(const JobDescription& job, std::string* jobid,
+                                   int32_t* retry_after) {
     SubmitJobRequest request;
     SubmitJobResponse response;
     request.mutable_job()->set_name(job.job_name);
@@ -51,33 +94,68 @@ std::string GalaxyImpl::SubmitJob(const JobDescription& job){
     task->mutable_requirement()->set_millicores(job.cpu_required);
     task->mutable_requirement()->set_memory(job.mem_required);
     request.mutable_job()->set_replica(job.replica);
-    rpc_client_->SendRequest(master_, &Master_Stub::SubmitJob,
-                             &request,&response,5,1);
-    return response.jobid();
+    request.mutable_job()->set_deploy_step(job.deploy_step);
+    bool ret = rpc_client_->SendRequest(master_, &Master_Stub::SubmitJob,
+                                        &request, &response, 5, 1);
+    if (!ret) {
+        return kSubmitFail;
+    }
+    switch (response.status()) {
+    case kOk:
+        *jobid = response.jobid();
+        return kSubmitOk;
+    case kThrottled:
+        *retry_after = response.retry_after();
+        return kSubmitThrottled;
+    case kQuota:
+    case kInputError:
+        return kSubmitRejected;
+    default:
+        return kSubmitFail;
+    }
 }
 
 bool GalaxyImpl::UpdateJob(const std::string& jobid, const JobDescription& job) {
     UpdateJobRequest request;
     UpdateJobResponse response;
+    request.set_jobid(jobid);
     request.mutable_job()->set_name(job.job_name);
+    if (job.is_batch) {
+        request.mutable_job()->set_type(kBatch);
+    }
     TaskDescriptor* task = request.mutable_job()->mutable_pod()->add_tasks();
     task->set_binary(job.binary);
     task->set_start_command(job.cmd_line);
     task->mutable_requirement()->set_millicores(job.cpu_required);
     task->mutable_requirement()->set_memory(job.mem_required);
     request.mutable_job()->set_replica(job.replica);
+    request.mutable_job()->set_deploy_step(job.deploy_step);
 
-    rpc_client_->SendRequest(master_, &Master_Stub::UpdateJob,
-                             &request, &response, 5, 1);
-    if (response.status() != kOk) {
+    bool ret = rpc_client_->SendRequest(master_, &Master_Stub::UpdateJob,
+                                        &request, &response, 5, 1);
+    if (!ret || response.status() != kOk) {
         return false;
     }
     return true;
 }
 
 bool GalaxyImpl::ListJobs(std::vector<JobInformation>* jobs) {
+    std::string page_token;
+    do {
+        if (!ListJobs(page_token, kListPageSize, jobs, &page_token)) {
+            return false;
+        }
+    } while (!page_token.empty());
+    return true;
+}
+
+bool GalaxyImpl::ListJobs(const std::string& page_token, int32_t page_size,
+                          std::vector<JobInformation>* jobs,
+                          std::string* next_page_token) {
     ListJobsRequest request;
     ListJobsResponse response;
+    request.set_page_token(page_token);
+    request.set_page_size(page_size);
     bool ret = rpc_client_->SendRequest(master_, &Master_Stub::ListJobs,
                              &request,&response,5,1);
     if (!ret || response.status() != kOk) {
@@ -97,20 +175,43 @@ bool GalaxyImpl::ListJobs(std::vector<JobInformation>* jobs) {
 				job_info.is_batch = (job.desc().type() == kBatch);
         jobs->push_back(job_info);
     }
+    *next_page_token = response.next_page_token();
     return true;
 }
 
 bool GalaxyImpl::ListAgents(std::vector<NodeDescription>* nodes) {
+    std::string page_token;
+    do {
+        if (!ListAgents(page_token, kListPageSize, nodes, &page_token)) {
+            return false;
+        }
+    } while (!page_token.empty());
+    return true;
+}
+
+bool GalaxyImpl::ListAgents(const std::string& page_token, int32_t page_size,
+                            std::vector<NodeDescription>* nodes,
+                            std::string* next_page_token) {
     ListAgentsRequest request;
     ListAgentsResponse response;
-    rpc_client_->SendRequest(master_, &Master_Stub::ListAgents,
-                             &request,&response, 5, 1);
+    request.set_page_token(page_token);
+    request.set_page_size(page_size);
+    // only what NodeDescription shows
+    request.add_fields("pod_num");
+    request.add_fields("total");
+    request.add_fields("assigned");
+    request.add_fields("used");
+    bool ret = rpc_client_->SendRequest(master_, &Master_Stub::ListAgents,
+                                        &request,&response, 5, 1);
+    if (!ret || response.status() != kOk) {
+        return false;
+    }
     int node_num = response.agents_size();
     for (int i = 0; i < node_num; i++) {
         const AgentInfo& node = response.agents(i);
         NodeDescription node_desc;
         node_desc.addr = node.endpoint();
-        node_desc.task_num = node.pods_size();
+        node_desc.task_num = node.pod_num();
         node_desc.cpu_share = node.total().millicores();
         node_desc.mem_share = node.total().memory();
         node_desc.cpu_assigned = node.assigned().millicores();
@@ -120,10 +221,115 @@ bool GalaxyImpl::ListAgents(std::vector<NodeDescription>* nodes) {
  
         nodes->push_back(node_desc);
     }
+    *next_page_token = response.next_page_token();
     return true;
 
 }
 
+int64_t GalaxyImpl::Watch(const std::vector<std::string>& jobids,
+                          WatchCallback callback, void* context) {
+    int64_t watch_id = 0;
+    {
+        MutexLock lock(&watch_mutex_);
+        watch_id = next_watch_id_++;
+        Subscription& subscription = subscriptions_[watch_id];
+        subscription.jobids = jobids;
+        subscription.callback = callback;
+        subscription.context = context;
+        subscription.revision = 0;
+    }
+    SendWatch(watch_id);
+    return watch_id;
+}
+
+void GalaxyImpl::Unwatch(int64_t watch_id) {
+    MutexLock lock(&watch_mutex_);
+    // the pending request, if any, finds it gone and is not renewed
+    subscriptions_.erase(watch_id);
+}
+
+void GalaxyImpl::SendWatch(int64_t watch_id) {
+    WatchRequest* request = new WatchRequest();
+    WatchResponse* response = new WatchResponse();
+    {
+        MutexLock lock(&watch_mutex_);
+        std::map<int64_t, Subscription>::iterator it = subscriptions_.find(watch_id);
+        if (it == subscriptions_.end()) {
+            delete request;
+            delete response;
+            return;
+        }
+        const Subscription& subscription = it->second;
+        request->set_revision(subscription.revision);
+        for (size_t i = 0; i < subscription.shard_revisions.size(); i++) {
+            request->add_shard_revisions(subscription.shard_revisions[i]);
+        }
+        for (size_t i = 0; i < subscription.jobids.size(); i++) {
+            request->add_jobids(subscription.jobids[i]);
+        }
+        request->set_timeout(kWatchTimeout);
+    }
+    boost::function<void (const WatchRequest*, WatchResponse*, bool, int)> callback;
+    callback = boost::bind(&GalaxyImpl::OnWatchResponse, this, watch_id, _1, _2, _3, _4);
+    rpc_client_->AsyncRequest(master_, &Master_Stub::Watch, request, response,
+                              callback, kWatchTimeout / 1000 + 10, 1);
+}
+
+void GalaxyImpl::OnWatchResponse(int64_t watch_id, const WatchRequest* request,
+                               WatchResponse* response, bool failed, int /*error*/) {
+    if (failed || response->status() != kOk) {
+        delete request;
+        delete response;
+        watch_pool_.DelayTask(kWatchRetryInterval,
+                              boost::bind(&GalaxyImpl::SendWatch, this, watch_id));
+        return;
+    }
+    WatchCallback user_callback = NULL;
+    void* context = NULL;
+    bool resync = response->compacted();
+    {
+        MutexLock lock(&watch_mutex_);
+        std::map<int64_t, Subscription>::iterator it = subscriptions_.find(watch_id);
+        if (it == subscriptions_.end()) {
+            delete request;
+            delete response;
+            return;
+        }
+        Subscription& subscription = it->second;
+        if (subscription.revision == 0) {
+            resync = true;
+        }
+        subscription.revision = response->revision();
+        subscription.shard_revisions.assign(response->shard_revisions().begin(),
+                                            response->shard_revisions().end());
+        user_callback = subscription.callback;
+        context = subscription.context;
+    }
+    std::vector<JobEvent> events;
+    for (int i = 0; i < response->events_size(); i++) {
+        const ::baidu::galaxy::WatchEvent& watch_event = response->events(i);
+        JobEvent event;
+        event.revision = watch_event.revision();
+        event.job_id = watch_event.jobid();
+        event.pod_id = watch_event.podid();
+        if (watch_event.has_pod_state()) {
+            event.state = PodState_Name(watch_event.pod_state());
+        } else {
+            event.state = JobState_Name(watch_event.job_state());
+        }
+        event.endpoint = watch_event.endpoint();
+        event.version = watch_event.version();
+        event.removed = watch_event.removed();
+        events.push_back(event);
+    }
+    delete request;
+    delete response;
+    if (resync || !events.empty()) {
+        user_callback(events, resync, context);
+    }
+    SendWatch(watch_id);
+}
+
 Galaxy* Galaxy::ConnectGalaxy(const std::string& master_addr) {
     return new GalaxyImpl(master_addr);
 }
@@ -46,19 +46,63 @@ struct NodeDescription {
 		int64_t mem_assigned;
 };
 
+// one job or pod state transition
+struct JobEvent {
+    int64_t revision;
+    std::string job_id;
+    // empty for job events
+    std::string pod_id;
+    // kJobNormal... for jobs, kPodPending... for pods
+    std::string state;
+    std::string endpoint;
+    std::string version;
+    // the pod was dropped from its job
+    bool removed;
+};
+
+// resync is set on the first call and whenever events were missed, the
+// jobs should be listed again, events after it follow in later calls
+typedef void (*WatchCallback)(const std::vector<JobEvent>& events, bool resync,
+                              void* context);
+
+enum SubmitStatus {
+    kSubmitOk = 0,
+    kSubmitFail = 1,
+    // master is over its pending pod limits, retry after retry_after ms
+    kSubmitThrottled = 2,
+    // the job can never be admitted, replica over the limits
+    kSubmitRejected = 3
+};
+
 class Galaxy {
 public:
     static Galaxy* ConnectGalaxy(const std::string& master_addr);
     //create a new job
     virtual std::string SubmitJob(const JobDescription& job) = 0;
+    //create a new job, telling throttled submissions from failed ones
+    virtual SubmitStatus SubmitJob(const JobDescription& job, std::string* jobid,
+                                   int32_t* retry_after) = 0;
     //update job for example update the replicate_count
     virtual bool UpdateJob(const std::string& jobid, const JobDescription& job) = 0;
     //list all jobs in galaxys
     virtual bool ListJobs(std::vector<JobInformation>* jobs) = 0;
+    //list one page of jobs after page_token, next_page_token is empty on the last page
+    virtual bool ListJobs(const std::string& page_token, int32_t page_size,
+                          std::vector<JobInformation>* jobs,
+                          std::string* next_page_token) = 0;
     //termintate job
     virtual bool TerminateJob(const std::string& job_id) = 0;
     //list all nodes of cluster
     virtual bool ListAgents(std::vector<NodeDescription>* nodes) = 0;
+    //list one page of nodes after page_token
+    virtual bool ListAgents(const std::string& page_token, int32_t page_size,
+                            std::vector<NodeDescription>* nodes,
+                            std::string* next_page_token) = 0;
+    //call callback with state changes of jobids, of all jobs if empty,
+    //until unwatched. returns the watch id, callbacks run in rpc threads
+    virtual int64_t Watch(const std::vector<std::string>& jobids,
+                          WatchCallback callback, void* context) = 0;
+    virtual void Unwatch(int64_t watch_id) = 0;
 };
 
 } // namespace galaxy
@@ -0,0 +1,162 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// A master over mem_nexus checking the pod digest of one fake agent. Once
+// two jobs run the agent process restarts, its digest is built from the
+// pods gced still runs, so the master must not place them again. Then one
+// pod is evicted by an update, the agent drops it from its digest and the
+// master must stop asking it for the differing buckets.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+
+#include <sofa/pbrpc/pbrpc.h>
+#include <gflags/gflags.h>
+
+#include "master/master_util.h"
+#include "local_cluster.h"
+
+DEFINE_string(agent_digest_test_bin_dir, ".", "dir of the master and mem_nexus binaries");
+DEFINE_int32(agent_digest_test_base_port, 18850, "first of the ports used by the test processes");
+DEFINE_int32(agent_digest_test_timeout, 60, "seconds for each step of the test");
+
+using baidu::galaxy::NumToString;
+
+static std::string Port(int32_t offset) {
+    return NumToString(FLAGS_agent_digest_test_base_port + offset);
+}
+
+// heartbeats with the digest every 100ms for ms
+static void HeartBeats(baidu::galaxy::RpcClient* rpc_client, baidu::galaxy::Master_Stub* master,
+                       baidu::galaxy::FakeAgent* agent, const std::string& agent_endpoint,
+                       int64_t* sequence, int32_t ms) {
+    for (int32_t i = 0; i < ms / 100; i++) {
+        baidu::galaxy::SendHeartBeat(rpc_client, master, agent, agent_endpoint, ++*sequence);
+        usleep(100000);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    char work_dir[] = "/tmp/agent_digest_test.XXXXXX";
+    if (mkdtemp(work_dir) == NULL) {
+        fprintf(stderr, "fail to make work dir\n");
+        return -1;
+    }
+    std::string nexus_server = "127.0.0.1:" + Port(0);
+    std::string agent_endpoint = "127.0.0.1:" + Port(2);
+    std::string master_endpoint = baidu::galaxy::MasterUtil::SelfEndpoint(Port(1));
+
+    sofa::pbrpc::RpcServerOptions options;
+    sofa::pbrpc::RpcServer rpc_server(options);
+    baidu::galaxy::FakeAgent* agent = new baidu::galaxy::FakeAgent(agent_endpoint, 1000, 1000);
+    if (!rpc_server.RegisterService(static_cast<baidu::galaxy::Agent*>(agent))
+        || !rpc_server.Start("0.0.0.0:" + Port(2))) {
+        fprintf(stderr, "fail to start fake agent\n");
+        return -1;
+    }
+
+    baidu::galaxy::LocalProcesses processes(FLAGS_agent_digest_test_bin_dir);
+    std::vector<std::string> args;
+    args.push_back("--mem_nexus_port=" + Port(0));
+    args.push_back("--mem_nexus_session_timeout=3000");
+    processes.Spawn("mem_nexus", args);
+    sleep(1);
+    std::string dir = std::string(work_dir) + "/master";
+    args.clear();
+    args.push_back("--nexus_servers=mem://" + nexus_server);
+    args.push_back("--mem_nexus_session_timeout=3000");
+    args.push_back("--master_port=" + Port(1));
+    args.push_back("--master_follower=false");
+    args.push_back("--master_safe_mode_min_wait=500");
+    args.push_back("--master_safe_mode_deadline=3000");
+    args.push_back("--master_digest_check_interval=300");
+    args.push_back("--master_snapshot_path=" + dir + "/snapshot");
+    args.push_back("--master_binary_store_path=" + dir + "/binaries");
+    args.push_back("--master_event_log_path=");
+    processes.Spawn("master", args);
+    sleep(1);
+
+    baidu::galaxy::RpcClient rpc_client;
+    baidu::galaxy::Master_Stub* master;
+    rpc_client.GetStub(master_endpoint, &master);
+    boost::scoped_ptr<baidu::galaxy::Master_Stub> master_ptr(master);
+    int64_t sequence = 0;
+    std::string jobids[2];
+    const char* names[2] = {"digest_a", "digest_b"};
+    for (int32_t round = 0; round < FLAGS_agent_digest_test_timeout * 2; round++) {
+        baidu::galaxy::SendHeartBeat(&rpc_client, master, agent, agent_endpoint, ++sequence);
+        for (int32_t i = 0; i < 2; i++) {
+            if (jobids[i].empty()) {
+                baidu::galaxy::SubmitJob(&rpc_client, master, names[i], 400, &jobids[i]);
+            }
+        }
+        baidu::galaxy::ScheduleOnAgent(&rpc_client, master_endpoint, agent_endpoint);
+        if (!jobids[0].empty() && !jobids[1].empty()
+            && agent->Runs(jobids[0]) > 0 && agent->Runs(jobids[1]) > 0) {
+            break;
+        }
+        usleep(500000);
+    }
+    if (jobids[0].empty() || jobids[1].empty()
+        || agent->Runs(jobids[0]) == 0 || agent->Runs(jobids[1]) == 0) {
+        fprintf(stderr, "jobs not placed\n");
+        return -1;
+    }
+
+    // pods it was sent before the restart are not known to the new process
+    agent->Restart();
+    int32_t run_pods = agent->RunPods();
+    for (int32_t round = 0; round < 10; round++) {
+        HeartBeats(&rpc_client, master, agent, agent_endpoint, &sequence, 400);
+        baidu::galaxy::ScheduleOnAgent(&rpc_client, master_endpoint, agent_endpoint);
+    }
+    if (agent->RunPods() != run_pods || agent->Runs(jobids[0]) != 1
+        || agent->Runs(jobids[1]) != 1) {
+        fprintf(stderr, "pods placed again after agent restart, run pods: %d of %d\n",
+                agent->RunPods(), run_pods);
+        return -1;
+    }
+    if (baidu::galaxy::GetMetric(&rpc_client, master, "digest_lost_pods") != 0) {
+        fprintf(stderr, "pods taken for lost after agent restart\n");
+        return -1;
+    }
+
+    // no longer fits beside the other pod, the master kills it
+    if (!baidu::galaxy::UpdateJob(&rpc_client, master, jobids[0], names[0], 800)) {
+        fprintf(stderr, "fail to update %s\n", jobids[0].c_str());
+        return -1;
+    }
+    for (int32_t round = 0; round < FLAGS_agent_digest_test_timeout * 10; round++) {
+        HeartBeats(&rpc_client, master, agent, agent_endpoint, &sequence, 100);
+        if (agent->Runs(jobids[0]) == 0) {
+            break;
+        }
+    }
+    if (agent->Runs(jobids[0]) != 0) {
+        fprintf(stderr, "evicted pod not killed\n");
+        return -1;
+    }
+    HeartBeats(&rpc_client, master, agent, agent_endpoint, &sequence, 1500);
+    int64_t queries = baidu::galaxy::GetMetric(&rpc_client, master, "digest_queries");
+    HeartBeats(&rpc_client, master, agent, agent_endpoint, &sequence, 3000);
+    int64_t later_queries = baidu::galaxy::GetMetric(&rpc_client, master, "digest_queries");
+    if (queries < 0 || later_queries != queries) {
+        fprintf(stderr, "digest of the agent still differs after kill, queries %ld then %ld\n",
+                queries, later_queries);
+        return -1;
+    }
+    processes.KillAll();
+    std::string clean = std::string("rm -rf ") + work_dir;
+    if (system(clean.c_str()) != 0) {
+        fprintf(stderr, "fail to remove %s\n", work_dir);
+    }
+    fprintf(stderr, "agent digest test passed\n");
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
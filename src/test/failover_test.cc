@@ -0,0 +1,171 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// An active master and a follower as local processes over mem_nexus, one
+// fake agent and this program as scheduler. Once a job runs the active
+// master is killed, the follower must take the master lock and serve the
+// job from its replica without deploying the pod again.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+
+#include <sofa/pbrpc/pbrpc.h>
+#include <gflags/gflags.h>
+
+#include "master/kv_store.h"
+#include "master/master_util.h"
+#include "local_cluster.h"
+
+DECLARE_string(nexus_root_path);
+DECLARE_string(master_path);
+DEFINE_string(failover_test_bin_dir, ".", "dir of the master and mem_nexus binaries");
+DEFINE_int32(failover_test_base_port, 18840, "first of the ports used by the test processes");
+DEFINE_int32(failover_test_timeout, 60, "seconds for each step of the test");
+
+using baidu::galaxy::NumToString;
+
+static std::string Port(int32_t offset) {
+    return NumToString(FLAGS_failover_test_base_port + offset);
+}
+
+static int32_t RunningNum(baidu::galaxy::RpcClient* rpc_client,
+                          baidu::galaxy::Master_Stub* master, const std::string& jobid) {
+    baidu::galaxy::ListJobsRequest request;
+    baidu::galaxy::ListJobsResponse response;
+    if (!rpc_client->SendRequest(master, &baidu::galaxy::Master_Stub::ListJobs,
+                                 &request, &response, 5, 1)) {
+        return -1;
+    }
+    for (int i = 0; i < response.jobs_size(); i++) {
+        if (response.jobs(i).jobid() == jobid) {
+            return response.jobs(i).running_num();
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[]) {
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    char work_dir[] = "/tmp/failover_test.XXXXXX";
+    if (mkdtemp(work_dir) == NULL) {
+        fprintf(stderr, "fail to make work dir\n");
+        return -1;
+    }
+    std::string nexus_server = "127.0.0.1:" + Port(0);
+    std::string agent_endpoint = "127.0.0.1:" + Port(3);
+    std::string master_endpoints[2];
+    for (int32_t i = 0; i < 2; i++) {
+        master_endpoints[i] = baidu::galaxy::MasterUtil::SelfEndpoint(Port(1 + i));
+    }
+
+    sofa::pbrpc::RpcServerOptions options;
+    sofa::pbrpc::RpcServer rpc_server(options);
+    baidu::galaxy::FakeAgent* agent = new baidu::galaxy::FakeAgent(agent_endpoint, 2000, 2000);
+    if (!rpc_server.RegisterService(static_cast<baidu::galaxy::Agent*>(agent))
+        || !rpc_server.Start("0.0.0.0:" + Port(3))) {
+        fprintf(stderr, "fail to start fake agent\n");
+        return -1;
+    }
+
+    baidu::galaxy::LocalProcesses processes(FLAGS_failover_test_bin_dir);
+    std::vector<std::string> args;
+    args.push_back("--mem_nexus_port=" + Port(0));
+    args.push_back("--mem_nexus_session_timeout=3000");
+    processes.Spawn("mem_nexus", args);
+    sleep(1);
+    pid_t masters[2];
+    for (int32_t i = 0; i < 2; i++) {
+        std::string dir = std::string(work_dir) + "/master" + NumToString(i);
+        args.clear();
+        args.push_back("--nexus_servers=mem://" + nexus_server);
+        args.push_back("--mem_nexus_session_timeout=3000");
+        args.push_back("--master_port=" + Port(1 + i));
+        args.push_back("--master_replica_interval=200");
+        args.push_back("--master_safe_mode_min_wait=500");
+        args.push_back("--master_safe_mode_deadline=3000");
+        args.push_back("--master_query_period=1000");
+        args.push_back("--master_snapshot_path=" + dir + "/snapshot");
+        args.push_back("--master_binary_store_path=" + dir + "/binaries");
+        args.push_back("--master_event_log_path=");
+        masters[i] = processes.Spawn("master", args);
+        // the first takes the lock, the second follows it
+        sleep(1);
+    }
+
+    boost::scoped_ptr<baidu::galaxy::KvStore> nexus(
+        baidu::galaxy::KvStore::Open("mem://" + nexus_server));
+    std::string master_path_key = FLAGS_nexus_root_path + FLAGS_master_path;
+    std::string leader;
+    if (!nexus->Get(master_path_key, &leader) || leader != master_endpoints[0]) {
+        fprintf(stderr, "first master not active: %s\n", leader.c_str());
+        return -1;
+    }
+
+    baidu::galaxy::RpcClient rpc_client;
+    baidu::galaxy::Master_Stub* stubs[2];
+    for (int32_t i = 0; i < 2; i++) {
+        rpc_client.GetStub(master_endpoints[i], &stubs[i]);
+    }
+    boost::scoped_ptr<baidu::galaxy::Master_Stub> stub_ptr0(stubs[0]);
+    boost::scoped_ptr<baidu::galaxy::Master_Stub> stub_ptr1(stubs[1]);
+    int64_t sequence = 0;
+    std::string jobid;
+    for (int32_t round = 0; round < FLAGS_failover_test_timeout * 2; round++) {
+        baidu::galaxy::SendHeartBeat(&rpc_client, stubs[0], agent_endpoint, ++sequence);
+        if (jobid.empty()) {
+            baidu::galaxy::SubmitJob(&rpc_client, stubs[0], "failover", 500, &jobid);
+        }
+        baidu::galaxy::ScheduleOnAgent(&rpc_client, master_endpoints[0], agent_endpoint);
+        if (!jobid.empty() && agent->Runs(jobid) > 0
+            && RunningNum(&rpc_client, stubs[0], jobid) == 1) {
+            break;
+        }
+        usleep(500000);
+    }
+    if (jobid.empty() || agent->Runs(jobid) == 0) {
+        fprintf(stderr, "job not placed\n");
+        return -1;
+    }
+    // for the follower to pull the running pod
+    sleep(2);
+
+    processes.Kill(masters[0]);
+    bool taken_over = false;
+    for (int32_t round = 0; round < FLAGS_failover_test_timeout * 2; round++) {
+        baidu::galaxy::SendHeartBeat(&rpc_client, stubs[1], agent_endpoint, ++sequence);
+        baidu::galaxy::ScheduleOnAgent(&rpc_client, master_endpoints[1], agent_endpoint);
+        if (!taken_over && nexus->Get(master_path_key, &leader)
+            && leader == master_endpoints[1]) {
+            taken_over = true;
+            // a few more rounds, a pod lost in the take over would be placed again
+            round = FLAGS_failover_test_timeout * 2 - 10;
+        }
+        usleep(500000);
+    }
+    if (!taken_over) {
+        fprintf(stderr, "follower did not take over\n");
+        return -1;
+    }
+    if (RunningNum(&rpc_client, stubs[1], jobid) != 1) {
+        fprintf(stderr, "job not running after take over\n");
+        return -1;
+    }
+    if (agent->RunPods() != 1 || agent->Runs(jobid) != 1) {
+        fprintf(stderr, "pod deployed again after take over, run pods: %d\n",
+                agent->RunPods());
+        return -1;
+    }
+    processes.KillAll();
+    std::string clean = std::string("rm -rf ") + work_dir;
+    if (system(clean.c_str()) != 0) {
+        fprintf(stderr, "fail to remove %s\n", work_dir);
+    }
+    fprintf(stderr, "failover test passed\n");
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,314 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// JobStore over a MemKvStore that can be made to fail. Mutations of a job
+// queued together must be coalesced into one write and batches kept under
+// master_persist_batch_size; a failed write must fail only the callbacks
+// of its job and leave the later batches flowing; LoadAll and ReplayLog
+// must give back what was committed.
+#include <stdio.h>
+#include <unistd.h>
+#include <string>
+#include <map>
+#include <set>
+#include <boost/bind.hpp>
+
+#include <gflags/gflags.h>
+#include <mutex.h>
+
+#include "master/job_store.h"
+#include "master/kv_store.h"
+
+DECLARE_string(nexus_root_path);
+DECLARE_string(jobs_store_path);
+DECLARE_string(jobs_log_path);
+DECLARE_int32(master_persist_batch_size);
+DECLARE_int32(master_persist_delay);
+DECLARE_int32(master_persist_threads);
+
+using baidu::common::Mutex;
+using baidu::common::MutexLock;
+using baidu::common::CondVar;
+using baidu::galaxy::JobInfo;
+using baidu::galaxy::JobStore;
+using baidu::galaxy::JobStoreLog;
+using baidu::galaxy::KvList;
+
+// counts the writes of job records, fails those of fail_key or all of them
+class FailingKvStore : public baidu::galaxy::MemKvStore {
+public:
+    FailingKvStore() : job_puts_(0), fail_all_(false) {}
+    virtual bool Put(const std::string& key, const std::string& value) {
+        {
+            MutexLock lock(&mutex_);
+            if (fail_all_ || key == fail_key_) {
+                return false;
+            }
+            if (key.find(FLAGS_jobs_store_path + "/") != std::string::npos) {
+                job_puts_++;
+            }
+        }
+        return MemKvStore::Put(key, value);
+    }
+    virtual bool Delete(const std::string& key) {
+        {
+            MutexLock lock(&mutex_);
+            if (fail_all_ || key == fail_key_) {
+                return false;
+            }
+        }
+        return MemKvStore::Delete(key);
+    }
+    void FailKey(const std::string& key) {
+        MutexLock lock(&mutex_);
+        fail_key_ = key;
+    }
+    void FailAll(bool fail) {
+        MutexLock lock(&mutex_);
+        fail_all_ = fail;
+    }
+    int32_t JobPuts() {
+        MutexLock lock(&mutex_);
+        return job_puts_;
+    }
+private:
+    Mutex mutex_;
+    int32_t job_puts_;
+    bool fail_all_;
+    std::string fail_key_;
+};
+
+// the callbacks run so far and the job ids of those that failed
+class Callbacks {
+public:
+    Callbacks() : done_(0), cond_(&mutex_) {}
+    JobStore::Callback For(const std::string& jobid) {
+        return boost::bind(&Callbacks::Done, this, jobid, _1);
+    }
+    bool WaitFor(int32_t num) {
+        MutexLock lock(&mutex_);
+        while (done_ < num) {
+            if (!cond_.TimeWait(5000)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    std::multiset<std::string> Failed() {
+        MutexLock lock(&mutex_);
+        return failed_;
+    }
+private:
+    void Done(const std::string& jobid, bool ok) {
+        MutexLock lock(&mutex_);
+        if (!ok) {
+            failed_.insert(jobid);
+        }
+        done_++;
+        cond_.Signal();
+    }
+    int32_t done_;
+    std::multiset<std::string> failed_;
+    Mutex mutex_;
+    CondVar cond_;
+};
+
+static JobInfo MakeJob(const std::string& jobid, int32_t replica) {
+    JobInfo job_info;
+    job_info.set_jobid(jobid);
+    job_info.mutable_desc()->set_name(jobid);
+    job_info.mutable_desc()->set_replica(replica);
+    return job_info;
+}
+
+static std::string JobName(int32_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "job_%02d", i);
+    return buf;
+}
+
+// the revision is applied after the callbacks of its batch have run
+static bool WaitApplied(JobStore* job_store, int64_t revision) {
+    for (int32_t i = 0; i < 500; i++) {
+        if (job_store->AppliedRevision() >= revision) {
+            return job_store->AppliedRevision() == revision;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+static bool ReadLog(FailingKvStore* kv_store, std::vector<JobStoreLog>* logs) {
+    std::string start_key = FLAGS_nexus_root_path + FLAGS_jobs_log_path + "/";
+    KvList entries;
+    if (!kv_store->Scan(start_key, start_key + "~", &entries)) {
+        return false;
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        logs->push_back(JobStoreLog());
+        if (!logs->back().ParseFromString(entries[i].second)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int TestBatching(FailingKvStore* kv_store, JobStore* job_store) {
+    Callbacks callbacks;
+    // queued together with its first version, only the second is written
+    job_store->Save(MakeJob(JobName(0), 1), callbacks.For(JobName(0)));
+    job_store->Save(MakeJob(JobName(0), 2), callbacks.For(JobName(0)));
+    for (int32_t i = 1; i < 10; i++) {
+        job_store->Save(MakeJob(JobName(i), 1), callbacks.For(JobName(i)));
+    }
+    if (!callbacks.WaitFor(11)) {
+        fprintf(stderr, "batching: callbacks not run\n");
+        return -1;
+    }
+    if (!callbacks.Failed().empty()) {
+        fprintf(stderr, "batching: %lu callbacks failed\n", callbacks.Failed().size());
+        return -1;
+    }
+    if (kv_store->JobPuts() != 10) {
+        fprintf(stderr, "batching: %d job records written, expect 10\n", kv_store->JobPuts());
+        return -1;
+    }
+    std::vector<JobStoreLog> logs;
+    if (!ReadLog(kv_store, &logs) || logs.empty()) {
+        fprintf(stderr, "batching: no job log\n");
+        return -1;
+    }
+    std::set<std::string> logged;
+    for (size_t i = 0; i < logs.size(); i++) {
+        if (logs[i].revision() != static_cast<int64_t>(i + 1)) {
+            fprintf(stderr, "batching: log entry %lu has revision %ld\n", i, logs[i].revision());
+            return -1;
+        }
+        if (logs[i].jobids_size() > FLAGS_master_persist_batch_size) {
+            fprintf(stderr, "batching: batch of %d records\n", logs[i].jobids_size());
+            return -1;
+        }
+        logged.insert(logs[i].jobids().begin(), logs[i].jobids().end());
+    }
+    if (logged.size() != 10 || !WaitApplied(job_store, logs.size())) {
+        fprintf(stderr, "batching: %lu jobs logged, applied revision %ld of %lu\n",
+                logged.size(), job_store->AppliedRevision(), logs.size());
+        return -1;
+    }
+    return 0;
+}
+
+static int TestFailure(FailingKvStore* kv_store, JobStore* job_store) {
+    Callbacks callbacks;
+    int64_t revision = job_store->AppliedRevision();
+    kv_store->FailKey(JobStore::JobKey(JobName(1)));
+    job_store->Save(MakeJob(JobName(1), 3), callbacks.For(JobName(1)));
+    job_store->Remove(JobName(2), callbacks.For(JobName(2)));
+    if (!callbacks.WaitFor(2)) {
+        fprintf(stderr, "failure: callbacks not run\n");
+        return -1;
+    }
+    std::multiset<std::string> failed = callbacks.Failed();
+    if (failed.size() != 1 || failed.count(JobName(1)) != 1) {
+        fprintf(stderr, "failure: %lu callbacks failed, expect only %s\n",
+                failed.size(), JobName(1).c_str());
+        return -1;
+    }
+    kv_store->FailKey("");
+    // a batch of which nothing, not even its log entry, is written
+    kv_store->FailAll(true);
+    job_store->Save(MakeJob(JobName(3), 3), callbacks.For(JobName(3)));
+    if (!callbacks.WaitFor(3) || callbacks.Failed().count(JobName(3)) != 1) {
+        fprintf(stderr, "failure: write under a failing store not failed\n");
+        return -1;
+    }
+    kv_store->FailAll(false);
+    job_store->Save(MakeJob(JobName(4), 3), callbacks.For(JobName(4)));
+    if (!callbacks.WaitFor(4) || callbacks.Failed().count(JobName(4)) != 0) {
+        fprintf(stderr, "failure: store stopped flushing after a failed batch\n");
+        return -1;
+    }
+    // one batch for the first two, then the failed one and the last
+    if (!WaitApplied(job_store, revision + 3)) {
+        fprintf(stderr, "failure: applied revision %ld after %ld\n",
+                job_store->AppliedRevision(), revision);
+        return -1;
+    }
+    return 0;
+}
+
+static int TestLoad(FailingKvStore* kv_store, int64_t revision) {
+    JobStore job_store(kv_store);
+    std::map<std::string, std::string> records;
+    if (!job_store.LoadAll(&records)) {
+        fprintf(stderr, "load: LoadAll failed\n");
+        return -1;
+    }
+    // job_02 removed, job_01 and job_03 at the version before their failed writes
+    if (records.size() != 9 || records.count(JobName(2)) != 0) {
+        fprintf(stderr, "load: %lu records\n", records.size());
+        return -1;
+    }
+    int32_t expected_replica[10] = {2, 1, 0, 1, 3, 1, 1, 1, 1, 1};
+    for (int32_t i = 0; i < 10; i++) {
+        if (i == 2) {
+            continue;
+        }
+        JobInfo job_info;
+        if (!job_info.ParseFromString(records[JobName(i)])
+            || job_info.desc().replica() != expected_replica[i]) {
+            fprintf(stderr, "load: bad record of %s\n", JobName(i).c_str());
+            return -1;
+        }
+    }
+    if (job_store.AppliedRevision() != revision) {
+        fprintf(stderr, "load: revision %ld, expect %ld\n",
+                job_store.AppliedRevision(), revision);
+        return -1;
+    }
+    // the log misses the entry of the batch that failed as a whole
+    std::map<std::string, std::string> replayed;
+    if (job_store.ReplayLog(0, &replayed)) {
+        fprintf(stderr, "load: replay across a log gap succeeded\n");
+        return -1;
+    }
+    replayed.clear();
+    if (!job_store.ReplayLog(revision - 1, &replayed) || replayed.size() != 1
+        || replayed.count(JobName(4)) != 1 || job_store.AppliedRevision() != revision) {
+        fprintf(stderr, "load: replay of the last entry gives %lu records\n",
+                replayed.size());
+        return -1;
+    }
+    job_store.TrimLog(revision);
+    std::vector<JobStoreLog> logs;
+    if (!ReadLog(kv_store, &logs) || logs.size() != 1 || logs[0].revision() != revision) {
+        fprintf(stderr, "load: %lu log entries left after trim\n", logs.size());
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    FLAGS_master_persist_batch_size = 4;
+    FLAGS_master_persist_delay = 200;
+    FLAGS_master_persist_threads = 2;
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    FailingKvStore kv_store;
+    int64_t revision = 0;
+    {
+        JobStore job_store(&kv_store);
+        if (TestBatching(&kv_store, &job_store) != 0
+            || TestFailure(&kv_store, &job_store) != 0) {
+            return -1;
+        }
+        revision = job_store.AppliedRevision();
+    }
+    if (TestLoad(&kv_store, revision) != 0) {
+        return -1;
+    }
+    fprintf(stderr, "job store test passed\n");
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
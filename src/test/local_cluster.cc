@@ -0,0 +1,326 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#include "local_cluster.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/scoped_ptr.hpp>
+
+namespace baidu {
+namespace galaxy {
+
+FakeAgent::FakeAgent(const std::string& endpoint, int32_t millicores, int32_t memory)
+    : endpoint_(endpoint), millicores_(millicores), memory_(memory),
+      run_pods_(0), overcommits_(0) {
+}
+
+void FakeAgent::ListPods() {
+    mutex_.AssertHeld();
+    std::vector<PodStatus> pods;
+    std::map<std::string, PodStatus>::iterator it = pods_.begin();
+    for (; it != pods_.end(); ++it) {
+        pods.push_back(it->second);
+    }
+    running_pods_.Reset(pods);
+}
+
+void FakeAgent::Query(::google::protobuf::RpcController* /*controller*/,
+                      const QueryRequest* request, QueryResponse* response,
+                      ::google::protobuf::Closure* done) {
+    MutexLock lock(&mutex_);
+    AgentInfo* agent = response->mutable_agent();
+    if (request->bucket_digests_size() > 0) {
+        ListPods();
+        std::vector<uint64_t> bucket_digests(request->bucket_digests().begin(),
+                                             request->bucket_digests().end());
+        std::vector<PodStatus> pods;
+        std::vector<int32_t> mismatched_buckets;
+        if (!running_pods_.Diff(bucket_digests, &pods, &mismatched_buckets)) {
+            response->set_status(kInputError);
+            done->Run();
+            return;
+        }
+        agent->set_endpoint(endpoint_);
+        for (size_t i = 0; i < pods.size(); i++) {
+            agent->add_pods()->CopyFrom(pods[i]);
+        }
+        for (size_t i = 0; i < mismatched_buckets.size(); i++) {
+            response->add_mismatched_buckets(mismatched_buckets[i]);
+        }
+        response->set_status(kOk);
+        done->Run();
+        return;
+    }
+    int32_t millicores = 0;
+    int32_t memory = 0;
+    std::map<std::string, PodStatus>::iterator it = pods_.begin();
+    for (; it != pods_.end(); ++it) {
+        millicores += it->second.resource_used().millicores();
+        memory += it->second.resource_used().memory();
+        agent->add_pods()->CopyFrom(it->second);
+    }
+    agent->set_endpoint(endpoint_);
+    agent->mutable_total()->set_millicores(millicores_);
+    agent->mutable_total()->set_memory(memory_);
+    agent->mutable_assigned()->set_millicores(millicores);
+    agent->mutable_assigned()->set_memory(memory);
+    agent->mutable_unassigned()->set_millicores(millicores_ - millicores);
+    agent->mutable_unassigned()->set_memory(memory_ - memory);
+    agent->mutable_free()->set_millicores(millicores_);
+    agent->mutable_free()->set_memory(memory_);
+    response->set_status(kOk);
+    done->Run();
+}
+
+void FakeAgent::RunPod(::google::protobuf::RpcController* /*controller*/,
+                       const RunPodRequest* request, RunPodResponse* response,
+                       ::google::protobuf::Closure* done) {
+    MutexLock lock(&mutex_);
+    run_pods_++;
+    Resource requirement;
+    requirement.set_millicores(0);
+    requirement.set_memory(0);
+    for (int i = 0; i < request->pod().tasks_size(); i++) {
+        const Resource& task_requirement = request->pod().tasks(i).requirement();
+        requirement.set_millicores(requirement.millicores() + task_requirement.millicores());
+        requirement.set_memory(requirement.memory() + task_requirement.memory());
+    }
+    int32_t millicores = requirement.millicores();
+    int32_t memory = requirement.memory();
+    std::map<std::string, PodStatus>::iterator it = pods_.begin();
+    for (; it != pods_.end(); ++it) {
+        if (it->first != request->podid()) {
+            millicores += it->second.resource_used().millicores();
+            memory += it->second.resource_used().memory();
+        }
+    }
+    if (millicores > millicores_ || memory > memory_) {
+        fprintf(stderr, "pod %s of %s overcommits the agent\n",
+                request->podid().c_str(), request->jobid().c_str());
+        overcommits_++;
+        response->set_status(kQuota);
+        done->Run();
+        return;
+    }
+    PodStatus& pod = pods_[request->podid()];
+    pod.set_podid(request->podid());
+    pod.set_jobid(request->jobid());
+    pod.set_version(request->version());
+    pod.set_endpoint(endpoint_);
+    pod.set_state(kPodRunning);
+    pod.mutable_resource_used()->CopyFrom(requirement);
+    response->set_status(kOk);
+    done->Run();
+}
+
+void FakeAgent::KillPod(::google::protobuf::RpcController* /*controller*/,
+                        const KillPodRequest* request, KillPodResponse* response,
+                        ::google::protobuf::Closure* done) {
+    MutexLock lock(&mutex_);
+    pods_.erase(request->podid());
+    running_pods_.Remove(request->podid());
+    response->set_status(kOk);
+    done->Run();
+}
+
+uint64_t FakeAgent::Digest() {
+    MutexLock lock(&mutex_);
+    ListPods();
+    return running_pods_.Root();
+}
+
+void FakeAgent::Restart() {
+    MutexLock lock(&mutex_);
+    running_pods_ = RunningPods();
+}
+
+int32_t FakeAgent::Runs(const std::string& jobid) {
+    MutexLock lock(&mutex_);
+    int32_t num = 0;
+    std::map<std::string, PodStatus>::iterator it = pods_.begin();
+    for (; it != pods_.end(); ++it) {
+        if (it->second.jobid() == jobid) {
+            num++;
+        }
+    }
+    return num;
+}
+
+int32_t FakeAgent::RunPods() {
+    MutexLock lock(&mutex_);
+    return run_pods_;
+}
+
+int32_t FakeAgent::Overcommits() {
+    MutexLock lock(&mutex_);
+    return overcommits_;
+}
+
+LocalProcesses::LocalProcesses(const std::string& bin_dir) : bin_dir_(bin_dir) {
+}
+
+LocalProcesses::~LocalProcesses() {
+    KillAll();
+}
+
+pid_t LocalProcesses::Spawn(const std::string& binary, const std::vector<std::string>& args) {
+    std::string path = bin_dir_ + "/" + binary;
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(path.c_str()));
+        for (size_t i = 0; i < args.size(); i++) {
+            argv.push_back(const_cast<char*>(args[i].c_str()));
+        }
+        argv.push_back(NULL);
+        execv(path.c_str(), &argv[0]);
+        fprintf(stderr, "fail to exec %s\n", path.c_str());
+        _exit(127);
+    }
+    if (pid > 0) {
+        children_.push_back(pid);
+    }
+    return pid;
+}
+
+void LocalProcesses::Kill(pid_t pid) {
+    for (size_t i = 0; i < children_.size(); i++) {
+        if (children_[i] == pid) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            children_.erase(children_.begin() + i);
+            return;
+        }
+    }
+}
+
+void LocalProcesses::KillAll() {
+    for (size_t i = 0; i < children_.size(); i++) {
+        kill(children_[i], SIGKILL);
+        waitpid(children_[i], NULL, 0);
+    }
+    children_.clear();
+}
+
+std::string NumToString(int64_t num) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", num);
+    return buf;
+}
+
+static void FillJob(const std::string& name, int32_t size, JobDescriptor* job) {
+    job->set_name(name);
+    job->set_user("test");
+    job->set_type(kLongRun);
+    job->set_replica(1);
+    TaskDescriptor* task = job->mutable_pod()->add_tasks();
+    task->set_start_command("sleep 1000");
+    task->mutable_requirement()->set_millicores(size);
+    task->mutable_requirement()->set_memory(size);
+}
+
+bool SubmitJob(RpcClient* rpc_client, Master_Stub* master,
+               const std::string& name, int32_t size, std::string* jobid) {
+    return SubmitJob(rpc_client, master, name, size, "", jobid);
+}
+
+bool SubmitJob(RpcClient* rpc_client, Master_Stub* master,
+               const std::string& name, int32_t size, const std::string& binary,
+               std::string* jobid) {
+    SubmitJobRequest request;
+    SubmitJobResponse response;
+    FillJob(name, size, request.mutable_job());
+    if (!binary.empty()) {
+        request.mutable_job()->mutable_pod()->mutable_tasks(0)->set_binary(binary);
+    }
+    if (!rpc_client->SendRequest(master, &Master_Stub::SubmitJob,
+                                 &request, &response, 5, 1)
+        || response.status() != kOk) {
+        return false;
+    }
+    *jobid = response.jobid();
+    return true;
+}
+
+bool UpdateJob(RpcClient* rpc_client, Master_Stub* master, const std::string& jobid,
+               const std::string& name, int32_t size) {
+    UpdateJobRequest request;
+    UpdateJobResponse response;
+    request.set_jobid(jobid);
+    FillJob(name, size, request.mutable_job());
+    return rpc_client->SendRequest(master, &Master_Stub::UpdateJob,
+                                   &request, &response, 5, 1)
+           && response.status() == kOk;
+}
+
+bool SendHeartBeat(RpcClient* rpc_client, Master_Stub* master,
+                   const std::string& agent_endpoint, int64_t sequence) {
+    HeartBeatRequest request;
+    HeartBeatResponse response;
+    request.set_endpoint(agent_endpoint);
+    request.set_sequence(sequence);
+    return rpc_client->SendRequest(master, &Master_Stub::HeartBeat,
+                                   &request, &response, 1, 1);
+}
+
+bool SendHeartBeat(RpcClient* rpc_client, Master_Stub* master,
+                   FakeAgent* agent, const std::string& agent_endpoint, int64_t sequence) {
+    HeartBeatRequest request;
+    HeartBeatResponse response;
+    request.set_endpoint(agent_endpoint);
+    request.set_sequence(sequence);
+    request.set_pod_digest(agent->Digest());
+    return rpc_client->SendRequest(master, &Master_Stub::HeartBeat,
+                                   &request, &response, 1, 1);
+}
+
+int64_t GetMetric(RpcClient* rpc_client, Master_Stub* master, const std::string& name) {
+    GetMasterStatusRequest request;
+    GetMasterStatusResponse response;
+    if (!rpc_client->SendRequest(master, &Master_Stub::GetMasterStatus,
+                                 &request, &response, 5, 1)) {
+        return -1;
+    }
+    for (int i = 0; i < response.metrics_size(); i++) {
+        if (response.metrics(i).name() == name) {
+            return response.metrics(i).value();
+        }
+    }
+    return -1;
+}
+
+void ScheduleOnAgent(RpcClient* rpc_client, const std::string& master_endpoint,
+                     const std::string& agent_endpoint) {
+    Master_Stub* stub = NULL;
+    rpc_client->GetStub(master_endpoint, &stub);
+    boost::scoped_ptr<Master_Stub> stub_ptr(stub);
+    GetPendingJobsRequest pending_request;
+    GetPendingJobsResponse pending_response;
+    if (!rpc_client->SendRequest(stub, &Master_Stub::GetPendingJobs,
+                                 &pending_request, &pending_response, 5, 1)) {
+        return;
+    }
+    ProposeRequest propose_request;
+    for (int i = 0; i < pending_response.scale_up_jobs_size(); i++) {
+        const JobInfo& job = pending_response.scale_up_jobs(i);
+        for (int j = 0; j < job.pods_size(); j++) {
+            ScheduleInfo* schedule = propose_request.add_schedule();
+            schedule->set_endpoint(agent_endpoint);
+            schedule->set_jobid(job.jobid());
+            schedule->set_podid(job.pods(j).podid());
+            schedule->set_action(kLaunch);
+        }
+    }
+    if (propose_request.schedule_size() == 0) {
+        return;
+    }
+    ProposeResponse propose_response;
+    rpc_client->SendRequest(stub, &Master_Stub::Propose,
+                            &propose_request, &propose_response, 5, 1);
+}
+
+}
+}
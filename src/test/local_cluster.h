@@ -0,0 +1,98 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+#ifndef BAIDU_GALAXY_LOCAL_CLUSTER_H
+#define BAIDU_GALAXY_LOCAL_CLUSTER_H
+#include <stdint.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <mutex.h>
+
+#include "proto/agent.pb.h"
+#include "proto/master.pb.h"
+#include "rpc/rpc_client.h"
+#include "pod_digest.h"
+
+namespace baidu {
+namespace galaxy {
+
+// Helpers of tests running master, router and mem_nexus as local
+// processes, with this process as agent and scheduler.
+
+// Agent that runs nothing, it keeps the pods sent to it and refuses the
+// ones it has no room for. The kept pods stand for what gced runs, the
+// digest and the drill-down are built from them as the agent does.
+class FakeAgent : public Agent {
+public:
+    FakeAgent(const std::string& endpoint, int32_t millicores, int32_t memory);
+    void Query(::google::protobuf::RpcController* controller,
+               const QueryRequest* request, QueryResponse* response,
+               ::google::protobuf::Closure* done);
+    void RunPod(::google::protobuf::RpcController* controller,
+                const RunPodRequest* request, RunPodResponse* response,
+                ::google::protobuf::Closure* done);
+    void KillPod(::google::protobuf::RpcController* controller,
+                 const KillPodRequest* request, KillPodResponse* response,
+                 ::google::protobuf::Closure* done);
+    // root of the pod digest sent in heartbeats
+    uint64_t Digest();
+    // the agent process starts again, gced and its pods stay
+    void Restart();
+    // pods of jobid kept
+    int32_t Runs(const std::string& jobid);
+    // RunPod requests accepted and refused for want of room
+    int32_t RunPods();
+    int32_t Overcommits();
+private:
+    Mutex mutex_;
+    std::string endpoint_;
+    int32_t millicores_;
+    int32_t memory_;
+    // the list of gced
+    void ListPods();
+    std::map<std::string, PodStatus> pods_;
+    RunningPods running_pods_;
+    int32_t run_pods_;
+    int32_t overcommits_;
+};
+
+// Children are killed when it goes.
+class LocalProcesses {
+public:
+    explicit LocalProcesses(const std::string& bin_dir);
+    ~LocalProcesses();
+    pid_t Spawn(const std::string& binary, const std::vector<std::string>& args);
+    void Kill(pid_t pid);
+    void KillAll();
+private:
+    std::string bin_dir_;
+    std::vector<pid_t> children_;
+};
+
+std::string NumToString(int64_t num);
+bool SubmitJob(RpcClient* rpc_client, Master_Stub* master,
+               const std::string& name, int32_t size, std::string* jobid);
+// with binary as the binary of its task
+bool SubmitJob(RpcClient* rpc_client, Master_Stub* master,
+               const std::string& name, int32_t size, const std::string& binary,
+               std::string* jobid);
+bool UpdateJob(RpcClient* rpc_client, Master_Stub* master, const std::string& jobid,
+               const std::string& name, int32_t size);
+bool SendHeartBeat(RpcClient* rpc_client, Master_Stub* master,
+                   const std::string& agent_endpoint, int64_t sequence);
+// with the pod digest of agent
+bool SendHeartBeat(RpcClient* rpc_client, Master_Stub* master,
+                   FakeAgent* agent, const std::string& agent_endpoint, int64_t sequence);
+// value of the named metric of GetMasterStatus, -1 when not got
+int64_t GetMetric(RpcClient* rpc_client, Master_Stub* master, const std::string& name);
+// one round of a scheduler: every pending pod proposed to the agent
+void ScheduleOnAgent(RpcClient* rpc_client, const std::string& master_endpoint,
+                     const std::string& agent_endpoint);
+
+}
+}
+
+#endif
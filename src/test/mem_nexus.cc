@@ -0,0 +1,249 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// In-memory nexus stand-in, so master, router and the rest can be run as
+// local processes in tests with --nexus_servers=mem://<host:port>.
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <sofa/pbrpc/pbrpc.h>
+#include <gflags/gflags.h>
+#include <logging.h>
+#include <mutex.h>
+#include <thread_pool.h>
+#include <timer.h>
+
+#include "proto/mem_nexus.pb.h"
+#include "master/kv_store.h"
+
+using baidu::common::Log;
+using baidu::common::FATAL;
+using baidu::common::INFO;
+using baidu::common::WARNING;
+
+DECLARE_string(mem_nexus_port);
+DECLARE_int32(mem_nexus_session_timeout);
+
+namespace baidu {
+namespace galaxy {
+
+// the answer to one watch, given by whichever comes first of a change,
+// a difference found right away or the poll timing out
+struct WatchReply {
+    Mutex mutex;
+    bool replied;
+    MemNexusResponse* response;
+    ::google::protobuf::Closure* done;
+    WatchReply(MemNexusResponse* resp, ::google::protobuf::Closure* closure)
+        : replied(false), response(resp), done(closure) {}
+    void Reply(bool ok, bool exists, const std::string& value) {
+        {
+            MutexLock lock(&mutex);
+            if (replied) {
+                return;
+            }
+            replied = true;
+        }
+        response->set_ok(ok);
+        response->set_exists(exists);
+        response->set_value(value);
+        done->Run();
+    }
+};
+
+class MemNexusImpl : public MemNexus {
+public:
+    MemNexusImpl() : workers_(8), reaper_(1) {
+        reaper_.DelayTask(1000, boost::bind(&MemNexusImpl::ReapSessions, this));
+    }
+    virtual ~MemNexusImpl() {
+        reaper_.Stop(false);
+        workers_.Stop(false);
+        std::map<std::string, MemKvStore*>::iterator it = sessions_.begin();
+        for (; it != sessions_.end(); ++it) {
+            delete it->second;
+        }
+    }
+    void Put(::google::protobuf::RpcController* /*controller*/,
+             const MemNexusRequest* request, MemNexusResponse* response,
+             ::google::protobuf::Closure* done) {
+        Touch(request->session());
+        response->set_ok(root_.Put(request->key(), request->value()));
+        done->Run();
+    }
+    void Get(::google::protobuf::RpcController* /*controller*/,
+             const MemNexusRequest* request, MemNexusResponse* response,
+             ::google::protobuf::Closure* done) {
+        Touch(request->session());
+        std::string value;
+        response->set_exists(root_.Get(request->key(), &value));
+        response->set_value(value);
+        response->set_ok(true);
+        done->Run();
+    }
+    void Delete(::google::protobuf::RpcController* /*controller*/,
+                const MemNexusRequest* request, MemNexusResponse* response,
+                ::google::protobuf::Closure* done) {
+        Touch(request->session());
+        response->set_ok(root_.Delete(request->key()));
+        done->Run();
+    }
+    void Scan(::google::protobuf::RpcController* /*controller*/,
+              const MemNexusRequest* request, MemNexusResponse* response,
+              ::google::protobuf::Closure* done) {
+        Touch(request->session());
+        KvList pairs;
+        response->set_ok(root_.Scan(request->key(), request->end_key(), &pairs));
+        for (size_t i = 0; i < pairs.size(); i++) {
+            MemNexusPair* pair = response->add_pairs();
+            pair->set_key(pairs[i].first);
+            pair->set_value(pairs[i].second);
+        }
+        done->Run();
+    }
+    void Lock(::google::protobuf::RpcController* /*controller*/,
+              const MemNexusRequest* request, MemNexusResponse* response,
+              ::google::protobuf::Closure* done) {
+        MemKvStore* session = Touch(request->session());
+        workers_.AddTask(boost::bind(&MemNexusImpl::DoLock, this, session,
+                                     request->key(), response, done, 0));
+    }
+    void Watch(::google::protobuf::RpcController* /*controller*/,
+               const MemNexusRequest* request, MemNexusResponse* response,
+               ::google::protobuf::Closure* done) {
+        Touch(request->session());
+        boost::shared_ptr<WatchReply> reply(new WatchReply(response, done));
+        root_.Watch(request->key(), boost::bind(&MemNexusImpl::OnChange, reply, _2, _3));
+        std::string value;
+        bool exists = root_.Get(request->key(), &value);
+        if (exists != request->exists() || value != request->value()) {
+            reply->Reply(true, exists, value);
+            return;
+        }
+        // answered before the client gives up, it watches again
+        workers_.DelayTask(30000, boost::bind(&WatchReply::Reply, reply,
+                                             false, false, std::string()));
+    }
+    void KeepAlive(::google::protobuf::RpcController* /*controller*/,
+                   const MemNexusRequest* request, MemNexusResponse* response,
+                   ::google::protobuf::Closure* done) {
+        MutexLock lock(&mutex_);
+        Session(request->session());
+        response->set_ok(!Expired(request->session()));
+        done->Run();
+    }
+private:
+    static void OnChange(boost::shared_ptr<WatchReply> reply,
+                         const std::string& value, bool deleted) {
+        reply->Reply(true, !deleted, value);
+    }
+    // polled, so an expired session stops waiting
+    void DoLock(MemKvStore* session, std::string key, MemNexusResponse* response,
+                ::google::protobuf::Closure* done, int32_t tries) {
+        if (session->TryLock(key)) {
+            response->set_ok(true);
+            done->Run();
+            return;
+        }
+        if (tries >= 40) {
+            response->set_ok(false);
+            done->Run();
+            return;
+        }
+        workers_.DelayTask(50, boost::bind(&MemNexusImpl::DoLock, this, session,
+                                           key, response, done, tries + 1));
+    }
+    MemKvStore* Touch(const std::string& session_id) {
+        MutexLock lock(&mutex_);
+        return Session(session_id);
+    }
+    MemKvStore* Session(const std::string& session_id) {
+        mutex_.AssertHeld();
+        if (!Expired(session_id)) {
+            last_seen_[session_id] = common::timer::get_micros();
+        }
+        std::map<std::string, MemKvStore*>::iterator it = sessions_.find(session_id);
+        if (it != sessions_.end()) {
+            return it->second;
+        }
+        MemKvStore* session = new MemKvStore(&root_, session_id);
+        sessions_[session_id] = session;
+        return session;
+    }
+    bool Expired(const std::string& session_id) {
+        mutex_.AssertHeld();
+        return expired_.find(session_id) != expired_.end();
+    }
+    // ended sessions stay known, their stores are kept for DoLock
+    void ReapSessions() {
+        int64_t now = common::timer::get_micros();
+        std::vector<MemKvStore*> expired;
+        {
+            MutexLock lock(&mutex_);
+            std::map<std::string, int64_t>::iterator it = last_seen_.begin();
+            while (it != last_seen_.end()) {
+                if (now - it->second < FLAGS_mem_nexus_session_timeout * 1000L) {
+                    ++it;
+                    continue;
+                }
+                LOG(INFO, "session %s expired", it->first.c_str());
+                expired_.insert(it->first);
+                expired.push_back(sessions_[it->first]);
+                last_seen_.erase(it++);
+            }
+        }
+        for (size_t i = 0; i < expired.size(); i++) {
+            expired[i]->ExpireSession();
+        }
+        reaper_.DelayTask(1000, boost::bind(&MemNexusImpl::ReapSessions, this));
+    }
+
+    MemKvStore root_;
+    Mutex mutex_;
+    std::map<std::string, MemKvStore*> sessions_;
+    std::map<std::string, int64_t> last_seen_;
+    std::set<std::string> expired_;
+    ThreadPool workers_;
+    ThreadPool reaper_;
+};
+
+}
+}
+
+static volatile bool s_quit = false;
+static void SignalIntHandler(int /*sig*/){
+    s_quit = true;
+}
+
+int main(int argc, char* argv[]) {
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    sofa::pbrpc::RpcServerOptions options;
+    sofa::pbrpc::RpcServer rpc_server(options);
+    baidu::galaxy::MemNexusImpl* mem_nexus = new baidu::galaxy::MemNexusImpl();
+    if (!rpc_server.RegisterService(static_cast<baidu::galaxy::MemNexus*>(mem_nexus))) {
+        LOG(FATAL, "failed to register mem nexus service");
+        exit(-1);
+    }
+    std::string server_addr = "0.0.0.0:" + FLAGS_mem_nexus_port;
+    if (!rpc_server.Start(server_addr)) {
+        LOG(FATAL, "failed to start mem nexus on %s", server_addr.c_str());
+        exit(-2);
+    }
+    LOG(INFO, "mem nexus serving on %s", server_addr.c_str());
+    signal(SIGINT, SignalIntHandler);
+    signal(SIGTERM, SignalIntHandler);
+    while (!s_quit) {
+        sleep(1);
+    }
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
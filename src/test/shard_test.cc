@@ -0,0 +1,242 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Two master shards and a router as local processes over mem_nexus, one
+// fake agent and this program as scheduler of both shards. A job needing
+// more than half of the agent and a small one, on different shards, must
+// both be placed, the agent never asked for more than it has. Through the
+// router a watch must see a job suspended, a shard's replica state and a
+// stored binary must be read.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
+
+#include <sofa/pbrpc/pbrpc.h>
+#include <gflags/gflags.h>
+
+#include "master/master_util.h"
+#include "local_cluster.h"
+
+DEFINE_string(shard_test_bin_dir, ".", "dir of the master, router and mem_nexus binaries");
+DEFINE_int32(shard_test_base_port, 18820, "first of the ports used by the test processes");
+DEFINE_int32(shard_test_timeout, 60, "seconds for both jobs to be placed");
+
+using baidu::galaxy::NumToString;
+
+static std::string Port(int32_t offset) {
+    return NumToString(FLAGS_shard_test_base_port + offset);
+}
+
+// suspends jobid and waits for its watch event
+static int TestWatch(baidu::galaxy::RpcClient* rpc_client, baidu::galaxy::Master_Stub* router,
+                     const std::string& jobid) {
+    baidu::galaxy::WatchRequest request;
+    baidu::galaxy::WatchResponse response;
+    request.add_jobids(jobid);
+    if (!rpc_client->SendRequest(router, &baidu::galaxy::Master_Stub::Watch,
+                                 &request, &response, 5, 1)
+        || response.status() != baidu::galaxy::kOk || response.shard_revisions_size() != 2) {
+        fprintf(stderr, "router does not answer watch\n");
+        return -1;
+    }
+    baidu::galaxy::SuspendJobRequest suspend_request;
+    baidu::galaxy::SuspendJobResponse suspend_response;
+    suspend_request.set_jobid(jobid);
+    if (!rpc_client->SendRequest(router, &baidu::galaxy::Master_Stub::SuspendJob,
+                                 &suspend_request, &suspend_response, 5, 1)
+        || suspend_response.status() != baidu::galaxy::kOk) {
+        fprintf(stderr, "fail to suspend %s\n", jobid.c_str());
+        return -1;
+    }
+    for (int32_t round = 0; round < 10; round++) {
+        request.set_revision(response.revision());
+        request.mutable_shard_revisions()->CopyFrom(response.shard_revisions());
+        request.set_timeout(1000);
+        if (!rpc_client->SendRequest(router, &baidu::galaxy::Master_Stub::Watch,
+                                     &request, &response, 5, 1)
+            || response.status() != baidu::galaxy::kOk) {
+            fprintf(stderr, "router does not answer watch\n");
+            return -1;
+        }
+        for (int i = 0; i < response.events_size(); i++) {
+            const baidu::galaxy::WatchEvent& event = response.events(i);
+            if (event.jobid() == jobid && event.podid().empty()
+                && event.job_state() == baidu::galaxy::kJobSuspend) {
+                return 0;
+            }
+        }
+    }
+    fprintf(stderr, "no watch event of suspended %s\n", jobid.c_str());
+    return -1;
+}
+
+static int TestReplicaState(baidu::galaxy::RpcClient* rpc_client,
+                            baidu::galaxy::Master_Stub* router, const std::string& jobid) {
+    baidu::galaxy::GetReplicaStateRequest request;
+    baidu::galaxy::GetReplicaStateResponse response;
+    request.set_shard(baidu::galaxy::MasterUtil::ShardOf(jobid));
+    if (!rpc_client->SendRequest(router, &baidu::galaxy::Master_Stub::GetReplicaState,
+                                 &request, &response, 5, 1)
+        || response.status() != baidu::galaxy::kOk) {
+        fprintf(stderr, "router does not answer replica state\n");
+        return -1;
+    }
+    for (int i = 0; i < response.jobids_size(); i++) {
+        if (response.jobids(i) == jobid) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "replica state of shard %d misses %s\n",
+            request.shard(), jobid.c_str());
+    return -1;
+}
+
+static int TestBinary(baidu::galaxy::RpcClient* rpc_client, baidu::galaxy::Master_Stub* router) {
+    std::string binary = "shard test binary";
+    std::string jobid;
+    if (!baidu::galaxy::SubmitJob(rpc_client, router, "binary", 100, binary, &jobid)) {
+        fprintf(stderr, "fail to submit job with binary\n");
+        return -1;
+    }
+    baidu::galaxy::ShowJobRequest show_request;
+    baidu::galaxy::ShowJobResponse show_response;
+    show_request.add_jobsid(jobid);
+    show_request.set_with_pods(false);
+    if (!rpc_client->SendRequest(router, &baidu::galaxy::Master_Stub::ShowJob,
+                                 &show_request, &show_response, 5, 1)
+        || show_response.jobs_size() != 1
+        || show_response.jobs(0).desc().pod().tasks_size() != 1) {
+        fprintf(stderr, "fail to show %s\n", jobid.c_str());
+        return -1;
+    }
+    baidu::galaxy::GetBinaryRequest request;
+    baidu::galaxy::GetBinaryResponse response;
+    request.set_digest(show_response.jobs(0).desc().pod().tasks(0).binary_digest());
+    if (!rpc_client->SendRequest(router, &baidu::galaxy::Master_Stub::GetBinary,
+                                 &request, &response, 5, 1)
+        || response.status() != baidu::galaxy::kOk || response.binary() != binary) {
+        fprintf(stderr, "router does not give back binary %s\n", request.digest().c_str());
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    char work_dir[] = "/tmp/shard_test.XXXXXX";
+    if (mkdtemp(work_dir) == NULL) {
+        fprintf(stderr, "fail to make work dir\n");
+        return -1;
+    }
+    std::string nexus = "--nexus_servers=mem://127.0.0.1:" + Port(0);
+    std::string agent_endpoint = "127.0.0.1:" + Port(4);
+    std::string router_endpoint = "127.0.0.1:" + Port(3);
+
+    sofa::pbrpc::RpcServerOptions options;
+    sofa::pbrpc::RpcServer rpc_server(options);
+    baidu::galaxy::FakeAgent* agent = new baidu::galaxy::FakeAgent(agent_endpoint, 2000, 2000);
+    if (!rpc_server.RegisterService(static_cast<baidu::galaxy::Agent*>(agent))
+        || !rpc_server.Start("0.0.0.0:" + Port(4))) {
+        fprintf(stderr, "fail to start fake agent\n");
+        return -1;
+    }
+
+    baidu::galaxy::LocalProcesses processes(FLAGS_shard_test_bin_dir);
+    std::vector<std::string> args;
+    args.push_back("--mem_nexus_port=" + Port(0));
+    args.push_back("--mem_nexus_session_timeout=3000");
+    processes.Spawn("mem_nexus", args);
+    sleep(1);
+    for (int32_t shard = 0; shard < 2; shard++) {
+        std::string dir = std::string(work_dir) + "/shard" + NumToString(shard);
+        args.clear();
+        args.push_back(nexus);
+        args.push_back("--master_port=" + Port(1 + shard));
+        args.push_back("--master_shard_id=" + NumToString(shard));
+        args.push_back("--master_shard_num=2");
+        args.push_back("--master_follower=false");
+        args.push_back("--master_safe_mode_min_wait=500");
+        args.push_back("--master_safe_mode_deadline=3000");
+        args.push_back("--master_query_period=1000");
+        args.push_back("--master_lease_timeout=2000");
+        args.push_back("--master_lease_hold=4000");
+        args.push_back("--master_snapshot_path=" + dir + "/snapshot");
+        args.push_back("--master_binary_store_path=" + dir + "/binaries");
+        args.push_back("--master_event_log_path=");
+        processes.Spawn("master", args);
+    }
+    args.clear();
+    args.push_back(nexus);
+    args.push_back("--router_port=" + Port(3));
+    args.push_back("--master_shard_num=2");
+    args.push_back("--master_lease_timeout=2000");
+    args.push_back("--relay_flush_interval=200");
+    processes.Spawn("router", args);
+
+    baidu::galaxy::RpcClient rpc_client;
+    baidu::galaxy::Master_Stub* router = NULL;
+    rpc_client.GetStub(router_endpoint, &router);
+    boost::scoped_ptr<baidu::galaxy::Master_Stub> router_ptr(router);
+    int64_t sequence = 0;
+    std::vector<std::string> jobids;
+    for (int32_t round = 0; round < FLAGS_shard_test_timeout * 2; round++) {
+        baidu::galaxy::SendHeartBeat(&rpc_client, router, agent_endpoint, ++sequence);
+        // the router sends submissions to the shards in turn
+        std::string jobid;
+        if (jobids.size() == 0
+            && baidu::galaxy::SubmitJob(&rpc_client, router, "big", 1200, &jobid)) {
+            jobids.push_back(jobid);
+        } else if (jobids.size() == 1
+                   && baidu::galaxy::SubmitJob(&rpc_client, router, "small", 600, &jobid)) {
+            jobids.push_back(jobid);
+            if (baidu::galaxy::MasterUtil::ShardOf(jobids[0])
+                == baidu::galaxy::MasterUtil::ShardOf(jobids[1])) {
+                fprintf(stderr, "both jobs on one shard\n");
+                return -1;
+            }
+        }
+        for (int32_t shard = 0; shard < 2; shard++) {
+            baidu::galaxy::ScheduleOnAgent(&rpc_client, "127.0.0.1:" + Port(1 + shard),
+                                           agent_endpoint);
+        }
+        if (agent->Overcommits() > 0) {
+            fprintf(stderr, "agent overcommitted\n");
+            return -1;
+        }
+        if (jobids.size() == 2 && agent->Runs(jobids[0]) > 0 && agent->Runs(jobids[1]) > 0) {
+            break;
+        }
+        usleep(500000);
+    }
+    if (jobids.size() < 2 || agent->Runs(jobids[0]) == 0 || agent->Runs(jobids[1]) == 0) {
+        fprintf(stderr, "jobs not placed\n");
+        return -1;
+    }
+
+    baidu::galaxy::ListJobsRequest list_request;
+    baidu::galaxy::ListJobsResponse list_response;
+    if (!rpc_client.SendRequest(router, &baidu::galaxy::Master_Stub::ListJobs,
+                                &list_request, &list_response, 5, 1)
+        || list_response.jobs_size() != 2) {
+        fprintf(stderr, "router does not list both jobs\n");
+        return -1;
+    }
+    if (TestWatch(&rpc_client, router, jobids[0]) != 0
+        || TestReplicaState(&rpc_client, router, jobids[1]) != 0
+        || TestBinary(&rpc_client, router) != 0) {
+        return -1;
+    }
+    processes.KillAll();
+    std::string clean = std::string("rm -rf ") + work_dir;
+    if (system(clean.c_str()) != 0) {
+        fprintf(stderr, "fail to remove %s\n", work_dir);
+    }
+    fprintf(stderr, "shard test passed\n");
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
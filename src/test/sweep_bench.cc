@@ -0,0 +1,141 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+// Throughput of the callbacks of a query sweep over many agents. Rpc
+// threads complete one query per agent, each callback does some work on
+// state under a lock shared by all of them, as JobManager callbacks do
+// under mutex_. The callbacks run either on the rpc threads taking the
+// lock each, on an Executor taking the lock each, or through a TaskBatch
+// on the Executor taking it once per batch.
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include <boost/bind.hpp>
+
+#include <gflags/gflags.h>
+#include <mutex.h>
+#include <thread.h>
+#include <timer.h>
+
+#include "master/executor.h"
+
+DEFINE_int32(sweep_bench_agents, 10000, "agents queried in the sweep");
+DEFINE_int32(sweep_bench_rpc_threads, 8, "threads completing the queries");
+DEFINE_int32(sweep_bench_workers, 4, "executor workers");
+DEFINE_int32(sweep_bench_batch, 64, "max callbacks run under one lock acquisition");
+DEFINE_string(sweep_bench_work, "200,2000,20000", "loop counts of callback work to measure");
+
+using baidu::common::Mutex;
+using baidu::common::MutexLock;
+using baidu::common::Thread;
+using baidu::galaxy::Executor;
+using baidu::galaxy::TaskBatch;
+
+enum CallbackMode {
+    kInlineLock = 0,
+    kExecutorLock = 1,
+    kExecutorBatch = 2
+};
+
+const char* kModeNames[] = {"inline lock", "executor, lock each", "executor, batched"};
+
+struct Sweep {
+    CallbackMode mode;
+    int32_t work;
+    Mutex mutex;
+    int64_t state;
+    volatile int64_t done;
+    Executor* executor;
+    TaskBatch* batch;
+};
+
+// runs with sweep->mutex held
+static void Callback(Sweep* sweep, int32_t agent) {
+    for (int32_t i = 0; i < sweep->work; i++) {
+        sweep->state += (agent ^ i) & 7;
+    }
+    __sync_fetch_and_add(&sweep->done, 1);
+}
+
+static void LockedCallback(Sweep* sweep, int32_t agent) {
+    MutexLock lock(&sweep->mutex);
+    Callback(sweep, agent);
+}
+
+static void CompleteQueries(Sweep* sweep, int32_t thread) {
+    for (int32_t agent = thread; agent < FLAGS_sweep_bench_agents;
+         agent += FLAGS_sweep_bench_rpc_threads) {
+        switch (sweep->mode) {
+        case kInlineLock:
+            LockedCallback(sweep, agent);
+            break;
+        case kExecutorLock:
+            sweep->executor->AddTask(boost::bind(&LockedCallback, sweep, agent));
+            break;
+        case kExecutorBatch:
+            sweep->batch->Add(boost::bind(&Callback, sweep, agent));
+            break;
+        }
+    }
+}
+
+// callbacks per second and the lock acquisitions of batches
+static double RunSweep(CallbackMode mode, int32_t work, int64_t* batches) {
+    Sweep sweep;
+    sweep.mode = mode;
+    sweep.work = work;
+    sweep.state = 0;
+    sweep.done = 0;
+    sweep.executor = new Executor(FLAGS_sweep_bench_workers);
+    sweep.batch = new TaskBatch(sweep.executor, &sweep.mutex, FLAGS_sweep_bench_batch);
+    int64_t start = baidu::common::timer::get_micros();
+    std::vector<Thread> threads(FLAGS_sweep_bench_rpc_threads);
+    for (int32_t i = 0; i < FLAGS_sweep_bench_rpc_threads; i++) {
+        threads[i].Start(boost::bind(&CompleteQueries, &sweep, i));
+    }
+    for (int32_t i = 0; i < FLAGS_sweep_bench_rpc_threads; i++) {
+        threads[i].Join();
+    }
+    while (sweep.done < FLAGS_sweep_bench_agents) {
+        usleep(100);
+    }
+    int64_t cost = baidu::common::timer::get_micros() - start;
+    *batches = sweep.batch->Batches();
+    delete sweep.batch;
+    delete sweep.executor;
+    return FLAGS_sweep_bench_agents * 1000000.0 / (cost > 0 ? cost : 1);
+}
+
+int main(int argc, char* argv[]) {
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    std::vector<int32_t> works;
+    const char* work = FLAGS_sweep_bench_work.c_str();
+    while (*work != '\0') {
+        char* end = NULL;
+        works.push_back(strtol(work, &end, 10));
+        if (end == work) {
+            fprintf(stderr, "bad --sweep_bench_work: %s\n", FLAGS_sweep_bench_work.c_str());
+            return -1;
+        }
+        work = *end == ',' ? end + 1 : end;
+    }
+    printf("%d agents, %d rpc threads, %d workers, batches of %d\n",
+           FLAGS_sweep_bench_agents, FLAGS_sweep_bench_rpc_threads,
+           FLAGS_sweep_bench_workers, FLAGS_sweep_bench_batch);
+    for (size_t i = 0; i < works.size(); i++) {
+        for (int32_t mode = kInlineLock; mode <= kExecutorBatch; mode++) {
+            int64_t batches = 0;
+            double rate = RunSweep(static_cast<CallbackMode>(mode), works[i], &batches);
+            printf("work %-8d %-20s %10.0f callbacks/s", works[i], kModeNames[mode], rate);
+            if (mode == kExecutorBatch) {
+                printf(", %ld lock acquisitions", batches);
+            }
+            printf("\n");
+        }
+    }
+    return 0;
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,203 @@
+// Copyright (c) 2015, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <gflags/gflags.h>
+
+#include <tprinter.h>
+#include <string_util.h>
+#include "master/event_log.h"
+#include "proto/galaxy.pb.h"
+
+DECLARE_string(master_event_log_path);
+
+using baidu::galaxy::EventLog;
+using baidu::galaxy::EventLogReader;
+using baidu::galaxy::EventRecord;
+
+const std::string kEventReaderUsage = "\n./event_reader dump [jobid]\n"
+                                      "./event_reader pending [jobid]\n"
+                                      "./event_reader reschedules\n"
+                                      "reads the event log under --master_event_log_path";
+
+// records of jobid only, all of them when it is empty
+bool MatchJob(const EventRecord& record, const std::string& jobid) {
+    return jobid.empty() || record.ids[baidu::galaxy::kEventJob] == EventLog::Hash(jobid);
+}
+
+std::string FormatTime(int64_t micros) {
+    time_t seconds = micros / 1000000;
+    struct tm t;
+    localtime_r(&seconds, &t);
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%04d-%02d-%02d %02d:%02d:%02d.%06ld",
+             t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+             t.tm_hour, t.tm_min, t.tm_sec, micros % 1000000);
+    return buf;
+}
+
+int Dump(EventLogReader* reader, const std::vector<EventRecord>& records,
+         const std::string& jobid) {
+    for (size_t i = 0; i < records.size(); i++) {
+        const EventRecord& record = records[i];
+        if (!MatchJob(record, jobid)) {
+            continue;
+        }
+        printf("%s %s job=%s pod=%s agent=%s from=%d to=%d value=%ld\n",
+               FormatTime(record.time).c_str(),
+               EventLogReader::TypeName(record.type),
+               reader->Name(record.ids[baidu::galaxy::kEventJob]).c_str(),
+               reader->Name(record.ids[baidu::galaxy::kEventPod]).c_str(),
+               reader->Name(record.ids[baidu::galaxy::kEventAgent]).c_str(),
+               record.from, record.to, record.value);
+    }
+    return 0;
+}
+
+// Time from a pod becoming pending, on creation or rescheduling, to the
+// agent reporting it started, per job.
+int Pending(EventLogReader* reader, const std::vector<EventRecord>& records,
+            const std::string& jobid) {
+    typedef std::pair<uint64_t, uint64_t> PodKey;
+    std::map<PodKey, int64_t> pending_since;
+    std::map<uint64_t, std::vector<int64_t> > waits;
+    for (size_t i = 0; i < records.size(); i++) {
+        const EventRecord& record = records[i];
+        if (!MatchJob(record, jobid)) {
+            continue;
+        }
+        PodKey key(record.ids[baidu::galaxy::kEventJob], record.ids[baidu::galaxy::kEventPod]);
+        switch (record.type) {
+        case baidu::galaxy::kEventPodAdd:
+        case baidu::galaxy::kEventPodReschedule:
+            pending_since[key] = record.time;
+            break;
+        case baidu::galaxy::kEventPodState:
+            if (record.to == baidu::galaxy::kPodPending) {
+                pending_since[key] = record.time;
+            }
+            break;
+        case baidu::galaxy::kEventPodStarted: {
+            std::map<PodKey, int64_t>::iterator it = pending_since.find(key);
+            if (it != pending_since.end()) {
+                waits[key.first].push_back(record.time - it->second);
+                pending_since.erase(it);
+            }
+            break;
+        }
+        case baidu::galaxy::kEventJobRemove:
+            // pods of a removed job never start
+            pending_since.erase(pending_since.lower_bound(PodKey(key.first, 0)),
+                                pending_since.upper_bound(PodKey(key.first, (uint64_t)-1)));
+            break;
+        default:
+            break;
+        }
+    }
+    std::map<uint64_t, int64_t> still_pending;
+    std::map<PodKey, int64_t>::iterator pending_it = pending_since.begin();
+    for (; pending_it != pending_since.end(); ++pending_it) {
+        still_pending[pending_it->first.first]++;
+    }
+    baidu::common::TPrinter tp(8);
+    tp.AddRow(8, "job", "started", "pending", "avg_ms", "p50_ms", "p90_ms", "p99_ms", "max_ms");
+    std::map<uint64_t, std::vector<int64_t> >::iterator it = waits.begin();
+    for (; it != waits.end(); ++it) {
+        std::vector<int64_t>& wait = it->second;
+        std::sort(wait.begin(), wait.end());
+        int64_t total = 0;
+        for (size_t i = 0; i < wait.size(); i++) {
+            total += wait[i];
+        }
+        std::vector<std::string> vs;
+        vs.push_back(reader->Name(it->first));
+        vs.push_back(baidu::common::NumToString((int64_t)wait.size()));
+        vs.push_back(baidu::common::NumToString(still_pending[it->first]));
+        vs.push_back(baidu::common::NumToString(total / (int64_t)wait.size() / 1000));
+        vs.push_back(baidu::common::NumToString(wait[wait.size() * 50 / 100] / 1000));
+        vs.push_back(baidu::common::NumToString(wait[wait.size() * 90 / 100] / 1000));
+        vs.push_back(baidu::common::NumToString(wait[wait.size() * 99 / 100] / 1000));
+        vs.push_back(baidu::common::NumToString(wait.back() / 1000));
+        tp.AddRow(vs);
+    }
+    printf("%s\n", tp.ToString().c_str());
+    return 0;
+}
+
+struct AgentTrouble {
+    int64_t reschedules;
+    int64_t run_fails;
+    int64_t deaths;
+    AgentTrouble() : reschedules(0), run_fails(0), deaths(0) {}
+};
+
+bool MoreReschedules(const std::pair<uint64_t, AgentTrouble>& a,
+                     const std::pair<uint64_t, AgentTrouble>& b) {
+    return a.second.reschedules > b.second.reschedules;
+}
+
+int Reschedules(EventLogReader* reader, const std::vector<EventRecord>& records) {
+    std::map<uint64_t, AgentTrouble> agents;
+    for (size_t i = 0; i < records.size(); i++) {
+        const EventRecord& record = records[i];
+        uint64_t agent = record.ids[baidu::galaxy::kEventAgent];
+        if (agent == 0) {
+            continue;
+        }
+        if (record.type == baidu::galaxy::kEventPodReschedule) {
+            agents[agent].reschedules++;
+        } else if (record.type == baidu::galaxy::kEventPodRunFail) {
+            agents[agent].run_fails++;
+        } else if (record.type == baidu::galaxy::kEventAgentState
+                   && record.to == baidu::galaxy::kDead) {
+            agents[agent].deaths++;
+        }
+    }
+    std::vector<std::pair<uint64_t, AgentTrouble> > sorted(agents.begin(), agents.end());
+    std::stable_sort(sorted.begin(), sorted.end(), MoreReschedules);
+    baidu::common::TPrinter tp(4);
+    tp.AddRow(4, "agent", "reschedules", "run_fails", "deaths");
+    for (size_t i = 0; i < sorted.size(); i++) {
+        std::vector<std::string> vs;
+        vs.push_back(reader->Name(sorted[i].first));
+        vs.push_back(baidu::common::NumToString(sorted[i].second.reschedules));
+        vs.push_back(baidu::common::NumToString(sorted[i].second.run_fails));
+        vs.push_back(baidu::common::NumToString(sorted[i].second.deaths));
+        tp.AddRow(vs);
+    }
+    printf("%s\n", tp.ToString().c_str());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    ::google::SetUsageMessage(kEventReaderUsage);
+    ::google::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        fprintf(stderr, "Usage:%s\n", kEventReaderUsage.c_str());
+        return -1;
+    }
+    EventLogReader reader(FLAGS_master_event_log_path);
+    std::vector<EventRecord> records;
+    if (!reader.Load(&records)) {
+        fprintf(stderr, "Read event log %s fail\n", FLAGS_master_event_log_path.c_str());
+        return 1;
+    }
+    std::string jobid = argc > 2 ? argv[2] : "";
+    if (strcmp(argv[1], "dump") == 0) {
+        return Dump(&reader, records, jobid);
+    } else if (strcmp(argv[1], "pending") == 0) {
+        return Pending(&reader, records, jobid);
+    } else if (strcmp(argv[1], "reschedules") == 0) {
+        return Reschedules(&reader, records);
+    }
+    fprintf(stderr, "Usage:%s\n", kEventReaderUsage.c_str());
+    return -1;
+}